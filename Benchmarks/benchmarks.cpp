@@ -0,0 +1,1112 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Metal/Metal.hpp>
+
+#include "canvas.hpp"
+#include "cpu_renderer.hpp"
+#include "damage_tracker.hpp"
+#include "display_list_optimizer.hpp"
+#include "geom/atlas.hpp"
+#include "geom/bezier.hpp"
+#include "geom/font.hpp"
+#include "geom/grid.hpp"
+#include "geom/sdf.hpp"
+#include "geom/svg.hpp"
+#include "geom/text.hpp"
+#include "geom/triangulator.hpp"
+#include "host_buffer.hpp"
+#include "parallel.hpp"
+#include "recording_backend.hpp"
+
+#include "third_party/nanosvg/src/nanosvg.h"
+#define NANOSVGRAST_IMPLEMENTATION
+#include "third_party/nanosvg/src/nanosvgrast.h"
+
+namespace flatland {
+namespace {
+
+struct BenchmarkContext {
+    MTL::Device *device;
+    // The picture drawn by the app, and the star used by smaller scenes.
+    NSVGimage *image;
+    NSVGimage *star;
+    // The TrueType font drawn by the glyph benchmark.
+    std::string font_path;
+};
+
+// Build a single path from every shape of [image], scaled by [scale].
+Path BuildImagePath(const NSVGimage *image, Scalar scale) {
+    PathBuilder builder;
+    for (auto shape = image->shapes; shape != NULL; shape = shape->next) {
+        for (auto path = shape->paths; path != NULL; path = path->next) {
+            for (int i = 0; i < path->npts - 1; i += 3) {
+                float *p = &path->pts[i * 2];
+                if (i == 0) {
+                    builder.moveTo(p[0] * scale, p[1] * scale);
+                }
+                builder.cubicTo(Point{p[2], p[3]} * scale,
+                                Point{p[4], p[5]} * scale,
+                                Point{p[6], p[7]} * scale);
+            }
+            builder.close();
+        }
+    }
+    return builder.takePath();
+}
+
+// The star scaled so that its larger dimension is [size].
+Path BuildStarPath(const BenchmarkContext &context, Scalar size) {
+    return BuildImagePath(context.star, size / std::max(context.star->width,
+                                                        context.star->height));
+}
+
+// A shape of the picture with the paints it is filled and stroked with.
+struct PictureShape {
+    Path path;
+    std::optional<Paint> fill;
+    std::optional<Paint> stroke;
+};
+
+// The shapes of [image] at the 4x scale the app draws the picture at.
+std::vector<PictureShape> BuildPicture(const NSVGimage *image) {
+    std::vector<PictureShape> shapes;
+    for (auto shape = image->shapes; shape != NULL; shape = shape->next) {
+        PathBuilder builder;
+        for (auto path = shape->paths; path != NULL; path = path->next) {
+            Scalar scale = 4;
+            for (int i = 0; i < path->npts - 1; i += 3) {
+                float *p = &path->pts[i * 2];
+                if (i == 0) {
+                    builder.moveTo(p[0] * scale, p[1] * scale);
+                }
+                builder.cubicTo(Point{p[2], p[3]} * scale,
+                                Point{p[4], p[5]} * scale,
+                                Point{p[6], p[7]} * scale);
+            }
+            builder.close();
+        }
+        PictureShape picture_shape{.path = builder.takePath(),
+                                   .fill = std::nullopt,
+                                   .stroke = std::nullopt};
+        if (shape->fill.type == NSVGpaintType::NSVG_PAINT_COLOR) {
+            picture_shape.fill = Paint{
+                .color =
+                    Color::FromRGB(shape->fill.color).WithAlpha(shape->opacity),
+                .fill_rule =
+                    shape->fillRule == NSVGfillRule::NSVG_FILLRULE_NONZERO
+                        ? FillRule::kNonZero
+                        : FillRule::kEvenOdd};
+        }
+        if (shape->stroke.type == NSVGpaintType::NSVG_PAINT_COLOR) {
+            picture_shape.stroke = Paint{
+                .color = Color::FromRGB(shape->stroke.color)
+                             .WithAlpha(shape->opacity),
+                .stroke = true,
+                .stroke_width = shape->strokeWidth};
+        }
+        shapes.push_back(std::move(picture_shape));
+    }
+    return shapes;
+}
+
+// Draw [shapes] onto [canvas] where the app draws the picture.
+void DrawPicture(Canvas &canvas, const std::vector<PictureShape> &shapes) {
+    canvas.Save();
+    canvas.Translate(500, 500);
+    for (const PictureShape &shape : shapes) {
+        if (shape.fill.has_value()) {
+            canvas.DrawPath(shape.path, *shape.fill);
+        }
+        if (shape.stroke.has_value()) {
+            canvas.DrawPath(shape.path, *shape.stroke);
+        }
+    }
+    canvas.Restore();
+}
+
+// The canvas options the app draws the picture with.
+CanvasOptions MakePictureOptions(CoverageAtlas *coverage_atlas) {
+    return {.convex_decomposition = true,
+            .curve_patches = true,
+            .coverage_atlas = coverage_atlas,
+            .occlusion_culling = true,
+            .batch_convex_draws = true,
+            .scissor_rect_clips = true,
+            .optimizer_passes = MakeDefaultOptimizerPasses()};
+}
+
+void PrintOptimizerStats(const Canvas &scene) {
+    for (const OptimizerPassStats &stats : scene.GetOptimizerStats()) {
+        std::cout << "  " << stats.name << ": " << stats.removed_commands
+                  << " commands, " << stats.removed_layers << " layers"
+                  << std::endl;
+    }
+}
+
+// Log the estimated stencil overdraw of each fan style for the picture fills.
+void BenchmarkOverdraw(const BenchmarkContext &context) {
+    std::vector<PictureShape> shapes = BuildPicture(context.image);
+    std::array<Triangulator, 2> overdraw_triangulators;
+    overdraw_triangulators[0].SetFanStyle(FanStyle::kCentroid);
+    overdraw_triangulators[1].SetFanStyle(FanStyle::kMiddleOut);
+    for (auto &triangulator : overdraw_triangulators) {
+        triangulator.SetCollectStats(true);
+        for (const PictureShape &shape : shapes) {
+            if (shape.fill.has_value()) {
+                triangulator.triangulate(shape.path, /*scale_factor=*/1);
+                triangulator.write(nullptr, nullptr);
+            }
+        }
+    }
+    std::cout << "Overdraw estimate (centroid): "
+              << overdraw_triangulators[0].GetStats().GetOverdrawEstimate()
+              << std::endl;
+    std::cout << "Overdraw estimate (middle-out): "
+              << overdraw_triangulators[1].GetStats().GetOverdrawEstimate()
+              << std::endl;
+}
+
+// Log what level of detail drops, turns into sprites and simplifies when the
+// picture is drawn at thumbnail sizes.
+void BenchmarkLevelOfDetail(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    std::vector<PictureShape> shapes = BuildPicture(context.image);
+    for (Scalar scale : {1.0f, 0.1f, 0.02f}) {
+        Triangulator lod_triangulator;
+        Canvas lod_canvas(&host_buffer, &lod_triangulator,
+                          {.level_of_detail = true});
+        lod_canvas.Scale(scale, scale);
+        DrawPicture(lod_canvas, shapes);
+        RenderProgram program = lod_canvas.Prepare();
+        const LevelOfDetailStats &stats = lod_canvas.GetLevelOfDetailStats();
+        std::cout << "Level of detail at " << scale << "x: "
+                  << stats.dropped << " dropped (" << stats.dropped_coverage
+                  << " px coverage), " << stats.sprites << " sprites ("
+                  << stats.sprite_coverage << " px coverage), "
+                  << stats.simplified << " simplified, "
+                  << program.GetCommands().size() << " commands"
+                  << std::endl;
+    }
+}
+
+// Log the throughput of tile binning the picture at 4K.
+void BenchmarkBinningThroughput(const BenchmarkContext &context) {
+    std::vector<PictureShape> shapes = BuildPicture(context.image);
+    std::vector<BinningPath> binning_paths;
+    for (const PictureShape &shape : shapes) {
+        binning_paths.push_back(BinningPath{
+            .path = &shape.path, .transform = Matrix::MakeTranslate(500, 500)});
+    }
+    TileBins bins;
+    auto start = std::chrono::steady_clock::now();
+    BinPaths(binning_paths, ISize(3840, 2160), bins);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Binned " << bins.GetSegmentCount() << " segments in "
+              << elapsed.count() * 1000 << "ms ("
+              << bins.GetSegmentCount() / elapsed.count()
+              << " segments/s)" << std::endl;
+}
+
+// Log the throughput of the CPU renderer and of nanosvg's rasterizer on the
+// picture fills, without its strokes.
+void BenchmarkCpuRasterThroughput(const BenchmarkContext &context) {
+    // The picture paths are recorded at 4x.
+    Scalar scale = 4;
+    ISize size(context.image->width * scale, context.image->height * scale);
+    Scalar megapixels = size.w * size.h / 1e6;
+    std::vector<uint8_t> pixels(size.w * size.h * 4);
+
+    std::vector<PictureShape> shapes = BuildPicture(context.image);
+    CpuRenderer cpu_renderer;
+    for (const PictureShape &shape : shapes) {
+        if (shape.fill.has_value()) {
+            cpu_renderer.DrawPath(shape.path, Matrix(), *shape.fill);
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    cpu_renderer.Render(size, kTransparent, pixels.data());
+    std::chrono::duration<double> cpu_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    // The CPU renderer ignores strokes, so nanosvg is timed on the fills
+    // alone.
+    std::vector<signed char> stroke_types;
+    for (auto shape = context.image->shapes; shape != NULL;
+         shape = shape->next) {
+        stroke_types.push_back(shape->stroke.type);
+        shape->stroke.type = NSVG_PAINT_NONE;
+    }
+    NSVGrasterizer *rasterizer = ::nsvgCreateRasterizer();
+    start = std::chrono::steady_clock::now();
+    ::nsvgRasterize(rasterizer, context.image, 0, 0, scale, pixels.data(),
+                    size.w, size.h, size.w * 4);
+    std::chrono::duration<double> nanosvg_elapsed =
+        std::chrono::steady_clock::now() - start;
+    ::nsvgDeleteRasterizer(rasterizer);
+    size_t index = 0;
+    for (auto shape = context.image->shapes; shape != NULL;
+         shape = shape->next) {
+        shape->stroke.type = stroke_types[index++];
+    }
+
+    std::cout << "CPU render " << size.w << "x" << size.h << ": "
+              << megapixels / cpu_elapsed.count()
+              << " MP/s, nsvgRasterize: "
+              << megapixels / nanosvg_elapsed.count() << " MP/s"
+              << std::endl;
+}
+
+// Log the time to rasterize the star as a glyph sized coverage mask and at
+// 1024px.
+void BenchmarkMaskRasterThroughput(const BenchmarkContext &context) {
+    for (int32_t mask_size : {24, 1024}) {
+        Path star = BuildStarPath(context, mask_size);
+        int iterations = mask_size < 100 ? 10000 : 20;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            RasterizePath(star, ISize(mask_size, mask_size));
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "Rasterized " << mask_size << "px star mask in "
+                  << elapsed.count() * 1e6 / iterations << "us"
+                  << std::endl;
+    }
+}
+
+// Log the size and compositing time of a large star mask stored densely and
+// as sparse strips.
+void BenchmarkSparseMaskFootprint(const BenchmarkContext &context) {
+    ISize size(2048, 2048);
+    Path star = BuildStarPath(context, size.w);
+    std::vector<uint8_t> dense = RasterizePath(star, size);
+    SparseMask sparse;
+    RasterizePathSparse(star, size, sparse);
+
+    std::vector<uint8_t> pixels(size.w * size.h * 4);
+    Color color = kRed.WithAlpha(0.5);
+    auto start = std::chrono::steady_clock::now();
+    CompositeMask(dense, size, color, pixels.data());
+    std::chrono::duration<double> dense_elapsed =
+        std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    CompositeMask(sparse, color, pixels.data());
+    std::chrono::duration<double> sparse_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "2048px star mask: dense " << dense.size() << " bytes, "
+              << dense_elapsed.count() * 1000 << "ms to composite; sparse "
+              << sparse.GetByteSize() << " bytes, "
+              << sparse_elapsed.count() * 1000 << "ms to composite"
+              << std::endl;
+}
+
+// Log the coverage atlas hit rate for the picture, and the CPU cost per draw
+// of small stars drawn through the atlas and tessellated.
+void BenchmarkAtlasStats(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    // Stars of a few sizes at scattered subpixel positions, so both the
+    // integer and fractional parts of the translation vary.
+    std::vector<Path> stars;
+    for (Scalar star_size : {12, 16, 24, 32}) {
+        stars.push_back(BuildStarPath(context, star_size));
+    }
+    constexpr int kStarDraws = 2000;
+    for (bool use_atlas : {true, false}) {
+        CoverageAtlas atlas;
+        atlas.BeginFrame();
+        Triangulator star_triangulator;
+        Canvas star_canvas(&host_buffer, &star_triangulator,
+                           {.coverage_atlas =
+                                use_atlas ? &atlas : nullptr});
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kStarDraws; i++) {
+            star_canvas.Save();
+            star_canvas.Translate((i * 37 % 1000) * 1.37f,
+                                  (i * 91 % 700) * 0.71f);
+            star_canvas.DrawPath(stars[i % stars.size()],
+                                 {.color = kRed});
+            star_canvas.Restore();
+        }
+        star_canvas.Prepare();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << (use_atlas ? "Atlas" : "Tessellated") << " star draw: "
+                  << elapsed.count() * 1e6 / kStarDraws << "us/draw";
+        if (use_atlas) {
+            const CoverageAtlasStats &stats = atlas.GetStats();
+            std::cout << " (" << stats.hits << " hits, " << stats.misses
+                      << " misses)";
+        }
+        std::cout << std::endl;
+    }
+
+    CoverageAtlas picture_atlas;
+    picture_atlas.BeginFrame();
+    Triangulator picture_triangulator;
+    Canvas picture_canvas(&host_buffer, &picture_triangulator,
+                          MakePictureOptions(&picture_atlas));
+    DrawPicture(picture_canvas, BuildPicture(context.image));
+    picture_canvas.Prepare();
+    const CoverageAtlasStats &stats = picture_atlas.GetStats();
+    size_t lookups = stats.hits + stats.misses + stats.rejected;
+    std::cout << "Picture atlas: " << stats.hits << " hits, "
+              << stats.misses << " misses, " << stats.rejected
+              << " rejected, " << stats.evicted_pages
+              << " pages evicted, hit rate "
+              << (lookups > 0 ? 100.0 * stats.hits / lookups : 0) << "%"
+              << std::endl;
+}
+
+// Log the time to generate one distance field for the star against
+// rasterizing a coverage mask at every size of a zoom.
+void BenchmarkDistanceFieldThroughput(const BenchmarkContext &context) {
+    std::vector<std::pair<Path, int32_t>> zoom_paths;
+    for (Scalar size = CoverageAtlas::kMinDistanceFieldSize;
+         size <= CoverageAtlas::kMaxDistanceFieldSize; size += 8) {
+        zoom_paths.emplace_back(BuildStarPath(context, size),
+                                static_cast<int32_t>(size));
+    }
+    constexpr int kIterations = 100;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        for (const auto &[path, size] : zoom_paths) {
+            RasterizePath(path, ISize(size, size));
+        }
+    }
+    std::chrono::duration<double> mask_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    Scalar field_size = CoverageAtlas::kDistanceFieldResolution +
+                        2 * CoverageAtlas::kDistanceFieldSpread;
+    Path field_path =
+        BuildStarPath(context, CoverageAtlas::kDistanceFieldResolution);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        GenerateDistanceField(
+            field_path, ISize(field_size, field_size),
+            CoverageAtlas::kDistanceFieldSpread, FillRule::kNonZero,
+            CoverageAtlas::kMaxDistanceFieldSize /
+                CoverageAtlas::kDistanceFieldResolution);
+    }
+    std::chrono::duration<double> field_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "Star zoom from " << CoverageAtlas::kMinDistanceFieldSize
+              << "px to " << CoverageAtlas::kMaxDistanceFieldSize
+              << "px: " << zoom_paths.size() << " coverage masks in "
+              << mask_elapsed.count() * 1e6 / kIterations
+              << "us, one distance field in "
+              << field_elapsed.count() * 1e6 / kIterations << "us"
+              << std::endl;
+}
+
+// Log the throughput of drawing a paragraph of text as a glyph run, with the
+// glyph outlines and atlas cold and warm. This needs a font file, so it only
+// runs when named.
+void BenchmarkGlyphThroughput(const BenchmarkContext &context) {
+    std::ifstream font_file(context.font_path, std::ios::binary);
+    if (!font_file) {
+        std::cout << "Glyph run: skipped, no font at " << context.font_path
+                  << std::endl;
+        return;
+    }
+    std::unique_ptr<Font> font = Font::Make(std::vector<uint8_t>(
+        std::istreambuf_iterator<char>(font_file), {}));
+    if (!font) {
+        std::cout << "Glyph run: skipped, " << context.font_path
+                  << " is not a supported font" << std::endl;
+        return;
+    }
+    HostBuffer host_buffer(context.device);
+    const std::string kSentence =
+        "The quick brown fox jumps over the lazy dog, while five "
+        "boxing wizards jump quickly. ";
+    Scalar font_size = 14;
+    Scalar line_width = 600;
+    std::vector<uint16_t> glyphs;
+    std::vector<Point> positions;
+    Point pen(0, font_size);
+    for (int repeat = 0; repeat < 20; repeat++) {
+        for (char ch : kSentence) {
+            uint16_t glyph = font->GetGlyphId(ch);
+            Scalar advance = font->GetAdvance(glyph) * font_size;
+            if (pen.x + advance > line_width) {
+                pen = Point(0, pen.y + font_size * 1.2f);
+            }
+            glyphs.push_back(glyph);
+            positions.push_back(pen);
+            pen.x += advance;
+        }
+    }
+
+    CoverageAtlas atlas;
+    for (bool warm : {false, true}) {
+        atlas.BeginFrame();
+        Triangulator glyph_triangulator;
+        Canvas glyph_canvas(&host_buffer, &glyph_triangulator,
+                            {.coverage_atlas = &atlas});
+        auto start = std::chrono::steady_clock::now();
+        glyph_canvas.DrawGlyphRun(*font, glyphs.data(),
+                                  positions.data(), glyphs.size(),
+                                  font_size, {.color = kRed});
+        RenderProgram program = glyph_canvas.Prepare();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << (warm ? "Warm" : "Cold") << " glyph run: "
+                  << glyphs.size() << " glyphs in "
+                  << elapsed.count() * 1000 << "ms ("
+                  << glyphs.size() / elapsed.count()
+                  << " glyphs/s), " << program.GetCommands().size()
+                  << " commands, " << font->GetCachedGlyphCount()
+                  << " cached outlines" << std::endl;
+    }
+}
+
+// Log the recording and replay throughput of a 30k rect scene, and the size
+// of its packed commands and side tables.
+void BenchmarkDisplayListThroughput(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    constexpr int kDrawCount = 30000;
+    const Color kColors[] = {kRed, kBlue, Color(0, 0.5, 0, 0.5)};
+    Triangulator list_triangulator;
+    Canvas list_canvas(&host_buffer, &list_triangulator);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kDrawCount; i++) {
+        if (i % 1000 == 0) {
+            if (i > 0) {
+                list_canvas.Restore();
+            }
+            list_canvas.Save();
+            list_canvas.Translate((i / 1000) % 8, (i / 1000) % 8);
+        }
+        Scalar x = (i * 37) % 1000;
+        Scalar y = (i * 53) % 1000;
+        list_canvas.DrawRect(Rect::MakeLTRB(x, y, x + 20, y + 20),
+                             {.color = kColors[i % 3]});
+    }
+    list_canvas.Restore();
+    RenderProgram program = list_canvas.Prepare();
+    std::chrono::duration<double> record_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    // Replay resolves every table reference the renderer would, without
+    // encoding, so that only the walk over the display list is measured.
+    const DisplayListTables &tables = program.GetTables();
+    constexpr int kIterations = 20;
+    Scalar checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        for (const PackedCommand &command : program.GetCommands()) {
+            const Matrix &transform =
+                tables.transforms[command.transform_index];
+            const Paint &paint = tables.paints[command.paint_index];
+            checksum += transform.GetTranslation().x + paint.color.a +
+                        command.depth_count;
+            if (command.extra_index != PackedCommand::kNoExtra) {
+                checksum += tables.extras[command.extra_index].bounds.l;
+            }
+        }
+    }
+    std::chrono::duration<double> replay_elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "Display list: " << kDrawCount << " draws recorded in "
+              << record_elapsed.count() * 1000 << "ms, replayed in "
+              << replay_elapsed.count() * 1000 / kIterations << "ms ("
+              << checksum << "), " << sizeof(PackedCommand)
+              << " bytes per command against " << sizeof(Command)
+              << " unpacked, " << tables.transforms.size()
+              << " transforms, " << tables.paints.size() << " paints, "
+              << tables.buffers.size() << " buffers, "
+              << tables.extras.size() << " extras" << std::endl;
+}
+
+// Log the recording time of clip dense scenes of increasing size, which
+// should grow linearly.
+void BenchmarkClipRecordingThroughput(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    PathBuilder clip_builder;
+    clip_builder.moveTo(0, 0);
+    clip_builder.lineTo(900, 0);
+    clip_builder.lineTo(900, 900);
+    clip_builder.lineTo(0, 900);
+    clip_builder.close();
+    Path clip = clip_builder.takePath();
+    for (int clip_count : {2500, 5000, 10000}) {
+        Triangulator clip_triangulator;
+        Canvas clip_canvas(&host_buffer, &clip_triangulator);
+        auto start = std::chrono::steady_clock::now();
+        clip_canvas.Save();
+        for (int i = 0; i < clip_count; i++) {
+            Scalar x = (i * 37) % 800;
+            Scalar y = (i * 53) % 800;
+            clip_canvas.DrawRect(Rect::MakeLTRB(x, y, x + 20, y + 20),
+                                 {.color = kRed});
+            clip_canvas.DrawRect(Rect::MakeLTRB(y, x, y + 20, x + 20),
+                                 {.color = Color(0, 0, 1, 0.5)});
+            clip_canvas.ClipPath(clip, ClipStyle::kIntersect);
+        }
+        clip_canvas.Restore();
+        RenderProgram program = clip_canvas.Prepare();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "Clip dense recording: " << clip_count
+                  << " clips and " << program.GetCommands().size()
+                  << " commands in " << elapsed.count() * 1000 << "ms"
+                  << std::endl;
+    }
+}
+
+// Log the draws culled by clip bounds in a scene of clipped scrolling lists,
+// and the pixels covered by intersect clip depth writes against full screen
+// covers.
+void BenchmarkClipBounds(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    // A grid of list views, each clipping rows scrolled mostly out of
+    // view.
+    Triangulator list_triangulator;
+    Canvas list_canvas(&host_buffer, &list_triangulator);
+    for (int list = 0; list < 16; list++) {
+        Scalar left = (list % 4) * 250 + 10;
+        Scalar top = (list / 4) * 250 + 10;
+        PathBuilder clip_builder;
+        clip_builder.moveTo(left, top);
+        clip_builder.lineTo(left + 200, top);
+        clip_builder.lineTo(left + 200, top + 200);
+        clip_builder.lineTo(left, top + 200);
+        clip_builder.close();
+        list_canvas.Save();
+        list_canvas.ClipPath(clip_builder.takePath(),
+                             ClipStyle::kIntersect);
+        for (int row = 0; row < 100; row++) {
+            Scalar row_top = top - 1000 + row * 40;
+            list_canvas.DrawRect(
+                Rect::MakeLTRB(left, row_top, left + 200, row_top + 36),
+                {.color = row % 2 ? kRed : kBlue});
+        }
+        list_canvas.Restore();
+    }
+    RenderProgram program = list_canvas.Prepare();
+    const ClipStats &stats = list_canvas.GetClipStats();
+    Rect screen = Rect::MakeLTRB(0, 0, 1000, 1000);
+    size_t intersect_clips = 0;
+    Scalar scissored_pixels = 0;
+    for (const PackedCommand &command : program.GetCommands()) {
+        if (command.type != CommandType::kClip ||
+            command.GetClipStyle() != ClipStyle::kIntersect) {
+            continue;
+        }
+        intersect_clips++;
+        const Rect &bounds =
+            program.GetTables().extras[command.extra_index].bounds;
+        if (auto visible = bounds.Intersection(screen)) {
+            scissored_pixels += visible->GetWidth() * visible->GetHeight();
+        }
+    }
+    std::cout << "Clip bounds: " << stats.culled_draws
+              << " draws and " << stats.culled_clips
+              << " clips culled, intersect covers "
+              << scissored_pixels << " px against "
+              << intersect_clips * screen.GetWidth() * screen.GetHeight()
+              << " px full screen" << std::endl;
+}
+
+// Log the draws culled by occlusion in layered UI and map scenes with opaque
+// backgrounds.
+void BenchmarkOcclusionCulling(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    Path star_path = BuildStarPath(context, 40);
+    // Overlapping windows, each an opaque background with content.
+    auto record_windows = [&](Canvas &scene) {
+        for (int window = 0; window < 8; window++) {
+            Scalar left = 40 * window;
+            Scalar top = 30 * window;
+            scene.DrawRect(
+                Rect::MakeLTRB(left, top, left + 800, top + 600),
+                {.color = Color(0.9, 0.9, 0.9, 1)});
+            for (int i = 0; i < 100; i++) {
+                scene.Save();
+                scene.Translate(left + (i % 10) * 70 + 20,
+                                top + (i / 10) * 55 + 20);
+                if (i % 2 == 0) {
+                    scene.DrawRect(Rect::MakeLTRB(0, 0, 50, 20),
+                                   {.color = kBlue});
+                } else {
+                    scene.DrawPath(star_path,
+                                   {.color = Color(1, 0, 0, 0.5)});
+                }
+                scene.Restore();
+            }
+        }
+    };
+    // Map zoom levels, each a grid of opaque tiles with features.
+    auto record_map = [&](Canvas &scene) {
+        for (int level = 0; level < 3; level++) {
+            for (int tile = 0; tile < 64; tile++) {
+                Scalar left = (tile % 8) * 128;
+                Scalar top = (tile / 8) * 128;
+                scene.DrawRect(
+                    Rect::MakeLTRB(left, top, left + 128, top + 128),
+                    {.color = Color(0.8, 0.9, 0.8, 1)});
+                for (int feature = 0; feature < 8; feature++) {
+                    Scalar x = left + (feature * 37 + level * 11) % 100;
+                    Scalar y = top + (feature * 53 + level * 7) % 100;
+                    scene.DrawRect(Rect::MakeLTRB(x, y, x + 24, y + 6),
+                                   {.color = Color(1, 1, 1, 0.8)});
+                }
+            }
+        }
+    };
+    auto report = [&](const char *name, const auto &record) {
+        size_t command_counts[2];
+        for (bool cull : {false, true}) {
+            Triangulator scene_triangulator;
+            Canvas scene(&host_buffer, &scene_triangulator,
+                         {.occlusion_culling = cull});
+            record(scene);
+            command_counts[cull] = scene.Prepare().GetCommands().size();
+            if (cull) {
+                const OcclusionStats &stats = scene.GetOcclusionStats();
+                std::cout << name << " occlusion: " << stats.culled
+                          << " of " << stats.tested << " draws culled by "
+                          << stats.occluders << " occluders, "
+                          << command_counts[0] << " commands reduced to "
+                          << command_counts[1] << std::endl;
+            }
+        }
+    };
+    report("UI", record_windows);
+    report("Map", record_map);
+}
+
+// Log the draw calls encoded for a scene of small convex fills with and
+// without batching.
+void BenchmarkDrawBatching(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    const Color kColors[] = {kRed, kBlue, Color(0, 0.5, 0, 0.5)};
+    for (bool batch : {false, true}) {
+        Triangulator batch_triangulator;
+        Canvas batch_canvas(&host_buffer, &batch_triangulator,
+                            {.batch_convex_draws = batch});
+        for (int i = 0; i < 10000; i++) {
+            Scalar x = (i * 37) % 1000;
+            Scalar y = (i * 53) % 1000;
+            batch_canvas.DrawRect(Rect::MakeLTRB(x, y, x + 12, y + 12),
+                                  {.color = kColors[(i / 50) % 3]});
+        }
+        RecordingBackend backend;
+        backend.Encode(batch_canvas.Prepare());
+        const RecordedWorkStats &stats = backend.GetStats();
+        std::cout << (batch ? "Batched" : "Unbatched")
+                  << " convex fills: " << stats.draw_calls
+                  << " draw calls, " << stats.transient_allocations
+                  << " transient allocations, " << stats.vertices
+                  << " vertices" << std::endl;
+    }
+}
+
+// Log what each optimizer pass removes from a scene of UI cards and from the
+// picture.
+void BenchmarkOptimizerPasses(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    Path star_path = BuildStarPath(context, 24);
+    // A scrolling list of cards, each grouped in a layer as UI toolkits
+    // do for opacity animations. Some cards are fading, some hidden and
+    // some are placeholders with nothing loaded yet.
+    auto record_cards = [&](Canvas &scene) {
+        PathBuilder viewport_builder;
+        viewport_builder.AddRect(
+            Rect::MakeLTRB(0.5, 0.5, 400.5, 800.5));
+        scene.Save();
+        scene.ClipPath(viewport_builder.takePath(),
+                       ClipStyle::kIntersect);
+        for (int card = 0; card < 40; card++) {
+            Scalar top = card * 100 - 600;
+            scene.SaveLayer(card % 5 == 1 ? 0.6 : 1.0);
+            if (card % 7 == 3) {
+                scene.Restore();
+                continue;
+            }
+            scene.Save();
+            PathBuilder card_builder;
+            card_builder.AddRect(
+                Rect::MakeLTRB(-10, top - 10, 410, top + 100));
+            scene.ClipPath(card_builder.takePath(),
+                           ClipStyle::kIntersect);
+            scene.DrawRect(Rect::MakeLTRB(10, top, 390, top + 90),
+                           {.color = Color(0.9, 0.9, 0.9, 1)});
+            // Fading cards only show their background.
+            if (card % 5 != 1) {
+                scene.Save();
+                scene.Translate(20, top + 20);
+                scene.DrawPath(star_path, {.color = kBlue});
+                scene.Restore();
+                // A badge faded all the way out, and a divider collapsed
+                // to nothing.
+                scene.DrawRect(Rect::MakeLTRB(350, top, 380, top + 30),
+                               {.color = Color(1, 0, 0, 0)});
+                scene.DrawRect(
+                    Rect::MakeLTRB(10, top + 90, 390, top + 90),
+                    {.color = kBlue});
+            }
+            scene.Restore();
+            scene.Restore();
+        }
+        scene.Restore();
+    };
+    size_t command_counts[2];
+    size_t layer_counts[2];
+    for (bool optimize : {false, true}) {
+        Triangulator scene_triangulator;
+        CanvasOptions options;
+        if (optimize) {
+            options.optimizer_passes = MakeDefaultOptimizerPasses();
+        }
+        Canvas scene(&host_buffer, &scene_triangulator, options);
+        record_cards(scene);
+        RenderProgram program = scene.Prepare();
+        command_counts[optimize] = program.GetCommands().size();
+        for (const RenderProgram::Data &offscreen :
+             program.GetOffscreens()) {
+            command_counts[optimize] += offscreen.commands.size();
+        }
+        layer_counts[optimize] = program.GetOffscreens().size();
+        if (optimize) {
+            std::cout << "Optimizer passes (cards): " << command_counts[0]
+                      << " commands in " << layer_counts[0]
+                      << " layers reduced to " << command_counts[1]
+                      << " in " << layer_counts[1] << std::endl;
+            PrintOptimizerStats(scene);
+        }
+    }
+
+    Triangulator picture_triangulator;
+    Canvas picture_canvas(&host_buffer, &picture_triangulator,
+                          MakePictureOptions(/*coverage_atlas=*/nullptr));
+    DrawPicture(picture_canvas, BuildPicture(context.image));
+    picture_canvas.Prepare();
+    std::cout << "Optimizer passes (picture):" << std::endl;
+    PrintOptimizerStats(picture_canvas);
+}
+
+// Log the damage between frames of a list with a blinking text cursor, and
+// the time to find the damage of a frame that repeats the last program.
+void BenchmarkDamageTracking(const BenchmarkContext &context) {
+    Path star_path = BuildStarPath(context, 16);
+    // A list of rows and a text field whose cursor blinks every frame.
+    auto record_list = [&](Canvas &scene, bool show_cursor) {
+        scene.DrawRect(Rect::MakeLTRB(0, 0, 1000, 1000),
+                       {.color = Color(0.95, 0.95, 0.95, 1)});
+        for (int row = 0; row < 20; row++) {
+            Scalar top = 60 + row * 40;
+            scene.DrawRect(Rect::MakeLTRB(20, top, 980, top + 36),
+                           {.color = kWhite});
+            scene.Save();
+            scene.Translate(30, top + 10);
+            scene.DrawPath(star_path, {.color = kBlue});
+            scene.Restore();
+        }
+        scene.DrawRect(Rect::MakeLTRB(20, 10, 980, 50),
+                       {.color = kWhite});
+        if (show_cursor) {
+            scene.DrawRect(Rect::MakeLTRB(120, 18, 122, 42),
+                           {.color = kBlack});
+        }
+    };
+    HostBuffer frame_buffer(context.device);
+    Triangulator frame_triangulator;
+    Canvas frame_canvas(&frame_buffer, &frame_triangulator,
+                        {.occlusion_culling = true,
+                         .batch_convex_draws = true});
+    RenderProgram frame_program;
+    DamageTracker tracker;
+    Rect frame_bounds = Rect::MakeLTRB(0, 0, 1000, 1000);
+    for (int frame = 0; frame < 6; frame++) {
+        frame_canvas.Reset(std::move(frame_program));
+        frame_buffer.ResetPersistent();
+        // The cursor blinks every other frame, so each blink is followed
+        // by a frame that repeats it.
+        record_list(frame_canvas, frame / 2 % 2 == 1);
+        frame_program = frame_canvas.Prepare();
+        const std::vector<Rect> &damage =
+            tracker.ComputeDamage(frame_program, frame_bounds);
+        const DamageStats &stats = tracker.GetStats();
+        std::cout << "Damage frame " << frame << ": "
+                  << stats.added_draws << " added, "
+                  << stats.removed_draws << " removed, "
+                  << stats.damaged_area << " of "
+                  << frame_bounds.GetWidth() * frame_bounds.GetHeight()
+                  << " px in " << damage.size() << " rects" << std::endl;
+    }
+
+    // A static scene passes the same program every frame, which is matched
+    // by id without signing it again.
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < 1000; frame++) {
+        tracker.ComputeDamage(frame_program, frame_bounds);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Damage of an unchanged program: "
+              << elapsed.count() * 1000000 / 1000 << "us/frame" << std::endl;
+}
+
+// Log the time to prepare a zoomed in map scene with and without group
+// culling, and the groups culled against the viewport.
+void BenchmarkGroupCulling(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    // A map of 32 by 32 tiles zoomed in on a few of them. Each tile is a
+    // group holding a group of features per map layer.
+    auto record_map = [&](Canvas &scene) {
+        scene.Translate(-3500, -3500);
+        scene.Scale(4, 4);
+        for (int tile = 0; tile < 1024; tile++) {
+            scene.Save();
+            scene.Translate((tile % 32) * 64, (tile / 32) * 64);
+            scene.DrawRect(Rect::MakeLTRB(0, 0, 64, 64),
+                           {.color = Color(0.9, 0.9, 0.85, 1)});
+            for (int layer = 0; layer < 2; layer++) {
+                scene.Save();
+                for (int feature = 0; feature < 8; feature++) {
+                    Scalar x = (feature * 23 + layer * 11) % 56;
+                    Scalar y = (feature * 37 + layer * 7) % 56;
+                    scene.DrawRect(
+                        Rect::MakeLTRB(x, y, x + 8, y + 8),
+                        {.color = layer ? kBlue : Color(0, 0.5, 0, 0.5)});
+                }
+                scene.Restore();
+            }
+            scene.Restore();
+        }
+    };
+    for (bool cull : {false, true}) {
+        Triangulator map_triangulator;
+        Canvas map_canvas(&host_buffer, &map_triangulator,
+                          {.viewport = Rect::MakeLTRB(0, 0, 1000, 1000),
+                           .cull_groups = cull});
+        record_map(map_canvas);
+        auto start = std::chrono::steady_clock::now();
+        RenderProgram program = map_canvas.Prepare();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const GroupCullStats &stats = map_canvas.GetGroupCullStats();
+        std::cout << "Group culling (" << (cull ? "on" : "off")
+                  << "): " << program.GetCommands().size()
+                  << " commands prepared in " << elapsed.count() * 1000
+                  << "ms, " << stats.culled << " of " << stats.tested
+                  << " groups tested culled (" << stats.groups
+                  << " recorded), " << stats.culled_commands
+                  << " commands dropped, " << program.GetGroups().size()
+                  << " runs" << std::endl;
+    }
+}
+
+// Log the time to record a scene of star tiles on one thread and in sub-lists
+// recorded on every core.
+void BenchmarkParallelRecording(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    // 16 rows of 16 tiles, each holding a few stars, so that most of the
+    // recording time goes to tessellation.
+    constexpr int kRows = 16;
+    auto record_row = [](Canvas &scene, int row) {
+        for (int column = 0; column < 16; column++) {
+            scene.Save();
+            scene.Translate(column * 64, row * 64);
+            for (int star = 0; star < 6; star++) {
+                PathBuilder builder;
+                Scalar cx = 12 + (star % 3) * 20;
+                Scalar cy = 16 + (star / 3) * 32;
+                for (int point = 0; point < 10; point++) {
+                    Scalar angle = point * M_PI / 5;
+                    Scalar radius = point % 2 ? 4 : 10;
+                    Scalar x = cx + radius * std::cos(angle);
+                    Scalar y = cy + radius * std::sin(angle);
+                    if (point == 0) {
+                        builder.moveTo(x, y);
+                    } else {
+                        builder.lineTo(x, y);
+                    }
+                }
+                builder.close();
+                scene.DrawPath(builder.takePath(),
+                               {.color = star % 2 ? kBlue : kRed});
+            }
+            scene.Restore();
+        }
+    };
+
+    Triangulator serial_triangulator;
+    Canvas serial_canvas(&host_buffer, &serial_triangulator);
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < kRows; row++) {
+        record_row(serial_canvas, row);
+    }
+    std::chrono::duration<double> serial_elapsed =
+        std::chrono::steady_clock::now() - start;
+    size_t serial_commands = serial_canvas.Prepare().GetCommands().size();
+
+    // Each row is a sub-list with a host buffer and triangulator of its
+    // own. The host buffers have to outlive the program.
+    std::vector<std::unique_ptr<HostBuffer>> row_buffers;
+    std::vector<std::unique_ptr<Triangulator>> row_triangulators;
+    std::vector<std::unique_ptr<Canvas>> rows;
+    for (int row = 0; row < kRows; row++) {
+        row_buffers.push_back(std::make_unique<HostBuffer>(context.device));
+        row_triangulators.push_back(std::make_unique<Triangulator>());
+        rows.push_back(std::make_unique<Canvas>(
+            row_buffers.back().get(), row_triangulators.back().get()));
+    }
+    Triangulator merged_triangulator;
+    Canvas merged_canvas(&host_buffer, &merged_triangulator);
+    start = std::chrono::steady_clock::now();
+    ParallelFor(kRows, [&](size_t row) { record_row(*rows[row], row); });
+    std::chrono::duration<double> parallel_elapsed =
+        std::chrono::steady_clock::now() - start;
+    for (int row = 0; row < kRows; row++) {
+        merged_canvas.DrawSubList(*rows[row]);
+    }
+    std::chrono::duration<double> merged_elapsed =
+        std::chrono::steady_clock::now() - start;
+    size_t merged_commands = merged_canvas.Prepare().GetCommands().size();
+
+    std::cout << "Parallel recording: " << kRows * 16 * 6
+              << " stars recorded in " << serial_elapsed.count() * 1000
+              << "ms on one thread (" << serial_commands
+              << " commands), " << parallel_elapsed.count() * 1000
+              << "ms in " << kRows << " sub-lists on "
+              << std::thread::hardware_concurrency() << " threads, "
+              << merged_elapsed.count() * 1000 << "ms merged ("
+              << merged_commands << " commands)" << std::endl;
+}
+
+// Log how the depth counts of a scene with more draws than fit the default
+// depth spacing are fit to the depth buffer.
+void BenchmarkDepthBudget(const BenchmarkContext &context) {
+    HostBuffer host_buffer(context.device);
+    constexpr int kDrawCount = 300000;
+    const Color kColors[] = {kRed, kBlue, Color(0, 0.5, 0, 0.5)};
+    Triangulator budget_triangulator;
+    Canvas budget_canvas(&host_buffer, &budget_triangulator);
+    for (int i = 0; i < kDrawCount; i++) {
+        Scalar x = (i * 37) % 1000;
+        Scalar y = (i * 53) % 1000;
+        budget_canvas.DrawRect(Rect::MakeLTRB(x, y, x + 4, y + 4),
+                               {.color = kColors[i % 3]});
+    }
+    auto start = std::chrono::steady_clock::now();
+    RenderProgram program = budget_canvas.Prepare();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const DepthBudgetStats &stats = budget_canvas.GetDepthBudgetStats();
+    std::cout << "Depth budget: " << kDrawCount << " draws prepared in "
+              << elapsed.count() * 1000 << "ms, widest span "
+              << stats.widest_span << ", "
+              << program.GetDepthRanges().size() << " ranges at epsilon "
+              << (program.GetDepthRanges().empty()
+                      ? kDepthEpsilon
+                      : program.GetDepthRanges()[0].epsilon)
+              << ", " << stats.renormalized_passes
+              << " passes renormalized, " << stats.depth_clears
+              << " depth clears, " << stats.overflowed_ranges
+              << " overflowed" << std::endl;
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)(const BenchmarkContext &context);
+    // Whether the benchmark only runs when named on the command line.
+    bool opt_in = false;
+};
+
+constexpr const char *kDefaultFontPath =
+    "/System/Library/Fonts/Supplemental/Arial.ttf";
+
+constexpr Benchmark kBenchmarks[] = {
+    {"overdraw", BenchmarkOverdraw},
+    {"level_of_detail", BenchmarkLevelOfDetail},
+    {"binning", BenchmarkBinningThroughput},
+    {"cpu_raster", BenchmarkCpuRasterThroughput},
+    {"mask_raster", BenchmarkMaskRasterThroughput},
+    {"sparse_mask", BenchmarkSparseMaskFootprint},
+    {"atlas", BenchmarkAtlasStats},
+    {"distance_field", BenchmarkDistanceFieldThroughput},
+    {"glyphs", BenchmarkGlyphThroughput, /*opt_in=*/true},
+    {"display_list", BenchmarkDisplayListThroughput},
+    {"clip_recording", BenchmarkClipRecordingThroughput},
+    {"clip_bounds", BenchmarkClipBounds},
+    {"occlusion", BenchmarkOcclusionCulling},
+    {"batching", BenchmarkDrawBatching},
+    {"optimizer", BenchmarkOptimizerPasses},
+    {"damage", BenchmarkDamageTracking},
+    {"group_culling", BenchmarkGroupCulling},
+    {"parallel_recording", BenchmarkParallelRecording},
+    {"depth_budget", BenchmarkDepthBudget},
+};
+
+} // namespace
+} // namespace flatland
+
+// Runs the benchmarks named on the command line, or all of them but the opt
+// in ones if none are. `--font=<path>` sets the font of the glyph benchmark.
+int main(int argc, const char *argv[]) {
+    using namespace flatland;
+    MTL::Device *device = MTL::CreateSystemDefaultDevice();
+    if (device == nullptr) {
+        std::cerr << "No Metal device" << std::endl;
+        return EXIT_FAILURE;
+    }
+    NSVGimage *image = ::nsvgParse(GetGhostscript().data(), "px", 96);
+    NSVGimage *star = ::nsvgParse(GetStar().data(), "px", 96);
+    BenchmarkContext context{.device = device,
+                             .image = image,
+                             .star = star,
+                             .font_path = kDefaultFontPath};
+
+    const std::string kFontFlag = "--font=";
+    std::vector<std::string> names;
+    int status = EXIT_SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (argument.starts_with(kFontFlag)) {
+            context.font_path = argument.substr(kFontFlag.size());
+            continue;
+        }
+        bool found = false;
+        for (const Benchmark &benchmark : kBenchmarks) {
+            found |= argument == benchmark.name;
+        }
+        if (!found) {
+            std::cerr << "Unknown benchmark " << argument << std::endl;
+            status = EXIT_FAILURE;
+        }
+        names.push_back(std::move(argument));
+    }
+    if (status == EXIT_SUCCESS) {
+        for (const Benchmark &benchmark : kBenchmarks) {
+            bool selected = names.empty() && !benchmark.opt_in;
+            for (const std::string &name : names) {
+                selected |= name == benchmark.name;
+            }
+            if (selected) {
+                benchmark.run(context);
+            }
+        }
+    }
+
+    ::nsvgDelete(image);
+    ::nsvgDelete(star);
+    device->release();
+    return status;
+}
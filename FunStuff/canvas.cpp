@@ -1,6 +1,15 @@
 #include "canvas.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <utility>
+
+#include "geom/occlusion.hpp"
+#include "geom/simplify.hpp"
 
 namespace flatland {
 
@@ -45,32 +54,355 @@ size_t CreateGradientTexture(Color colors[], size_t color_size,
     return id;
 }
 
+// Fills covering less than this fraction of a pixel can't change an 8-bit
+// channel and are dropped.
+static constexpr Scalar kMinCoverage = 1.0f / 255.0f;
+
+// Fills no larger than this in device pixels are drawn as a single pixel.
+static constexpr Scalar kMaxSpriteSize = 1.0f;
+
+// Fills smaller than this in device pixels are flattened and simplified.
+static constexpr Scalar kMaxSimplifySize = 64.0f;
+
+// Maximum deviation in device pixels allowed by simplification.
+static constexpr Scalar kSimplifyTolerance = 0.25f;
+
+// Simplified fills may use up to this many points per pixel of
+// sqrt(device area), and at least kMinSimplifiedPoints.
+static constexpr Scalar kSimplifiedPointsPerPixel = 4.0f;
+static constexpr size_t kMinSimplifiedPoints = 8;
+
+// Rect clips with edges within this many device pixels of whole pixels are
+// applied as scissor rects.
+static constexpr Scalar kScissorAlignmentTolerance = 1.0f / 256.0f;
+
+// The most depth counts a segment spans before it is closed. A pass can only
+// be split into depth ranges between segments, so this leaves room for one
+// in a depth buffer at [kMinDepthEpsilon].
+static constexpr int32_t kMaxSegmentDepthSpan =
+    static_cast<int32_t>(0.5f / kMinDepthEpsilon);
+
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+    return hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+}
+
+uint64_t HashScalars(uint64_t hash, const Scalar *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+        hash = HashCombine(hash, bits);
+    }
+    return hash;
+}
+
+uint64_t HashMatrix(const Matrix &matrix) {
+    return HashScalars(0, matrix.GetStorage(), 16);
+}
+
+bool MatricesEqual(const Matrix &a, const Matrix &b) {
+    return std::memcmp(a.GetStorage(), b.GetStorage(), 16 * sizeof(Scalar)) ==
+           0;
+}
+
+uint64_t HashPaint(const Paint &paint) {
+    Scalar values[] = {paint.color.r, paint.color.g, paint.color.b,
+                       paint.color.a, paint.stroke_width};
+    uint64_t hash = HashScalars(0, values, 5);
+    hash = HashCombine(hash, paint.stroke);
+    hash = HashCombine(hash, static_cast<uint64_t>(paint.fill_rule));
+    hash = HashCombine(hash, paint.gradient.index());
+    if (auto *linear = std::get_if<LinearGradient>(&paint.gradient)) {
+        hash = HashCombine(hash, linear->texture_index);
+    } else if (auto *radial = std::get_if<RadialGradient>(&paint.gradient)) {
+        hash = HashCombine(hash, radial->texture_index);
+    }
+    return hash;
+}
+
+bool PaintsEqual(const Paint &a, const Paint &b) {
+    if (a.color != b.color || a.stroke != b.stroke || a.stroke_width != b.stroke_width ||
+        a.fill_rule != b.fill_rule ||
+        a.gradient.index() != b.gradient.index()) {
+        return false;
+    }
+    if (auto *linear = std::get_if<LinearGradient>(&a.gradient)) {
+        const LinearGradient &other = std::get<LinearGradient>(b.gradient);
+        return linear->start == other.start && linear->end == other.end &&
+               linear->texture_index == other.texture_index;
+    }
+    if (auto *radial = std::get_if<RadialGradient>(&a.gradient)) {
+        const RadialGradient &other = std::get<RadialGradient>(b.gradient);
+        return radial->center == other.center &&
+               radial->radius == other.radius &&
+               radial->texture_index == other.texture_index;
+    }
+    return true;
+}
+
 bool IsBlur(const ImageFilter &filter) {
     return !std::holds_alternative<std::monostate>(filter);
 }
 
+// The local bounds touched by a draw of [bounds] with [paint]. Strokes extend
+// half their width past the path, with the width clamped to a pixel as the
+// triangulator does.
+Rect ComputeDrawBounds(const Rect &bounds, const Paint &paint) {
+    if (!paint.stroke) {
+        return bounds;
+    }
+    Scalar outset = std::max(paint.stroke_width, 1.0f) / 2;
+    return bounds.Expand(outset, outset);
+}
+
+// The least and greatest depth counts of the vertices of [command], which
+// merges draws of several depths.
+template <typename Vertex>
+std::pair<int32_t, int32_t>
+GetMergedDepthSpan(const PackedCommand &command,
+                   const DisplayListTables &tables) {
+    const uint8_t *contents = static_cast<const uint8_t *>(
+        tables.buffers[command.buffer_index]->contents());
+    const Vertex *vertices =
+        reinterpret_cast<const Vertex *>(contents + command.vertex_offset);
+    std::pair<int32_t, int32_t> span(command.depth_count, command.depth_count);
+    for (uint32_t i = 0; i < command.index_count; i++) {
+        int32_t depth_count = static_cast<int32_t>(vertices[i].depth_count);
+        span.first = std::min(span.first, depth_count);
+        span.second = std::max(span.second, depth_count);
+    }
+    return span;
+}
+
+// [rect] intersected with [bounds], if any, or an empty rect if they don't
+// overlap.
+Rect IntersectBounds(const std::optional<Rect> &bounds, const Rect &rect) {
+    if (!bounds.has_value()) {
+        return rect;
+    }
+    return bounds->Intersection(rect).value_or(Rect());
+}
+
+// A texture for a layer that can be rendered to and then sampled.
+MTL::Texture *AllocateLayerTexture(HostBuffer *host_buffer, Scalar width,
+                                   Scalar height) {
+    MTL::TextureDescriptor *desc = MTL::TextureDescriptor::alloc();
+    desc->setWidth(std::ceil(width));
+    desc->setHeight(std::ceil(height));
+    desc->setDepth(1);
+    desc->setUsage(MTL::TextureUsageShaderRead |
+                   MTL::TextureUsageRenderTarget);
+    desc->setArrayLength(1);
+    desc->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
+    desc->setMipmapLevelCount(1);
+    desc->setStorageMode(MTL::StorageModePrivate);
+    desc->setSampleCount(1);
+    desc->setTextureType(MTL::TextureType2D);
+    desc->setSwizzle(MTL::TextureSwizzleChannels()); // WTF Metal CPP.
+    desc->setCompressionType(MTL::TextureCompressionTypeLossy);
+    desc->setAllowGPUOptimizedContents(true);
+
+    auto texture = host_buffer->AllocateTempTexture(desc);
+    desc->release();
+    return texture;
+}
+
+// The id of the last program made by any canvas.
+std::atomic<uint64_t> last_program_id = 0;
+
 } // namespace
 
-RenderProgram::RenderProgram(std::vector<Command> commands,
-                             std::vector<Data> offscreens)
-    : commands_(std::move(commands)), offscreens_(std::move(offscreens)) {}
+RenderProgram::RenderProgram(std::vector<PackedCommand> commands,
+                             std::vector<Data> offscreens,
+                             DisplayListTables tables,
+                             std::vector<CommandGroup> groups,
+                             std::vector<DepthRange> depth_ranges)
+    : commands_(std::move(commands)), offscreens_(std::move(offscreens)),
+      groups_(std::move(groups)), depth_ranges_(std::move(depth_ranges)),
+      tables_(std::move(tables)),
+      id_(last_program_id.fetch_add(1, std::memory_order_relaxed) + 1) {}
 
-const std::vector<Command> &RenderProgram::GetCommands() const {
+const std::vector<PackedCommand> &RenderProgram::GetCommands() const {
     return commands_;
 }
 
+const std::vector<CommandGroup> &RenderProgram::GetGroups() const {
+    return groups_;
+}
+
+const std::vector<DepthRange> &RenderProgram::GetDepthRanges() const {
+    return depth_ranges_;
+}
+
+const DisplayListTables &RenderProgram::GetTables() const { return tables_; }
+
 const std::vector<RenderProgram::Data> &RenderProgram::GetOffscreens() const {
     return offscreens_;
 }
 
+void RenderProgram::TakeStorage(std::vector<PackedCommand> &commands,
+                                std::vector<Data> &offscreens,
+                                DisplayListTables &tables,
+                                std::vector<CommandGroup> &groups,
+                                std::vector<DepthRange> &depth_ranges) {
+    commands = std::move(commands_);
+    offscreens = std::move(offscreens_);
+    tables = std::move(tables_);
+    groups = std::move(groups_);
+    depth_ranges = std::move(depth_ranges_);
+    commands_.clear();
+    offscreens_.clear();
+    tables_ = {};
+    groups_.clear();
+    depth_ranges_.clear();
+    id_ = 0;
+}
+
 ///
 
-Canvas::Canvas(HostBuffer *host_buffer, Triangulator *triangulator)
-    : host_buffer_(host_buffer), triangulator_(triangulator) {
+void PreparedDisplayList::IndexLayers() {
+    layer_indices.assign(tables->extras.size(), kNoLayer);
+    for (size_t i = 0; i < layers.size(); i++) {
+        // Layers that were never composited have no extra.
+        if (layers[i].composite_extra_index < layer_indices.size()) {
+            layer_indices[layers[i].composite_extra_index] = i;
+        }
+    }
+}
+
+std::optional<size_t>
+PreparedDisplayList::FindLayer(const PackedCommand &command) const {
+    if (command.type != CommandType::kTexture ||
+        command.extra_index >= layer_indices.size() ||
+        layer_indices[command.extra_index] == kNoLayer) {
+        return std::nullopt;
+    }
+    return layer_indices[command.extra_index];
+}
+
+void PreparedDisplayList::RemoveUnreachableLayers() {
+    // Every layer is drawn by a later one or by the onscreen pass, so one
+    // walk backwards finds all the layers that are still drawn. Layers that
+    // have been folded into their parent are no longer drawn by anything.
+    for (PreparedLayer &layer : layers) {
+        layer.is_removed = true;
+    }
+    auto mark = [&](const std::vector<PackedCommand> &pass) {
+        for (const PackedCommand &command : pass) {
+            if (std::optional<size_t> layer = FindLayer(command)) {
+                layers[*layer].is_removed = false;
+            }
+        }
+    };
+    mark(commands);
+    for (size_t i = layers.size(); i-- > 0;) {
+        if (layers[i].is_removed) {
+            layers[i].commands.clear();
+        } else {
+            mark(layers[i].commands);
+        }
+    }
+}
+
+size_t PreparedDisplayList::CountCommands() const {
+    size_t count = commands.size();
+    for (const PreparedLayer &layer : layers) {
+        count += layer.is_removed ? 0 : layer.commands.size();
+    }
+    return count;
+}
+
+size_t PreparedDisplayList::CountLayers() const {
+    return std::count_if(
+        layers.begin(), layers.end(),
+        [](const PreparedLayer &layer) { return !layer.is_removed; });
+}
+
+///
+
+Canvas::Canvas(HostBuffer *host_buffer, Triangulator *triangulator,
+               CanvasOptions options)
+    : host_buffer_(host_buffer), triangulator_(triangulator),
+      options_(options) {
+    for (const OptimizerPass &pass : options_.optimizer_passes) {
+        optimizer_stats_.push_back(OptimizerPassStats{.name = pass.name});
+    }
     clip_stack_.push_back({});
     pending_states_.push_back(CommandState{.is_onscreen = true});
 }
 
+void Canvas::Reset(RenderProgram previous) {
+    std::vector<PackedCommand> commands;
+    std::vector<RenderProgram::Data> offscreens;
+    DisplayListTables tables;
+    std::vector<CommandGroup> groups;
+    std::vector<DepthRange> depth_ranges;
+    previous.TakeStorage(commands, offscreens, tables, groups, depth_ranges);
+    // The pools are popped from the back, so storage is pushed in reverse
+    // order of use to hand each pass the storage it had last frame.
+    for (auto it = offscreens.rbegin(); it != offscreens.rend(); ++it) {
+        if (it->commands.capacity() > 0) {
+            command_pool_.push_back(std::move(it->commands));
+        }
+        if (it->groups.capacity() > 0) {
+            group_pool_.push_back(std::move(it->groups));
+        }
+        if (it->depth_ranges.capacity() > 0) {
+            depth_range_pool_.push_back(std::move(it->depth_ranges));
+        }
+    }
+    if (commands.capacity() > 0) {
+        command_pool_.push_back(std::move(commands));
+    }
+    if (groups.capacity() > 0) {
+        group_pool_.push_back(std::move(groups));
+    }
+    if (depth_ranges.capacity() > 0) {
+        depth_range_pool_.push_back(std::move(depth_ranges));
+    }
+    if (offscreens.capacity() > offscreen_pool_.capacity()) {
+        offscreens.clear();
+        offscreen_pool_ = std::move(offscreens);
+    }
+    // Prefer whichever tables have the larger storage, which is usually
+    // the previous frame's since [Prepare] hands the canvas's over.
+    if (tables.transforms.capacity() > tables_.transforms.capacity()) {
+        tables_ = std::move(tables);
+    }
+    tables_.transforms.clear();
+    tables_.paints.clear();
+    tables_.buffers.clear();
+    tables_.extras.clear();
+
+    for (auto *states : {&finalized_states_, &pending_states_}) {
+        for (auto it = states->rbegin(); it != states->rend(); ++it) {
+            it->Clear();
+            state_pool_.push_back(std::move(*it));
+        }
+        states->clear();
+    }
+    clip_stack_.clear();
+    pending_clips_.clear();
+    pending_clip_bounds_.clear();
+    pending_clip_limits_.clear();
+    atlas_vertices_.clear();
+    atlas_depth_count_ = 0;
+    transform_indices_.Clear();
+    paint_indices_.Clear();
+    buffer_indices_.Clear();
+    lod_stats_ = {};
+    occlusion_stats_ = {};
+    clip_stats_ = {};
+    group_cull_stats_ = {};
+    depth_budget_stats_ = {};
+    for (OptimizerPassStats &stats : optimizer_stats_) {
+        stats = OptimizerPassStats{.name = stats.name};
+    }
+
+    clip_stack_.push_back({});
+    pending_states_.push_back(TakePooledState());
+    GetCurrent().is_onscreen = true;
+}
+
 // Transform Management.
 
 void Canvas::Translate(Scalar tx, Scalar ty) {
@@ -94,12 +426,165 @@ void Canvas::Transform(const Matrix &m) {
 
 // Drawing Management.
 
+std::optional<Path> Canvas::ClipToViewport(const Path &path) const {
+    if (!options_.viewport.has_value()) {
+        return std::nullopt;
+    }
+    std::array<HalfPlane, 4> planes;
+    if (!ComputeLocalClipPlanes(
+            options_.viewport->Expand(options_.guard_band, options_.guard_band),
+            clip_stack_.back().transform, planes)) {
+        return std::nullopt;
+    }
+    return ClipPathToPlanes(path, planes);
+}
+
+bool Canvas::ApplyLevelOfDetail(const Path &path, const Paint &paint,
+                                std::optional<Path> &simplified) {
+    const Matrix &transform = clip_stack_.back().transform;
+    Rect local_bounds = path.GetBounds();
+    Rect device_bounds = transform.TransformBounds(local_bounds);
+    Scalar device_size =
+        std::max(device_bounds.GetWidth(), device_bounds.GetHeight());
+
+    if (device_size <= kMaxSpriteSize) {
+        Scalar coverage = std::min(
+            std::abs(ComputePathArea(path) * transform.GetDeterminant()),
+            1.0f);
+        if (coverage < kMinCoverage) {
+            lod_stats_.dropped++;
+            lod_stats_.dropped_coverage += coverage;
+            return true;
+        }
+        // Gradients can't be weighted by coverage through the paint color.
+        if (!paint.HasGradient()) {
+            Point center((local_bounds.l + local_bounds.r) / 2,
+                         (local_bounds.t + local_bounds.b) / 2);
+            Scalar half_size = 0.5f / transform.GetMaxBasisLength();
+            Paint sprite_paint = paint;
+            sprite_paint.color =
+                paint.color.WithAlpha(paint.color.a * coverage);
+            DrawRect(Rect::MakeLTRB(center.x - half_size, center.y - half_size,
+                                    center.x + half_size,
+                                    center.y + half_size),
+                     sprite_paint);
+            lod_stats_.sprites++;
+            lod_stats_.sprite_coverage += coverage;
+            return true;
+        }
+    }
+
+    if (device_size < kMaxSimplifySize) {
+        Scalar scale = transform.GetMaxBasisLength();
+        Scalar device_area = device_bounds.GetWidth() * device_bounds.GetHeight();
+        size_t max_points = std::max(
+            kMinSimplifiedPoints,
+            static_cast<size_t>(kSimplifiedPointsPerPixel *
+                                std::sqrt(device_area)));
+        simplified.emplace(
+            SimplifyPath(path, scale, kSimplifyTolerance / scale, max_points));
+        lod_stats_.simplified++;
+    }
+    return false;
+}
+
+bool Canvas::DrawPathFromAtlas(const Path &path, const Matrix &transform,
+                               const Paint &paint) {
+    Rect device_bounds = transform.TransformBounds(path.GetBounds());
+    Scalar device_size =
+        std::max(device_bounds.GetWidth(), device_bounds.GetHeight());
+    // Level of detail handles these more cheaply.
+    if (options_.level_of_detail && device_size <= kMaxSpriteSize) {
+        return false;
+    }
+    if (options_.viewport.has_value() &&
+        !options_.viewport->Intersection(device_bounds).has_value()) {
+        return true;
+    }
+    if (IsClippedOut(device_bounds)) {
+        return true;
+    }
+    CoverageAtlas *atlas = options_.coverage_atlas;
+    std::optional<AtlasQuad> quad;
+    if (options_.distance_fields) {
+        quad = atlas->FindOrGenerateDistanceField(path, transform,
+                                                  paint.fill_rule);
+    }
+    if (!quad.has_value() && device_size <= CoverageAtlas::kMaxMaskSize) {
+        quad = atlas->FindOrRasterize(path, transform, paint.fill_rule);
+    }
+    if (!quad.has_value()) {
+        return false;
+    }
+
+    if (atlas_vertices_.empty()) {
+        atlas_bounds_ = quad->device;
+        atlas_depth_count_ = clip_stack_.back().draw_count;
+    } else {
+        atlas_bounds_ = atlas_bounds_.Union(quad->device);
+    }
+    // The batch may not be flushed until after the clip is restored.
+    AddToPendingClip(quad->device);
+    Color color = paint.color.Premultiply();
+    std::array<Scalar, 12> positions = quad->device.GetQuad();
+    std::array<Scalar, 12> uvs = quad->texels.GetQuad();
+    for (size_t i = 0; i < 12; i += 2) {
+        atlas_vertices_.push_back(AtlasVertex{
+            .color = {color.r, color.g, color.b, color.a},
+            .position = {positions[i], positions[i + 1]},
+            .uv = {uvs[i], uvs[i + 1]},
+            .depth_count =
+                static_cast<float>(clip_stack_.back().draw_count),
+            .distance_range = quad->distance_range,
+        });
+    }
+    clip_stack_.back().draw_count++;
+    return true;
+}
+
+void Canvas::FlushAtlasBatch() {
+    if (atlas_vertices_.empty()) {
+        return;
+    }
+    auto result = host_buffer_->AllocatePersistent(
+        atlas_vertices_.size() * sizeof(AtlasVertex), 0, 16);
+    std::memcpy(result.position.contents(), atlas_vertices_.data(),
+                atlas_vertices_.size() * sizeof(AtlasVertex));
+    size_t vertex_count = atlas_vertices_.size();
+    atlas_vertices_.clear();
+
+    Record(Command{
+        .paint = Paint(),
+        .depth_count = atlas_depth_count_,
+        .index_count = vertex_count,
+        .type = CommandType::kAtlas,
+        .vertex_buffer = result.position,
+        .index_buffer = {},
+        .bounds = atlas_bounds_,
+        .is_convex = true,
+        .transform = Matrix(),
+    });
+}
+
 void Canvas::DrawRect(const Rect &rect, Paint paint) {
+    const Matrix &transform = clip_stack_.back().transform;
+    if (IsClippedOut(
+            transform.TransformBounds(ComputeDrawBounds(rect, paint)))) {
+        return;
+    }
     auto result =
         host_buffer_->AllocatePersistent(6 * sizeof(simd::float2), 0, 16);
     std::array<Scalar, 12> bounds = rect.GetQuad();
     std::memcpy(result.position.contents(), bounds.data(), 6 * sizeof(Point));
 
+    // A rect is its own interior as long as it stays axis aligned.
+    const Scalar *m = transform.GetStorage();
+    std::optional<Rect> interior = std::nullopt;
+    if (options_.occlusion_culling && m[1] == 0 && m[4] == 0 && m[3] == 0 &&
+        m[7] == 0 && m[15] == 1) {
+        interior = transform.TransformBounds(rect);
+    }
+
     Record(Command{
         .paint = paint,
         .depth_count = clip_stack_.back().draw_count,
@@ -109,26 +594,107 @@ void Canvas::DrawRect(const Rect &rect, Paint paint) {
         .index_buffer = {},
         .bounds = rect,
         .is_convex = true,
-        .transform = clip_stack_.back().transform,
+        .transform = transform,
+        .interior = interior,
     });
     clip_stack_.back().draw_count++;
 }
 
 void Canvas::DrawPath(const Path &path, Paint paint) {
+    if (options_.coverage_atlas != nullptr && !paint.stroke &&
+        !paint.HasGradient() &&
+        DrawPathFromAtlas(path, clip_stack_.back().transform, paint)) {
+        return;
+    }
+    DrawPathTessellated(path, paint);
+}
+
+void Canvas::DrawGlyphRun(Font &font, const uint16_t *glyphs,
+                          const Point *positions, size_t count,
+                          Scalar font_size, Paint paint) {
+    bool use_atlas = options_.coverage_atlas != nullptr && !paint.stroke &&
+                     !paint.HasGradient();
+    Matrix glyph_scale = Matrix::MakeScale(font_size, font_size);
+    for (size_t i = 0; i < count; i++) {
+        const Path &path = font.GetGlyphPath(glyphs[i]);
+        if (path.Empty()) {
+            continue;
+        }
+        Matrix glyph_transform =
+            Matrix::MakeTranslate(positions[i].x, positions[i].y) *
+            glyph_scale;
+        if (use_atlas &&
+            DrawPathFromAtlas(path,
+                              clip_stack_.back().transform * glyph_transform,
+                              paint)) {
+            continue;
+        }
+        Save();
+        Transform(glyph_transform);
+        DrawPathTessellated(path, paint);
+        Restore();
+    }
+}
+
+void Canvas::DrawPathTessellated(const Path &path, const Paint &paint) {
+    if (IsClippedOut(clip_stack_.back().transform.TransformBounds(
+            ComputeDrawBounds(path.GetBounds(), paint)))) {
+        return;
+    }
+    std::optional<Path> simplified = std::nullopt;
+    if (options_.level_of_detail && !paint.stroke &&
+        ApplyLevelOfDetail(path, paint, simplified)) {
+        return;
+    }
+    const Path &source = simplified.has_value() ? *simplified : path;
+
+    // Clipping a stroke would stroke the new edges, so only fills are clipped.
+    std::optional<Path> clipped =
+        paint.stroke ? std::nullopt : ClipToViewport(source);
+    const Path &visible = clipped.has_value() ? *clipped : source;
+    if (visible.Empty()) {
+        return;
+    }
+
     size_t vertex_count = 0;
     size_t index_count = 0;
-   if (!paint.stroke) {
+    size_t patch_count = 0;
+    bool is_convex = visible.IsConvex() || paint.stroke;
+    if (!is_convex && options_.convex_decomposition) {
         auto [p_vertex_count, p_index_count] =
-            triangulator_->triangulate(path, /*scale_factor=*/1);
+            triangulator_->triangulateConvexDecomposition(visible,
+                                                          /*scale_factor=*/1);
+        vertex_count = p_vertex_count;
+        index_count = p_index_count;
+        is_convex = index_count > 0;
+    }
+    if (index_count > 0) {
+        // Drawn from the convex decomposition.
+    } else if (!is_convex && options_.curve_patches) {
+        // The renderer raises the resolve level of the patches by the scale
+        // of the transform, so curves are chopped to leave room for it.
+        auto [p_vertex_count, p_index_count, p_patch_count] =
+            triangulator_->triangulatePatches(
+                visible, /*scale_factor=*/1,
+                ComputeResolveLevelBias(
+                    clip_stack_.back().transform.GetMaxBasisLength()));
+        vertex_count = p_vertex_count;
+        index_count = p_index_count;
+        patch_count = p_patch_count;
+    } else if (!paint.stroke) {
+        auto [p_vertex_count, p_index_count] =
+            triangulator_->triangulate(visible, /*scale_factor=*/1);
         vertex_count = p_vertex_count;
         index_count = p_index_count;
     } else {
         auto [p_vertex_count, p_index_count] =
-            triangulator_->triangulateStroke(path, /*stroke_width=*/paint.stroke_width, /*scale_factor=*/1);
+            triangulator_->triangulateStroke(visible, /*stroke_width=*/paint.stroke_width, /*scale_factor=*/1);
         vertex_count = p_vertex_count;
         index_count = p_index_count;
     }
-    if (vertex_count == 0 || index_count == 0) {
+    if (vertex_count == 0 || (index_count == 0 && patch_count == 0)) {
+        triangulator_->write(nullptr, nullptr);
+        triangulator_->writePatches(nullptr);
         return;
     }
     auto result =
@@ -139,6 +705,20 @@ void Canvas::DrawPath(const Path &path, Paint paint) {
         std::cerr << "Failed to allocate persistent." << std::endl;
         return;
     }
+    BufferView patch_buffer = {};
+    if (patch_count > 0) {
+        patch_buffer = host_buffer_
+                           ->AllocatePersistent(
+                               patch_count * sizeof(CurvePatch), 0, 16)
+                           .position;
+        triangulator_->writePatches(patch_buffer.contents());
+    }
+
+    std::optional<Rect> interior = std::nullopt;
+    if (options_.occlusion_culling && !paint.stroke && visible.IsConvex()) {
+        interior =
+            ComputeInteriorRect(visible, clip_stack_.back().transform);
+    }
 
     Record(Command{
         .paint = paint,
@@ -147,21 +727,40 @@ void Canvas::DrawPath(const Path &path, Paint paint) {
         .type = CommandType::kDraw,
         .vertex_buffer = result.position,
         .index_buffer = result.index,
-        .bounds = path.GetBounds(),
-        .is_convex = path.IsConvex() || paint.stroke,
+        .bounds = visible.GetBounds(),
+        .is_convex = is_convex,
         .transform = clip_stack_.back().transform,
+        .patch_buffer = patch_buffer,
+        .patch_count = patch_count,
+        .interior = interior,
     });
     clip_stack_.back().draw_count++;
 }
 
 void Canvas::ClipPath(const Path &path, ClipStyle style) {
+    if (style == ClipStyle::kIntersect && options_.scissor_rect_clips) {
+        if (std::optional<Rect> rect = ComputeScissorClip(path)) {
+            ClipStackEntry &entry = clip_stack_.back();
+            entry.scissor = IntersectBounds(entry.scissor, *rect);
+            entry.clip_bounds = IntersectBounds(entry.clip_bounds, *rect);
+            RecordScissor(entry.scissor);
+            clip_stats_.scissor_clips++;
+            return;
+        }
+    }
+    // An empty result is still recorded, as an intersect clip with nothing
+    // visible must clip everything.
+    std::optional<Path> clipped = ClipToViewport(path);
+    const Path &visible = clipped.has_value() ? *clipped : path;
     auto [vertex_count, index_count] =
-        triangulator_->triangulate(path, /*scale_factor=*/1);
+        triangulator_->triangulate(visible, /*scale_factor=*/1);
     auto result =
         host_buffer_->AllocatePersistent(vertex_count * sizeof(simd::float2),
                                          index_count * sizeof(uint16_t), 16);
     triangulator_->write(result.position.contents(), result.index.contents());
 
+    // Clips are always stenciled, so convexity only informs the optimizer
+    // passes. Rects are checked as well, since they are the common clip.
     Record(Command{
         .paint = Paint(),
         .depth_count = 0,
@@ -169,18 +768,79 @@ void Canvas::ClipPath(const Path &path, ClipStyle style) {
         .type = CommandType::kClip,
         .vertex_buffer = result.position,
         .index_buffer = result.index,
-        .bounds = path.GetBounds(),
-        .is_convex = path.IsConvex(),
+        .bounds = visible.GetBounds(),
+        .is_convex = visible.IsConvex() || visible.IsRect(),
         .transform = clip_stack_.back().transform,
         .style = style,
     });
-    clip_stack_.back().pending_clips.push_back(GetCurrent().commands.size() -
-                                               1);
+    pending_clips_.push_back(GetCurrent().commands.size() - 1);
+    pending_clip_bounds_.push_back(std::nullopt);
+    pending_clip_limits_.push_back(clip_stack_.back().clip_bounds);
     clip_stack_.back().draw_count++;
+
+    // A difference clip can remove any part of the bounds, so only
+    // intersect clips shrink them. An empty rect clips out everything.
+    if (style == ClipStyle::kIntersect) {
+        std::optional<Rect> &clip_bounds = clip_stack_.back().clip_bounds;
+        clip_bounds = IntersectBounds(
+            clip_bounds,
+            clip_stack_.back().transform.TransformBounds(visible.GetBounds()));
+    }
+}
+
+std::optional<Rect> Canvas::ComputeScissorClip(const Path &path) const {
+    const Matrix &transform = clip_stack_.back().transform;
+    const Scalar *m = transform.GetStorage();
+    // Scales and translates, optionally with a quarter turn.
+    bool is_rectilinear = (m[1] == 0 && m[4] == 0) || (m[0] == 0 && m[5] == 0);
+    if (!is_rectilinear || m[3] != 0 || m[7] != 0 || m[15] != 1 ||
+        !path.IsRect()) {
+        return std::nullopt;
+    }
+    // Stencil clips are antialiased, so only rects with whole pixel edges
+    // are clipped the same by a scissor.
+    Rect device = transform.TransformBounds(path.GetBounds());
+    Rect snapped = Rect::MakeLTRB(std::round(device.l), std::round(device.t),
+                                  std::round(device.r), std::round(device.b));
+    if (std::abs(device.l - snapped.l) > kScissorAlignmentTolerance ||
+        std::abs(device.t - snapped.t) > kScissorAlignmentTolerance ||
+        std::abs(device.r - snapped.r) > kScissorAlignmentTolerance ||
+        std::abs(device.b - snapped.b) > kScissorAlignmentTolerance) {
+        return std::nullopt;
+    }
+    return snapped;
+}
+
+void Canvas::RecordScissor(const std::optional<Rect> &scissor) {
+    constexpr Scalar kInfinity = std::numeric_limits<Scalar>::infinity();
+    Rect bounds = scissor.value_or(
+        Rect::MakeLTRB(-kInfinity, -kInfinity, kInfinity, kInfinity));
+    FlushAtlasBatch();
+
+    // A scissor with nothing recorded since the last one, such as on a
+    // restore followed by another rect clip, replaces it.
+    CommandState &state = GetCurrent();
+    if (!state.segments.empty() && !state.commands.empty() &&
+        state.commands.back().type == CommandType::kScissor &&
+        state.segments.back().commands_end == state.commands.size() &&
+        state.segments.back().opaque_end == state.opaque_commands.size()) {
+        tables_.extras[state.commands.back().extra_index].bounds = bounds;
+        return;
+    }
+    Record(Command{
+        .paint = Paint(),
+        .depth_count = 0,
+        .index_count = 0,
+        .type = CommandType::kScissor,
+        .bounds = bounds,
+    });
 }
 
 void Canvas::DrawTexture(const Rect &dest, MTL::Texture *texture,
                          Scalar alpha) {
+    if (IsClippedOut(clip_stack_.back().transform.TransformBounds(dest))) {
+        return;
+    }
     Record(Command{.paint = Paint{.color = Color(0, 0, 0, alpha)},
                    .depth_count = clip_stack_.back().draw_count,
                    .index_count = 0,
@@ -196,56 +856,226 @@ void Canvas::DrawTexture(const Rect &dest, MTL::Texture *texture,
 
 void Canvas::SaveLayer(Scalar alpha, ImageFilter image_filter,
                        ColorFilter color_filter) {
+    FlushAtlasBatch();
     ClipStackEntry entry{
-        .draw_count = clip_stack_.back().draw_count,
         .transform = clip_stack_.back().transform,
+        .draw_count = clip_stack_.back().draw_count,
+        .pending_clip_start = pending_clips_.size(),
         .is_save_layer = true,
         .alpha = alpha,
+        .clip_bounds = clip_stack_.back().clip_bounds,
+        .group_draw_count = clip_stack_.back().draw_count,
+        .group_opaque_begin = GetCurrent().opaque_commands.size(),
+        .group_commands_begin = GetCurrent().commands.size(),
     };
+    // Blurring spreads draws outside the clip bounds back inside them.
+    if (auto *gaussian = std::get_if<GaussianFilter>(&image_filter);
+        gaussian != nullptr && entry.clip_bounds.has_value()) {
+        entry.clip_bounds = entry.clip_bounds->Expand(3 * gaussian->sigma,
+                                                      3 * gaussian->sigma);
+    }
     clip_stack_.push_back(entry);
-    pending_states_.push_back(CommandState{
-        .image_filter = image_filter,
-        .color_filter = color_filter,
-    });
+    pending_states_.push_back(TakePooledState());
+    pending_states_.back().image_filter = image_filter;
+    pending_states_.back().color_filter = color_filter;
 }
 
 RenderProgram Canvas::Prepare() {
-    auto &state = GetCurrent();
-    if (!state.pending_commands.empty()) {
-        std::cerr << "Insert " << state.pending_commands.size() << " commands" << std::endl;
-        state.commands.insert(state.commands.begin() + state.flush_index,
-                              state.pending_commands.rbegin(),
-                              state.pending_commands.rend());
-        state.pending_commands.clear();
-    }
+    FlushAtlasBatch();
     while (!clip_stack_.empty()) {
         Restore();
     }
-    std::vector<Command> temp;
-    std::swap(state.commands, temp);
-    std::vector<RenderProgram::Data> offscreens;
-
-    int index = 0;
-    for (auto offscreen_state : finalized_states_) {
-        if (!offscreen_state.pending_commands.empty()) {
-            offscreen_state.commands.insert(
-                offscreen_state.commands.begin() + offscreen_state.flush_index,
-                offscreen_state.pending_commands.rbegin(),
-                offscreen_state.pending_commands.rend());
-            offscreen_state.pending_commands.clear();
+    if (options_.cull_groups) {
+        if (options_.viewport.has_value()) {
+            CullGroups(GetCurrent());
+            for (auto &offscreen_state : finalized_states_) {
+                CullGroups(offscreen_state);
+            }
         }
-
-        offscreens.push_back(RenderProgram::Data{
-            .commands = offscreen_state.commands,
-            .texture = textures_[index++],
-            .filter_texture = offscreen_state.filter_texture,
+        BuildGroupHierarchy();
+    }
+    if (options_.occlusion_culling) {
+        CullOccluded(GetCurrent());
+        for (auto &offscreen_state : finalized_states_) {
+            CullOccluded(offscreen_state);
+        }
+    }
+    PreparedDisplayList &prepared = prepared_;
+    prepared.commands = TakePooledCommands();
+    GetCurrent().TakeCommands(prepared.commands);
+    prepared.layers.clear();
+    for (auto &offscreen_state : finalized_states_) {
+        PreparedLayer layer{
+            .commands = TakePooledCommands(),
             .image_filter = offscreen_state.image_filter,
             .color_filter = offscreen_state.color_filter,
+            .alpha = offscreen_state.alpha,
             .bounds = offscreen_state.bounds_estimate.value_or(
                 Rect::MakeLTRB(0, 0, 1, 1)),
+            .composite_extra_index = offscreen_state.composite_extra_index,
+        };
+        offscreen_state.TakeCommands(layer.commands);
+        prepared.layers.push_back(std::move(layer));
+    }
+    prepared.tables = &tables_;
+    prepared.IndexLayers();
+    // Layers whose draw was culled or clipped out are never rendered.
+    prepared.RemoveUnreachableLayers();
+    RunOptimizerPasses();
+
+    std::vector<PackedCommand> temp = std::move(prepared.commands);
+    if (options_.batch_convex_draws) {
+        BatchConvexDraws(temp);
+    }
+    std::vector<CommandGroup> groups = TakePooledGroups();
+    BuildCommandGroups(temp, groups);
+    std::vector<DepthRange> depth_ranges = TakePooledDepthRanges();
+    AssignDepthRanges(temp, depth_ranges);
+    std::vector<RenderProgram::Data> offscreens = std::move(offscreen_pool_);
+    offscreens.clear();
+    offscreen_pool_.clear();
+
+    for (PreparedLayer &layer : prepared.layers) {
+        if (layer.is_removed) {
+            command_pool_.push_back(std::move(layer.commands));
+            continue;
+        }
+        if (options_.batch_convex_draws) {
+            BatchConvexDraws(layer.commands);
+        }
+        std::vector<CommandGroup> layer_groups = TakePooledGroups();
+        BuildCommandGroups(layer.commands, layer_groups);
+        std::vector<DepthRange> layer_depth_ranges = TakePooledDepthRanges();
+        AssignDepthRanges(layer.commands, layer_depth_ranges);
+        MTL::Texture *texture = AllocateLayerTexture(
+            host_buffer_, layer.bounds.GetWidth(), layer.bounds.GetHeight());
+        MTL::Texture *filter_texture = nullptr;
+        if (IsBlur(layer.image_filter)) {
+            filter_texture = AllocateLayerTexture(host_buffer_,
+                                                  layer.bounds.GetWidth() / 2,
+                                                  layer.bounds.GetHeight() / 2);
+        }
+        tables_.extras[layer.composite_extra_index].texture =
+            filter_texture != nullptr ? filter_texture : texture;
+        offscreens.push_back(RenderProgram::Data{
+            .commands = std::move(layer.commands),
+            .groups = std::move(layer_groups),
+            .depth_ranges = std::move(layer_depth_ranges),
+            .texture = texture,
+            .filter_texture = filter_texture,
+            .image_filter = layer.image_filter,
+            .color_filter = layer.color_filter,
+            .bounds = layer.bounds,
+        });
+    }
+    prepared.layers.clear();
+    transform_indices_.Clear();
+    paint_indices_.Clear();
+    buffer_indices_.Clear();
+    return RenderProgram(std::move(temp), std::move(offscreens),
+                         std::exchange(tables_, {}), std::move(groups),
+                         std::move(depth_ranges));
+}
+
+void Canvas::RunOptimizerPasses() {
+    // Each pass is charged with the commands and layers that are gone after
+    // it runs, including layers that are no longer drawn because of it.
+    PreparedDisplayList &prepared = prepared_;
+    for (size_t i = 0; i < options_.optimizer_passes.size(); i++) {
+        size_t commands = prepared.CountCommands();
+        size_t layers = prepared.CountLayers();
+        options_.optimizer_passes[i].run(prepared);
+        prepared.RemoveUnreachableLayers();
+        optimizer_stats_[i].removed_commands +=
+            commands - prepared.CountCommands();
+        optimizer_stats_[i].removed_layers += layers - prepared.CountLayers();
+    }
+}
+
+void Canvas::BatchConvexDraws(std::vector<PackedCommand> &commands) {
+    // Consecutive commands are drawn in order within a single draw call as
+    // well, so merging them is safe regardless of overlap. Only the state
+    // they bind has to match.
+    auto is_batchable = [&](const PackedCommand &command) {
+        if (command.type != CommandType::kDraw || !command.IsConvex()) {
+            return false;
+        }
+        const Scalar *m =
+            tables_.transforms[command.transform_index].GetStorage();
+        return !tables_.paints[command.paint_index].HasGradient() &&
+               m[3] == 0 && m[7] == 0 && m[15] == 1;
+    };
+    auto is_opaque = [&](const PackedCommand &command) {
+        return tables_.paints[command.paint_index].IsOpaque();
+    };
+
+    // A batch replaces at least two commands, so the result is written over
+    // the commands already read.
+    std::vector<BatchVertex> &vertices = batch_vertices_;
+    size_t out = 0;
+    size_t i = 0;
+    while (i < commands.size()) {
+        size_t end = i + 1;
+        if (is_batchable(commands[i])) {
+            while (end < commands.size() && is_batchable(commands[end]) &&
+                   is_opaque(commands[end]) == is_opaque(commands[i])) {
+                end++;
+            }
+        }
+        if (end - i < 2) {
+            commands[out++] = commands[i];
+            i = end;
+            continue;
+        }
+
+        vertices.clear();
+        for (size_t j = i; j < end; j++) {
+            const PackedCommand &command = commands[j];
+            const Matrix &transform =
+                tables_.transforms[command.transform_index];
+            Color color =
+                tables_.paints[command.paint_index].color.Premultiply();
+            const uint8_t *contents = static_cast<const uint8_t *>(
+                tables_.buffers[command.buffer_index]->contents());
+            const Point *points = reinterpret_cast<const Point *>(
+                contents + command.vertex_offset);
+            const uint16_t *indices = reinterpret_cast<const uint16_t *>(
+                contents + command.index_offset);
+            for (uint32_t k = 0; k < command.index_count; k++) {
+                Point point = transform.TransformPoint(
+                    points[command.IsIndexed() ? indices[k] : k]);
+                vertices.push_back(BatchVertex{
+                    .color = {color.r, color.g, color.b, color.a},
+                    .position = {point.x, point.y},
+                    .depth_count = static_cast<float>(command.depth_count),
+                });
+            }
+        }
+        auto buffer = host_buffer_->AllocatePersistent(
+            vertices.size() * sizeof(BatchVertex), 0, 16);
+        if (!buffer.position) {
+            std::cerr << "Failed to allocate persistent." << std::endl;
+            out = std::copy(commands.begin() + i, commands.begin() + end,
+                            commands.begin() + out) -
+                  commands.begin();
+            i = end;
+            continue;
+        }
+        std::memcpy(buffer.position.contents(), vertices.data(),
+                    vertices.size() * sizeof(BatchVertex));
+        commands[out++] = Pack(Command{
+            .paint = tables_.paints[commands[end - 1].paint_index],
+            .depth_count = commands[end - 1].depth_count,
+            .index_count = vertices.size(),
+            .type = CommandType::kBatch,
+            .vertex_buffer = buffer.position,
+            .index_buffer = {},
+            .transform = Matrix(),
+            .is_convex = true,
         });
+        i = end;
     }
-    return RenderProgram(temp, std::move(offscreens));
+    commands.resize(out);
 }
 
 // Save Layer Management.
@@ -255,9 +1085,20 @@ void Canvas::Save() {
     // have a clip depth set to the minimum of the clip depth of this save,
     // inclusive of any nested layers. This is computed by accumulated the
     // number of draws into each clip stack entry.
+    if (options_.cull_groups) {
+        // Atlas quads are batched within a group, so that the batch lies
+        // inside the group's commands.
+        FlushAtlasBatch();
+    }
     ClipStackEntry entry{
-        .draw_count = clip_stack_.back().draw_count,
         .transform = clip_stack_.back().transform,
+        .draw_count = clip_stack_.back().draw_count,
+        .pending_clip_start = pending_clips_.size(),
+        .clip_bounds = clip_stack_.back().clip_bounds,
+        .scissor = clip_stack_.back().scissor,
+        .group_draw_count = clip_stack_.back().draw_count,
+        .group_opaque_begin = GetCurrent().opaque_commands.size(),
+        .group_commands_begin = GetCurrent().commands.size(),
     };
     clip_stack_.push_back(entry);
 }
@@ -267,23 +1108,57 @@ void Canvas::Restore() {
         // Once we restore a clip stack entry, we've computed the depth value
         // that needs to be assigned to all clips within this save layer.
         // we recorded the indices of any pending clips that need to be updated.
-        const ClipStackEntry &entry = clip_stack_.back();
+        if (clip_stack_.back().is_save_layer || options_.cull_groups) {
+            FlushAtlasBatch();
+        }
+        const ClipStackEntry entry = clip_stack_.back();
         auto &state = GetCurrent();
-        for (size_t clip_index : entry.pending_clips) {
-            state.commands[clip_index].depth_count = entry.draw_count;
+        // A clip's depth write only needs to cover the draws after it,
+        // including those after later clips, so the bounds are accumulated
+        // backwards. Clips with nothing drawn after them are dropped, as are
+        // intersect clips with nothing drawn inside the clips before them.
+        std::optional<Rect> covered = std::nullopt;
+        for (size_t i = pending_clips_.size();
+             i-- > entry.pending_clip_start;) {
+            if (pending_clip_bounds_[i].has_value()) {
+                covered = covered.has_value()
+                              ? covered->Union(*pending_clip_bounds_[i])
+                              : *pending_clip_bounds_[i];
+            }
+            PackedCommand &clip = state.commands[pending_clips_[i]];
+            clip.depth_count = entry.draw_count;
+            std::optional<Rect> cover = covered;
+            if (covered.has_value() && pending_clip_limits_[i].has_value()) {
+                cover = covered->Intersection(*pending_clip_limits_[i]);
+            }
+            if (!cover.has_value()) {
+                clip.flags |= PackedCommand::kCulled;
+                clip_stats_.culled_clips++;
+            } else if (clip.GetClipStyle() == ClipStyle::kIntersect) {
+                tables_.extras[clip.extra_index].bounds = *cover;
+            }
+        }
+        pending_clips_.resize(entry.pending_clip_start);
+        pending_clip_bounds_.resize(entry.pending_clip_start);
+        pending_clip_limits_.resize(entry.pending_clip_start);
+        if (covered.has_value()) {
+            AddToPendingClip(*covered);
         }
         clip_stack_.pop_back();
         if (!clip_stack_.empty()) {
             clip_stack_.back().draw_count = entry.draw_count;
+            // The scissor restored below belongs to the enclosing group.
+            if (!entry.is_save_layer && entry.group_bounds.has_value()) {
+                RecordGroup(entry, *entry.group_bounds);
+            }
+            // A layer's scissor is only set within its own pass.
+            if (!entry.is_save_layer &&
+                entry.scissor != clip_stack_.back().scissor) {
+                RecordScissor(clip_stack_.back().scissor);
+            }
         }
         if (entry.is_save_layer) {
-            if (!state.pending_commands.empty()) {
-                state.commands.insert(state.commands.begin() +
-                                          state.flush_index,
-                                      state.pending_commands.rbegin(),
-                                      state.pending_commands.rend());
-                state.pending_commands.clear();
-            }
+            state.Flush();
 
             finalized_states_.push_back(
                 std::move(pending_states_[pending_states_.size() - 1]));
@@ -300,83 +1175,823 @@ void Canvas::Restore() {
                 finalized_states_.back().bounds_estimate = dest;
             }
 
-            // Create texture for offscreen.
-            MTL::TextureDescriptor *desc = MTL::TextureDescriptor::alloc();
-            desc->setWidth(std::ceil(dest.GetWidth()));
-            desc->setHeight(std::ceil(dest.GetHeight()));
-            desc->setDepth(1);
-            desc->setUsage(MTL::TextureUsageShaderRead |
-                           MTL::TextureUsageRenderTarget);
-            desc->setArrayLength(1);
-            desc->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
-            desc->setMipmapLevelCount(1);
-            desc->setStorageMode(MTL::StorageModePrivate);
-            desc->setSampleCount(1);
-            desc->setTextureType(MTL::TextureType2D);
-            desc->setSwizzle(MTL::TextureSwizzleChannels()); // WTF Metal CPP.
-            desc->setCompressionType(MTL::TextureCompressionTypeLossy);
-            desc->setAllowGPUOptimizedContents(true);
-
-            auto texture = host_buffer_->AllocateTempTexture(desc);
-            desc->release();
-
-            textures_.push_back(texture);
-
-            if (is_blur) {
-                MTL::TextureDescriptor *desc = MTL::TextureDescriptor::alloc();
-                desc->setWidth(std::ceil(dest.GetWidth() / 2));
-                desc->setHeight(std::ceil(dest.GetHeight() / 2));
-                desc->setDepth(1);
-                desc->setUsage(MTL::TextureUsageShaderRead |
-                               MTL::TextureUsageRenderTarget);
-                desc->setArrayLength(1);
-                desc->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
-                desc->setMipmapLevelCount(1);
-                desc->setStorageMode(MTL::StorageModePrivate);
-                desc->setSampleCount(1);
-                desc->setTextureType(MTL::TextureType2D);
-                desc->setSwizzle(
-                    MTL::TextureSwizzleChannels()); // WTF Metal CPP.
-                desc->setCompressionType(MTL::TextureCompressionTypeLossy);
-                desc->setAllowGPUOptimizedContents(true);
-
-                auto texture = host_buffer_->AllocateTempTexture(desc);
-                desc->release();
-
-                finalized_states_.back().filter_texture = texture;
-                DrawTexture(dest, texture, 1.0);
-            } else {
-                DrawTexture(dest, texture, entry.alpha);
+            // The textures are allocated in [Prepare], once the optimizer
+            // passes have decided whether the layer is still needed. A blur
+            // is drawn from its filter texture, which applies no alpha.
+            CommandState &layer = finalized_states_.back();
+            layer.alpha = entry.alpha;
+            size_t extra_count = tables_.extras.size();
+            DrawTexture(dest, nullptr, is_blur ? 1.0f : entry.alpha);
+            if (tables_.extras.size() > extra_count) {
+                layer.composite_extra_index = extra_count;
+                // The layer's draws are within [dest], and the composite is
+                // within its transformed bounds.
+                RecordGroup(entry,
+                            dest.Union(clip_stack_.back().transform
+                                           .TransformBounds(dest)));
+            }
+        }
+    }
+}
+
+void Canvas::DrawSubList(Canvas &sub_list) {
+    FlushAtlasBatch();
+    sub_list.FlushAtlasBatch();
+    while (sub_list.clip_stack_.size() > 1) {
+        sub_list.Restore();
+    }
+    // Restoring the root entry assigns the depth of its clips.
+    int draw_count = sub_list.clip_stack_.back().draw_count;
+    std::optional<Rect> group_bounds = sub_list.clip_stack_.back().group_bounds;
+    bool has_scissor = sub_list.clip_stack_.back().scissor.has_value();
+    sub_list.Restore();
+
+    const DisplayListTables &tables = sub_list.tables_;
+    sub_list_transforms_.clear();
+    for (const Matrix &transform : tables.transforms) {
+        sub_list_transforms_.push_back(AddTransform(transform));
+    }
+    sub_list_paints_.clear();
+    for (const Paint &paint : tables.paints) {
+        sub_list_paints_.push_back(AddPaint(paint));
+    }
+    sub_list_buffers_.clear();
+    for (MTL::Buffer *buffer : tables.buffers) {
+        sub_list_buffers_.push_back(AddBuffer(buffer));
+    }
+    uint32_t extra_offset = tables_.extras.size();
+    tables_.extras.insert(tables_.extras.end(), tables.extras.begin(),
+                          tables.extras.end());
+
+    int depth_offset = clip_stack_.back().draw_count;
+    auto rebase = [&](PackedCommand &command) {
+        command.transform_index =
+            sub_list_transforms_[command.transform_index];
+        command.paint_index = sub_list_paints_[command.paint_index];
+        // Commands without vertices have no buffer.
+        if (command.buffer_index < sub_list_buffers_.size()) {
+            command.buffer_index = sub_list_buffers_[command.buffer_index];
+        }
+        if (command.extra_index != PackedCommand::kNoExtra) {
+            command.extra_index += extra_offset;
+        }
+        command.depth_count += depth_offset;
+        if (command.type == CommandType::kAtlas && depth_offset != 0) {
+            // Atlas quads carry their own depths.
+            AtlasVertex *vertices = reinterpret_cast<AtlasVertex *>(
+                static_cast<uint8_t *>(
+                    tables_.buffers[command.buffer_index]->contents()) +
+                command.vertex_offset);
+            for (uint32_t i = 0; i < command.index_count; i++) {
+                vertices[i].depth_count += depth_offset;
+            }
+        }
+    };
+    auto rebase_state = [&](CommandState &state) {
+        for (PackedCommand &command : state.opaque_commands) {
+            rebase(command);
+        }
+        for (PackedCommand &command : state.commands) {
+            rebase(command);
+        }
+        for (RecordedGroup &group : state.groups) {
+            group.first_depth += depth_offset;
+            group.end_depth += depth_offset;
+        }
+    };
+
+    // Layers are complete, so they are finalized as they are.
+    for (CommandState &layer : sub_list.finalized_states_) {
+        rebase_state(layer);
+        if (layer.composite_extra_index != PackedCommand::kNoExtra) {
+            layer.composite_extra_index += extra_offset;
+        }
+        finalized_states_.push_back(std::move(layer));
+    }
+
+    // The onscreen commands continue the current state, like those of a
+    // group would.
+    CommandState &from = sub_list.GetCurrent();
+    rebase_state(from);
+    CommandState &state = GetCurrent();
+    const std::optional<Rect> &scissor = clip_stack_.back().scissor;
+    ClipStackEntry group{
+        .group_draw_count = depth_offset,
+        .group_opaque_begin = state.opaque_commands.size(),
+        .group_commands_begin = state.commands.size(),
+    };
+    state.opaque_commands.insert(state.opaque_commands.end(),
+                                 from.opaque_commands.begin(),
+                                 from.opaque_commands.end());
+    for (const PackedCommand &command : from.commands) {
+        if (command.type == CommandType::kScissor && scissor.has_value()) {
+            Rect &bounds = tables_.extras[command.extra_index].bounds;
+            bounds = IntersectBounds(scissor, bounds);
+        }
+        state.commands.push_back(command);
+    }
+    for (const CommandSegment &segment : from.segments) {
+        state.segments.push_back(CommandSegment{
+            .opaque_end = group.group_opaque_begin + segment.opaque_end,
+            .commands_end = group.group_commands_begin + segment.commands_end,
+        });
+    }
+    if (options_.occlusion_culling) {
+        // Fills under a clip here don't occlude, and the rest only occlude
+        // within the scissor.
+        bool is_clipped = HasActiveClip();
+        auto append_occlusion = [&](std::vector<OcclusionInfo> &to,
+                                    const std::vector<OcclusionInfo> &infos,
+                                    size_t count) {
+            if (infos.size() != count) {
+                to.resize(to.size() + count);
+                return;
+            }
+            for (OcclusionInfo info : infos) {
+                if (info.interior.has_value() && is_clipped) {
+                    info.interior = std::nullopt;
+                } else if (info.interior.has_value() && scissor.has_value()) {
+                    info.interior = scissor->Intersection(*info.interior);
+                }
+                to.push_back(info);
             }
+        };
+        append_occlusion(state.opaque_occlusion, from.opaque_occlusion,
+                         from.opaque_commands.size());
+        append_occlusion(state.occlusion, from.occlusion,
+                         from.commands.size());
+    }
+    for (RecordedGroup recorded : from.groups) {
+        recorded.opaque_begin += group.group_opaque_begin;
+        recorded.opaque_end += group.group_opaque_begin;
+        recorded.commands_begin += group.group_commands_begin;
+        recorded.commands_end += group.group_commands_begin;
+        state.groups.push_back(recorded);
+    }
+
+    clip_stack_.back().draw_count += draw_count;
+    if (from.bounds_estimate.has_value()) {
+        Rect bounds = *from.bounds_estimate;
+        state.bounds_estimate = state.bounds_estimate.has_value()
+                                    ? state.bounds_estimate->Union(bounds)
+                                    : bounds;
+        AddToPendingClip(bounds);
+        // The group bounds also hold the draws of layers.
+        if (group_bounds.has_value()) {
+            bounds = bounds.Union(*group_bounds);
         }
+        RecordGroup(group, bounds);
+    }
+    // Nothing restores a scissor left set at the root of the sub-list.
+    if (has_scissor) {
+        RecordScissor(clip_stack_.back().scissor);
     }
+
+    lod_stats_.dropped += sub_list.lod_stats_.dropped;
+    lod_stats_.sprites += sub_list.lod_stats_.sprites;
+    lod_stats_.simplified += sub_list.lod_stats_.simplified;
+    lod_stats_.dropped_coverage += sub_list.lod_stats_.dropped_coverage;
+    lod_stats_.sprite_coverage += sub_list.lod_stats_.sprite_coverage;
+    clip_stats_.culled_draws += sub_list.clip_stats_.culled_draws;
+    clip_stats_.culled_clips += sub_list.clip_stats_.culled_clips;
+    clip_stats_.scissor_clips += sub_list.clip_stats_.scissor_clips;
+    sub_list.Reset();
 }
 
 // Command Recording
 
 void Canvas::Record(Command &&cmd) {
+    // Opaque draws are reordered ahead of the batch anyway, so only other
+    // commands end it.
+    bool is_opaque_draw =
+        cmd.type == CommandType::kDraw && cmd.paint.IsOpaque();
+    if (cmd.type != CommandType::kAtlas && !is_opaque_draw) {
+        FlushAtlasBatch();
+    }
+
     auto &state = GetCurrent();
+    if (cmd.type == CommandType::kScissor) {
+        // Like a clip, this ends the segment so that no draw is reordered
+        // across it.
+        if (options_.occlusion_culling) {
+            state.occlusion.push_back(OcclusionInfo{});
+        }
+        state.commands.push_back(Pack(cmd));
+        state.Flush();
+        return;
+    }
+
+    Rect device_bounds =
+        cmd.transform.TransformBounds(ComputeDrawBounds(cmd.bounds, cmd.paint));
+    // Atlas quads are added as they are batched.
+    if (cmd.type != CommandType::kClip && cmd.type != CommandType::kAtlas) {
+        AddToPendingClip(device_bounds);
+    }
+    if (cmd.type != CommandType::kClip) {
+        AddToGroup(device_bounds);
+    }
     if (state.bounds_estimate.has_value()) {
-        state.bounds_estimate = state.bounds_estimate->Union(
-            cmd.transform.TransformBounds(cmd.bounds));
+        state.bounds_estimate = state.bounds_estimate->Union(device_bounds);
     } else {
-        state.bounds_estimate = cmd.transform.TransformBounds(cmd.bounds);
+        state.bounds_estimate = device_bounds;
     }
 
+    if (options_.occlusion_culling) {
+        // Stroke bounds don't include the stroke width, and atlas batches
+        // span several depths, so neither is culled.
+        OcclusionInfo info;
+        if ((cmd.type == CommandType::kDraw && !cmd.paint.stroke) ||
+            cmd.type == CommandType::kTexture) {
+            info.bounds = device_bounds;
+        }
+        if (is_opaque_draw && !HasActiveClip() && cmd.interior.has_value()) {
+            // Only the part inside the scissor is drawn.
+            const std::optional<Rect> &scissor = clip_stack_.back().scissor;
+            info.interior = scissor.has_value()
+                                ? scissor->Intersection(*cmd.interior)
+                                : cmd.interior;
+        }
+        (is_opaque_draw ? state.opaque_occlusion : state.occlusion)
+            .push_back(info);
+    }
+
+    if (cmd.depth_count - state.segment_depth >= kMaxSegmentDepthSpan) {
+        state.Flush();
+        state.segment_depth = cmd.depth_count;
+    }
     if (cmd.type == CommandType::kClip) {
-        // Flush and record
-        if (!state.pending_commands.empty()) {
-            state.commands.insert(state.commands.begin() + state.flush_index,
-                                  state.pending_commands.rbegin(),
-                                  state.pending_commands.rend());
-            state.pending_commands.clear();
-        }
-        state.commands.push_back(std::move(cmd));
-        state.flush_index = state.commands.size();
-    } else if (cmd.paint.IsOpaque() && cmd.type == CommandType::kDraw) {
-        state.pending_commands.push_back(std::move(cmd));
+        // Record and flush
+        state.commands.push_back(Pack(cmd));
+        state.Flush();
+    } else if (is_opaque_draw) {
+        state.opaque_commands.push_back(Pack(cmd));
     } else {
-        state.commands.push_back(std::move(cmd));
+        state.commands.push_back(Pack(cmd));
+    }
+}
+
+bool Canvas::IsClippedOut(const Rect &device_bounds) {
+    const std::optional<Rect> &clip_bounds = clip_stack_.back().clip_bounds;
+    if (!clip_bounds.has_value() ||
+        clip_bounds->Intersection(device_bounds).has_value()) {
+        return false;
+    }
+    clip_stats_.culled_draws++;
+    return true;
+}
+
+void Canvas::AddToGroup(const Rect &device_bounds) {
+    if (!options_.cull_groups) {
+        return;
+    }
+    std::optional<Rect> &bounds = clip_stack_.back().group_bounds;
+    bounds = bounds.has_value() ? bounds->Union(device_bounds) : device_bounds;
+}
+
+void Canvas::RecordGroup(const ClipStackEntry &entry, const Rect &bounds) {
+    if (!options_.cull_groups) {
+        return;
+    }
+    CommandState &state = GetCurrent();
+    state.groups.push_back(RecordedGroup{
+        .opaque_begin = entry.group_opaque_begin,
+        .opaque_end = state.opaque_commands.size(),
+        .commands_begin = entry.group_commands_begin,
+        .commands_end = state.commands.size(),
+        .first_depth = entry.group_draw_count,
+        .end_depth = clip_stack_.back().draw_count,
+        .bounds = bounds,
+    });
+    AddToGroup(bounds);
+}
+
+void Canvas::AddToPendingClip(const Rect &device_bounds) {
+    if (pending_clip_bounds_.empty()) {
+        return;
+    }
+    std::optional<Rect> &bounds = pending_clip_bounds_.back();
+    bounds = bounds.has_value() ? bounds->Union(device_bounds) : device_bounds;
+}
+
+bool Canvas::HasActiveClip() const {
+    // Clips outside of the layer apply to the layer as a whole.
+    auto layer = std::find_if(
+        clip_stack_.rbegin(), clip_stack_.rend(),
+        [](const ClipStackEntry &entry) { return entry.is_save_layer; });
+    size_t start =
+        layer == clip_stack_.rend() ? 0 : layer->pending_clip_start;
+    return pending_clips_.size() > start;
+}
+
+void Canvas::CullGroups(CommandState &state) {
+    auto cull = [&](std::vector<PackedCommand> &commands, size_t begin,
+                    size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (!commands[i].IsCulled()) {
+                commands[i].flags |= PackedCommand::kCulled;
+                group_cull_stats_.culled_commands++;
+            }
+        }
+    };
+    // Walking backwards visits each group before the groups inside it,
+    // which were restored first.
+    std::vector<RecordedGroup> &groups = state.groups;
+    for (size_t i = groups.size(); i-- > 0;) {
+        RecordedGroup &group = groups[i];
+        group_cull_stats_.tested++;
+        if (options_.viewport->Intersection(group.bounds).has_value()) {
+            continue;
+        }
+        group_cull_stats_.culled++;
+        group.is_culled = true;
+        cull(state.opaque_commands, group.opaque_begin, group.opaque_end);
+        cull(state.commands, group.commands_begin, group.commands_end);
+        while (i > 0 && groups[i - 1].first_depth >= group.first_depth) {
+            groups[--i].is_culled = true;
+        }
+    }
+}
+
+void Canvas::BuildGroupHierarchy() {
+    std::vector<GroupNode> &nodes = group_nodes_;
+    nodes.clear();
+    auto add_nodes = [&](const CommandState &state) {
+        group_cull_stats_.groups += state.groups.size();
+        for (const RecordedGroup &group : state.groups) {
+            if (!group.is_culled) {
+                nodes.push_back(GroupNode{
+                    .first_depth = group.first_depth,
+                    .end_depth = group.end_depth,
+                    .bounds = group.bounds,
+                    .parent = GroupNode::kNoParent,
+                });
+            }
+        }
+    };
+    add_nodes(GetCurrent());
+    for (const CommandState &offscreen_state : finalized_states_) {
+        add_nodes(offscreen_state);
+    }
+    std::sort(nodes.begin(), nodes.end(),
+              [](const GroupNode &a, const GroupNode &b) {
+                  return a.first_depth != b.first_depth
+                             ? a.first_depth < b.first_depth
+                             : a.end_depth > b.end_depth;
+              });
+    // Groups nested without drawing anything of their own span the same
+    // depths and draw the same, so only one is kept.
+    nodes.erase(std::unique(nodes.begin(), nodes.end(),
+                            [](const GroupNode &a, const GroupNode &b) {
+                                return a.first_depth == b.first_depth &&
+                                       a.end_depth == b.end_depth;
+                            }),
+                nodes.end());
+    // Depth ranges of groups either nest or are disjoint, so the parent of
+    // each group is the innermost earlier group that hasn't ended.
+    uint32_t open = GroupNode::kNoParent;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        while (open != GroupNode::kNoParent &&
+               nodes[open].end_depth <= nodes[i].first_depth) {
+            open = nodes[open].parent;
+        }
+        nodes[i].parent = open;
+        open = i;
+    }
+}
+
+void Canvas::BuildCommandGroups(const std::vector<PackedCommand> &commands,
+                                std::vector<CommandGroup> &groups) {
+    groups.clear();
+    const std::vector<GroupNode> &nodes = group_nodes_;
+    if (nodes.empty()) {
+        return;
+    }
+    std::vector<OpenGroup> &open = open_groups_;
+    open.clear();
+    // A run of one command is no cheaper to skip than the command, and a
+    // run the same as the one inside it has looser bounds.
+    auto close = [&](uint32_t end) {
+        OpenGroup group = open.back();
+        open.pop_back();
+        if (end - group.begin < 2 ||
+            (!groups.empty() && groups.back().begin == group.begin &&
+             groups.back().end == end)) {
+            return;
+        }
+        groups.push_back(CommandGroup{
+            .begin = group.begin,
+            .end = end,
+            .bounds = nodes[group.node].bounds,
+        });
+    };
+    auto contains = [&](uint32_t node, int32_t first, int32_t last) {
+        return nodes[node].first_depth <= first &&
+               last < nodes[node].end_depth;
+    };
+    for (uint32_t i = 0; i < commands.size(); i++) {
+        const PackedCommand &command = commands[i];
+        std::pair<int32_t, int32_t> span(command.depth_count,
+                                         command.depth_count);
+        if (command.type == CommandType::kClip ||
+            command.type == CommandType::kScissor) {
+            while (!open.empty()) {
+                close(i);
+            }
+            continue;
+        } else if (command.type == CommandType::kAtlas) {
+            span = GetMergedDepthSpan<AtlasVertex>(command, tables_);
+        } else if (command.type == CommandType::kBatch) {
+            span = GetMergedDepthSpan<BatchVertex>(command, tables_);
+        }
+        while (!open.empty() &&
+               !contains(open.back().node, span.first, span.second)) {
+            close(i);
+        }
+        // The innermost group containing the command encloses the last
+        // group to begin at or before it.
+        auto after = std::upper_bound(
+            nodes.begin(), nodes.end(), span.first,
+            [](int32_t depth_count, const GroupNode &node) {
+                return depth_count < node.first_depth;
+            });
+        if (after == nodes.begin()) {
+            continue;
+        }
+        uint32_t node = after - nodes.begin() - 1;
+        while (node != GroupNode::kNoParent &&
+               !contains(node, span.first, span.second)) {
+            node = nodes[node].parent;
+        }
+        // Open the groups between the innermost open group and the command.
+        uint32_t top = open.empty() ? GroupNode::kNoParent : open.back().node;
+        size_t opened = open.size();
+        for (; node != top; node = nodes[node].parent) {
+            open.push_back(OpenGroup{.node = node, .begin = i});
+        }
+        std::reverse(open.begin() + opened, open.end());
+    }
+    while (!open.empty()) {
+        close(commands.size());
+    }
+    std::sort(groups.begin(), groups.end(),
+              [](const CommandGroup &a, const CommandGroup &b) {
+                  return a.begin != b.begin ? a.begin < b.begin
+                                            : a.end > b.end;
+              });
+}
+
+void Canvas::AssignDepthRanges(const std::vector<PackedCommand> &commands,
+                               std::vector<DepthRange> &ranges) {
+    ranges.clear();
+    // Scissors don't draw, so they span nothing.
+    std::vector<std::pair<int32_t, int32_t>> &spans = depth_spans_;
+    spans.clear();
+    int32_t least = std::numeric_limits<int32_t>::max();
+    int32_t greatest = std::numeric_limits<int32_t>::min();
+    for (const PackedCommand &command : commands) {
+        std::pair<int32_t, int32_t> span(command.depth_count,
+                                         command.depth_count);
+        if (command.type == CommandType::kScissor) {
+            span = {std::numeric_limits<int32_t>::max(),
+                    std::numeric_limits<int32_t>::min()};
+        } else if (command.type == CommandType::kAtlas) {
+            span = GetMergedDepthSpan<AtlasVertex>(command, tables_);
+        } else if (command.type == CommandType::kBatch) {
+            span = GetMergedDepthSpan<BatchVertex>(command, tables_);
+        }
+        least = std::min(least, span.first);
+        greatest = std::max(greatest, span.second);
+        spans.push_back(span);
+    }
+    if (least > greatest) {
+        return;
+    }
+
+    // Renormalize to the finest spacing the pass needs, so that most scenes
+    // fit one depth buffer, and split it only beyond that.
+    int32_t span = greatest - least;
+    Scalar epsilon = kDepthEpsilon;
+    while (epsilon > kMinDepthEpsilon && span * epsilon > 1) {
+        epsilon /= 2;
+    }
+    int32_t capacity = static_cast<int32_t>(1 / epsilon);
+    depth_budget_stats_.widest_span =
+        std::max(depth_budget_stats_.widest_span, span);
+    if (epsilon < kDepthEpsilon) {
+        depth_budget_stats_.renormalized_passes++;
+    }
+    if (span <= capacity) {
+        ranges.push_back(DepthRange{
+            .begin = 0,
+            .base = least,
+            .epsilon = epsilon,
+        });
+        return;
+    }
+
+    std::vector<int32_t> &suffix_min = depth_suffix_min_;
+    suffix_min.resize(spans.size() + 1);
+    suffix_min.back() = std::numeric_limits<int32_t>::max();
+    for (size_t i = spans.size(); i > 0; i--) {
+        suffix_min[i - 1] = std::min(suffix_min[i], spans[i - 1].first);
+    }
+    // Grow each run until the next command would overflow it, then end it
+    // at the last point where the pass can be split.
+    uint32_t begin = 0;
+    uint32_t split = 0;
+    int32_t prefix_max = std::numeric_limits<int32_t>::min();
+    std::pair<int32_t, int32_t> run(std::numeric_limits<int32_t>::max(),
+                                    std::numeric_limits<int32_t>::min());
+    for (uint32_t i = 0; i < spans.size(); i++) {
+        if (i > begin && prefix_max < suffix_min[i]) {
+            split = i;
+        }
+        const std::pair<int32_t, int32_t> &next = spans[i];
+        if (run.first <= run.second && split > begin &&
+            std::max(run.second, next.second) -
+                    std::min(run.first, next.first) >
+                capacity) {
+            ranges.push_back(DepthRange{.begin = begin});
+            begin = split;
+            run = {std::numeric_limits<int32_t>::max(),
+                   std::numeric_limits<int32_t>::min()};
+            for (uint32_t j = begin; j < i; j++) {
+                run.first = std::min(run.first, spans[j].first);
+                run.second = std::max(run.second, spans[j].second);
+            }
+        }
+        run.first = std::min(run.first, next.first);
+        run.second = std::max(run.second, next.second);
+        prefix_max = std::max(prefix_max, next.second);
+    }
+    ranges.push_back(DepthRange{.begin = begin});
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        uint32_t end = i + 1 < ranges.size() ? ranges[i + 1].begin
+                                             : spans.size();
+        run = {std::numeric_limits<int32_t>::max(),
+               std::numeric_limits<int32_t>::min()};
+        for (uint32_t j = ranges[i].begin; j < end; j++) {
+            run.first = std::min(run.first, spans[j].first);
+            run.second = std::max(run.second, spans[j].second);
+        }
+        ranges[i].base = run.first <= run.second ? run.first : 0;
+        ranges[i].epsilon = epsilon;
+        if (run.second - run.first > capacity) {
+            depth_budget_stats_.overflowed_ranges++;
+        }
+    }
+    depth_budget_stats_.depth_clears += ranges.size() - 1;
+}
+
+void Canvas::CullOccluded(CommandState &state) {
+    if (!state.bounds_estimate.has_value()) {
+        return;
+    }
+    std::vector<CullEntry> &entries = cull_entries_;
+    entries.clear();
+    bool has_occluder = false;
+    auto add_entries = [&](std::vector<PackedCommand> &commands,
+                           const std::vector<OcclusionInfo> &infos) {
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (commands[i].IsCulled()) {
+                continue;
+            }
+            if (infos[i].bounds.has_value() || infos[i].interior.has_value()) {
+                entries.push_back(CullEntry{commands[i].depth_count,
+                                            &commands[i], &infos[i]});
+                has_occluder |= infos[i].interior.has_value();
+            }
+        }
+    };
+    add_entries(state.opaque_commands, state.opaque_occlusion);
+    add_entries(state.commands, state.occlusion);
+    if (!has_occluder) {
+        return;
+    }
+
+    // Walk from the top of the paint order down, so that each command is
+    // tested against the fills drawn over it.
+    std::sort(entries.begin(), entries.end(),
+              [](const CullEntry &a, const CullEntry &b) {
+                  return a.depth_count > b.depth_count;
+              });
+    static constexpr Scalar kOcclusionCellSize = 8;
+    OcclusionBuffer &buffer = occlusion_buffer_;
+    buffer.Reset(*state.bounds_estimate, kOcclusionCellSize);
+    for (const CullEntry &entry : entries) {
+        if (entry.info->bounds.has_value()) {
+            occlusion_stats_.tested++;
+            if (buffer.IsOccluded(*entry.info->bounds)) {
+                entry.command->flags |= PackedCommand::kCulled;
+                occlusion_stats_.culled++;
+                continue;
+            }
+        }
+        if (entry.info->interior.has_value()) {
+            buffer.AddOccluder(*entry.info->interior);
+            occlusion_stats_.occluders++;
+        }
+    }
+}
+
+void Canvas::CommandState::Flush() {
+    CommandSegment last = segments.empty() ? CommandSegment{} : segments.back();
+    if (last.opaque_end == opaque_commands.size() &&
+        last.commands_end == commands.size()) {
+        return;
+    }
+    segments.push_back(CommandSegment{
+        .opaque_end = opaque_commands.size(),
+        .commands_end = commands.size(),
+    });
+}
+
+void Canvas::CommandState::TakeCommands(std::vector<PackedCommand> &result) {
+    Flush();
+    result.clear();
+    result.reserve(opaque_commands.size() + commands.size());
+    auto is_visible = [](const PackedCommand &command) {
+        return !command.IsCulled();
+    };
+    CommandSegment begin;
+    for (const CommandSegment &end : segments) {
+        std::copy_if(opaque_commands.rend() - end.opaque_end,
+                     opaque_commands.rend() - begin.opaque_end,
+                     std::back_inserter(result), is_visible);
+        std::copy_if(commands.begin() + begin.commands_end,
+                     commands.begin() + end.commands_end,
+                     std::back_inserter(result), is_visible);
+        begin = end;
+    }
+    opaque_commands.clear();
+    commands.clear();
+    segments.clear();
+    opaque_occlusion.clear();
+    occlusion.clear();
+    groups.clear();
+    segment_depth = 0;
+}
+
+void Canvas::CommandState::Clear() {
+    opaque_commands.clear();
+    commands.clear();
+    segments.clear();
+    opaque_occlusion.clear();
+    occlusion.clear();
+    groups.clear();
+    segment_depth = 0;
+    bounds_estimate = std::nullopt;
+    is_onscreen = false;
+    alpha = 1;
+    composite_extra_index = PackedCommand::kNoExtra;
+    image_filter = std::monostate{};
+    color_filter = std::monostate{};
+}
+
+Canvas::CommandState Canvas::TakePooledState() {
+    if (state_pool_.empty()) {
+        return CommandState{};
+    }
+    CommandState state = std::move(state_pool_.back());
+    state_pool_.pop_back();
+    return state;
+}
+
+std::vector<PackedCommand> Canvas::TakePooledCommands() {
+    if (command_pool_.empty()) {
+        return {};
+    }
+    std::vector<PackedCommand> commands = std::move(command_pool_.back());
+    command_pool_.pop_back();
+    return commands;
+}
+
+std::vector<CommandGroup> Canvas::TakePooledGroups() {
+    if (group_pool_.empty()) {
+        return {};
+    }
+    std::vector<CommandGroup> groups = std::move(group_pool_.back());
+    group_pool_.pop_back();
+    return groups;
+}
+
+std::vector<DepthRange> Canvas::TakePooledDepthRanges() {
+    if (depth_range_pool_.empty()) {
+        return {};
+    }
+    std::vector<DepthRange> depth_ranges = std::move(depth_range_pool_.back());
+    depth_range_pool_.pop_back();
+    return depth_ranges;
+}
+
+uint32_t Canvas::AddTransform(const Matrix &transform) {
+    // Consecutive commands usually share a transform and paint, so the last
+    // entry is checked before hashing.
+    if (!tables_.transforms.empty() &&
+        MatricesEqual(tables_.transforms.back(), transform)) {
+        return tables_.transforms.size() - 1;
+    }
+    uint32_t index = transform_indices_.FindOrInsert(
+        HashMatrix(transform), tables_.transforms.size(),
+        [&](uint32_t index) {
+            return MatricesEqual(tables_.transforms[index], transform);
+        });
+    if (index == tables_.transforms.size()) {
+        tables_.transforms.push_back(transform);
+    }
+    return index;
+}
+
+uint32_t Canvas::AddPaint(const Paint &paint) {
+    if (!tables_.paints.empty() && PaintsEqual(tables_.paints.back(), paint)) {
+        return tables_.paints.size() - 1;
+    }
+    uint32_t index = paint_indices_.FindOrInsert(
+        HashPaint(paint), tables_.paints.size(), [&](uint32_t index) {
+            return PaintsEqual(tables_.paints[index], paint);
+        });
+    if (index == tables_.paints.size()) {
+        tables_.paints.push_back(paint);
+    }
+    return index;
+}
+
+uint32_t Canvas::AddBuffer(MTL::Buffer *buffer) {
+    uint32_t index = buffer_indices_.FindOrInsert(
+        HashCombine(0, reinterpret_cast<uintptr_t>(buffer)),
+        tables_.buffers.size(),
+        [&](uint32_t index) { return tables_.buffers[index] == buffer; });
+    if (index == tables_.buffers.size()) {
+        tables_.buffers.push_back(buffer);
+    }
+    return index;
+}
+
+PackedCommand Canvas::Pack(const Command &cmd) {
+    uint32_t transform_index = AddTransform(cmd.transform);
+    uint32_t paint_index = AddPaint(cmd.paint);
+    uint32_t buffer_index = 0;
+    if (cmd.vertex_buffer) {
+        buffer_index = AddBuffer(cmd.vertex_buffer.buffer);
+    }
+
+    // Only stenciled draws, clips, scissors and textures need their bounds at
+    // replay.
+    uint32_t extra_index = PackedCommand::kNoExtra;
+    if (cmd.type == CommandType::kTexture || cmd.type == CommandType::kClip ||
+        cmd.type == CommandType::kScissor ||
+        (cmd.type == CommandType::kDraw && !cmd.is_convex)) {
+        extra_index = tables_.extras.size();
+        tables_.extras.push_back(CommandExtra{
+            .bounds = cmd.bounds,
+            .texture = cmd.texture,
+            .patch_buffer = cmd.patch_buffer,
+            .patch_count = cmd.patch_count,
+        });
+    }
+
+    uint8_t flags = 0;
+    if (cmd.is_convex) {
+        flags |= PackedCommand::kConvex;
+    }
+    if (cmd.index_buffer) {
+        flags |= PackedCommand::kIndexed;
+    }
+    if (cmd.type == CommandType::kClip && cmd.style == ClipStyle::kDifference) {
+        flags |= PackedCommand::kDifference;
+    }
+    return PackedCommand{
+        .type = cmd.type,
+        .flags = flags,
+        .buffer_index = buffer_index,
+        .vertex_offset = static_cast<uint32_t>(cmd.vertex_buffer.offset),
+        .index_offset = static_cast<uint32_t>(cmd.index_buffer.offset),
+        .index_count = static_cast<uint32_t>(cmd.index_count),
+        .depth_count = cmd.depth_count,
+        .transform_index = transform_index,
+        .paint_index = paint_index,
+        .extra_index = extra_index,
+    };
+}
+
+void Canvas::IndexTable::Clear() {
+    std::fill(indices.begin(), indices.end(), kEmpty);
+    count = 0;
+}
+
+void Canvas::IndexTable::Grow() {
+    std::vector<uint64_t> old_hashes = std::move(hashes);
+    std::vector<uint32_t> old_indices = std::move(indices);
+    size_t capacity = std::max<size_t>(64, old_indices.size() * 2);
+    hashes.assign(capacity, 0);
+    indices.assign(capacity, kEmpty);
+    count = 0;
+    for (size_t i = 0; i < old_indices.size(); i++) {
+        if (old_indices[i] != kEmpty) {
+            FindOrInsert(old_hashes[i], old_indices[i],
+                         [](uint32_t) { return false; });
+        }
     }
 }
 
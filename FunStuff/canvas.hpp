@@ -2,9 +2,15 @@
 #define CANVAS
 
 #include <variant>
+#include <vector>
 
+#include "geom/atlas.hpp"
 #include "geom/basic.hpp"
 #include "geom/bezier.hpp"
+#include "geom/font.hpp"
+#include "geom/occlusion.hpp"
+#include "geom/paint.hpp"
+#include "geom/path_clipper.hpp"
 #include "geom/triangulator.hpp"
 #include "host_buffer.hpp"
 
@@ -20,45 +26,19 @@ enum class ClipStyle {
     kDifference
 };
 
-enum class FillRule {
-    kNonZero,
-    kEvenOdd,
-};
-
-enum class CommandType {
+enum class CommandType : uint8_t {
     kDraw,
     kTexture,
     kClip,
-};
-
-struct LinearGradient {
-    Point start;
-    Point end;
-    size_t texture_index;
-};
-
-struct RadialGradient {
-    Point center;
-    Scalar radius;
-    size_t texture_index;
-};
-
-using Gradient = std::variant<std::monostate, LinearGradient, RadialGradient>;
-
-struct Paint {
-    Color color;
-    Gradient gradient = std::monostate();
-    bool stroke = false;
-    Scalar stroke_width = 1.0f;
-    FillRule fill_rule = FillRule::kNonZero;
-
-    constexpr bool HasGradient() const {
-        return !std::holds_alternative<std::monostate>(gradient);
-    }
-
-    constexpr bool IsOpaque() const {
-        return !HasGradient() && color.is_opaque();
-    }
+    /// A batch of quads sampling a [CoverageAtlas].
+    kAtlas,
+    /// Convex solid fills merged into one draw by
+    /// [CanvasOptions::batch_convex_draws].
+    kBatch,
+    /// Sets the scissor rect for the commands that follow to the device
+    /// space [CommandExtra::bounds], which are infinite to remove it. See
+    /// [CanvasOptions::scissor_rect_clips].
+    kScissor,
 };
 
 struct GaussianFilter {
@@ -74,7 +54,45 @@ struct ColorMatrixFilter {
 
 using ColorFilter = std::variant<std::monostate, ColorMatrixFilter>;
 
-// Internal data.
+/// @brief A vertex of a [CommandType::kAtlas] batch, in device space.
+///
+/// The depth is carried per vertex so that consecutive atlas draws can be
+/// batched into one command.
+struct AtlasVertex {
+    /// Premultiplied paint color.
+    simd::float4 color;
+    simd::float2 position;
+    /// Atlas texel coordinates.
+    simd::float2 uv;
+    /// Non-normalized depth, see [Command::depth_count].
+    float depth_count;
+    /// See [AtlasQuad::distance_range].
+    float distance_range;
+};
+
+static_assert(sizeof(AtlasVertex) == 48);
+
+/// @brief A vertex of a [CommandType::kBatch] draw, in device space.
+struct BatchVertex {
+    /// Premultiplied.
+    simd::float4 color;
+    simd::float2 position;
+    float depth_count;
+    float padding;
+};
+
+static_assert(sizeof(BatchVertex) == 32);
+
+/// @brief The depth between successive depth counts, see
+/// [Command::depth_count]. Passes that draw more than fit use a finer
+/// spacing, down to [kMinDepthEpsilon].
+static constexpr Scalar kDepthEpsilon = 1.0f / 262144.0f;
+
+/// @brief The finest depth spacing, a few steps of a 32-bit float depth
+/// buffer just below 1, so that rasterization can't reorder draws.
+static constexpr Scalar kMinDepthEpsilon = 1.0f / 4194304.0f;
+
+// Internal data. The unpacked form of a command passed to [Canvas::Record].
 struct Command {
     Paint paint;
 
@@ -92,12 +110,117 @@ struct Command {
     bool is_convex = false;
     ClipStyle style;
     MTL::Texture *texture = nullptr;
+    // Instanced [CurvePatch] data, stenciled after the indexed fan.
+    BufferView patch_buffer = {};
+    size_t patch_count = 0;
+    // A device space rect inside an opaque fill, for occlusion culling.
+    std::optional<Rect> interior = std::nullopt;
+};
+
+/// @brief Data that only some commands need, referenced by
+/// [PackedCommand::extra_index].
+struct CommandExtra {
+    /// Cover bounds for stenciled draws and difference clips, or the
+    /// destination of textures. For intersect clips, the device space rect
+    /// that the depth write is scissored to.
+    Rect bounds;
+    MTL::Texture *texture = nullptr;
+    BufferView patch_buffer = {};
+    size_t patch_count = 0;
+};
+
+/// @brief Side tables referenced by index from [PackedCommand]s.
+///
+/// Transforms, paints and buffers are de-duplicated while recording, so a
+/// scene drawn with a handful of each stores every one once.
+struct DisplayListTables {
+    std::vector<Matrix> transforms;
+    std::vector<Paint> paints;
+    std::vector<MTL::Buffer *> buffers;
+    std::vector<CommandExtra> extras;
+};
+
+/// @brief A recorded command packed into 32 bytes, so that walking a large
+/// scene stays within cache.
+///
+/// Vertices and indices share a buffer, as allocated by
+/// [HostBuffer::AllocatePersistent]. See [Command] for the meaning of the
+/// fields.
+struct PackedCommand {
+    static constexpr uint8_t kConvex = 1 << 0;
+    /// Whether [index_offset] refers to an index buffer. Otherwise
+    /// [index_count] vertices are drawn directly.
+    static constexpr uint8_t kIndexed = 1 << 1;
+    /// A clip with [ClipStyle::kDifference].
+    static constexpr uint8_t kDifference = 1 << 2;
+    /// Hidden by later opaque draws. Culled commands are dropped when the
+    /// commands are taken, so they never reach a [RenderProgram].
+    static constexpr uint8_t kCulled = 1 << 3;
+    static constexpr uint32_t kNoExtra = UINT32_MAX;
+
+    CommandType type;
+    /// The k* flags above.
+    uint32_t flags : 4;
+    /// Index into [DisplayListTables::buffers]. Shares a word with [type] and
+    /// [flags]; persistent buffers are at least 32KB, so 2^20 of them cover
+    /// 32GB of geometry.
+    uint32_t buffer_index : 20;
+    uint32_t vertex_offset;
+    uint32_t index_offset;
+    uint32_t index_count;
+    int32_t depth_count;
+    uint32_t transform_index;
+    uint32_t paint_index;
+    uint32_t extra_index;
+
+    bool IsConvex() const { return flags & kConvex; }
+
+    bool IsIndexed() const { return flags & kIndexed; }
+
+    bool IsCulled() const { return flags & kCulled; }
+
+    ClipStyle GetClipStyle() const {
+        return (flags & kDifference) ? ClipStyle::kDifference
+                                     : ClipStyle::kIntersect;
+    }
+};
+
+static_assert(sizeof(PackedCommand) == 32);
+
+/// @brief A run of the commands of a pass drawn within one Save/Restore or
+/// SaveLayer group, with the device bounds of everything the group draws.
+///
+/// The groups of a pass are ordered by [begin], with enclosing groups ahead
+/// of the groups inside them, so skipping to [end] skips the whole subtree.
+/// Runs hold only draws. Clips and scissors end them, since their effect
+/// outlives the group.
+struct CommandGroup {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    Rect bounds;
+};
+
+/// @brief A run of the commands of a pass drawn against a depth buffer of its
+/// own.
+///
+/// A command of the run with depth count c is drawn at depth
+/// 1 - (c - [base]) * [epsilon]. The depth buffer is cleared before every
+/// run but the first, so a pass can draw more depth counts than one buffer
+/// holds.
+struct DepthRange {
+    /// The index of the first command of the run.
+    uint32_t begin = 0;
+    /// The least depth count drawn by the run.
+    int32_t base = 0;
+    Scalar epsilon = kDepthEpsilon;
 };
 
 class RenderProgram {
   public:
     struct Data {
-        std::vector<Command> commands;
+        std::vector<PackedCommand> commands;
+        std::vector<CommandGroup> groups;
+        std::vector<DepthRange> depth_ranges;
         MTL::Texture *texture = nullptr;
         MTL::Texture *filter_texture = nullptr;
         ImageFilter image_filter = std::monostate{};
@@ -106,29 +229,252 @@ class RenderProgram {
     };
 
     RenderProgram() = default;
-    RenderProgram(std::vector<Command> commands, std::vector<Data> offscreens);
+    RenderProgram(std::vector<PackedCommand> commands,
+                  std::vector<Data> offscreens, DisplayListTables tables,
+                  std::vector<CommandGroup> groups = {},
+                  std::vector<DepthRange> depth_ranges = {});
 
     RenderProgram(RenderProgram &&) = default;
     RenderProgram &operator=(RenderProgram &&) = default;
 
     ~RenderProgram() = default;
 
-    const std::vector<Command> &GetCommands() const;
+    const std::vector<PackedCommand> &GetCommands() const;
 
     const std::vector<Data> &GetOffscreens() const;
 
+    /// @brief The groups of [GetCommands], see [CanvasOptions::cull_groups].
+    const std::vector<CommandGroup> &GetGroups() const;
+
+    /// @brief The depth ranges of [GetCommands]. A pass without any is drawn
+    /// with depth counts from zero at [kDepthEpsilon].
+    const std::vector<DepthRange> &GetDepthRanges() const;
+
+    /// @brief The tables shared by the commands of every pass.
+    const DisplayListTables &GetTables() const;
+
+    /// @brief A number unique to this program among those recorded by any
+    /// canvas, or zero for an empty program. Programs are immutable, so
+    /// results derived from a program can be cached by its id.
+    uint64_t GetId() const { return id_; }
+
+    /// @brief Move the storage of this program into [commands], [offscreens],
+    /// [tables], [groups] and [depth_ranges], leaving it empty.
+    void TakeStorage(std::vector<PackedCommand> &commands,
+                     std::vector<Data> &offscreens, DisplayListTables &tables,
+                     std::vector<CommandGroup> &groups,
+                     std::vector<DepthRange> &depth_ranges);
+
   private:
     std::vector<Data> offscreens_;
-    std::vector<Command> commands_;
+    std::vector<PackedCommand> commands_;
+    std::vector<CommandGroup> groups_;
+    std::vector<DepthRange> depth_ranges_;
+    DisplayListTables tables_;
     bool onscreen_;
+    uint64_t id_ = 0;
 
     RenderProgram(const RenderProgram &) = delete;
     RenderProgram &operator=(const RenderProgram &) = delete;
 };
 
+/// @brief A layer of a [PreparedDisplayList], before its textures are
+/// allocated.
+struct PreparedLayer {
+    std::vector<PackedCommand> commands;
+    ImageFilter image_filter = std::monostate{};
+    ColorFilter color_filter = std::monostate{};
+    Scalar alpha = 1;
+    /// Device space bounds of the layer's texture.
+    Rect bounds;
+    /// The extra of the [CommandType::kTexture] that draws the layer into its
+    /// parent. Its texture is filled in once the layer is allocated.
+    uint32_t composite_extra_index = PackedCommand::kNoExtra;
+    /// Set once the layer has been folded into its parent or is no longer
+    /// drawn. Removed layers are never allocated.
+    bool is_removed = false;
+};
+
+/// @brief The passes of a recording as seen by [OptimizerPass]es, which run
+/// in [Canvas::Prepare] after occlusion culling and before batching.
+///
+/// Layers are in the order they were restored, so each layer comes before
+/// the layer that draws it.
+struct PreparedDisplayList {
+    std::vector<PackedCommand> commands;
+    std::vector<PreparedLayer> layers;
+    DisplayListTables *tables = nullptr;
+
+    static constexpr uint32_t kNoLayer = UINT32_MAX;
+
+    /// The index of the layer composited by each extra, or [kNoLayer].
+    std::vector<uint32_t> layer_indices;
+
+    /// @brief Build [layer_indices] once [layers] have been added. Passes
+    /// don't change which extra composites a layer, so this holds for all
+    /// of them.
+    void IndexLayers();
+
+    /// @brief The index of the layer that [command] draws, or std::nullopt
+    /// if it doesn't draw a layer.
+    std::optional<size_t> FindLayer(const PackedCommand &command) const;
+
+    /// @brief Mark the layers that are no longer drawn by any pass as
+    /// removed.
+    void RemoveUnreachableLayers();
+
+    /// @brief Call [fn] with the commands of the onscreen pass and of each
+    /// layer that hasn't been removed.
+    template <typename F> void ForEachPass(const F &fn) {
+        fn(commands);
+        for (PreparedLayer &layer : layers) {
+            if (!layer.is_removed) {
+                fn(layer.commands);
+            }
+        }
+    }
+
+    size_t CountCommands() const;
+
+    size_t CountLayers() const;
+};
+
+/// @brief A named transformation of a [PreparedDisplayList], such as those
+/// in display_list_optimizer.hpp.
+struct OptimizerPass {
+    const char *name;
+    void (*run)(PreparedDisplayList &list);
+};
+
+/// @brief What one [OptimizerPass] has eliminated, including the commands
+/// of layers it removed.
+struct OptimizerPassStats {
+    const char *name = nullptr;
+    size_t removed_commands = 0;
+    size_t removed_layers = 0;
+};
+
+struct CanvasOptions {
+    /// Decompose simple non-convex fills into convex pieces so that they can
+    /// be drawn directly instead of with stencil-then-cover. Paths that can't
+    /// be decomposed fall back to stenciling.
+    bool convex_decomposition = false;
+
+    /// Stencil non-convex fills with a fan of segment end points plus one
+    /// GPU-expanded patch per curve, instead of flattening curves on the CPU.
+    bool curve_patches = false;
+
+    /// The device space bounds of the render target. If set, fills and clips
+    /// are clipped to the viewport before tessellation so that vertex counts
+    /// scale with the visible area rather than the size of the path.
+    std::optional<Rect> viewport = std::nullopt;
+
+    /// Distance outside of [viewport] that is kept when clipping. This keeps
+    /// the new clip edges off screen.
+    Scalar guard_band = 32;
+
+    /// Reduce the cost of fills that are small on screen. Fills with
+    /// negligible coverage are dropped, sub-pixel fills are drawn as a single
+    /// coverage-weighted pixel, and other small fills are flattened and
+    /// simplified with a vertex budget based on their device-space size.
+    bool level_of_detail = false;
+
+    /// If set, small solid fills are rasterized on the CPU into this atlas
+    /// and drawn as textured quads, batched across consecutive draws. Fills
+    /// that don't fit are tessellated as usual.
+    CoverageAtlas *coverage_atlas = nullptr;
+
+    /// Store fills in [coverage_atlas] as signed distance fields where
+    /// possible, which are generated once per path rather than once per
+    /// scale. Only applies to scale and translate transforms.
+    bool distance_fields = false;
+
+    /// Drop draws that are entirely hidden by later opaque fills when the
+    /// canvas is prepared. Opaque convex fills and rects that aren't clipped
+    /// are rasterized into a coarse coverage mask, in reverse paint order.
+    bool occlusion_culling = false;
+
+    /// Merge runs of consecutive convex solid fills that share a blend mode
+    /// into a single draw when the canvas is prepared. Vertices are
+    /// transformed on the CPU and carry their own color and depth.
+    bool batch_convex_draws = false;
+
+    /// Apply intersect clips by rectangles that stay pixel aligned in device
+    /// space with a scissor rect instead of a stencil and depth write. The
+    /// scissor is scoped to the current layer.
+    bool scissor_rect_clips = false;
+
+    /// Track the device bounds of each Save/Restore and SaveLayer group. When
+    /// the canvas is prepared, groups outside [viewport] are dropped with a
+    /// single test, and each pass is given its [CommandGroup]s so that
+    /// replaying part of the target can skip the groups outside it. Atlas
+    /// batches end at group boundaries.
+    bool cull_groups = false;
+
+    /// Passes run over the recording in [Canvas::Prepare], in order. Layers
+    /// are allocated after the passes, so a layer they remove costs nothing.
+    std::vector<OptimizerPass> optimizer_passes = {};
+};
+
+/// @brief Counters for [CanvasOptions::occlusion_culling].
+struct OcclusionStats {
+    size_t occluders = 0;
+    size_t tested = 0;
+    size_t culled = 0;
+};
+
+/// @brief Counters for the work avoided by tracking clip bounds.
+struct ClipStats {
+    /// Draws entirely outside the bounds of the intersect clips.
+    size_t culled_draws = 0;
+    /// Clips dropped because nothing was drawn after them.
+    size_t culled_clips = 0;
+    /// Clips applied as scissor rects.
+    size_t scissor_clips = 0;
+};
+
+/// @brief Counters for [CanvasOptions::cull_groups].
+struct GroupCullStats {
+    size_t groups = 0;
+    /// Groups tested against the viewport. Groups inside a culled group
+    /// aren't tested.
+    size_t tested = 0;
+    size_t culled = 0;
+    /// Commands dropped with the culled groups.
+    size_t culled_commands = 0;
+};
+
+/// @brief How the depth counts of the passes fit their depth buffers, see
+/// [DepthRange].
+struct DepthBudgetStats {
+    /// The most depth counts spanned by one pass.
+    int32_t widest_span = 0;
+    /// Passes drawn at a finer depth spacing than [kDepthEpsilon].
+    size_t renormalized_passes = 0;
+    /// Depth buffer clears within passes.
+    size_t depth_clears = 0;
+    /// Runs that still span more depth counts than fit, because their
+    /// commands can't be split without reordering them. Their last draws
+    /// may be lost.
+    size_t overflowed_ranges = 0;
+};
+
+/// @brief Counters for the work avoided by [CanvasOptions::level_of_detail].
+struct LevelOfDetailStats {
+    size_t dropped = 0;
+    size_t sprites = 0;
+    size_t simplified = 0;
+    /// Total device pixel coverage of dropped fills. This bounds the change in
+    /// the rendered output from dropping.
+    Scalar dropped_coverage = 0;
+    /// Total device pixel coverage that was moved into sprites.
+    Scalar sprite_coverage = 0;
+};
+
 class Canvas {
   public:
-    Canvas(HostBuffer *host_buffer, Triangulator *triangulator);
+    Canvas(HostBuffer *host_buffer, Triangulator *triangulator,
+           CanvasOptions options = {});
 
     ~Canvas() = default;
 
@@ -136,6 +482,18 @@ class Canvas {
 
     void DrawRect(const Rect &rect, Paint paint);
 
+    /// @brief Draw [count] glyphs of [font] at [font_size] pixels per em,
+    /// with the origin of glyphs[i] on the baseline at positions[i].
+    ///
+    /// Glyph outlines come from the font's cache. With
+    /// [CanvasOptions::coverage_atlas] set, the whole run is drawn as one
+    /// batch of atlas quads and glyphs already in the atlas are not
+    /// rasterized again. Glyphs that can't be drawn from the atlas are
+    /// tessellated individually.
+    void DrawGlyphRun(Font &font, const uint16_t *glyphs,
+                      const Point *positions, size_t count, Scalar font_size,
+                      Paint paint);
+
     void ClipPath(const Path &path, ClipStyle style);
 
     void Translate(Scalar tx, Scalar ty);
@@ -161,8 +519,59 @@ class Canvas {
     /// @brief Pop the current clip stack.
     void Restore();
 
+    /// @brief Draw everything recorded by [sub_list] here, as if it had been
+    /// recorded between a [Save] and [Restore].
+    ///
+    /// Independent parts of a scene, such as map tiles or pages, can be
+    /// recorded on separate threads into canvases of their own and merged
+    /// in paint order. A sub-list counts depths from zero, and they are
+    /// offset past the draws recorded here. It must be recorded with the
+    /// same options, in this canvas's device space, so starting from
+    /// [GetTransform]. Its scissors are limited to the current scissor.
+    ///
+    /// Each thread needs its own [HostBuffer] and [Triangulator]. The host
+    /// buffer must outlive the prepared program, and gradients must come
+    /// from the one it is rendered with. Sub-lists recorded concurrently
+    /// can't share a [CanvasOptions::coverage_atlas] or a [Font].
+    ///
+    /// [sub_list] is left empty, as after [Reset].
+    void DrawSubList(Canvas &sub_list);
+
+    /// @brief The current transform, from local to device space.
+    const Matrix &GetTransform() const { return clip_stack_.back().transform; }
+
     RenderProgram Prepare();
 
+    /// @brief Discard anything recorded and start recording a new frame.
+    ///
+    /// The storage of [previous], which should have been prepared by this
+    /// canvas, is reused along with the canvas's own. Once a frame has been
+    /// recorded, recording and preparing a similar frame makes no heap
+    /// allocations. Frames that record more than any before, and paths the
+    /// coverage atlas has not rasterized yet, still allocate.
+    void Reset(RenderProgram previous = RenderProgram());
+
+    const LevelOfDetailStats &GetLevelOfDetailStats() const {
+        return lod_stats_;
+    }
+
+    const OcclusionStats &GetOcclusionStats() const { return occlusion_stats_; }
+
+    const ClipStats &GetClipStats() const { return clip_stats_; }
+
+    const GroupCullStats &GetGroupCullStats() const {
+        return group_cull_stats_;
+    }
+
+    const DepthBudgetStats &GetDepthBudgetStats() const {
+        return depth_budget_stats_;
+    }
+
+    /// @brief Stats for each of [CanvasOptions::optimizer_passes], in order.
+    const std::vector<OptimizerPassStats> &GetOptimizerStats() const {
+        return optimizer_stats_;
+    }
+
     // Allocation. Should This Go Here?
     Gradient CreateLinearGradient(Point from, Point to, Color colors[],
                                   size_t color_size);
@@ -173,60 +582,356 @@ class Canvas {
   private:
     HostBuffer *host_buffer_ = nullptr;
     Triangulator *triangulator_ = nullptr;
+    CanvasOptions options_;
+    LevelOfDetailStats lod_stats_;
+    OcclusionStats occlusion_stats_;
+    ClipStats clip_stats_;
+    GroupCullStats group_cull_stats_;
+    DepthBudgetStats depth_budget_stats_;
+    std::vector<OptimizerPassStats> optimizer_stats_;
 
     struct ClipStackEntry {
         Matrix transform = Matrix();
         int draw_count = 0;
-        std::vector<size_t> pending_clips;
+        // The clips recorded since this entry was pushed are
+        // [pending_clips_] from this index on.
+        size_t pending_clip_start = 0;
         bool is_save_layer = false;
         Scalar alpha = 1.0f;
+        // A conservative device space bound of the intersect clips in
+        // effect, or std::nullopt if nothing is clipped.
+        std::optional<Rect> clip_bounds = std::nullopt;
+        // The intersection of the scissor clips in effect within the current
+        // layer, or std::nullopt if there are none.
+        std::optional<Rect> scissor = std::nullopt;
+        // With [CanvasOptions::cull_groups], the draw count and sizes of the
+        // current state's command lists when this entry was pushed, and the
+        // device bounds of the draws since.
+        int group_draw_count = 0;
+        size_t group_opaque_begin = 0;
+        size_t group_commands_begin = 0;
+        std::optional<Rect> group_bounds = std::nullopt;
     };
     std::vector<ClipStackEntry> clip_stack_;
+    // Indices of the clips whose depth is assigned on [Restore], shared by
+    // the entries of [clip_stack_].
+    std::vector<size_t> pending_clips_;
+    // Parallel to [pending_clips_], the device bounds of the draws recorded
+    // after each clip and before the next one. Only these can be affected
+    // by the clip's depth write.
+    std::vector<std::optional<Rect>> pending_clip_bounds_;
+    // Parallel to [pending_clips_], the clip bounds in effect before each
+    // clip. Nothing is drawn outside them, so they limit the depth write too.
+    std::vector<std::optional<Rect>> pending_clip_limits_;
+
+    /// @brief Whether [device_bounds] lies entirely outside the current
+    /// clip bounds, in which case the draw is counted as culled.
+    bool IsClippedOut(const Rect &device_bounds);
+
+    /// @brief Add [device_bounds] to the draws covered by the most recent
+    /// pending clip.
+    void AddToPendingClip(const Rect &device_bounds);
+
+    /// @brief The device space rect to scissor to for an intersect clip by
+    /// [path], if it is a rect that stays pixel aligned under the current
+    /// transform.
+    std::optional<Rect> ComputeScissorClip(const Path &path) const;
+
+    /// @brief Record a [CommandType::kScissor] to [scissor].
+    void RecordScissor(const std::optional<Rect> &scissor);
+
+    /// @brief Add [device_bounds] to the bounds of the innermost group.
+    void AddToGroup(const Rect &device_bounds);
+
+    /// @brief Record the commands of the current state since [entry] was
+    /// pushed as a group drawing within [bounds], and add them to the
+    /// enclosing group.
+    void RecordGroup(const ClipStackEntry &entry, const Rect &bounds);
 
     void Record(Command &&cmd);
 
+    /// @brief An open addressing map from hashes to indices of a table,
+    /// which keeps its storage when cleared.
+    struct IndexTable {
+        static constexpr uint32_t kEmpty = UINT32_MAX;
+
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> indices;
+        size_t count = 0;
+
+        void Clear();
+
+        /// @brief Find the index stored for [hash] for which [equals] is
+        /// true, or else store and return [index].
+        template <typename F>
+        uint32_t FindOrInsert(uint64_t hash, uint32_t index, const F &equals) {
+            if ((count + 1) * 2 > indices.size()) {
+                Grow();
+            }
+            size_t mask = indices.size() - 1;
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                if (indices[slot] == kEmpty) {
+                    hashes[slot] = hash;
+                    indices[slot] = index;
+                    count++;
+                    return index;
+                }
+                if (hashes[slot] == hash && equals(indices[slot])) {
+                    return indices[slot];
+                }
+            }
+        }
+
+      private:
+        void Grow();
+    };
+
+    DisplayListTables tables_;
+    IndexTable transform_indices_;
+    IndexTable paint_indices_;
+    IndexTable buffer_indices_;
+
+    /// @brief Pack [cmd], adding its transform, paint and buffer to the
+    /// tables if they aren't already present.
+    PackedCommand Pack(const Command &cmd);
+
+    /// @brief The index of [transform] in the tables, adding it if it isn't
+    /// already present. Likewise for [AddPaint] and [AddBuffer].
+    uint32_t AddTransform(const Matrix &transform);
+
+    uint32_t AddPaint(const Paint &paint);
+
+    uint32_t AddBuffer(MTL::Buffer *buffer);
+
+    // The indices in the tables of the entries of a sub-list's tables, for
+    // [DrawSubList].
+    std::vector<uint32_t> sub_list_transforms_;
+    std::vector<uint32_t> sub_list_paints_;
+    std::vector<uint32_t> sub_list_buffers_;
+
+    /// @brief The end of a run of commands in [CommandState], exclusive.
+    /// Each segment begins where the previous one ends.
+    struct CommandSegment {
+        size_t opaque_end = 0;
+        size_t commands_end = 0;
+    };
+
+    /// @brief A group recorded into a [CommandState]. Its commands are the
+    /// ranges of the state's command lists, and its draws have depth counts
+    /// from [first_depth] up to [end_depth], exclusive.
+    struct RecordedGroup {
+        size_t opaque_begin = 0;
+        size_t opaque_end = 0;
+        size_t commands_begin = 0;
+        size_t commands_end = 0;
+        int32_t first_depth = 0;
+        int32_t end_depth = 0;
+        Rect bounds;
+        bool is_culled = false;
+    };
+
+    struct OcclusionInfo {
+        /// Device space bounds, or std::nullopt if the command is never
+        /// culled.
+        std::optional<Rect> bounds;
+        /// Set for unclipped opaque fills.
+        std::optional<Rect> interior;
+    };
+
     struct CommandState {
         // Two command lists are mainted for recording. The set of recorded
-        // commands, and a set of pending commands. The latter holds any draws
+        // commands, and a set of opaque commands. The former holds any draws
         // that require blending with the backdrop. These will be deferred as
         // long as possible, so that opaque occluding draws can be executed
-        // first. The opaque draws are held in pending_commands_. Once a drawing
-        // command is executed that that requires a flush, the opaque commands
-        // are inserted in reverse order at the insert_point index.
+        // first. Once a drawing command is executed that that requires a
+        // flush, the current segment is closed. When the commands are taken,
+        // each segment emits its opaque commands in reverse order followed by
+        // its recorded commands.
         //
         // Example (O - opaque, T - transparent, C - clip)
         //
-        //  Command        Pending            Recorded               Flush Index
-        //     O1           ->O1                                          0
-        //     O2           O1 ->O2                                       0
-        //     T1           O1 O2                  ->T1                   0
-        //     T2           O1 O2               T1 ->T2                   0
-        //     C                               O2 O1 T1 T2 -> C           5
+        //  Command        Opaque             Recorded               Segments
+        //     O1           ->O1
+        //     O2           O1 ->O2
+        //     T1           O1 O2                  ->T1
+        //     T2           O1 O2               T1 ->T2
+        //     C            O1 O2               T1 T2 ->C            ->{2, 3}
+        //
+        // Output:          O2 O1 T1 T2 C
         //
-        // Above: opaque and transparent commands are recorded separately. When
-        // a clip is encountered, the opaque commands are inserted in reverse
-        // order at the start of the command list. This also sets the flush
-        // index to be after the recorded clip.
-        std::vector<Command> pending_commands;
-        std::vector<Command> commands;
-        size_t flush_index = 0;
+        // Above: opaque and transparent commands are recorded separately.
+        // When a clip is encountered, the segment is closed so that the
+        // opaque commands are ordered ahead of the transparent ones, but not
+        // ahead of the clip. Closing a segment doesn't move any commands, so
+        // recording stays linear in the number of commands however many
+        // clips there are.
+        std::vector<PackedCommand> opaque_commands;
+        std::vector<PackedCommand> commands;
+        std::vector<CommandSegment> segments;
+        // The depth count that the current segment was started at by
+        // [Canvas::Record], to bound the depths a segment spans.
+        int32_t segment_depth = 0;
+
+        // Parallel to [opaque_commands] and [commands] when occlusion culling
+        // is enabled.
+        std::vector<OcclusionInfo> opaque_occlusion;
+        std::vector<OcclusionInfo> occlusion;
+
+        // With [CanvasOptions::cull_groups], the groups in the order they
+        // were restored, so each follows the groups inside it.
+        std::vector<RecordedGroup> groups;
+
+        /// @brief Close the current segment, if it isn't empty.
+        void Flush();
+
+        /// @brief Concatenate the segments into [result], leaving the state
+        /// empty.
+        void TakeCommands(std::vector<PackedCommand> &result);
+
+        /// @brief Empty the state, keeping its storage.
+        void Clear();
 
         // Union of the estimated bounds of all draws.
         std::optional<Rect> bounds_estimate = std::nullopt;
 
         bool is_onscreen = false;
 
+        // For layers, the alpha passed to [SaveLayer] and the extra of the
+        // command drawing the layer, if it wasn't culled.
+        Scalar alpha = 1;
+        uint32_t composite_extra_index = PackedCommand::kNoExtra;
+
         ImageFilter image_filter = std::monostate{};
         ColorFilter color_filter = std::monostate{};
-        MTL::Texture *filter_texture = nullptr;
     };
 
     std::vector<CommandState> pending_states_;
     std::vector<CommandState> finalized_states_;
-    std::vector<MTL::Texture *> textures_;
+    PreparedDisplayList prepared_;
+
+    // Storage kept across frames by [Reset].
+    std::vector<CommandState> state_pool_;
+    std::vector<std::vector<PackedCommand>> command_pool_;
+    std::vector<std::vector<CommandGroup>> group_pool_;
+    std::vector<std::vector<DepthRange>> depth_range_pool_;
+    std::vector<RenderProgram::Data> offscreen_pool_;
+
+    /// @brief An empty command state, reusing pooled storage if possible.
+    CommandState TakePooledState();
+
+    /// @brief An empty command list, reusing pooled storage if possible.
+    std::vector<PackedCommand> TakePooledCommands();
+
+    /// @brief An empty group list, reusing pooled storage if possible.
+    std::vector<CommandGroup> TakePooledGroups();
+
+    /// @brief An empty depth range list, reusing pooled storage if possible.
+    std::vector<DepthRange> TakePooledDepthRanges();
 
     CommandState &GetCurrent() { return pending_states_.back(); }
 
+    /// @brief Whether a clip applies to draws into the current layer.
+    bool HasActiveClip() const;
+
+    /// @brief Mark the commands of [state] that are hidden by later opaque
+    /// fills as culled.
+    void CullOccluded(CommandState &state);
+
+    /// @brief Mark the commands of the groups of [state] outside the
+    /// viewport as culled.
+    void CullGroups(CommandState &state);
+
+    /// @brief A group that survived [CullGroups], in the hierarchy of every
+    /// group recorded.
+    struct GroupNode {
+        static constexpr uint32_t kNoParent = UINT32_MAX;
+
+        int32_t first_depth;
+        int32_t end_depth;
+        Rect bounds;
+        uint32_t parent;
+    };
+    // Ordered by depth, with enclosing groups ahead of the groups inside.
+    std::vector<GroupNode> group_nodes_;
+
+    /// @brief Gather the surviving groups of every state into
+    /// [group_nodes_]. Depth counts are shared by the passes, so the
+    /// hierarchy is too.
+    void BuildGroupHierarchy();
+
+    /// @brief Write the runs of [commands] drawn within each group of
+    /// [group_nodes_] to [groups].
+    void BuildCommandGroups(const std::vector<PackedCommand> &commands,
+                            std::vector<CommandGroup> &groups);
+
+    struct OpenGroup {
+        uint32_t node;
+        uint32_t begin;
+    };
+    std::vector<OpenGroup> open_groups_;
+
+    /// @brief Divide [commands] into runs whose depth counts fit a depth
+    /// buffer, and write them to [ranges].
+    ///
+    /// A pass is only split before a command where every command ahead of
+    /// it is drawn below every command from it on, so clearing the depth
+    /// buffer there can't let a draw through that depth testing would
+    /// reject.
+    void AssignDepthRanges(const std::vector<PackedCommand> &commands,
+                           std::vector<DepthRange> &ranges);
+
+    // The least and greatest depth counts drawn by each command of the pass
+    // in [AssignDepthRanges], and the least drawn from each command on.
+    std::vector<std::pair<int32_t, int32_t>> depth_spans_;
+    std::vector<int32_t> depth_suffix_min_;
+
+    struct CullEntry {
+        int32_t depth_count;
+        PackedCommand *command;
+        const OcclusionInfo *info;
+    };
+    std::vector<CullEntry> cull_entries_;
+    OcclusionBuffer occlusion_buffer_;
+
+    /// @brief Replace runs of convex solid fills in [commands] with
+    /// [CommandType::kBatch] commands.
+    void BatchConvexDraws(std::vector<PackedCommand> &commands);
+
+    /// @brief Run [CanvasOptions::optimizer_passes] over [prepared_].
+    void RunOptimizerPasses();
+
+    std::vector<BatchVertex> batch_vertices_;
+
+    /// @brief Clip [path] to the viewport in the current transform's local
+    /// space, or std::nullopt if no clipping is needed.
+    std::optional<Path> ClipToViewport(const Path &path) const;
+
+    /// @brief Drop [path] or draw it as a sprite if it is too small to be
+    /// worth tessellating, or else write a simplified version to
+    /// [simplified] if it is small.
+    ///
+    /// @returns true if the fill has been handled.
+    bool ApplyLevelOfDetail(const Path &path, const Paint &paint,
+                            std::optional<Path> &simplified);
+
+    // Quads for the atlas draws since the last flush.
+    std::vector<AtlasVertex> atlas_vertices_;
+    Rect atlas_bounds_;
+    int atlas_depth_count_ = 0;
+
+    /// @brief Draw [path] transformed by [transform] from
+    /// [CanvasOptions::coverage_atlas].
+    ///
+    /// @returns true if the fill has been handled.
+    bool DrawPathFromAtlas(const Path &path, const Matrix &transform,
+                           const Paint &paint);
+
+    /// @brief Draw [path] with the current transform without the atlas.
+    void DrawPathTessellated(const Path &path, const Paint &paint);
+
+    /// @brief Record the pending atlas quads as a single command.
+    void FlushAtlasBatch();
+
     Canvas(Canvas &&) = delete;
     Canvas(const Canvas &) = delete;
     Canvas &operator=(const Canvas &) = delete;
@@ -0,0 +1,419 @@
+#include "cpu_renderer.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "geom/float4.hpp"
+#include "parallel.hpp"
+
+namespace flatland {
+
+namespace {
+
+static constexpr uint32_t kTilePixels = kGridSize * kGridSize;
+
+// Tile buffers are column major, so that each column of kGridSize pixels is
+// four Float4 values and the prefix sum along a row runs on every row of the
+// tile at once.
+static constexpr uint32_t kColumnLanes = kGridSize / 4;
+static_assert(kGridSize % 4 == 0);
+
+// The accumulation buffer has two spare columns for area that lands on or
+// just past the right edge of the tile.
+static constexpr uint32_t kAccumulationSize = (kGridSize + 2) * kGridSize;
+
+using TileBuffer = std::array<Scalar, kTilePixels>;
+
+// Accumulate the signed area of the line [p0, p1] into [acc], in tile local
+// pixel coordinates with 0 <= x, y <= kGridSize. The prefix sum of [acc]
+// along a row gives the winding contribution of the line at each pixel.
+void AccumulateLine(Scalar *acc, Point p0, Point p1) {
+    if (p0.y == p1.y) {
+        return;
+    }
+    Scalar direction = 1;
+    if (p0.y > p1.y) {
+        std::swap(p0, p1);
+        direction = -1;
+    }
+    Scalar dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+    Scalar x = std::clamp<Scalar>(p0.x, 0, kGridSize);
+    int32_t first_row = static_cast<int32_t>(std::floor(p0.y));
+    int32_t end_row = std::min(static_cast<int32_t>(std::ceil(p1.y)),
+                               static_cast<int32_t>(kGridSize));
+    for (int32_t y = first_row; y < end_row; y++) {
+        auto at = [&](int32_t column) -> Scalar & {
+            return acc[column * kGridSize + y];
+        };
+        Scalar dy = std::min<Scalar>(y + 1, p1.y) - std::max<Scalar>(y, p0.y);
+        // Clamped, since rounding in the clipping of nearly horizontal lines
+        // can push x slightly outside of the tile.
+        Scalar next_x = std::clamp<Scalar>(x + dxdy * dy, 0, kGridSize);
+        Scalar d = dy * direction;
+        Scalar x0 = std::min(x, next_x);
+        Scalar x1 = std::max(x, next_x);
+        Scalar x0_floor = std::floor(x0);
+        Scalar x1_ceil = std::ceil(x1);
+        int32_t x0i = static_cast<int32_t>(x0_floor);
+        int32_t x1i = static_cast<int32_t>(x1_ceil);
+        if (x1i <= x0i + 1) {
+            // The line stays within one pixel of this row.
+            Scalar xmf = 0.5f * (x + next_x) - x0_floor;
+            at(x0i) += d - d * xmf;
+            at(x0i + 1) += d * xmf;
+        } else {
+            Scalar s = 1 / (x1 - x0);
+            Scalar x0f = x0 - x0_floor;
+            Scalar a0 = 0.5f * s * (1 - x0f) * (1 - x0f);
+            Scalar x1f = x1 - x1_ceil + 1;
+            Scalar am = 0.5f * s * x1f * x1f;
+            at(x0i) += d * a0;
+            if (x1i == x0i + 2) {
+                at(x0i + 1) += d * (1 - a0 - am);
+            } else {
+                Scalar a1 = s * (1.5f - x0f);
+                at(x0i + 1) += d * (a1 - a0);
+                for (int32_t xi = x0i + 2; xi < x1i - 1; xi++) {
+                    at(xi) += d * s;
+                }
+                Scalar a2 = a1 + (x1i - x0i - 3) * s;
+                at(x1i - 1) += d * (1 - a2 - am);
+            }
+            at(x1i) += d * am;
+        }
+        x = next_x;
+    }
+}
+
+// Accumulate segment [p0, p1], in tile local coordinates, clipped to the
+// tile.
+//
+// The backdrop is the winding number just outside the top left corner of the
+// tile. The winding at a point in the tile differs from it by the crossings
+// of the left edge above the point, plus the crossings of the row from the
+// left edge to the point. The former are accumulated as a vertical line down
+// the left edge from the crossing, the latter by accumulating the part of
+// the segment inside the tile.
+void AccumulateSegment(Scalar *acc, Point p0, Point p1) {
+    constexpr Scalar kSize = kGridSize;
+    if (std::max(p0.y, p1.y) < 0 || std::min(p0.y, p1.y) > kSize) {
+        return;
+    }
+    // Clip to the rows of the tile.
+    if (p0.y != p1.y) {
+        Scalar dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+        auto clip_y = [&](Point &p, Scalar y) {
+            p = Point(p0.x + (y - p0.y) * dxdy, y);
+        };
+        Point c0 = p0;
+        Point c1 = p1;
+        for (Point *p : {&c0, &c1}) {
+            if (p->y < 0) {
+                clip_y(*p, 0);
+            } else if (p->y > kSize) {
+                clip_y(*p, kSize);
+            }
+        }
+        p0 = c0;
+        p1 = c1;
+    }
+
+    if ((p0.x < 0) != (p1.x < 0)) {
+        Scalar y = p0.y + (0 - p0.x) * (p1.y - p0.y) / (p1.x - p0.x);
+        // Crossing the left edge to the right decrements the winding of the
+        // edge below the crossing.
+        if (p1.x > p0.x) {
+            AccumulateLine(acc, Point(0, kSize), Point(0, y));
+            p0 = Point(0, y);
+        } else {
+            AccumulateLine(acc, Point(0, y), Point(0, kSize));
+            p1 = Point(0, y);
+        }
+    } else if (p0.x < 0) {
+        return;
+    }
+
+    // Geometry right of the tile does not affect it.
+    if (p0.x > kSize && p1.x > kSize) {
+        return;
+    }
+    if ((p0.x > kSize) != (p1.x > kSize)) {
+        Scalar y = p0.y + (kSize - p0.x) * (p1.y - p0.y) / (p1.x - p0.x);
+        if (p0.x > kSize) {
+            p0 = Point(kSize, y);
+        } else {
+            p1 = Point(kSize, y);
+        }
+    }
+    AccumulateLine(acc, p0, p1);
+}
+
+// Convert the accumulated area and [backdrop] into coverage with
+// [fill_rule].
+void ResolveCoverage(const Scalar *acc, int32_t backdrop, FillRule fill_rule,
+                     TileBuffer &coverage) {
+    std::array<Float4, kColumnLanes> winding;
+    winding.fill(Splat4(static_cast<Scalar>(backdrop)));
+    for (uint32_t x = 0; x < kGridSize; x++) {
+        for (uint32_t lane = 0; lane < kColumnLanes; lane++) {
+            size_t index = x * kGridSize + lane * 4;
+            winding[lane] += Load4(acc + index);
+            Float4 w = Abs4(winding[lane]);
+            if (fill_rule == FillRule::kEvenOdd) {
+                w -= 2 * Trunc4(w * 0.5f);
+                w = 1 - Abs4(1 - w);
+            }
+            Store4(coverage.data() + index, Min4(w, Splat4(1)));
+        }
+    }
+}
+
+// Inverse of the 2D affine part of [matrix].
+struct InverseAffine {
+    Scalar a, b, c, d, tx, ty;
+
+    explicit InverseAffine(const Matrix &matrix) {
+        const Scalar *m = matrix.GetStorage();
+        Scalar det = matrix.GetDeterminant();
+        Scalar inv_det = det != 0 ? 1 / det : 0;
+        a = m[5] * inv_det;
+        b = -m[1] * inv_det;
+        c = -m[4] * inv_det;
+        d = m[0] * inv_det;
+        tx = m[12];
+        ty = m[13];
+    }
+
+    Point Map(Point p) const {
+        Scalar x = p.x - tx;
+        Scalar y = p.y - ty;
+        return Point(a * x + c * y, b * x + d * y);
+    }
+};
+
+// Sample [ramp] like a clamped, linearly filtered 1D texture.
+Color SampleRamp(const std::vector<Color> &ramp, Scalar t) {
+    Scalar u = std::clamp<Scalar>(t, 0, 1) * ramp.size() - 0.5f;
+    u = std::clamp<Scalar>(u, 0, ramp.size() - 1);
+    size_t i0 = static_cast<size_t>(u);
+    size_t i1 = std::min(i0 + 1, ramp.size() - 1);
+    Scalar f = u - i0;
+    const Color &c0 = ramp[i0];
+    const Color &c1 = ramp[i1];
+    return Color(c0.r + (c1.r - c0.r) * f, c0.g + (c1.g - c0.g) * f,
+                 c0.b + (c1.b - c0.b) * f, c0.a + (c1.a - c0.a) * f);
+}
+
+struct TileColor {
+    TileBuffer r;
+    TileBuffer g;
+    TileBuffer b;
+    TileBuffer a;
+};
+
+// Source over composite of [source] weighted by [coverage], or by full
+// coverage if [coverage] is null.
+void Composite(TileColor &dest, const TileColor &source,
+               const TileBuffer *coverage) {
+    for (uint32_t i = 0; i < kTilePixels; i += 4) {
+        Float4 cov = coverage ? Load4(coverage->data() + i) : Splat4(1);
+        Float4 sr = Load4(source.r.data() + i) * cov;
+        Float4 sg = Load4(source.g.data() + i) * cov;
+        Float4 sb = Load4(source.b.data() + i) * cov;
+        Float4 sa = Load4(source.a.data() + i) * cov;
+        Float4 inv = 1 - sa;
+        Store4(dest.r.data() + i, sr + Load4(dest.r.data() + i) * inv);
+        Store4(dest.g.data() + i, sg + Load4(dest.g.data() + i) * inv);
+        Store4(dest.b.data() + i, sb + Load4(dest.b.data() + i) * inv);
+        Store4(dest.a.data() + i, sa + Load4(dest.a.data() + i) * inv);
+    }
+}
+
+uint8_t ToUnorm8(Scalar value) {
+    return static_cast<uint8_t>(std::clamp<Scalar>(value, 0, 1) * 255 + 0.5f);
+}
+
+std::vector<Color> CreateRamp(Color colors[], size_t color_size) {
+    std::vector<Color> ramp;
+    ramp.reserve(color_size);
+    for (size_t i = 0; i < color_size; i++) {
+        ramp.push_back(colors[i].Premultiply());
+    }
+    if (ramp.empty()) {
+        ramp.push_back(kTransparent);
+    }
+    return ramp;
+}
+
+} // namespace
+
+void CpuRenderer::DrawPath(const Path &path, const Matrix &transform,
+                           Paint paint) {
+    if (paint.stroke || path.Empty()) {
+        return;
+    }
+    paths_.push_back(BinningPath{.path = &path, .transform = transform});
+    paints_.push_back(std::move(paint));
+}
+
+void CpuRenderer::Reset() {
+    paths_.clear();
+    paints_.clear();
+}
+
+void CpuRenderer::Render(ISize size, Color clear_color, uint8_t *pixels) {
+    BinPaths(paths_, size, bins_);
+
+    row_paths_.resize(bins_.rows);
+    for (std::vector<uint32_t> &row : row_paths_) {
+        row.clear();
+    }
+    for (uint32_t i = 0; i < bins_.paths.size(); i++) {
+        const PathTiles &tiles = bins_.paths[i];
+        for (int32_t row = tiles.top; row < tiles.bottom; row++) {
+            row_paths_[row].push_back(i);
+        }
+    }
+
+    ParallelFor(bins_.columns * bins_.rows, [&](size_t tile) {
+        RenderTile(tile % bins_.columns, tile / bins_.columns, size,
+                   clear_color, pixels);
+    });
+}
+
+void CpuRenderer::RenderTile(uint32_t column, uint32_t row, ISize size,
+                             Color clear_color, uint8_t *pixels) const {
+    Color clear = clear_color.Premultiply();
+    TileColor dest;
+    dest.r.fill(clear.r);
+    dest.g.fill(clear.g);
+    dest.b.fill(clear.b);
+    dest.a.fill(clear.a);
+
+    Scalar origin_x = static_cast<Scalar>(column * kGridSize);
+    Scalar origin_y = static_cast<Scalar>(row * kGridSize);
+    std::array<Scalar, kAccumulationSize> acc;
+    TileBuffer coverage;
+    TileColor source;
+
+    for (uint32_t path_index : row_paths_[row]) {
+        const PathTiles &tiles = bins_.paths[path_index];
+        if (static_cast<int32_t>(column) < tiles.left ||
+            static_cast<int32_t>(column) >= tiles.right) {
+            continue;
+        }
+        uint32_t tile = tiles.tile_offset +
+                        (row - tiles.top) * (tiles.right - tiles.left) +
+                        (column - tiles.left);
+        uint32_t first_segment = bins_.tile_segment_offsets[tile];
+        uint32_t end_segment = bins_.tile_segment_offsets[tile + 1];
+        int32_t backdrop = bins_.tile_backdrops[tile];
+        const Paint &paint = paints_[path_index];
+
+        // Without segments the whole tile has the backdrop winding.
+        bool solid = first_segment == end_segment;
+        if (solid && (backdrop == 0 || (paint.fill_rule == FillRule::kEvenOdd &&
+                                        backdrop % 2 == 0))) {
+            continue;
+        }
+        if (!solid) {
+            acc.fill(0);
+            for (uint32_t i = first_segment; i < end_segment; i++) {
+                uint32_t segment = bins_.tile_segments[i];
+                AccumulateSegment(
+                    acc.data(),
+                    Point(bins_.segment_x0[segment] - origin_x,
+                          bins_.segment_y0[segment] - origin_y),
+                    Point(bins_.segment_x1[segment] - origin_x,
+                          bins_.segment_y1[segment] - origin_y));
+            }
+            ResolveCoverage(acc.data(), backdrop, paint.fill_rule, coverage);
+        }
+
+        // Shade the paint.
+        const LinearGradient *linear =
+            std::get_if<LinearGradient>(&paint.gradient);
+        const RadialGradient *radial =
+            std::get_if<RadialGradient>(&paint.gradient);
+        if (!linear && !radial) {
+            Color color = paint.color.Premultiply();
+            if (solid && color.is_opaque()) {
+                dest.r.fill(color.r);
+                dest.g.fill(color.g);
+                dest.b.fill(color.b);
+                dest.a.fill(color.a);
+                continue;
+            }
+            source.r.fill(color.r);
+            source.g.fill(color.g);
+            source.b.fill(color.b);
+            source.a.fill(color.a);
+        } else {
+            // Gradients are defined in the local space of the path.
+            InverseAffine inverse(paths_[path_index].transform);
+            const std::vector<Color> &ramp = gradient_ramps_[
+                linear ? linear->texture_index : radial->texture_index];
+            for (uint32_t x = 0; x < kGridSize; x++) {
+                for (uint32_t y = 0; y < kGridSize; y++) {
+                    Point local = inverse.Map(
+                        Point(origin_x + x + 0.5f, origin_y + y + 0.5f));
+                    Scalar t;
+                    if (linear) {
+                        Point start_to_end = linear->end - linear->start;
+                        Point start_to_position = local - linear->start;
+                        t = start_to_position.Dot(start_to_end) /
+                            start_to_end.Dot(start_to_end);
+                    } else {
+                        Point offset = local - radial->center;
+                        t = std::sqrt(offset.Dot(offset)) / radial->radius;
+                    }
+                    Color color = SampleRamp(ramp, t);
+                    size_t index = x * kGridSize + y;
+                    source.r[index] = color.r;
+                    source.g[index] = color.g;
+                    source.b[index] = color.b;
+                    source.a[index] = color.a;
+                }
+            }
+        }
+        Composite(dest, source, solid ? nullptr : &coverage);
+    }
+
+    // Write out the part of the tile inside the image.
+    uint32_t width = std::min<int32_t>(kGridSize, size.w - origin_x);
+    uint32_t height = std::min<int32_t>(kGridSize, size.h - origin_y);
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *out = pixels + ((row * kGridSize + y) * size.w +
+                                 column * kGridSize) *
+                                    4;
+        for (uint32_t x = 0; x < width; x++) {
+            size_t index = x * kGridSize + y;
+            *out++ = ToUnorm8(dest.r[index]);
+            *out++ = ToUnorm8(dest.g[index]);
+            *out++ = ToUnorm8(dest.b[index]);
+            *out++ = ToUnorm8(dest.a[index]);
+        }
+    }
+}
+
+Gradient CpuRenderer::CreateLinearGradient(Point from, Point to,
+                                           Color colors[], size_t color_size) {
+    LinearGradient gradient;
+    gradient.start = from;
+    gradient.end = to;
+    gradient.texture_index = gradient_ramps_.size();
+    gradient_ramps_.push_back(CreateRamp(colors, color_size));
+    return gradient;
+}
+
+Gradient CpuRenderer::CreateRadialGradient(Point center, Scalar radius,
+                                           Color colors[], size_t color_size) {
+    RadialGradient gradient;
+    gradient.center = center;
+    gradient.radius = radius;
+    gradient.texture_index = gradient_ramps_.size();
+    gradient_ramps_.push_back(CreateRamp(colors, color_size));
+    return gradient;
+}
+
+} // namespace flatland
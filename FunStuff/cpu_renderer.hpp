@@ -0,0 +1,69 @@
+#ifndef CPU_RENDERER
+#define CPU_RENDERER
+
+#include <vector>
+
+#include "geom/basic.hpp"
+#include "geom/bezier.hpp"
+#include "geom/grid.hpp"
+#include "geom/paint.hpp"
+
+namespace flatland {
+
+/// @brief A software renderer for fills, for use where there is no GPU.
+///
+/// Paths are flattened and binned into kGridSize square tiles with
+/// [BinPaths]. Every tile is then rendered independently: for each path that
+/// touches the tile, winding numbers are reconstructed from the tile backdrop
+/// plus the signed area of the segments binned into the tile, converted to
+/// coverage with the path's fill rule and composited in draw order. Tiles
+/// that a path covers without any segments are filled without computing
+/// coverage, and tiles it does not touch are never visited. Tiles are
+/// rendered across all cores.
+class CpuRenderer {
+  public:
+    CpuRenderer() = default;
+
+    ~CpuRenderer() = default;
+
+    /// @brief Record a fill of [path] transformed by [transform].
+    ///
+    /// [path] must outlive the next call to [Render]. Strokes are not
+    /// supported and are ignored.
+    void DrawPath(const Path &path, const Matrix &transform, Paint paint);
+
+    /// @brief Render the recorded fills over [clear_color].
+    ///
+    /// [pixels] receives premultiplied RGBA8, row major with [size.w] * 4
+    /// bytes per row.
+    void Render(ISize size, Color clear_color, uint8_t *pixels);
+
+    /// @brief Discard the recorded fills. Gradients stay valid.
+    void Reset();
+
+    Gradient CreateLinearGradient(Point from, Point to, Color colors[],
+                                  size_t color_size);
+
+    Gradient CreateRadialGradient(Point center, Scalar radius, Color colors[],
+                                  size_t color_size);
+
+  private:
+    std::vector<BinningPath> paths_;
+    std::vector<Paint> paints_;
+    // Premultiplied color ramps, indexed by Gradient texture_index.
+    std::vector<std::vector<Color>> gradient_ramps_;
+    TileBins bins_;
+    // The recorded paths touching each tile row, in draw order.
+    std::vector<std::vector<uint32_t>> row_paths_;
+
+    void RenderTile(uint32_t column, uint32_t row, ISize size,
+                    Color clear_color, uint8_t *pixels) const;
+
+    CpuRenderer(CpuRenderer &&) = delete;
+    CpuRenderer(const CpuRenderer &) = delete;
+    CpuRenderer &operator=(const CpuRenderer &) = delete;
+};
+
+} // namespace flatland
+
+#endif // CPU_RENDERER
@@ -0,0 +1,511 @@
+#include "damage_tracker.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <variant>
+
+#include "geom/patches.hpp"
+
+namespace flatland {
+
+namespace {
+
+// Damage is grown by this many device pixels to cover antialiasing.
+static constexpr Scalar kDamageOutset = 1.0f;
+
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+    return hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+}
+
+uint64_t HashScalars(uint64_t hash, const Scalar *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+        hash = HashCombine(hash, bits);
+    }
+    return hash;
+}
+
+uint64_t HashRect(uint64_t hash, const Rect &rect) {
+    Scalar values[] = {rect.l, rect.t, rect.r, rect.b};
+    return HashScalars(hash, values, 4);
+}
+
+uint64_t HashPaint(uint64_t hash, const Paint &paint) {
+    Scalar values[] = {paint.color.r, paint.color.g, paint.color.b,
+                       paint.color.a, paint.stroke_width};
+    hash = HashScalars(hash, values, 5);
+    hash = HashCombine(hash, paint.stroke);
+    hash = HashCombine(hash, static_cast<uint64_t>(paint.fill_rule));
+    hash = HashCombine(hash, paint.gradient.index());
+    if (auto *linear = std::get_if<LinearGradient>(&paint.gradient)) {
+        Scalar points[] = {linear->start.x, linear->start.y, linear->end.x,
+                           linear->end.y};
+        hash = HashScalars(hash, points, 4);
+        hash = HashCombine(hash, linear->texture_index);
+    } else if (auto *radial = std::get_if<RadialGradient>(&paint.gradient)) {
+        Scalar circle[] = {radial->center.x, radial->center.y, radial->radius};
+        hash = HashScalars(hash, circle, 3);
+        hash = HashCombine(hash, radial->texture_index);
+    }
+    return hash;
+}
+
+uint64_t HashFilters(uint64_t hash, const RenderProgram::Data &offscreen) {
+    hash = HashCombine(hash, offscreen.image_filter.index());
+    if (auto *gaussian = std::get_if<GaussianFilter>(&offscreen.image_filter)) {
+        hash = HashScalars(hash, &gaussian->sigma, 1);
+    }
+    hash = HashCombine(hash, offscreen.color_filter.index());
+    if (auto *matrix =
+            std::get_if<ColorMatrixFilter>(&offscreen.color_filter)) {
+        hash = HashScalars(hash, matrix->m, 20);
+    }
+    return hash;
+}
+
+std::optional<Rect> UnionBounds(const std::optional<Rect> &a,
+                                const Rect &b) {
+    return a.has_value() ? a->Union(b) : b;
+}
+
+Scalar GetArea(const Rect &rect) {
+    return rect.GetWidth() * rect.GetHeight();
+}
+
+// The offscreen of [program] that [texture] holds, before or after filters.
+std::optional<size_t> FindOffscreen(const RenderProgram &program,
+                                    MTL::Texture *texture) {
+    const std::vector<RenderProgram::Data> &offscreens =
+        program.GetOffscreens();
+    for (size_t i = 0; i < offscreens.size(); i++) {
+        if (texture != nullptr && (offscreens[i].texture == texture ||
+                                   offscreens[i].filter_texture == texture)) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+// Call [fn] with each run of [vertices] that shares a depth count, which is
+// one of the draws merged into a batch.
+template <typename Vertex, typename F>
+void ForEachMergedDraw(const Vertex *vertices, uint32_t count, const F &fn) {
+    uint32_t start = 0;
+    for (uint32_t i = 1; i <= count; i++) {
+        if (i == count ||
+            vertices[i].depth_count != vertices[start].depth_count) {
+            fn(vertices + start, i - start);
+            start = i;
+        }
+    }
+}
+
+// Whether [command] can be merged into a [CommandType::kBatch] by
+// [CanvasOptions::batch_convex_draws].
+bool IsBatchable(const PackedCommand &command,
+                 const DisplayListTables &tables) {
+    if (command.type != CommandType::kDraw || !command.IsConvex()) {
+        return false;
+    }
+    const Scalar *m = tables.transforms[command.transform_index].GetStorage();
+    return !tables.paints[command.paint_index].HasGradient() && m[3] == 0 &&
+           m[7] == 0 && m[15] == 1;
+}
+
+// Add the vertices of [command] to [hash] and [bounds] as the
+// [BatchVertex]es it would have in a batch.
+void SignBatchableDraw(const PackedCommand &command,
+                       const DisplayListTables &tables, uint64_t &hash,
+                       std::optional<Rect> &bounds) {
+    const Matrix &transform = tables.transforms[command.transform_index];
+    Color color = tables.paints[command.paint_index].color.Premultiply();
+    Scalar rgba[] = {color.r, color.g, color.b, color.a};
+    const uint8_t *contents = static_cast<const uint8_t *>(
+        tables.buffers[command.buffer_index]->contents());
+    const Point *points =
+        reinterpret_cast<const Point *>(contents + command.vertex_offset);
+    const uint16_t *indices =
+        reinterpret_cast<const uint16_t *>(contents + command.index_offset);
+    for (uint32_t i = 0; i < command.index_count; i++) {
+        Point point = transform.TransformPoint(
+            points[command.IsIndexed() ? indices[i] : i]);
+        hash = HashScalars(hash, rgba, 4);
+        hash = HashScalars(hash, &point.x, 2);
+        bounds = UnionBounds(bounds, Rect::MakePointBounds(point, point));
+    }
+}
+
+} // namespace
+
+const std::vector<Rect> &
+DamageTracker::ComputeDamage(const RenderProgram &program,
+                             const Rect &target_bounds, bool atlas_changed) {
+    stats_ = DamageStats();
+    damage_.clear();
+    // The last program matches itself everywhere, and its signatures and
+    // command bounds are still those kept from the last call.
+    if (is_valid_ && program.GetId() != 0 && program.GetId() == program_id_ &&
+        !atlas_changed && target_bounds == target_bounds_) {
+        damaged_layers_.assign(program.GetOffscreens().size(), false);
+        return damage_;
+    }
+    current_.clear();
+    command_bounds_.clear();
+    if (atlas_changed) {
+        atlas_generation_++;
+    }
+
+    // Children come first, so a layer's hash is ready before the layers that
+    // draw it are signed.
+    layer_hashes_.clear();
+    for (const RenderProgram::Data &offscreen : program.GetOffscreens()) {
+        Sign(offscreen.commands, program, /*record_bounds=*/false);
+        uint64_t hash = HashFilters(HashRect(0, offscreen.bounds), offscreen);
+        for (const Signature &signature : current_) {
+            hash = HashCombine(hash, signature.hash);
+        }
+        current_.clear();
+        layer_hashes_.push_back(hash);
+    }
+
+    Sign(program.GetCommands(), program, /*record_bounds=*/true);
+    // Opaque draws are moved ahead of the draws they cover, so the order of
+    // the commands isn't the order they paint in.
+    std::sort(current_.begin(), current_.end(),
+              [](const Signature &a, const Signature &b) {
+                  return a.depth_count != b.depth_count
+                             ? a.depth_count < b.depth_count
+                             : a.hash < b.hash;
+              });
+
+    if (!is_valid_ || target_bounds != target_bounds_) {
+        target_bounds_ = target_bounds;
+        stats_.added_draws = current_.size();
+        stats_.removed_draws = previous_.size();
+        AddDamage(target_bounds);
+    } else {
+        Diff();
+    }
+    std::swap(previous_, current_);
+    program_id_ = program.GetId();
+    is_valid_ = true;
+
+    for (const Rect &rect : damage_) {
+        stats_.damaged_area += GetArea(rect);
+    }
+
+    // A layer is drawn by at most one command, and comes before the layer
+    // that draws it.
+    const std::vector<RenderProgram::Data> &offscreens =
+        program.GetOffscreens();
+    const DisplayListTables &tables = program.GetTables();
+    damaged_layers_.assign(offscreens.size(), false);
+    auto mark_layers = [&](const std::vector<PackedCommand> &commands,
+                           const std::optional<Rect> *bounds) {
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (commands[i].type != CommandType::kTexture) {
+                continue;
+            }
+            std::optional<size_t> layer = FindOffscreen(
+                program, tables.extras[commands[i].extra_index].texture);
+            if (!layer.has_value()) {
+                continue;
+            }
+            bool is_damaged =
+                bounds == nullptr ||
+                (bounds[i].has_value() &&
+                 std::any_of(damage_.begin(), damage_.end(),
+                             [&](const Rect &rect) {
+                                 return rect.Intersection(*bounds[i])
+                                     .has_value();
+                             }));
+            damaged_layers_[*layer] = damaged_layers_[*layer] || is_damaged;
+        }
+    };
+    mark_layers(program.GetCommands(), command_bounds_.data());
+    for (size_t i = offscreens.size(); i-- > 0;) {
+        if (damaged_layers_[i]) {
+            mark_layers(offscreens[i].commands, nullptr);
+        }
+    }
+    return damage_;
+}
+
+void DamageTracker::Sign(const std::vector<PackedCommand> &commands,
+                         const RenderProgram &program, bool record_bounds) {
+    const DisplayListTables &tables = program.GetTables();
+    // Every pass starts without a scissor.
+    std::optional<Rect> scissor;
+    uint64_t scissor_hash = 0;
+    for (const PackedCommand &command : commands) {
+        const Matrix &transform = tables.transforms[command.transform_index];
+        // Draws that can be batched are signed as they would be in a batch,
+        // so that they still match when they join or leave one. The size
+        // and paint of a batch change with the draws merged into it, so
+        // batches are only signed by their vertices.
+        bool is_batchable = IsBatchable(command, tables);
+        uint64_t hash = HashCombine(
+            static_cast<uint64_t>(is_batchable ? CommandType::kBatch
+                                               : command.type),
+            scissor_hash);
+        if (!is_batchable && command.type != CommandType::kAtlas &&
+            command.type != CommandType::kBatch) {
+            hash = HashCombine(hash, command.flags & ~PackedCommand::kCulled);
+            hash = HashCombine(hash, command.index_count);
+            hash = HashScalars(hash, transform.GetStorage(), 16);
+            hash = HashPaint(hash, tables.paints[command.paint_index]);
+        }
+
+        const uint8_t *contents =
+            command.type == CommandType::kScissor
+                ? nullptr
+                : static_cast<const uint8_t *>(
+                      tables.buffers[command.buffer_index]->contents());
+        // Scissors are not signed themselves, since they only change the
+        // signatures of the commands after them.
+        std::optional<Rect> bounds;
+        size_t first_signature = current_.size();
+        switch (command.type) {
+        case CommandType::kScissor: {
+            const Rect &rect = tables.extras[command.extra_index].bounds;
+            scissor = rect;
+            scissor_hash = HashRect(0, rect);
+            break;
+        }
+        case CommandType::kDraw:
+        case CommandType::kClip: {
+            if (is_batchable) {
+                SignBatchableDraw(command, tables, hash, bounds);
+                break;
+            }
+            const Point *points = reinterpret_cast<const Point *>(
+                contents + command.vertex_offset);
+            const uint16_t *indices = reinterpret_cast<const uint16_t *>(
+                contents + command.index_offset);
+            for (uint32_t i = 0; i < command.index_count; i++) {
+                const Point &point =
+                    points[command.IsIndexed() ? indices[i] : i];
+                hash = HashScalars(hash, &point.x, 2);
+                if (command.type == CommandType::kDraw &&
+                    command.IsConvex()) {
+                    Point device = transform.TransformPoint(point);
+                    bounds =
+                        UnionBounds(bounds, Rect::MakePointBounds(device,
+                                                                  device));
+                }
+            }
+            if (command.extra_index == PackedCommand::kNoExtra) {
+                break;
+            }
+            CommandExtra extra = tables.extras[command.extra_index];
+            if (extra.patch_count > 0) {
+                const Scalar *patches =
+                    static_cast<const Scalar *>(extra.patch_buffer.contents());
+                hash = HashScalars(hash, patches,
+                                   extra.patch_count * sizeof(CurvePatch) /
+                                       sizeof(Scalar));
+            }
+            if (command.type == CommandType::kClip &&
+                command.GetClipStyle() == ClipStyle::kIntersect) {
+                // The cover of an intersect clip is the union of the draws
+                // it clips, so it changes with them, and is already in
+                // device space. Draws that change are damaged themselves.
+                bounds = extra.bounds;
+            } else {
+                hash = HashRect(hash, extra.bounds);
+                bounds = transform.TransformBounds(extra.bounds);
+            }
+            break;
+        }
+        case CommandType::kTexture: {
+            const CommandExtra &extra = tables.extras[command.extra_index];
+            hash = HashRect(hash, extra.bounds);
+            std::optional<size_t> layer = FindOffscreen(program, extra.texture);
+            // Layers match by their contents, other textures by identity.
+            hash = HashCombine(
+                hash, layer.has_value()
+                          ? layer_hashes_[*layer]
+                          : reinterpret_cast<uintptr_t>(extra.texture));
+            bounds = transform.TransformBounds(extra.bounds);
+            break;
+        }
+        case CommandType::kAtlas: {
+            hash = HashCombine(hash, atlas_generation_);
+            ForEachMergedDraw(
+                reinterpret_cast<const AtlasVertex *>(contents +
+                                                      command.vertex_offset),
+                command.index_count,
+                [&](const AtlasVertex *vertices, uint32_t count) {
+                    uint64_t draw_hash = hash;
+                    std::optional<Rect> draw_bounds;
+                    for (uint32_t i = 0; i < count; i++) {
+                        Scalar values[] = {
+                            vertices[i].color[0],    vertices[i].color[1],
+                            vertices[i].color[2],    vertices[i].color[3],
+                            vertices[i].position[0], vertices[i].position[1],
+                            vertices[i].uv[0],       vertices[i].uv[1],
+                            vertices[i].distance_range};
+                        draw_hash = HashScalars(draw_hash, values, 9);
+                        Point point(vertices[i].position[0],
+                                    vertices[i].position[1]);
+                        draw_bounds = UnionBounds(
+                            draw_bounds, Rect::MakePointBounds(point, point));
+                    }
+                    current_.push_back(
+                        Signature{draw_hash,
+                                  static_cast<int32_t>(vertices[0].depth_count),
+                                  draw_bounds});
+                });
+            break;
+        }
+        case CommandType::kBatch: {
+            ForEachMergedDraw(
+                reinterpret_cast<const BatchVertex *>(contents +
+                                                      command.vertex_offset),
+                command.index_count,
+                [&](const BatchVertex *vertices, uint32_t count) {
+                    uint64_t draw_hash = hash;
+                    std::optional<Rect> draw_bounds;
+                    for (uint32_t i = 0; i < count; i++) {
+                        Scalar values[] = {
+                            vertices[i].color[0],    vertices[i].color[1],
+                            vertices[i].color[2],    vertices[i].color[3],
+                            vertices[i].position[0], vertices[i].position[1]};
+                        draw_hash = HashScalars(draw_hash, values, 6);
+                        Point point(vertices[i].position[0],
+                                    vertices[i].position[1]);
+                        draw_bounds = UnionBounds(
+                            draw_bounds, Rect::MakePointBounds(point, point));
+                    }
+                    current_.push_back(
+                        Signature{draw_hash,
+                                  static_cast<int32_t>(vertices[0].depth_count),
+                                  draw_bounds});
+                });
+            break;
+        }
+        }
+
+        if (command.type == CommandType::kDraw ||
+            command.type == CommandType::kClip ||
+            command.type == CommandType::kTexture) {
+            current_.push_back(Signature{hash, command.depth_count, bounds});
+        }
+        // Nothing outside the scissor is drawn.
+        std::optional<Rect> command_bounds;
+        for (size_t i = first_signature; i < current_.size(); i++) {
+            std::optional<Rect> &draw_bounds = current_[i].bounds;
+            if (draw_bounds.has_value() && scissor.has_value()) {
+                draw_bounds = draw_bounds->Intersection(*scissor);
+            }
+            if (draw_bounds.has_value()) {
+                command_bounds = UnionBounds(command_bounds, *draw_bounds);
+            }
+        }
+        if (record_bounds) {
+            command_bounds_.push_back(command_bounds);
+        }
+    }
+}
+
+void DamageTracker::Diff() {
+    // Most frames change little, so skip the shared start and end.
+    size_t begin = 0;
+    while (begin < previous_.size() && begin < current_.size() &&
+           previous_[begin].hash == current_[begin].hash) {
+        begin++;
+    }
+    size_t previous_end = previous_.size();
+    size_t current_end = current_.size();
+    while (previous_end > begin && current_end > begin &&
+           previous_[previous_end - 1].hash ==
+               current_[current_end - 1].hash) {
+        previous_end--;
+        current_end--;
+    }
+
+    // Match each new signature with the first unmatched old one with the
+    // same hash after the last match, keeping the matches in order.
+    candidates_.clear();
+    for (size_t i = begin; i < previous_end; i++) {
+        candidates_.emplace_back(previous_[i].hash, i);
+    }
+    std::sort(candidates_.begin(), candidates_.end());
+    matched_.assign(previous_.size(), false);
+    uint32_t next = begin;
+    for (size_t i = begin; i < current_end; i++) {
+        auto candidate =
+            std::lower_bound(candidates_.begin(), candidates_.end(),
+                             std::make_pair(current_[i].hash, next));
+        if (candidate != candidates_.end() &&
+            candidate->first == current_[i].hash) {
+            matched_[candidate->second] = true;
+            next = candidate->second + 1;
+            continue;
+        }
+        stats_.added_draws++;
+        if (current_[i].bounds.has_value()) {
+            AddDamage(*current_[i].bounds);
+        }
+    }
+    for (size_t i = begin; i < previous_end; i++) {
+        if (matched_[i]) {
+            continue;
+        }
+        stats_.removed_draws++;
+        if (previous_[i].bounds.has_value()) {
+            AddDamage(*previous_[i].bounds);
+        }
+    }
+}
+
+void DamageTracker::AddDamage(Rect rect) {
+    rect = rect.Expand(kDamageOutset, kDamageOutset);
+    std::optional<Rect> visible =
+        Rect::MakeLTRB(std::floor(rect.l), std::floor(rect.t),
+                       std::ceil(rect.r), std::ceil(rect.b))
+            .Intersection(target_bounds_);
+    if (!visible.has_value()) {
+        return;
+    }
+    Rect merged = *visible;
+    while (true) {
+        // Merge the rects it overlaps, which may make it overlap others.
+        for (size_t i = 0; i < damage_.size();) {
+            if (damage_[i].Intersection(merged).has_value()) {
+                merged = merged.Union(damage_[i]);
+                damage_.erase(damage_.begin() + i);
+                i = 0;
+            } else {
+                i++;
+            }
+        }
+        damage_.push_back(merged);
+        if (damage_.size() <= kMaxDamageRects) {
+            return;
+        }
+        // Too many rects, so merge the pair whose union grows the least.
+        size_t first = 0;
+        size_t second = 1;
+        Scalar least_growth = std::numeric_limits<Scalar>::infinity();
+        for (size_t i = 0; i < damage_.size(); i++) {
+            for (size_t j = i + 1; j < damage_.size(); j++) {
+                Scalar growth = GetArea(damage_[i].Union(damage_[j])) -
+                                GetArea(damage_[i]) - GetArea(damage_[j]);
+                if (growth < least_growth) {
+                    first = i;
+                    second = j;
+                    least_growth = growth;
+                }
+            }
+        }
+        merged = damage_[first].Union(damage_[second]);
+        damage_.erase(damage_.begin() + second);
+        damage_.erase(damage_.begin() + first);
+    }
+}
+
+} // namespace flatland
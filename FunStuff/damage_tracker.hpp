@@ -0,0 +1,117 @@
+#ifndef DAMAGE_TRACKER
+#define DAMAGE_TRACKER
+
+#include <optional>
+#include <vector>
+
+#include "canvas.hpp"
+
+namespace flatland {
+
+/// @brief Totals for the last [DamageTracker::ComputeDamage].
+struct DamageStats {
+    /// Draws of the new program without a match in the old, and draws of the
+    /// old program without a match in the new.
+    size_t added_draws = 0;
+    size_t removed_draws = 0;
+    /// Device pixels covered by the damage rects.
+    Scalar damaged_area = 0;
+};
+
+/// @brief Finds the parts of the render target that differ between
+/// successive [RenderProgram]s, so that only those need to be drawn again.
+///
+/// Draws are matched by identity: a hash of their type, geometry, transform,
+/// paint and scissor, or for layers, of the layer's own draws and filters.
+/// Buffers, depth counts and textures of layers are ignored, so a program
+/// recorded again from the same scene matches the last one everywhere.
+/// Batches are compared per draw they were merged from.
+///
+/// Draws are matched in paint order, so draws that change order are damaged.
+/// Unmatched draws of either program damage their device bounds.
+class DamageTracker {
+  public:
+    /// The most damage rects returned. Rects beyond this are merged into the
+    /// nearest.
+    static constexpr size_t kMaxDamageRects = 4;
+
+    DamageTracker() = default;
+
+    ~DamageTracker() = default;
+
+    /// @brief Compare the onscreen pass of [program] with the program given
+    /// to the last call, and return the disjoint, pixel aligned rects within
+    /// [target_bounds] whose contents may differ.
+    ///
+    /// Everything is damaged on the first call, after [Invalidate] and when
+    /// [target_bounds] changes. Set [atlas_changed] when texels of the
+    /// coverage atlas were replaced since the last call, which damages every
+    /// atlas draw. Passing the same program again with none of these
+    /// damages nothing and skips signing it.
+    const std::vector<Rect> &ComputeDamage(const RenderProgram &program,
+                                           const Rect &target_bounds,
+                                           bool atlas_changed = false);
+
+    /// @brief Damage everything on the next [ComputeDamage], such as when
+    /// the contents of the retained target were lost.
+    void Invalidate() { is_valid_ = false; }
+
+    /// @brief The device bounds of each onscreen command of the last program,
+    /// or std::nullopt for commands that don't draw, such as scissors.
+    const std::vector<std::optional<Rect>> &GetCommandBounds() const {
+        return command_bounds_;
+    }
+
+    /// @brief Whether each offscreen of the last program is drawn by a
+    /// command that intersects the damage, directly or through other
+    /// offscreens, and so has to be rendered.
+    const std::vector<bool> &GetDamagedLayers() const {
+        return damaged_layers_;
+    }
+
+    const DamageStats &GetStats() const { return stats_; }
+
+  private:
+    struct Signature {
+        uint64_t hash;
+        /// Paint order, see [Command::depth_count].
+        int32_t depth_count;
+        std::optional<Rect> bounds;
+    };
+
+    std::vector<Signature> previous_;
+    std::vector<Signature> current_;
+    std::vector<std::optional<Rect>> command_bounds_;
+    std::vector<uint64_t> layer_hashes_;
+    std::vector<bool> damaged_layers_;
+    // (hash, index) of the unmatched previous signatures, for matching.
+    std::vector<std::pair<uint64_t, uint32_t>> candidates_;
+    std::vector<bool> matched_;
+    std::vector<Rect> damage_;
+    Rect target_bounds_;
+    // Bumped when the atlas changes, so that atlas draws don't match.
+    uint64_t atlas_generation_ = 0;
+    // [RenderProgram::GetId] of the program [previous_] was signed from.
+    uint64_t program_id_ = 0;
+    bool is_valid_ = false;
+    DamageStats stats_;
+
+    /// @brief Append the signatures of [commands] to [current_], and their
+    /// bounds to [command_bounds_] if [record_bounds] is set.
+    void Sign(const std::vector<PackedCommand> &commands,
+              const RenderProgram &program, bool record_bounds);
+
+    /// @brief Match [current_] against [previous_] and add the bounds of the
+    /// unmatched signatures of both to [damage_].
+    void Diff();
+
+    void AddDamage(Rect rect);
+
+    DamageTracker(const DamageTracker &) = delete;
+    DamageTracker(DamageTracker &&) = delete;
+    DamageTracker &operator=(const DamageTracker &) = delete;
+};
+
+} // namespace flatland
+
+#endif // DAMAGE_TRACKER
@@ -0,0 +1,267 @@
+#include "display_list_optimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <variant>
+
+namespace flatland {
+
+namespace {
+
+// Slack for points on the edge of a clip's triangles, in device pixels.
+static constexpr Scalar kContainmentTolerance = 1.0f / 1024.0f;
+
+bool IsEmpty(const Rect &rect) {
+    return !(rect.GetWidth() > 0 && rect.GetHeight() > 0);
+}
+
+// Call [fn] with each vertex of [command] in local space.
+template <typename F>
+void ForEachVertex(const PackedCommand &command,
+                   const DisplayListTables &tables, const F &fn) {
+    const uint8_t *contents = static_cast<const uint8_t *>(
+        tables.buffers[command.buffer_index]->contents());
+    const Point *points =
+        reinterpret_cast<const Point *>(contents + command.vertex_offset);
+    const uint16_t *indices =
+        reinterpret_cast<const uint16_t *>(contents + command.index_offset);
+    for (uint32_t i = 0; i < command.index_count; i++) {
+        fn(points[command.IsIndexed() ? indices[i] : i]);
+    }
+}
+
+// Whether [point] is inside one of the triangles of [command], in device
+// space.
+bool TrianglesContain(const PackedCommand &command,
+                      const DisplayListTables &tables, Point point) {
+    const Matrix &transform = tables.transforms[command.transform_index];
+    Point triangle[3];
+    uint32_t corner = 0;
+    bool contained = false;
+    ForEachVertex(command, tables, [&](Point vertex) {
+        triangle[corner++] = transform.TransformPoint(vertex);
+        if (corner < 3) {
+            return;
+        }
+        corner = 0;
+        // Inside if the point is on the same side of every edge, whichever
+        // way the triangle winds.
+        Scalar area = (triangle[1] - triangle[0]).Cross(triangle[2] -
+                                                         triangle[0]);
+        if (area == 0) {
+            return;
+        }
+        Scalar sign = area > 0 ? 1 : -1;
+        bool inside = true;
+        for (int i = 0; i < 3; i++) {
+            Point edge = triangle[(i + 1) % 3] - triangle[i];
+            Scalar distance = sign * edge.Cross(point - triangle[i]) /
+                              std::sqrt(edge.Dot(edge));
+            inside &= distance >= -kContainmentTolerance;
+        }
+        contained |= inside;
+    });
+    return contained;
+}
+
+// Replace the command drawing [layer] with the commands of the layer.
+void InlineLayer(PreparedDisplayList &list, PreparedLayer &layer) {
+    bool found = false;
+    list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+        if (found || &commands == &layer.commands) {
+            return;
+        }
+        for (size_t i = 0; i < commands.size(); i++) {
+            if (commands[i].type == CommandType::kTexture &&
+                commands[i].extra_index == layer.composite_extra_index) {
+                commands.erase(commands.begin() + i);
+                commands.insert(commands.begin() + i, layer.commands.begin(),
+                                layer.commands.end());
+                found = true;
+                return;
+            }
+        }
+    });
+    layer.commands.clear();
+    layer.is_removed = true;
+}
+
+bool IsUnfiltered(const PreparedLayer &layer) {
+    return std::holds_alternative<std::monostate>(layer.image_filter) &&
+           std::holds_alternative<std::monostate>(layer.color_filter);
+}
+
+} // namespace
+
+void RemoveTransparentDraws(PreparedDisplayList &list) {
+    const DisplayListTables &tables = *list.tables;
+    list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+        std::erase_if(commands, [&](const PackedCommand &command) {
+            if (command.type != CommandType::kDraw &&
+                command.type != CommandType::kTexture) {
+                return false;
+            }
+            const Paint &paint = tables.paints[command.paint_index];
+            return !paint.HasGradient() && paint.color.a <= 0;
+        });
+    });
+}
+
+void RemoveEmptyDraws(PreparedDisplayList &list) {
+    const DisplayListTables &tables = *list.tables;
+    list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+        std::erase_if(commands, [&](const PackedCommand &command) {
+            if (command.type == CommandType::kTexture ||
+                (command.type == CommandType::kDraw && !command.IsConvex())) {
+                // The destination or cover of the draw.
+                return IsEmpty(tables.extras[command.extra_index].bounds);
+            }
+            if (command.type != CommandType::kDraw) {
+                return false;
+            }
+            // A transform can't give an area to geometry that has none.
+            std::optional<Rect> bounds;
+            ForEachVertex(command, tables, [&](Point point) {
+                Rect rect = Rect::MakePointBounds(point, point);
+                bounds = bounds.has_value() ? bounds->Union(rect) : rect;
+            });
+            return !bounds.has_value() || IsEmpty(*bounds);
+        });
+    });
+}
+
+void RemoveContainingClips(PreparedDisplayList &list) {
+    const DisplayListTables &tables = *list.tables;
+    list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+        std::erase_if(commands, [&](const PackedCommand &command) {
+            if (command.type != CommandType::kClip ||
+                command.GetClipStyle() != ClipStyle::kIntersect ||
+                !command.IsConvex()) {
+                return false;
+            }
+            // A convex region contains a rect if it contains its corners.
+            const Rect &cover = tables.extras[command.extra_index].bounds;
+            for (Point corner :
+                 {Point(cover.l, cover.t), Point(cover.r, cover.t),
+                  Point(cover.r, cover.b), Point(cover.l, cover.b)}) {
+                if (!TrianglesContain(command, tables, corner)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    });
+}
+
+void RemoveEmptyLayers(PreparedDisplayList &list) {
+    // Children come first, so a layer left empty by removing its children
+    // is removed as well.
+    for (PreparedLayer &layer : list.layers) {
+        if (layer.is_removed ||
+            std::any_of(layer.commands.begin(), layer.commands.end(),
+                        [](const PackedCommand &command) {
+                            return command.type != CommandType::kClip &&
+                                   command.type != CommandType::kScissor;
+                        })) {
+            continue;
+        }
+        list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+            std::erase_if(commands, [&](const PackedCommand &command) {
+                return command.type == CommandType::kTexture &&
+                       command.extra_index == layer.composite_extra_index;
+            });
+        });
+        layer.commands.clear();
+        layer.is_removed = true;
+    }
+}
+
+void FoldLayerAlpha(PreparedDisplayList &list) {
+    DisplayListTables &tables = *list.tables;
+    for (PreparedLayer &layer : list.layers) {
+        if (layer.is_removed || layer.alpha == 1 || !IsUnfiltered(layer)) {
+            continue;
+        }
+        // Clips in the layer only apply to its one draw, so they can stay.
+        PackedCommand *draw = nullptr;
+        size_t draw_count = 0;
+        bool has_scissor = false;
+        for (PackedCommand &command : layer.commands) {
+            if (command.type == CommandType::kScissor) {
+                has_scissor = true;
+            } else if (command.type != CommandType::kClip) {
+                draw = &command;
+                draw_count++;
+            }
+        }
+        if (draw_count != 1 || has_scissor) {
+            continue;
+        }
+        Paint paint = tables.paints[draw->paint_index];
+        bool is_foldable =
+            draw->type == CommandType::kTexture ||
+            (draw->type == CommandType::kDraw && !paint.stroke &&
+             !paint.HasGradient());
+        if (!is_foldable) {
+            continue;
+        }
+        paint.color.a *= layer.alpha;
+        draw->paint_index = tables.paints.size();
+        tables.paints.push_back(paint);
+        InlineLayer(list, layer);
+    }
+}
+
+void InlineLayers(PreparedDisplayList &list) {
+    for (PreparedLayer &layer : list.layers) {
+        if (layer.is_removed || layer.alpha != 1 || !IsUnfiltered(layer) ||
+            std::any_of(layer.commands.begin(), layer.commands.end(),
+                        [](const PackedCommand &command) {
+                            return command.type == CommandType::kScissor;
+                        })) {
+            continue;
+        }
+        InlineLayer(list, layer);
+    }
+}
+
+void RemoveRedundantScissors(PreparedDisplayList &list) {
+    constexpr Scalar kInfinity = std::numeric_limits<Scalar>::infinity();
+    const DisplayListTables &tables = *list.tables;
+    list.ForEachPass([&](std::vector<PackedCommand> &commands) {
+        // Every pass starts without a scissor.
+        Rect current =
+            Rect::MakeLTRB(-kInfinity, -kInfinity, kInfinity, kInfinity);
+        size_t out = 0;
+        for (size_t i = 0; i < commands.size(); i++) {
+            const PackedCommand &command = commands[i];
+            if (command.type == CommandType::kScissor) {
+                bool is_replaced =
+                    i + 1 == commands.size() ||
+                    commands[i + 1].type == CommandType::kScissor;
+                const Rect &bounds = tables.extras[command.extra_index].bounds;
+                if (is_replaced || bounds == current) {
+                    continue;
+                }
+                current = bounds;
+            }
+            commands[out++] = command;
+        }
+        commands.resize(out);
+    });
+}
+
+std::vector<OptimizerPass> MakeDefaultOptimizerPasses() {
+    return {
+        {"transparent draws", RemoveTransparentDraws},
+        {"empty draws", RemoveEmptyDraws},
+        {"containing clips", RemoveContainingClips},
+        {"empty layers", RemoveEmptyLayers},
+        {"layer alpha", FoldLayerAlpha},
+        {"inlined layers", InlineLayers},
+        {"redundant scissors", RemoveRedundantScissors},
+    };
+}
+
+} // namespace flatland
@@ -0,0 +1,55 @@
+#ifndef DISPLAY_LIST_OPTIMIZER
+#define DISPLAY_LIST_OPTIMIZER
+
+#include <vector>
+
+#include "canvas.hpp"
+
+namespace flatland {
+
+/// @brief Remove solid fills and textures drawn with no alpha, along with
+/// any layers that were only drawn that way.
+void RemoveTransparentDraws(PreparedDisplayList &list);
+
+/// @brief Remove fills whose geometry covers no area and textures drawn into
+/// an empty rect.
+void RemoveEmptyDraws(PreparedDisplayList &list);
+
+/// @brief Remove convex intersect clips that contain the cover of their
+/// depth write, such as a clip that contains the clip before it.
+///
+/// The cover of an intersect clip is already limited to the draws after it
+/// and the clips before it, so containing it means clipping nothing.
+void RemoveContainingClips(PreparedDisplayList &list);
+
+/// @brief Remove layers that draw nothing, such as a [Canvas::SaveLayer]
+/// that is restored straight away or whose draws have all been removed.
+void RemoveEmptyLayers(PreparedDisplayList &list);
+
+/// @brief Fold the alpha of unfiltered layers holding a single draw into the
+/// paint of that draw, and draw it directly into the parent.
+///
+/// Only draws that touch each pixel once are folded: fills and textures,
+/// but not strokes, whose triangles may overlap, or atlas batches.
+void FoldLayerAlpha(PreparedDisplayList &list);
+
+/// @brief Draw the commands of layers with full alpha and no filters
+/// directly into their parent.
+///
+/// A layer keeps its own depth counts, which sit between those of the
+/// parent's draws before and after it, so clips on either side still apply.
+/// Layers that set a scissor are kept, since theirs is not relative to the
+/// parent's.
+void InlineLayers(PreparedDisplayList &list);
+
+/// @brief Remove scissors that are replaced before anything is drawn and
+/// scissors that don't change the scissor rect.
+void RemoveRedundantScissors(PreparedDisplayList &list);
+
+/// @brief All of the above, ordered so that each pass sees the work removed
+/// by the ones before it.
+std::vector<OptimizerPass> MakeDefaultOptimizerPasses();
+
+} // namespace flatland
+
+#endif // DISPLAY_LIST_OPTIMIZER
@@ -0,0 +1,346 @@
+#include "atlas.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#include "sdf.hpp"
+#include "text.hpp"
+
+namespace flatland {
+
+namespace {
+
+// Shelf heights are rounded up to a multiple of this, so that masks of
+// similar heights share a shelf.
+static constexpr int32_t kShelfHeightStep = 4;
+
+// Fractional translations are quantized to this many positions per pixel.
+static constexpr Scalar kSubpixelSteps = 4;
+
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+    return hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+}
+
+uint64_t FloatBits(Scalar value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+Path TransformPath(const Path &path, const Matrix &transform) {
+    PathBuilder builder;
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            builder.moveTo(transform.TransformPoint(data[0]));
+            break;
+        case SegmentType::kLinear:
+            builder.lineTo(transform.TransformPoint(data[1]));
+            break;
+        case SegmentType::kQuad:
+            builder.quadTo(transform.TransformPoint(data[1]),
+                           transform.TransformPoint(data[2]));
+            break;
+        case SegmentType::kCubic:
+            builder.cubicTo(transform.TransformPoint(data[1]),
+                            transform.TransformPoint(data[2]),
+                            transform.TransformPoint(data[3]));
+            break;
+        case SegmentType::kClose:
+            builder.close();
+            break;
+        }
+        return true;
+    });
+    return builder.takePath();
+}
+
+} // namespace
+
+ShelfPacker::ShelfPacker(int32_t width, int32_t height)
+    : width_(width), height_(height) {}
+
+bool ShelfPacker::Allocate(int32_t width, int32_t height, int32_t &x,
+                           int32_t &y) {
+    if (width > width_ || height > height_) {
+        return false;
+    }
+    Shelf *best = nullptr;
+    for (Shelf &shelf : shelves_) {
+        if (shelf.height >= height && width_ - shelf.x >= width &&
+            (best == nullptr || shelf.height < best->height)) {
+            best = &shelf;
+        }
+    }
+    if (best == nullptr) {
+        int32_t top = shelves_.empty()
+                          ? 0
+                          : shelves_.back().y + shelves_.back().height;
+        int32_t shelf_height =
+            std::min((height + kShelfHeightStep - 1) / kShelfHeightStep *
+                         kShelfHeightStep,
+                     height_ - top);
+        if (shelf_height < height) {
+            return false;
+        }
+        shelves_.push_back(Shelf{.y = top, .height = shelf_height, .x = 0});
+        best = &shelves_.back();
+    }
+    x = best->x;
+    y = best->y;
+    best->x += width;
+    return true;
+}
+
+void ShelfPacker::Reset() { shelves_.clear(); }
+
+///
+
+CoverageAtlas::CoverageAtlas(int32_t size, int32_t page_size)
+    : size_(size), page_size_(page_size), pages_per_row_(size / page_size),
+      pixels_(size * size, 0) {
+    for (int32_t i = 0; i < pages_per_row_ * pages_per_row_; i++) {
+        pages_.push_back(Page{.packer = ShelfPacker(page_size, page_size),
+                              .last_used_frame = 0,
+                              .keys = {}});
+    }
+}
+
+void CoverageAtlas::BeginFrame() { frame_++; }
+
+std::optional<AtlasQuad> CoverageAtlas::FindOrRasterize(const Path &path,
+                                                        const Matrix &transform,
+                                                        FillRule fill_rule) {
+    const Scalar *m = transform.GetStorage();
+    if (m[3] != 0 || m[7] != 0 || m[15] != 1) {
+        return std::nullopt;
+    }
+
+    // Split the translation into a whole pixel offset, which is applied when
+    // drawing, and a quantized subpixel offset, which is baked into the mask.
+    Point translation = transform.GetTranslation();
+    Scalar whole_x = std::floor(translation.x);
+    Scalar whole_y = std::floor(translation.y);
+    Scalar subpixel_x =
+        std::round((translation.x - whole_x) * kSubpixelSteps);
+    Scalar subpixel_y =
+        std::round((translation.y - whole_y) * kSubpixelSteps);
+    if (subpixel_x == kSubpixelSteps) {
+        whole_x++;
+        subpixel_x = 0;
+    }
+    if (subpixel_y == kSubpixelSteps) {
+        whole_y++;
+        subpixel_y = 0;
+    }
+    Matrix local(m[0], m[1], 0, 0,     //
+                 m[4], m[5], 0, 0,     //
+                 0, 0, 1, 0,           //
+                 subpixel_x / kSubpixelSteps, subpixel_y / kSubpixelSteps, 0,
+                 1);
+
+    // One texel of gutter on every side keeps bilinear filtering and pixel
+    // snapping from reading neighbouring masks.
+    Rect bounds = local.TransformBounds(path.GetBounds());
+    int32_t left = static_cast<int32_t>(std::floor(bounds.l)) - 1;
+    int32_t top = static_cast<int32_t>(std::floor(bounds.t)) - 1;
+    int32_t width = static_cast<int32_t>(std::ceil(bounds.r)) + 1 - left;
+    int32_t height = static_cast<int32_t>(std::ceil(bounds.b)) + 1 - top;
+    if (!(width <= kMaxMaskSize && height <= kMaxMaskSize)) {
+        return std::nullopt;
+    }
+
+    std::array<Scalar, 6> transform_key = {m[0], m[1], m[4], m[5],
+                                           subpixel_x, subpixel_y};
+    uint64_t key = path.GetHash();
+    key = HashCombine(key, static_cast<uint64_t>(fill_rule));
+    for (Scalar value : transform_key) {
+        key = HashCombine(key, FloatBits(value));
+    }
+
+    const Entry *entry = nullptr;
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        if (!it->second.Matches(path, fill_rule, /*distance_field=*/false,
+                                transform_key)) {
+            stats_.rejected++;
+            return std::nullopt;
+        }
+        entry = &it->second;
+        stats_.hits++;
+    } else {
+        Entry created;
+        if (!Allocate(width, height, created)) {
+            stats_.rejected++;
+            return std::nullopt;
+        }
+        created.offset_x = left;
+        created.offset_y = top;
+        created.path_hash = path.GetHash();
+        created.path_bounds = path.GetBounds();
+        created.fill_rule = fill_rule;
+        created.transform_key = transform_key;
+
+        Path mask_path =
+            TransformPath(path, Matrix::MakeTranslate(-left, -top) * local);
+        Write(created,
+              RasterizePath(mask_path, ISize(width, height), fill_rule));
+
+        pages_[created.page].keys.push_back(key);
+        entry = &entries_.emplace(key, std::move(created)).first->second;
+        stats_.misses++;
+    }
+    pages_[entry->page].last_used_frame = frame_;
+
+    Scalar device_l = whole_x + entry->offset_x;
+    Scalar device_t = whole_y + entry->offset_y;
+    return AtlasQuad{
+        .device = Rect::MakeLTRB(device_l, device_t, device_l + entry->width,
+                                 device_t + entry->height),
+        .texels = Rect::MakeLTRB(entry->u, entry->v, entry->u + entry->width,
+                                 entry->v + entry->height),
+    };
+}
+
+std::optional<AtlasQuad>
+CoverageAtlas::FindOrGenerateDistanceField(const Path &path,
+                                           const Matrix &transform,
+                                           FillRule fill_rule) {
+    const Scalar *m = transform.GetStorage();
+    if (m[1] != 0 || m[4] != 0 || m[3] != 0 || m[7] != 0 || m[15] != 1) {
+        return std::nullopt;
+    }
+    Rect bounds = path.GetBounds();
+    Rect device_bounds = transform.TransformBounds(bounds);
+    Scalar device_size =
+        std::max(device_bounds.GetWidth(), device_bounds.GetHeight());
+    if (!(device_size >= kMinDistanceFieldSize &&
+          device_size <= kMaxDistanceFieldSize)) {
+        return std::nullopt;
+    }
+
+    // Distinguish fields from masks of the same path drawn with an identity
+    // transform.
+    static constexpr uint64_t kDistanceFieldTag = 0x5df;
+    uint64_t key = path.GetHash();
+    key = HashCombine(key, static_cast<uint64_t>(fill_rule));
+    key = HashCombine(key, kDistanceFieldTag);
+
+    const Entry *entry = nullptr;
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        if (!it->second.Matches(path, fill_rule, /*distance_field=*/true,
+                                /*transform_key=*/{})) {
+            stats_.rejected++;
+            return std::nullopt;
+        }
+        entry = &it->second;
+        stats_.hits++;
+    } else {
+        Entry created;
+        Scalar texels_per_unit =
+            kDistanceFieldResolution /
+            std::max(bounds.GetWidth(), bounds.GetHeight());
+        int32_t width =
+            static_cast<int32_t>(std::ceil(bounds.GetWidth() * texels_per_unit +
+                                           2 * kDistanceFieldSpread));
+        int32_t height = static_cast<int32_t>(std::ceil(
+            bounds.GetHeight() * texels_per_unit + 2 * kDistanceFieldSpread));
+        if (!Allocate(width, height, created)) {
+            stats_.rejected++;
+            return std::nullopt;
+        }
+        Scalar spread_units = kDistanceFieldSpread / texels_per_unit;
+        created.field_bounds = Rect::MakeLTRB(
+            bounds.l - spread_units, bounds.t - spread_units,
+            bounds.l - spread_units + width / texels_per_unit,
+            bounds.t - spread_units + height / texels_per_unit);
+
+        Path field_path = TransformPath(
+            path, Matrix::MakeTranslate(kDistanceFieldSpread,
+                                        kDistanceFieldSpread) *
+                      Matrix::MakeScale(texels_per_unit, texels_per_unit) *
+                      Matrix::MakeTranslate(-bounds.l, -bounds.t));
+        Write(created, GenerateDistanceField(
+                         field_path, ISize(width, height),
+                         kDistanceFieldSpread, fill_rule,
+                         kMaxDistanceFieldSize / kDistanceFieldResolution));
+
+        created.path_hash = path.GetHash();
+        created.path_bounds = path.GetBounds();
+        created.fill_rule = fill_rule;
+        created.distance_field = true;
+
+        pages_[created.page].keys.push_back(key);
+        entry = &entries_.emplace(key, std::move(created)).first->second;
+        stats_.misses++;
+    }
+    pages_[entry->page].last_used_frame = frame_;
+
+    Rect device = transform.TransformBounds(entry->field_bounds);
+    Scalar pixels_per_texel = device.GetWidth() / entry->width;
+    return AtlasQuad{
+        .device = device,
+        .texels = Rect::MakeLTRB(entry->u, entry->v, entry->u + entry->width,
+                                 entry->v + entry->height),
+        .distance_range = 2 * kDistanceFieldSpread * pixels_per_texel,
+    };
+}
+
+void CoverageAtlas::Write(const Entry &entry,
+                          const std::vector<uint8_t> &mask) {
+    for (int32_t row = 0; row < entry.height; row++) {
+        std::memcpy(&pixels_[(entry.v + row) * size_ + entry.u],
+                    &mask[row * entry.width], entry.width);
+    }
+    Rect written = Rect::MakeLTRB(entry.u, entry.v, entry.u + entry.width,
+                                  entry.v + entry.height);
+    dirty_ = dirty_.GetWidth() > 0 ? dirty_.Union(written) : written;
+}
+
+bool CoverageAtlas::Allocate(int32_t width, int32_t height, Entry &entry) {
+    int32_t x = 0;
+    int32_t y = 0;
+    size_t page = 0;
+    for (; page < pages_.size(); page++) {
+        if (pages_[page].packer.Allocate(width, height, x, y)) {
+            break;
+        }
+    }
+    if (page == pages_.size()) {
+        size_t victim = pages_.size();
+        for (size_t i = 0; i < pages_.size(); i++) {
+            if (pages_[i].last_used_frame < frame_ &&
+                (victim == pages_.size() ||
+                 pages_[i].last_used_frame <
+                     pages_[victim].last_used_frame)) {
+                victim = i;
+            }
+        }
+        if (victim == pages_.size()) {
+            return false;
+        }
+        EvictPage(victim);
+        page = victim;
+        if (!pages_[page].packer.Allocate(width, height, x, y)) {
+            return false;
+        }
+    }
+    entry.u = static_cast<int32_t>(page % pages_per_row_) * page_size_ + x;
+    entry.v = static_cast<int32_t>(page / pages_per_row_) * page_size_ + y;
+    entry.width = width;
+    entry.height = height;
+    entry.page = page;
+    return true;
+}
+
+void CoverageAtlas::EvictPage(size_t page) {
+    for (uint64_t key : pages_[page].keys) {
+        entries_.erase(key);
+    }
+    pages_[page].keys.clear();
+    pages_[page].packer.Reset();
+    stats_.evicted_pages++;
+}
+
+} // namespace flatland
@@ -0,0 +1,207 @@
+#ifndef GEOM_ATLAS
+#define GEOM_ATLAS
+
+#include <array>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "basic.hpp"
+#include "bezier.hpp"
+#include "paint.hpp"
+
+namespace flatland {
+
+/// @brief Packs rectangles into a fixed size region as rows of shelves.
+///
+/// Each shelf is as tall as the first rectangle placed in it, rounded up to
+/// a small multiple so that similarly sized rectangles share shelves.
+/// Rectangles are placed left to right on the shortest shelf they fit in, and
+/// a new shelf is opened below the last one when none fit.
+class ShelfPacker {
+  public:
+    ShelfPacker(int32_t width, int32_t height);
+
+    /// @brief Reserve a [width] x [height] region.
+    ///
+    /// @returns false if there is no room, otherwise writes the top left of
+    /// the region to [x] and [y].
+    bool Allocate(int32_t width, int32_t height, int32_t &x, int32_t &y);
+
+    /// @brief Release every region.
+    void Reset();
+
+  private:
+    struct Shelf {
+        int32_t y;
+        int32_t height;
+        int32_t x;
+    };
+
+    int32_t width_;
+    int32_t height_;
+    std::vector<Shelf> shelves_;
+};
+
+/// @brief Where to draw a cached coverage mask.
+struct AtlasQuad {
+    /// Device space bounds of the mask, aligned to whole pixels.
+    Rect device;
+    /// Bounds of the mask in the atlas, in texels.
+    Rect texels;
+    /// For distance fields, the device pixels spanned by the full range of
+    /// encoded distances. Zero for coverage masks.
+    Scalar distance_range = 0;
+};
+
+/// @brief Counters for [CoverageAtlas] lookups.
+struct CoverageAtlasStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    /// Lookups that could not be placed because every page was in use by the
+    /// current frame, or because their key is held by a different path.
+    size_t rejected = 0;
+    size_t evicted_pages = 0;
+};
+
+/// @brief A cache of small anti-aliased path masks, stored in a single 8-bit
+/// coverage texture.
+///
+/// Masks are keyed by the path contents, the fill rule, the linear part of
+/// the transform and the fractional part of its translation quantized to a
+/// quarter pixel, so the same path drawn at any integer offset reuses a
+/// single mask. Masks are rasterized on the CPU with [RasterizePath] with a
+/// one texel gutter.
+///
+/// Paths may instead be stored as signed distance fields with
+/// [FindOrGenerateDistanceField]. These are keyed by the path and fill rule
+/// only, so a single entry serves every scale within a range.
+///
+/// The atlas is split into square pages, each packed with a [ShelfPacker].
+/// When no page has room, the least recently used page that was not used by
+/// the current frame is cleared and its masks are dropped. Evicting whole
+/// pages keeps the packers simple and avoids fragmentation.
+class CoverageAtlas {
+  public:
+    CoverageAtlas(int32_t size = 1024, int32_t page_size = 256);
+
+    ~CoverageAtlas() = default;
+
+    /// @brief The largest mask, in pixels, that a path may be drawn with.
+    static constexpr int32_t kMaxMaskSize = 64;
+
+    /// @brief Mark the start of a new frame. Masks looked up by the previous
+    /// frames become eligible for eviction.
+    void BeginFrame();
+
+    /// @brief Find or rasterize the mask of [path] drawn with [transform].
+    ///
+    /// @returns std::nullopt if the transformed path is larger than
+    /// [kMaxMaskSize], [transform] has perspective, or the atlas is full for
+    /// this frame.
+    std::optional<AtlasQuad> FindOrRasterize(const Path &path,
+                                             const Matrix &transform,
+                                             FillRule fill_rule);
+
+    /// @brief The resolution, in texels, of the longer side of a path in its
+    /// distance field, not counting the spread.
+    static constexpr int32_t kDistanceFieldResolution = 32;
+
+    /// @brief The distance, in texels, encoded on either side of an edge.
+    static constexpr Scalar kDistanceFieldSpread = 4;
+
+    /// @brief The range of device sizes, in pixels, that a path may be drawn
+    /// at from a distance field. Larger sizes visibly round corners.
+    static constexpr Scalar kMinDistanceFieldSize = 16;
+    static constexpr Scalar kMaxDistanceFieldSize = 128;
+
+    /// @brief Find or generate the distance field of [path] and place it
+    /// with [transform].
+    ///
+    /// @returns std::nullopt if [transform] rotates, skews or has
+    /// perspective, the transformed path is outside of the supported size
+    /// range, or the atlas is full for this frame.
+    std::optional<AtlasQuad> FindOrGenerateDistanceField(
+        const Path &path, const Matrix &transform, FillRule fill_rule);
+
+    ISize GetSize() const { return ISize(size_, size_); }
+
+    /// @brief Atlas coverage, row major with one byte per texel.
+    const std::vector<uint8_t> &GetPixels() const { return pixels_; }
+
+    /// @brief The region written since the last call to [ClearDirtyRegion],
+    /// or an empty rect if nothing was written.
+    Rect GetDirtyRegion() const { return dirty_; }
+
+    void ClearDirtyRegion() { dirty_ = Rect(); }
+
+    const CoverageAtlasStats &GetStats() const { return stats_; }
+
+  private:
+    struct Entry {
+        /// Top left texel of the mask in the atlas.
+        int32_t u = 0;
+        int32_t v = 0;
+        int32_t width = 0;
+        int32_t height = 0;
+        /// Offset of the top left of the mask from the integer part of the
+        /// transform's translation.
+        int32_t offset_x = 0;
+        int32_t offset_y = 0;
+        /// For distance fields, the region of path space covered by the
+        /// field.
+        Rect field_bounds;
+        size_t page = 0;
+
+        /// The inputs the entry's key was computed from. Different inputs
+        /// can share a key, so these are checked on every hit.
+        size_t path_hash = 0;
+        Rect path_bounds;
+        FillRule fill_rule = FillRule::kNonZero;
+        bool distance_field = false;
+        /// For masks, the linear part of the transform followed by the
+        /// quantized subpixel offset.
+        std::array<Scalar, 6> transform_key = {};
+
+        bool Matches(const Path &path, FillRule other_fill_rule,
+                     bool other_distance_field,
+                     const std::array<Scalar, 6> &other_transform_key) const {
+            return path_hash == path.GetHash() &&
+                   path_bounds == path.GetBounds() &&
+                   fill_rule == other_fill_rule &&
+                   distance_field == other_distance_field &&
+                   transform_key == other_transform_key;
+        }
+    };
+
+    struct Page {
+        ShelfPacker packer;
+        uint64_t last_used_frame = 0;
+        std::vector<uint64_t> keys;
+    };
+
+    int32_t size_;
+    int32_t page_size_;
+    int32_t pages_per_row_;
+    uint64_t frame_ = 1;
+    std::vector<Page> pages_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    std::vector<uint8_t> pixels_;
+    Rect dirty_;
+    CoverageAtlasStats stats_;
+
+    bool Allocate(int32_t width, int32_t height, Entry &entry);
+
+    void EvictPage(size_t page);
+
+    /// @brief Copy a [width] x [height] mask into the texels of [entry].
+    void Write(const Entry &entry, const std::vector<uint8_t> &mask);
+
+    CoverageAtlas(const CoverageAtlas &) = delete;
+    CoverageAtlas(CoverageAtlas &&) = delete;
+    CoverageAtlas &operator=(const CoverageAtlas &) = delete;
+};
+
+} // namespace flatland
+
+#endif // GEOM_ATLAS
@@ -80,11 +80,11 @@ struct Point {
         return Point(std::fmin(x, other.x), std::fmin(y, other.y));
     }
 
-    constexpr bool operator==(const Point &other) {
+    constexpr bool operator==(const Point &other) const {
         return x == other.x && y == other.y;
     }
 
-    constexpr bool operator!=(const Point &other) {
+    constexpr bool operator!=(const Point &other) const {
         return x != other.x || y != other.y;
     }
 
@@ -140,6 +140,14 @@ struct Rect {
         return Rect(l - other.l, t - other.t, r - other.r, b - other.b);
     }
 
+    constexpr bool operator==(const Rect &other) const {
+        return l == other.l && t == other.t && r == other.r && b == other.b;
+    }
+
+    constexpr bool operator!=(const Rect &other) const {
+        return !(*this == other);
+    }
+
     constexpr Scalar GetWidth() const { return r - l; }
 
     constexpr Scalar GetHeight() const { return b - t; }
@@ -216,6 +224,17 @@ struct Matrix {
 
     constexpr Point GetTranslation() const { return Point(m[12], m[13]); }
 
+    /// @brief The length of the longer of the transformed X and Y basis
+    /// vectors, i.e. the maximum scale applied by this matrix.
+    Scalar GetMaxBasisLength() const {
+        return std::sqrt(std::max(m[0] * m[0] + m[1] * m[1],
+                                  m[4] * m[4] + m[5] * m[5]));
+    }
+
+    /// @brief The determinant of the 2D linear part of this matrix, i.e. the
+    /// factor by which areas are scaled.
+    constexpr Scalar GetDeterminant() const { return m[0] * m[5] - m[1] * m[4]; }
+
     static constexpr Matrix MakeScale(Scalar sx, Scalar sy = 1, Scalar sz = 1) {
         return Matrix(sx, 0, 0, 0, //
                       0, sy, 0, 0, //
@@ -310,11 +329,11 @@ struct Color {
 
     constexpr bool is_opaque() const { return a >= 1.0; }
     
-    bool operator==(const Color& other) {
+    bool operator==(const Color& other) const {
         return r == other.r && g == other.g && b == other.b && a == other.a;
     }
     
-    bool operator!=(const Color& other) {
+    bool operator!=(const Color& other) const {
         return r != other.r || g != other.g || b != other.b || a != other.a;
     }
 
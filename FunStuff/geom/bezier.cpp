@@ -1,10 +1,31 @@
 #include "bezier.hpp"
 
 #include "convexicator.hpp"
+#include <array>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
 namespace flatland {
 
+namespace {
+
+// FNV-1a over the raw segment data.
+size_t ComputeSegmentHash(const std::vector<Point> &segments) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(segments.data());
+    for (size_t i = 0; i < segments.size() * sizeof(Point); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return static_cast<size_t>(hash);
+}
+
+// The number of Points each SegmentType takes in the segment data, including
+// the one holding the type.
+constexpr std::array<int, 5> kSegmentSizes = {2, 3, 4, 5, 1};
+
+} // namespace
 
 Point SolveQuad(Scalar t, const Point &p0, const Point &cp,
                        const Point &p1) {
@@ -32,8 +53,13 @@ Point SolveCubic(Scalar t, const Point &p0, const Point &cp1,
 Path::Path(std::vector<Point> segments, Rect bounds)
     : segments_(std::move(segments)), bounds_(bounds) {}
 
+Path::Path(Path &&path) noexcept
+    : segments_(std::move(path.segments_)), last_point_(path.last_point_),
+      is_convex_(path.is_convex_),
+      hash_(path.hash_.exchange(0, std::memory_order_relaxed)),
+      bounds_(path.bounds_) {}
+
 void Path::iterate(const Path::PathCallback &cb) const {
-    constexpr std::array<int, 5> type_offsets = {2, 3, 4, 5, 1};
     size_t offset = 0;
     while (offset < segments_.size()) {
         int ix = std::round((segments_[offset].x));
@@ -41,7 +67,7 @@ void Path::iterate(const Path::PathCallback &cb) const {
         if (!cb(type, segments_.data() + offset + 1)) {
             return;
         }
-        offset += type_offsets[ix];
+        offset += kSegmentSizes[ix];
     }
 }
 
@@ -51,6 +77,84 @@ Rect Path::GetBounds() const { return bounds_; }
 
 bool Path::IsConvex() const { return is_convex_; }
 
+bool Path::IsRect() const {
+    if (!(bounds_.l < bounds_.r && bounds_.t < bounds_.b)) {
+        return false;
+    }
+    // Every line must be axis aligned between corners of the bounds, and the
+    // contour must visit four distinct corners, ending where it started. Any
+    // such contour is the rectangle in one winding or the other.
+    auto is_corner = [&](const Point &p) {
+        return (p.x == bounds_.l || p.x == bounds_.r) &&
+               (p.y == bounds_.t || p.y == bounds_.b);
+    };
+    std::array<Point, 4> corners;
+    size_t corner_count = 0;
+    Point start;
+    int contours = 0;
+    bool is_rect = true;
+    // The segments are walked directly rather than with [iterate], whose
+    // std::function would allocate to hold this loop's state, as clips test
+    // every path.
+    for (size_t offset = 0; is_rect && offset < segments_.size();) {
+        int ix = std::round(segments_[offset].x);
+        const Point *data = segments_.data() + offset + 1;
+        offset += kSegmentSizes[ix];
+        switch (static_cast<SegmentType>(ix)) {
+        case SegmentType::kStart:
+            is_rect = ++contours == 1 && is_corner(data[0]);
+            start = data[0];
+            break;
+        case SegmentType::kLinear:
+            if (data[0] == data[1]) {
+                break;
+            }
+            if (corner_count == 4 || !is_corner(data[1]) ||
+                (data[0].x != data[1].x && data[0].y != data[1].y)) {
+                is_rect = false;
+                break;
+            }
+            for (size_t i = 0; i < corner_count; i++) {
+                is_rect = is_rect && corners[i] != data[1];
+            }
+            corners[corner_count++] = data[1];
+            break;
+        case SegmentType::kQuad:
+        case SegmentType::kCubic:
+            is_rect = false;
+            break;
+        case SegmentType::kClose:
+            break;
+        }
+    }
+    return is_rect && corner_count == 4 && corners[3] == start;
+}
+
+size_t Path::GetHash() const {
+    // Racing threads compute the same hash, so either store wins.
+    size_t hash = hash_.load(std::memory_order_relaxed);
+    if (hash == 0) {
+        hash = ComputeSegmentHash(segments_);
+        hash_.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+bool Path::HasSameSegments(const Path &other) const {
+    return segments_.size() == other.segments_.size() &&
+           ::memcmp(segments_.data(), other.segments_.data(),
+                    segments_.size() * sizeof(Point)) == 0;
+}
+
+Path Path::Clone() const {
+    Path result(segments_, bounds_);
+    result.last_point_ = last_point_;
+    result.is_convex_ = is_convex_;
+    result.hash_.store(hash_.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    return result;
+}
+
 // PathBuilder implementation.
 
 void PathBuilder::moveTo(Scalar x, Scalar y) {
@@ -1,6 +1,7 @@
 #ifndef GEOM_BEZIER
 #define GEOM_BEZIER
 
+#include <atomic>
 #include <functional>
 #include <vector>
 
@@ -45,7 +46,7 @@ class Path {
   public:
     ~Path() = default;
 
-    Path(Path &&path) = default;
+    Path(Path &&path) noexcept;
 
     /// Note: return false to terminate iteration.
     using PathCallback = std::function<bool(SegmentType, const Point *data)>;
@@ -61,6 +62,28 @@ class Path {
     bool Empty() const;
     
     bool IsConvex() const;
+
+    /// @brief Whether this path is a single contour tracing the edges of its
+    /// non-empty bounds, such as one built by [PathBuilder::AddRect].
+    bool IsRect() const;
+
+    /// @brief A hash of the segment data of this path.
+    ///
+    /// Two paths with identical segments will have the same hash. This is
+    /// suitable for use as a cache key for derived data such as meshes, but
+    /// different paths can share a hash, so a cache hit should be checked
+    /// with [HasSameSegments].
+    ///
+    /// The hash is computed on first use and kept.
+    size_t GetHash() const;
+
+    /// @brief Whether [other] has exactly the segments of this path.
+    bool HasSameSegments(const Path &other) const;
+
+    /// @brief A copy of this path.
+    ///
+    /// Paths can only be copied explicitly, as they may be large.
+    Path Clone() const;
     
     Point GetLastPoint() const {
         return last_point_;
@@ -77,6 +100,9 @@ class Path {
     std::vector<Point> segments_;
     Point last_point_;
     bool is_convex_ = false;
+    // Zero until [GetHash] is first called. Paths may be drawn from several
+    // recording threads at once, so this is atomic.
+    mutable std::atomic<size_t> hash_ = 0;
     Rect bounds_;
 };
 
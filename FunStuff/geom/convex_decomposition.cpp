@@ -0,0 +1,309 @@
+#include "convex_decomposition.hpp"
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <unordered_map>
+
+#include "wangs_formula.hpp"
+
+namespace flatland {
+
+namespace {
+
+// Ear clipping and the simplicity check are both quadratic in the number of
+// points. Larger contours are cheaper to stencil than to decompose.
+static constexpr size_t kMaxDecompositionPoints = 512;
+
+uint32_t EdgeKey(uint16_t from, uint16_t to) {
+    return static_cast<uint32_t>(from) << 16 | to;
+}
+
+bool FlattenSingleContour(const Path &path, Scalar scale_factor,
+                          std::vector<Point> &points) {
+    int contour_count = 0;
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            contour_count++;
+            points.push_back(data[0]);
+            break;
+        case SegmentType::kLinear:
+            points.push_back(data[1]);
+            break;
+        case SegmentType::kQuad: {
+            Scalar divisions = std::ceil(ComputeQuadradicSubdivisions(
+                scale_factor, data[0], data[1], data[2]));
+            for (int i = 1; i < divisions; i++) {
+                points.push_back(
+                    SolveQuad(i / divisions, data[0], data[1], data[2]));
+            }
+            points.push_back(data[2]);
+            break;
+        }
+        case SegmentType::kCubic: {
+            Scalar divisions = std::ceil(ComputeCubicSubdivisions(
+                scale_factor, data[0], data[1], data[2], data[3]));
+            for (int i = 1; i < divisions; i++) {
+                points.push_back(SolveCubic(i / divisions, data[0], data[1],
+                                            data[2], data[3]));
+            }
+            points.push_back(data[3]);
+            break;
+        }
+        case SegmentType::kClose:
+            break;
+        }
+        return contour_count <= 1 && points.size() <= kMaxDecompositionPoints;
+    });
+    if (contour_count != 1 || points.size() > kMaxDecompositionPoints) {
+        return false;
+    }
+
+    // Drop repeated points (including the closing point, which duplicates the
+    // contour start) and collinear points. Both produce zero area ears.
+    std::vector<Point> cleaned;
+    cleaned.reserve(points.size());
+    for (const Point &pt : points) {
+        if (cleaned.empty() || cleaned.back() != pt) {
+            cleaned.push_back(pt);
+        }
+    }
+    while (cleaned.size() > 1 && cleaned.front() == cleaned.back()) {
+        cleaned.pop_back();
+    }
+    points.clear();
+    for (size_t i = 0; i < cleaned.size(); i++) {
+        const Point &prev = cleaned[(i + cleaned.size() - 1) % cleaned.size()];
+        const Point &cur = cleaned[i];
+        const Point &next = cleaned[(i + 1) % cleaned.size()];
+        if ((cur - prev).Cross(next - cur) != 0) {
+            points.push_back(cur);
+        }
+    }
+    return points.size() >= 3;
+}
+
+Scalar SignedArea(const std::vector<Point> &points) {
+    Scalar area = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+        area += points[i].Cross(points[(i + 1) % points.size()]);
+    }
+    return area / 2;
+}
+
+int Orientation(const Point &a, const Point &b, const Point &c) {
+    Scalar cross = (b - a).Cross(c - a);
+    return (cross > 0) - (cross < 0);
+}
+
+bool OnSegment(const Point &a, const Point &b, const Point &p) {
+    return std::min(a.x, b.x) <= p.x && p.x <= std::max(a.x, b.x) &&
+           std::min(a.y, b.y) <= p.y && p.y <= std::max(a.y, b.y);
+}
+
+bool SegmentsIntersect(const Point &a, const Point &b, const Point &c,
+                       const Point &d) {
+    int o1 = Orientation(a, b, c);
+    int o2 = Orientation(a, b, d);
+    int o3 = Orientation(c, d, a);
+    int o4 = Orientation(c, d, b);
+    if (o1 != o2 && o3 != o4 && o1 != 0 && o2 != 0 && o3 != 0 && o4 != 0) {
+        return true;
+    }
+    return (o1 == 0 && OnSegment(a, b, c)) || (o2 == 0 && OnSegment(a, b, d)) ||
+           (o3 == 0 && OnSegment(c, d, a)) || (o4 == 0 && OnSegment(c, d, b));
+}
+
+// O(n^2) check that no two non-adjacent edges touch.
+bool IsSimplePolygon(const std::vector<Point> &points) {
+    size_t n = points.size();
+    for (size_t i = 0; i < n; i++) {
+        const Point &a = points[i];
+        const Point &b = points[(i + 1) % n];
+        Rect ab = Rect::MakePointBounds(a, b);
+        for (size_t j = i + 2; j < n; j++) {
+            if (i == 0 && j == n - 1) {
+                continue;
+            }
+            const Point &c = points[j];
+            const Point &d = points[(j + 1) % n];
+            Rect cd = Rect::MakePointBounds(c, d);
+            if (ab.r < cd.l || cd.r < ab.l || ab.b < cd.t || cd.b < ab.t) {
+                continue;
+            }
+            if (SegmentsIntersect(a, b, c, d)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Inclusive point in triangle test for a counter-clockwise triangle.
+bool ContainsPoint(const Point &a, const Point &b, const Point &c,
+                   const Point &p) {
+    return (b - a).Cross(p - a) >= 0 && (c - b).Cross(p - b) >= 0 &&
+           (a - c).Cross(p - c) >= 0;
+}
+
+// Ear clipping. [points] must be counter-clockwise (positive signed area).
+bool EarClip(const std::vector<Point> &points,
+             std::vector<std::array<uint16_t, 3>> &triangles) {
+    std::vector<uint16_t> remaining(points.size());
+    std::iota(remaining.begin(), remaining.end(), 0);
+
+    while (remaining.size() > 3) {
+        size_t m = remaining.size();
+        bool found_ear = false;
+        for (size_t i = 0; i < m; i++) {
+            uint16_t prev = remaining[(i + m - 1) % m];
+            uint16_t cur = remaining[i];
+            uint16_t next = remaining[(i + 1) % m];
+            const Point &a = points[prev];
+            const Point &b = points[cur];
+            const Point &c = points[next];
+            // Reflex or degenerate vertex, not an ear.
+            if ((b - a).Cross(c - b) <= 0) {
+                continue;
+            }
+            bool is_ear = true;
+            for (uint16_t other : remaining) {
+                if (other == prev || other == cur || other == next) {
+                    continue;
+                }
+                if (ContainsPoint(a, b, c, points[other])) {
+                    is_ear = false;
+                    break;
+                }
+            }
+            if (!is_ear) {
+                continue;
+            }
+            triangles.push_back({prev, cur, next});
+            remaining.erase(remaining.begin() + i);
+            found_ear = true;
+            break;
+        }
+        if (!found_ear) {
+            return false;
+        }
+    }
+    triangles.push_back({remaining[0], remaining[1], remaining[2]});
+    return true;
+}
+
+// Hertel-Mehlhorn: starting from a triangulation, remove each diagonal whose
+// removal leaves both endpoints convex.
+std::vector<std::vector<uint16_t>>
+MergeConvexPieces(const std::vector<Point> &points,
+                  const std::vector<std::array<uint16_t, 3>> &triangles) {
+    std::vector<std::vector<uint16_t>> pieces;
+    std::unordered_map<uint32_t, size_t> edge_owner;
+    for (const auto &tri : triangles) {
+        for (int i = 0; i < 3; i++) {
+            edge_owner[EdgeKey(tri[i], tri[(i + 1) % 3])] = pieces.size();
+        }
+        pieces.push_back({tri[0], tri[1], tri[2]});
+    }
+
+    std::vector<std::pair<uint16_t, uint16_t>> diagonals;
+    for (const auto &tri : triangles) {
+        for (int i = 0; i < 3; i++) {
+            uint16_t a = tri[i];
+            uint16_t b = tri[(i + 1) % 3];
+            if (a < b && edge_owner.count(EdgeKey(b, a))) {
+                diagonals.emplace_back(a, b);
+            }
+        }
+    }
+
+    auto is_convex_at = [&](const std::vector<uint16_t> &poly, size_t i) {
+        const Point &prev = points[poly[(i + poly.size() - 1) % poly.size()]];
+        const Point &cur = points[poly[i]];
+        const Point &next = points[poly[(i + 1) % poly.size()]];
+        return (cur - prev).Cross(next - cur) >= 0;
+    };
+
+    std::vector<uint16_t> merged;
+    for (auto [a, b] : diagonals) {
+        size_t p1 = edge_owner[EdgeKey(a, b)];
+        size_t p2 = edge_owner[EdgeKey(b, a)];
+        if (p1 == p2) {
+            continue;
+        }
+        const std::vector<uint16_t> &first = pieces[p1];
+        const std::vector<uint16_t> &second = pieces[p2];
+
+        // Walk [first] from b around to a, then [second] from a around to b
+        // skipping the shared endpoints.
+        merged.clear();
+        size_t start =
+            std::find(first.begin(), first.end(), b) - first.begin();
+        for (size_t i = 0; i < first.size(); i++) {
+            merged.push_back(first[(start + i) % first.size()]);
+        }
+        size_t a_index = merged.size() - 1;
+        start = std::find(second.begin(), second.end(), a) - second.begin();
+        for (size_t i = 1; i + 1 < second.size(); i++) {
+            merged.push_back(second[(start + i) % second.size()]);
+        }
+        if (!is_convex_at(merged, 0) || !is_convex_at(merged, a_index)) {
+            continue;
+        }
+
+        edge_owner.erase(EdgeKey(a, b));
+        edge_owner.erase(EdgeKey(b, a));
+        for (size_t i = 0; i < merged.size(); i++) {
+            edge_owner[EdgeKey(merged[i], merged[(i + 1) % merged.size()])] =
+                p1;
+        }
+        pieces[p1] = merged;
+        pieces[p2].clear();
+    }
+    return pieces;
+}
+
+} // namespace
+
+bool ComputeConvexDecomposition(const Path &path, Scalar scale_factor,
+                                ConvexDecomposition &result) {
+    result.points.clear();
+    result.indices.clear();
+    result.piece_count = 0;
+
+    std::vector<Point> points;
+    if (!FlattenSingleContour(path, scale_factor, points) ||
+        !IsSimplePolygon(points)) {
+        return false;
+    }
+    Scalar area = SignedArea(points);
+    if (area == 0) {
+        return false;
+    }
+    if (area < 0) {
+        std::reverse(points.begin(), points.end());
+    }
+
+    std::vector<std::array<uint16_t, 3>> triangles;
+    if (!EarClip(points, triangles)) {
+        return false;
+    }
+
+    // Each convex piece is written as a fan from its first vertex.
+    for (const auto &piece : MergeConvexPieces(points, triangles)) {
+        if (piece.empty()) {
+            continue;
+        }
+        for (size_t i = 1; i + 1 < piece.size(); i++) {
+            result.indices.push_back(piece[0]);
+            result.indices.push_back(piece[i]);
+            result.indices.push_back(piece[i + 1]);
+        }
+        result.piece_count++;
+    }
+    result.points = std::move(points);
+    return true;
+}
+
+} // namespace flatland
@@ -0,0 +1,36 @@
+#ifndef GEOM_CONVEX_DECOMPOSITION
+#define GEOM_CONVEX_DECOMPOSITION
+
+#include <vector>
+
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// @brief A set of non-overlapping convex polygons that exactly cover a
+/// simple polygon, stored as a triangle list.
+///
+/// Each convex piece is emitted as a triangle fan, so the triangles do not
+/// overlap and the mesh can be drawn without stenciling.
+struct ConvexDecomposition {
+    std::vector<Point> points;
+    std::vector<uint16_t> indices;
+    size_t piece_count = 0;
+};
+
+/// @brief Decompose the single contour of [path] into convex pieces.
+///
+/// The contour is flattened with [scale_factor], triangulated by ear clipping
+/// and then the triangles are merged into larger convex pieces by removing
+/// inessential diagonals (Hertel-Mehlhorn). This produces at most four times
+/// the optimal number of pieces.
+///
+/// @returns false if the path has more than one contour, is self
+/// intersecting, or is too large to decompose cheaply. In that case the path
+/// must be drawn with stencil-then-cover.
+bool ComputeConvexDecomposition(const Path &path, Scalar scale_factor,
+                                ConvexDecomposition &result);
+
+} // namespace flatland
+
+#endif // GEOM_CONVEX_DECOMPOSITION
@@ -0,0 +1,55 @@
+#ifndef GEOM_FLOAT4
+#define GEOM_FLOAT4
+
+#include <cstring>
+#include <stdint.h>
+
+#include "basic.hpp"
+
+namespace flatland {
+
+/// @brief Four Scalar lanes, using the GCC/Clang vector extension.
+///
+/// This is one SSE register on x86-64 and one NEON register on arm64, so it
+/// is passed the same way whatever instruction set extensions are enabled,
+/// and keeps the geometry code free of simd/Metal headers.
+using Float4 = Scalar __attribute__((vector_size(4 * sizeof(Scalar))));
+
+/// @brief The per lane mask produced by comparing two [Float4] values. Each
+/// lane is either all zeros or all ones.
+using Mask4 = int32_t __attribute__((vector_size(4 * sizeof(int32_t))));
+
+inline Float4 Load4(const Scalar *data) {
+    Float4 result;
+    ::memcpy(&result, data, sizeof(Float4));
+    return result;
+}
+
+inline void Store4(Scalar *data, Float4 value) {
+    ::memcpy(data, &value, sizeof(Float4));
+}
+
+inline Float4 Splat4(Scalar value) { return Float4{} + value; }
+
+/// @brief Per lane [mask] ? [a] : [b].
+inline Float4 Select4(Mask4 mask, Float4 a, Float4 b) {
+    return reinterpret_cast<Float4>((reinterpret_cast<Mask4>(a) & mask) |
+                                    (reinterpret_cast<Mask4>(b) & ~mask));
+}
+
+inline Float4 Abs4(Float4 value) {
+    return reinterpret_cast<Float4>(reinterpret_cast<Mask4>(value) &
+                                    0x7fffffff);
+}
+
+inline Float4 Min4(Float4 a, Float4 b) { return Select4(a < b, a, b); }
+
+/// @brief Truncate toward zero.
+inline Float4 Trunc4(Float4 value) {
+    return __builtin_convertvector(__builtin_convertvector(value, Mask4),
+                                   Float4);
+}
+
+} // namespace flatland
+
+#endif // GEOM_FLOAT4
@@ -0,0 +1,382 @@
+#include "font.hpp"
+
+#include <cstring>
+#include <optional>
+
+namespace flatland {
+
+namespace {
+
+// Composite glyphs may reference other composites. Deeper nesting than this
+// is treated as malformed, which also guards against cycles.
+static constexpr int kMaxCompositeDepth = 8;
+
+// Simple glyph flags.
+static constexpr uint8_t kOnCurve = 0x01;
+static constexpr uint8_t kXShort = 0x02;
+static constexpr uint8_t kYShort = 0x04;
+static constexpr uint8_t kRepeat = 0x08;
+static constexpr uint8_t kXSameOrPositive = 0x10;
+static constexpr uint8_t kYSameOrPositive = 0x20;
+
+// Composite glyph flags.
+static constexpr uint16_t kArgsAreWords = 0x0001;
+static constexpr uint16_t kArgsAreXYValues = 0x0002;
+static constexpr uint16_t kHaveScale = 0x0008;
+static constexpr uint16_t kMoreComponents = 0x0020;
+static constexpr uint16_t kHaveXYScale = 0x0040;
+static constexpr uint16_t kHaveTwoByTwo = 0x0080;
+
+// Big endian reads that return zero past the end of [data].
+uint8_t ReadU8(const std::vector<uint8_t> &data, size_t offset) {
+    return offset < data.size() ? data[offset] : 0;
+}
+
+uint16_t ReadU16(const std::vector<uint8_t> &data, size_t offset) {
+    return static_cast<uint16_t>(ReadU8(data, offset) << 8 |
+                                 ReadU8(data, offset + 1));
+}
+
+int16_t ReadI16(const std::vector<uint8_t> &data, size_t offset) {
+    return static_cast<int16_t>(ReadU16(data, offset));
+}
+
+uint32_t ReadU32(const std::vector<uint8_t> &data, size_t offset) {
+    return static_cast<uint32_t>(ReadU16(data, offset)) << 16 |
+           ReadU16(data, offset + 2);
+}
+
+Scalar ReadF2Dot14(const std::vector<uint8_t> &data, size_t offset) {
+    return ReadI16(data, offset) / 16384.0f;
+}
+
+uint32_t MakeTag(const char tag[5]) {
+    return static_cast<uint32_t>(tag[0]) << 24 |
+           static_cast<uint32_t>(tag[1]) << 16 |
+           static_cast<uint32_t>(tag[2]) << 8 | static_cast<uint32_t>(tag[3]);
+}
+
+} // namespace
+
+std::unique_ptr<Font> Font::Make(std::vector<uint8_t> data) {
+    std::unique_ptr<Font> font(new Font(std::move(data)));
+    if (!font->Parse()) {
+        return nullptr;
+    }
+    return font;
+}
+
+Font::Font(std::vector<uint8_t> data) : data_(std::move(data)) {}
+
+bool Font::Parse() {
+    size_t head = 0, maxp = 0, hhea = 0, cmap = 0;
+    size_t table_count = ReadU16(data_, 4);
+    for (size_t i = 0; i < table_count; i++) {
+        size_t record = 12 + i * 16;
+        uint32_t tag = ReadU32(data_, record);
+        size_t offset = ReadU32(data_, record + 8);
+        size_t length = ReadU32(data_, record + 12);
+        if (offset + length > data_.size()) {
+            return false;
+        }
+        if (tag == MakeTag("head")) {
+            head = offset;
+        } else if (tag == MakeTag("maxp")) {
+            maxp = offset;
+        } else if (tag == MakeTag("hhea")) {
+            hhea = offset;
+        } else if (tag == MakeTag("hmtx")) {
+            hmtx_offset_ = offset;
+        } else if (tag == MakeTag("cmap")) {
+            cmap = offset;
+        } else if (tag == MakeTag("loca")) {
+            loca_offset_ = offset;
+        } else if (tag == MakeTag("glyf")) {
+            glyf_offset_ = offset;
+            glyf_length_ = length;
+        }
+    }
+    if (!head || !maxp || !hhea || !hmtx_offset_ || !cmap || !loca_offset_ ||
+        !glyf_offset_) {
+        return false;
+    }
+
+    units_per_em_ = ReadU16(data_, head + 18);
+    long_loca_ = ReadI16(data_, head + 50) != 0;
+    glyph_count_ = ReadU16(data_, maxp + 4);
+    h_metric_count_ = ReadU16(data_, hhea + 34);
+    if (units_per_em_ == 0 || h_metric_count_ == 0) {
+        return false;
+    }
+
+    // Prefer a full Unicode subtable, then a BMP one.
+    size_t subtable_count = ReadU16(data_, cmap + 2);
+    for (size_t i = 0; i < subtable_count; i++) {
+        size_t record = cmap + 4 + i * 8;
+        uint16_t platform = ReadU16(data_, record);
+        uint16_t encoding = ReadU16(data_, record + 2);
+        size_t offset = cmap + ReadU32(data_, record + 4);
+        uint16_t format = ReadU16(data_, offset);
+        bool is_unicode =
+            platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+        if (!is_unicode || (format != 4 && format != 12)) {
+            continue;
+        }
+        if (cmap_format_ != 12) {
+            cmap_offset_ = offset;
+            cmap_format_ = format;
+        }
+    }
+    return cmap_format_ != 0;
+}
+
+uint16_t Font::GetGlyphId(uint32_t codepoint) const {
+    if (cmap_format_ == 12) {
+        size_t group_count = ReadU32(data_, cmap_offset_ + 12);
+        size_t lo = 0;
+        size_t hi = group_count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            size_t group = cmap_offset_ + 16 + mid * 12;
+            uint32_t start = ReadU32(data_, group);
+            uint32_t end = ReadU32(data_, group + 4);
+            if (codepoint < start) {
+                hi = mid;
+            } else if (codepoint > end) {
+                lo = mid + 1;
+            } else {
+                return static_cast<uint16_t>(ReadU32(data_, group + 8) +
+                                             codepoint - start);
+            }
+        }
+        return 0;
+    }
+
+    if (codepoint > 0xFFFF) {
+        return 0;
+    }
+    size_t segment_count = ReadU16(data_, cmap_offset_ + 6) / 2;
+    size_t end_codes = cmap_offset_ + 14;
+    size_t start_codes = end_codes + segment_count * 2 + 2;
+    size_t deltas = start_codes + segment_count * 2;
+    size_t range_offsets = deltas + segment_count * 2;
+    size_t lo = 0;
+    size_t hi = segment_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ReadU16(data_, end_codes + mid * 2) < codepoint) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == segment_count ||
+        ReadU16(data_, start_codes + lo * 2) > codepoint) {
+        return 0;
+    }
+    uint16_t start = ReadU16(data_, start_codes + lo * 2);
+    uint16_t delta = ReadU16(data_, deltas + lo * 2);
+    size_t range_offset_position = range_offsets + lo * 2;
+    uint16_t range_offset = ReadU16(data_, range_offset_position);
+    if (range_offset == 0) {
+        return static_cast<uint16_t>(codepoint + delta);
+    }
+    uint16_t glyph = ReadU16(data_, range_offset_position + range_offset +
+                                        (codepoint - start) * 2);
+    return glyph == 0 ? 0 : static_cast<uint16_t>(glyph + delta);
+}
+
+Scalar Font::GetAdvance(uint16_t glyph) const {
+    size_t index = std::min<size_t>(glyph, h_metric_count_ - 1);
+    return static_cast<Scalar>(ReadU16(data_, hmtx_offset_ + index * 4)) /
+           units_per_em_;
+}
+
+const Path &Font::GetGlyphPath(uint16_t glyph) {
+    auto it = glyph_paths_.find(glyph);
+    if (it != glyph_paths_.end()) {
+        return it->second;
+    }
+
+    std::vector<std::vector<OutlinePoint>> contours;
+    Scalar scale = 1.0f / units_per_em_;
+    if (!ReadOutline(glyph, Matrix::MakeScale(scale, -scale), 0, contours)) {
+        contours.clear();
+    }
+
+    // Consecutive off curve points imply an on curve point between them.
+    PathBuilder builder;
+    for (const std::vector<OutlinePoint> &contour : contours) {
+        if (contour.size() < 2) {
+            continue;
+        }
+        size_t count = contour.size();
+        // Start on an on curve point, or between the first two off curve
+        // points if there are none.
+        size_t first = 0;
+        while (first < count && !contour[first].on_curve) {
+            first++;
+        }
+        Point start = first < count
+                          ? contour[first].point
+                          : (contour[0].point + contour[1].point) * 0.5f;
+        if (first == count) {
+            first = 0;
+        }
+        builder.moveTo(start);
+        std::optional<Point> control;
+        for (size_t i = 1; i <= count; i++) {
+            const OutlinePoint &current = contour[(first + i) % count];
+            if (current.on_curve) {
+                if (control.has_value()) {
+                    builder.quadTo(*control, current.point);
+                    control.reset();
+                } else {
+                    builder.lineTo(current.point);
+                }
+            } else if (control.has_value()) {
+                Point mid = (*control + current.point) * 0.5f;
+                builder.quadTo(*control, mid);
+                control = current.point;
+            } else {
+                control = current.point;
+            }
+        }
+        if (control.has_value()) {
+            builder.quadTo(*control, start);
+        }
+        builder.close();
+    }
+    return glyph_paths_.emplace(glyph, builder.takePath()).first->second;
+}
+
+bool Font::ReadOutline(uint16_t glyph, const Matrix &transform, int depth,
+                       std::vector<std::vector<OutlinePoint>> &contours) const {
+    if (glyph >= glyph_count_ || depth > kMaxCompositeDepth) {
+        return false;
+    }
+    size_t start = long_loca_ ? ReadU32(data_, loca_offset_ + glyph * 4)
+                              : ReadU16(data_, loca_offset_ + glyph * 2) * 2u;
+    size_t end = long_loca_ ? ReadU32(data_, loca_offset_ + glyph * 4 + 4)
+                            : ReadU16(data_, loca_offset_ + glyph * 2 + 2) * 2u;
+    if (end > glyf_length_ || start > end) {
+        return false;
+    }
+    if (start == end) {
+        // No outline, e.g. a space.
+        return true;
+    }
+    size_t offset = glyf_offset_ + start;
+    int16_t contour_count = ReadI16(data_, offset);
+
+    if (contour_count < 0) {
+        size_t component = offset + 10;
+        uint16_t flags = 0;
+        do {
+            flags = ReadU16(data_, component);
+            uint16_t component_glyph = ReadU16(data_, component + 2);
+            component += 4;
+            Scalar dx = 0;
+            Scalar dy = 0;
+            if (flags & kArgsAreWords) {
+                dx = ReadI16(data_, component);
+                dy = ReadI16(data_, component + 2);
+                component += 4;
+            } else {
+                dx = static_cast<int8_t>(ReadU8(data_, component));
+                dy = static_cast<int8_t>(ReadU8(data_, component + 1));
+                component += 2;
+            }
+            // Components aligned by matching points are placed at their
+            // origin.
+            if (!(flags & kArgsAreXYValues)) {
+                dx = 0;
+                dy = 0;
+            }
+            Scalar a = 1, b = 0, c = 0, d = 1;
+            if (flags & kHaveScale) {
+                a = d = ReadF2Dot14(data_, component);
+                component += 2;
+            } else if (flags & kHaveXYScale) {
+                a = ReadF2Dot14(data_, component);
+                d = ReadF2Dot14(data_, component + 2);
+                component += 4;
+            } else if (flags & kHaveTwoByTwo) {
+                a = ReadF2Dot14(data_, component);
+                b = ReadF2Dot14(data_, component + 2);
+                c = ReadF2Dot14(data_, component + 4);
+                d = ReadF2Dot14(data_, component + 6);
+                component += 8;
+            }
+            Matrix component_transform(a, b, 0, 0,  //
+                                       c, d, 0, 0,  //
+                                       0, 0, 1, 0,  //
+                                       dx, dy, 0, 1);
+            if (!ReadOutline(component_glyph, transform * component_transform,
+                             depth + 1, contours)) {
+                return false;
+            }
+        } while (flags & kMoreComponents);
+        return true;
+    }
+
+    size_t end_points = offset + 10;
+    size_t point_count =
+        contour_count > 0
+            ? ReadU16(data_, end_points + (contour_count - 1) * 2) + 1u
+            : 0;
+    size_t instruction_length = ReadU16(data_, end_points + contour_count * 2);
+    size_t cursor = end_points + contour_count * 2 + 2 + instruction_length;
+    if (cursor + point_count > glyf_offset_ + end) {
+        return false;
+    }
+
+    std::vector<uint8_t> flags(point_count);
+    for (size_t i = 0; i < point_count;) {
+        uint8_t flag = ReadU8(data_, cursor++);
+        size_t repeat = (flag & kRepeat) ? ReadU8(data_, cursor++) : 0;
+        for (size_t j = 0; j <= repeat && i < point_count; j++) {
+            flags[i++] = flag;
+        }
+    }
+    std::vector<Point> points(point_count);
+    int32_t value = 0;
+    for (size_t i = 0; i < point_count; i++) {
+        if (flags[i] & kXShort) {
+            uint8_t delta = ReadU8(data_, cursor++);
+            value += (flags[i] & kXSameOrPositive) ? delta : -delta;
+        } else if (!(flags[i] & kXSameOrPositive)) {
+            value += ReadI16(data_, cursor);
+            cursor += 2;
+        }
+        points[i].x = value;
+    }
+    value = 0;
+    for (size_t i = 0; i < point_count; i++) {
+        if (flags[i] & kYShort) {
+            uint8_t delta = ReadU8(data_, cursor++);
+            value += (flags[i] & kYSameOrPositive) ? delta : -delta;
+        } else if (!(flags[i] & kYSameOrPositive)) {
+            value += ReadI16(data_, cursor);
+            cursor += 2;
+        }
+        points[i].y = value;
+    }
+
+    size_t first = 0;
+    for (int16_t i = 0; i < contour_count; i++) {
+        size_t last = ReadU16(data_, end_points + i * 2);
+        if (last < first || last >= point_count) {
+            return false;
+        }
+        std::vector<OutlinePoint> &contour = contours.emplace_back();
+        for (size_t j = first; j <= last; j++) {
+            contour.push_back(OutlinePoint{transform.TransformPoint(points[j]),
+                                           (flags[j] & kOnCurve) != 0});
+        }
+        first = last + 1;
+    }
+    return true;
+}
+
+} // namespace flatland
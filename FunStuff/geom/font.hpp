@@ -0,0 +1,82 @@
+#ifndef GEOM_FONT
+#define GEOM_FONT
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "basic.hpp"
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// @brief A TrueType font with quadratic `glyf` outlines.
+///
+/// Only the tables needed to map characters to glyphs and to build their
+/// outlines are read: `head`, `maxp`, `hhea`, `hmtx`, `cmap` (formats 4 and
+/// 12), `loca` and `glyf`. Composite glyphs are supported when their
+/// components are positioned by offsets. Hinting instructions are ignored.
+///
+/// Glyph outlines are built into [Path]s on first use and cached by glyph id.
+/// Paths are in em units with y pointing down, so that a glyph drawn with a
+/// transform scaled by the font size has its origin on the baseline.
+class Font {
+  public:
+    /// @brief Parse the font in [data].
+    ///
+    /// @returns nullptr if [data] is not a TrueType font with glyph outlines.
+    static std::unique_ptr<Font> Make(std::vector<uint8_t> data);
+
+    ~Font() = default;
+
+    size_t GetGlyphCount() const { return glyph_count_; }
+
+    /// @brief The glyph for [codepoint], or glyph 0 (missing glyph) if the
+    /// font has none.
+    uint16_t GetGlyphId(uint32_t codepoint) const;
+
+    /// @brief The horizontal advance of [glyph] in em units.
+    Scalar GetAdvance(uint16_t glyph) const;
+
+    /// @brief The outline of [glyph], which is valid for the lifetime of the
+    /// font.
+    const Path &GetGlyphPath(uint16_t glyph);
+
+    size_t GetCachedGlyphCount() const { return glyph_paths_.size(); }
+
+  private:
+    struct OutlinePoint {
+        Point point;
+        bool on_curve;
+    };
+
+    std::vector<uint8_t> data_;
+    uint16_t units_per_em_ = 0;
+    size_t glyph_count_ = 0;
+    bool long_loca_ = false;
+    size_t loca_offset_ = 0;
+    size_t glyf_offset_ = 0;
+    size_t glyf_length_ = 0;
+    size_t hmtx_offset_ = 0;
+    size_t h_metric_count_ = 0;
+    size_t cmap_offset_ = 0;
+    uint16_t cmap_format_ = 0;
+    std::unordered_map<uint16_t, Path> glyph_paths_;
+
+    Font(std::vector<uint8_t> data);
+
+    bool Parse();
+
+    /// @brief Append the contours of [glyph], transformed by [transform],
+    /// to [contours].
+    bool ReadOutline(uint16_t glyph, const Matrix &transform, int depth,
+                     std::vector<std::vector<OutlinePoint>> &contours) const;
+
+    Font(const Font &) = delete;
+    Font(Font &&) = delete;
+    Font &operator=(const Font &) = delete;
+};
+
+} // namespace flatland
+
+#endif // GEOM_FONT
@@ -1,80 +1,299 @@
 #include "grid.hpp"
-#include "bezier.hpp"
+
+#include <algorithm>
+
+#include "../parallel.hpp"
+#include "wangs_formula.hpp"
 
 namespace flatland {
 
-// First, generate an N * N Grid for the given frame size.
+// First, generate the tiles for the given frame size.
 Grid GenerateGridOfSize(ISize size) {
     std::vector<Rect> tiles;
-    for (int i = 0; i < std::ceil(size.w / 16); i++) {
-        for (int j = 0; j < std::ceil(size.h / 16); j++) {
-            tiles.push_back(
-                Rect::MakeLTRB(i * 16, j * 16, i * 16 + 16, j * 16 + 16));
+    int32_t columns = (std::max(size.w, 0) + kGridSize - 1) / kGridSize;
+    int32_t rows = (std::max(size.h, 0) + kGridSize - 1) / kGridSize;
+    for (int32_t i = 0; i < columns; i++) {
+        for (int32_t j = 0; j < rows; j++) {
+            tiles.push_back(Rect::MakeLTRB(i * kGridSize, j * kGridSize,
+                                           (i + 1) * kGridSize,
+                                           (j + 1) * kGridSize));
         }
     }
     return Grid{.tiles = std::move(tiles)};
 }
 
-// Next, we iterate through our paths and compute the intersected path segments for
-// each tile. We first perform a quick reject with the conservative path bounds.
+namespace {
+
+struct Line {
+    Point p0;
+    Point p1;
+};
+
+// Per path state between the counting and writing passes.
+struct PathBinningState {
+    std::vector<Line> lines;
+    PathTiles tiles;
+    std::vector<uint32_t> tile_counts;
+    std::vector<int32_t> backdrop_deltas;
+    uint32_t segment_offset = 0;
+    uint32_t tile_segment_offset = 0;
+};
+
+// Tile coordinates are clamped well inside the int32_t range so that far off
+// screen geometry can't overflow.
+static constexpr Scalar kMaxTileIndex = 1 << 24;
+
+int32_t TileIndex(Scalar coordinate) {
+    return static_cast<int32_t>(std::clamp(std::floor(coordinate / kGridSize),
+                                           -kMaxTileIndex, kMaxTileIndex));
+}
 
-void GenerateWorkPerTile(Grid& grid, Path& path) {
-    Rect bounds = path.GetBounds();
-    for (int i = 0; i < grid.tiles.size(); i++) {
-        const Rect& tile = grid.tiles[i];
-        // No intersection, ignore.
-        if (!tile.Intersection(bounds).has_value()) {
-            continue;
+// Flatten [path] into device space lines.
+void FlattenPath(const Path &path, const Matrix &transform,
+                 std::vector<Line> &lines) {
+    // Curves are transformed before flattening, so they are flattened at
+    // device scale.
+    auto push_line = [&](Point p0, Point p1) {
+        if (p0 != p1) {
+            lines.push_back({p0, p1});
         }
-        // If there is an intersection, for each segment in the path,
-        // we need to compute the clipped path segment.
-        path.iterate([&](SegmentType type, const Point *data) {
-            switch (type) {
-            case SegmentType::kStart: {
-                
-                break;
+    };
+    auto add_line = [&](Point p0, Point p1) {
+        // Geometry left of the viewport is projected onto x = 0. This keeps
+        // its contribution to the winding of visible tiles. Lines crossing
+        // x = 0 are split so that the visible part keeps its shape.
+        if ((p0.x < 0) != (p1.x < 0)) {
+            Scalar y = p0.y + (0 - p0.x) * (p1.y - p0.y) / (p1.x - p0.x);
+            Point crossing(0, y);
+            push_line(Point(std::max(p0.x, 0.0f), p0.y), crossing);
+            push_line(crossing, Point(std::max(p1.x, 0.0f), p1.y));
+            return;
+        }
+        p0.x = std::max(p0.x, 0.0f);
+        p1.x = std::max(p1.x, 0.0f);
+        push_line(p0, p1);
+    };
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+        case SegmentType::kClose:
+            break;
+        case SegmentType::kLinear:
+            add_line(transform.TransformPoint(data[0]),
+                     transform.TransformPoint(data[1]));
+            break;
+        case SegmentType::kQuad: {
+            Point p0 = transform.TransformPoint(data[0]);
+            Point cp = transform.TransformPoint(data[1]);
+            Point p1 = transform.TransformPoint(data[2]);
+            Scalar divisions =
+                std::ceil(ComputeQuadradicSubdivisions(1, p0, cp, p1));
+            Point prev = p0;
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveQuad(i / divisions, p0, cp, p1);
+                add_line(prev, pt);
+                prev = pt;
             }
-            case SegmentType::kLinear: {
-                Point p0 = data[0];
-                Point p1 = data[1];
-                if (!Rect::MakePointBounds(p0, p1).Intersection(tile).has_value()) {
-                    break;
-                }
-                break;
+            add_line(prev, p1);
+            break;
+        }
+        case SegmentType::kCubic: {
+            Point p0 = transform.TransformPoint(data[0]);
+            Point cp1 = transform.TransformPoint(data[1]);
+            Point cp2 = transform.TransformPoint(data[2]);
+            Point p1 = transform.TransformPoint(data[3]);
+            Scalar divisions =
+                std::ceil(ComputeCubicSubdivisions(1, p0, cp1, cp2, p1));
+            Point prev = p0;
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveCubic(i / divisions, p0, cp1, cp2, p1);
+                add_line(prev, pt);
+                prev = pt;
             }
-            case SegmentType::kQuad: {
-                Point p0 = data[0];
-                Point cp = data[1];
-                Point p1 = data[2];
-
-                // (1 - t)^2 * P0 + 2t(1 - t) * CP + t^2 * P1
-                if (Rect::MakePointBounds(p0, p1, cp, cp).Intersection(tile).has_value()) {
-                    break;
-                }
+            add_line(prev, p1);
+            break;
+        }
+        }
+        return true;
+    });
+}
 
-                break;
-            }
-            case SegmentType::kCubic: {
-                Point p0 = data[0];
-                Point cp1 = data[1];
-                Point cp2 = data[2];
-                Point p1 = data[3];
-
-                // (1 - t)^3 * P0 + 3t(1 - t)^2 * CP1 + 3(1 - t)t^2 * CP2 + t^3 * P2
-                if (Rect::MakePointBounds(p0, p1, cp1, cp2).Intersection(tile).has_value()) {
-                    break;
+// Invoke [visit] with the tile space (column, row) of every tile in
+// [tiles] that [line] touches, walking one tile row at a time.
+template <typename Visitor>
+void WalkTiles(const Line &line, const PathTiles &tiles, Visitor &&visit) {
+    Scalar min_y = std::min(line.p0.y, line.p1.y);
+    Scalar max_y = std::max(line.p0.y, line.p1.y);
+    int32_t first_row = std::max(TileIndex(min_y), tiles.top);
+    int32_t last_row = std::min(TileIndex(max_y), tiles.bottom - 1);
+    Scalar dy = line.p1.y - line.p0.y;
+    Scalar dxdy = dy != 0 ? (line.p1.x - line.p0.x) / dy : 0;
+
+    for (int32_t row = first_row; row <= last_row; row++) {
+        // The part of the line within this row.
+        Scalar y0 = std::max(min_y, static_cast<Scalar>(row * kGridSize));
+        Scalar y1 =
+            std::min(max_y, static_cast<Scalar>((row + 1) * kGridSize));
+        Scalar x0 = dy != 0 ? line.p0.x + (y0 - line.p0.y) * dxdy : line.p0.x;
+        Scalar x1 = dy != 0 ? line.p0.x + (y1 - line.p0.y) * dxdy : line.p1.x;
+        int32_t first_column =
+            std::max(TileIndex(std::min(x0, x1)), tiles.left);
+        int32_t last_column =
+            std::min(TileIndex(std::max(x0, x1)), tiles.right - 1);
+        for (int32_t column = first_column; column <= last_column; column++) {
+            visit(column, row);
+        }
+    }
+}
+
+// Invoke [visit] with the tile space (column, row) and direction of every
+// tile top edge crossed by [line]. Crossings are half open, so a line ending
+// exactly on an edge is counted by only one of the lines that meet there.
+template <typename Visitor>
+void WalkRowCrossings(const Line &line, const PathTiles &tiles,
+                      Visitor &&visit) {
+    if (line.p0.y == line.p1.y) {
+        return;
+    }
+    int32_t direction = line.p1.y > line.p0.y ? 1 : -1;
+    Scalar min_y = std::min(line.p0.y, line.p1.y);
+    Scalar max_y = std::max(line.p0.y, line.p1.y);
+    // Rows whose top edge y satisfies min_y < y <= max_y.
+    int32_t first_row = std::max(TileIndex(min_y) + 1, tiles.top);
+    int32_t last_row = std::min(TileIndex(max_y), tiles.bottom - 1);
+    Scalar dxdy = (line.p1.x - line.p0.x) / (line.p1.y - line.p0.y);
+    for (int32_t row = first_row; row <= last_row; row++) {
+        Scalar y = static_cast<Scalar>(row * kGridSize);
+        Scalar x = line.p0.x + (y - line.p0.y) * dxdy;
+        visit(TileIndex(x), row, direction);
+    }
+}
+
+void CountPath(const BinningPath &input, uint32_t columns, uint32_t rows,
+               PathBinningState &state) {
+    FlattenPath(*input.path, input.transform, state.lines);
+
+    Rect bounds = input.transform.TransformBounds(input.path->GetBounds());
+    PathTiles &tiles = state.tiles;
+    tiles.left = std::clamp(TileIndex(std::max(bounds.l, 0.0f)), 0,
+                            static_cast<int32_t>(columns));
+    tiles.top =
+        std::clamp(TileIndex(bounds.t), 0, static_cast<int32_t>(rows));
+    tiles.right = std::clamp(TileIndex(bounds.r) + 1, tiles.left,
+                             static_cast<int32_t>(columns));
+    tiles.bottom = std::clamp(TileIndex(bounds.b) + 1, tiles.top,
+                              static_cast<int32_t>(rows));
+
+    uint32_t width = tiles.right - tiles.left;
+    state.tile_counts.assign(tiles.GetTileCount(), 0);
+    state.backdrop_deltas.assign(tiles.GetTileCount(), 0);
+    if (width == 0 || tiles.bottom == tiles.top) {
+        return;
+    }
+
+    for (const Line &line : state.lines) {
+        WalkTiles(line, tiles, [&](int32_t column, int32_t row) {
+            state.tile_counts[(row - tiles.top) * width + column -
+                              tiles.left]++;
+        });
+        // A crossing of a tile's top edge changes the winding of the top
+        // left corner of every tile to its right.
+        WalkRowCrossings(
+            line, tiles, [&](int32_t column, int32_t row, int32_t direction) {
+                int32_t first_column = std::max(column + 1, tiles.left);
+                if (first_column < tiles.right) {
+                    state.backdrop_deltas[(row - tiles.top) * width +
+                                          first_column - tiles.left] +=
+                        direction;
                 }
-               
-                break;
-            }
-            case SegmentType::kClose:
-                
-                break;
-            }
-            return true;
+            });
+    }
+}
+
+void WritePath(uint32_t path_index, PathBinningState &state,
+               TileBins &result) {
+    const PathTiles &tiles = state.tiles;
+    uint32_t width = tiles.right - tiles.left;
+
+    for (size_t i = 0; i < state.lines.size(); i++) {
+        size_t segment = state.segment_offset + i;
+        result.segment_x0[segment] = state.lines[i].p0.x;
+        result.segment_y0[segment] = state.lines[i].p0.y;
+        result.segment_x1[segment] = state.lines[i].p1.x;
+        result.segment_y1[segment] = state.lines[i].p1.y;
+        result.segment_path[segment] = path_index;
+    }
+
+    // Convert the counts into offsets and prefix sum the backdrop deltas
+    // along each row.
+    uint32_t offset = state.tile_segment_offset;
+    for (uint32_t row = 0; row < tiles.GetTileCount() / std::max(width, 1u);
+         row++) {
+        int32_t backdrop = 0;
+        for (uint32_t column = 0; column < width; column++) {
+            uint32_t local = row * width + column;
+            uint32_t tile = tiles.tile_offset + local;
+            backdrop += state.backdrop_deltas[local];
+            result.tile_backdrops[tile] = backdrop;
+            result.tile_segment_offsets[tile] = offset;
+            offset += state.tile_counts[local];
+            // Reused as the write cursor below.
+            state.tile_counts[local] = result.tile_segment_offsets[tile];
+        }
+    }
+
+    for (size_t i = 0; i < state.lines.size(); i++) {
+        uint32_t segment = state.segment_offset + i;
+        WalkTiles(state.lines[i], tiles, [&](int32_t column, int32_t row) {
+            uint32_t local = (row - tiles.top) * width + column - tiles.left;
+            result.tile_segments[state.tile_counts[local]++] = segment;
         });
     }
 }
 
+} // namespace
+
+void BinPaths(const std::vector<BinningPath> &paths, ISize size,
+              TileBins &result) {
+    result.columns = (std::max(size.w, 0) + kGridSize - 1) / kGridSize;
+    result.rows = (std::max(size.h, 0) + kGridSize - 1) / kGridSize;
+
+    std::vector<PathBinningState> states(paths.size());
+    ParallelFor(paths.size(), [&](size_t i) {
+        CountPath(paths[i], result.columns, result.rows, states[i]);
+    });
+
+    // Assign each path its range of the output arrays.
+    uint32_t segment_count = 0;
+    uint32_t tile_count = 0;
+    uint32_t tile_segment_count = 0;
+    result.paths.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        PathBinningState &state = states[i];
+        state.segment_offset = segment_count;
+        state.tiles.tile_offset = tile_count;
+        state.tile_segment_offset = tile_segment_count;
+        result.paths[i] = state.tiles;
+
+        segment_count += state.lines.size();
+        tile_count += state.tiles.GetTileCount();
+        for (uint32_t count : state.tile_counts) {
+            tile_segment_count += count;
+        }
+    }
+
+    result.segment_x0.resize(segment_count);
+    result.segment_y0.resize(segment_count);
+    result.segment_x1.resize(segment_count);
+    result.segment_y1.resize(segment_count);
+    result.segment_path.resize(segment_count);
+    result.tile_segment_offsets.resize(tile_count + 1);
+    result.tile_segment_offsets[tile_count] = tile_segment_count;
+    result.tile_backdrops.resize(tile_count);
+    result.tile_segments.resize(tile_segment_count);
+
+    ParallelFor(paths.size(),
+                [&](size_t i) { WritePath(i, states[i], result); });
+}
 
 } // namespace flatland.
@@ -1,7 +1,10 @@
 #ifndef GEOM_GRID
 #define GEOM_GRID
 
+#include <vector>
+
 #include "basic.hpp"
+#include "bezier.hpp"
 
 namespace flatland {
 
@@ -16,6 +19,69 @@ struct Grid {
 
 Grid GenerateGridOfSize(ISize size);
 
+/// @brief A path to be binned, with the transform to device space.
+struct BinningPath {
+    const Path *path = nullptr;
+    Matrix transform;
+};
+
+/// @brief The tiles covered by a single path.
+///
+/// Tiles are stored row major over the tile space bounds of the path,
+/// clipped to the viewport.
+struct PathTiles {
+    // Tile space bounds, [left, right) x [top, bottom).
+    int32_t left = 0;
+    int32_t top = 0;
+    int32_t right = 0;
+    int32_t bottom = 0;
+    // Index of the first tile of this path in the per-tile arrays of
+    // [TileBins].
+    uint32_t tile_offset = 0;
+
+    uint32_t GetTileCount() const { return (right - left) * (bottom - top); }
+};
+
+/// @brief The output of [BinPaths].
+///
+/// Segments are flattened lines in device space, stored as a structure of
+/// arrays. Each path has a row major block of tiles; for each tile there is a
+/// list of the segments that touch it (in compressed sparse row form) and a
+/// backdrop.
+///
+/// The backdrop of a tile is the winding number of its top left corner. The
+/// winding of any other point in the tile differs from the backdrop only by
+/// crossings of segments in the tile's list, since only those can touch a
+/// path from the corner to the point. Segments left of the viewport are
+/// clamped to x = 0 so that they land on the left edge of the first column.
+struct TileBins {
+    uint32_t columns = 0;
+    uint32_t rows = 0;
+
+    std::vector<Scalar> segment_x0;
+    std::vector<Scalar> segment_y0;
+    std::vector<Scalar> segment_x1;
+    std::vector<Scalar> segment_y1;
+    std::vector<uint32_t> segment_path;
+
+    std::vector<PathTiles> paths;
+
+    // For tile i, its segments are
+    // tile_segments[tile_segment_offsets[i], tile_segment_offsets[i + 1]).
+    std::vector<uint32_t> tile_segment_offsets;
+    std::vector<uint32_t> tile_segments;
+    std::vector<int32_t> tile_backdrops;
+
+    size_t GetSegmentCount() const { return segment_x0.size(); }
+};
+
+/// @brief Flatten [paths] and bin their segments into kGridSize square tiles
+/// covering [size].
+///
+/// Each segment only visits the tiles it touches. Paths are binned in
+/// parallel.
+void BinPaths(const std::vector<BinningPath> &paths, ISize size,
+              TileBins &result);
 
 } // namespace flatland
 
@@ -0,0 +1,165 @@
+#include "occlusion.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace flatland {
+
+namespace {
+
+// The bits [first, last] of a 64-bit word, with [first] and [last] in
+// [0, 63].
+uint64_t BitRange(int32_t first, int32_t last) {
+    uint64_t upper = last == 63 ? ~0ull : (1ull << (last + 1)) - 1;
+    return upper & ~((1ull << first) - 1);
+}
+
+} // namespace
+
+std::optional<Rect> ComputeInteriorRect(const Path &path,
+                                        const Matrix &transform) {
+    const Scalar *m = transform.GetStorage();
+    if (m[3] != 0 || m[7] != 0 || m[15] != 1) {
+        return std::nullopt;
+    }
+    std::vector<Point> points;
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            points.push_back(transform.TransformPoint(data[0]));
+            break;
+        case SegmentType::kLinear:
+            points.push_back(transform.TransformPoint(data[1]));
+            break;
+        case SegmentType::kQuad:
+            points.push_back(transform.TransformPoint(data[2]));
+            break;
+        case SegmentType::kCubic:
+            points.push_back(transform.TransformPoint(data[3]));
+            break;
+        case SegmentType::kClose:
+            break;
+        }
+        return true;
+    });
+    // Closing a contour may repeat the start point.
+    if (points.size() > 1 && points.front() == points.back()) {
+        points.pop_back();
+    }
+    if (points.size() < 3) {
+        return std::nullopt;
+    }
+
+    Point center;
+    Rect bounds = Rect::MakePointBounds(points[0], points[0]);
+    Scalar area = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+        const Point &p0 = points[i];
+        const Point &p1 = points[(i + 1) % points.size()];
+        center += p0;
+        bounds = bounds.Union(Rect::MakePointBounds(p0, p0));
+        area += p0.Cross(p1);
+    }
+    if (area == 0) {
+        return std::nullopt;
+    }
+    center = center * (1.0f / points.size());
+    Scalar half_width = bounds.GetWidth() / 2;
+    Scalar half_height = bounds.GetHeight() / 2;
+
+    // Each edge limits the scale of the rect to where its nearest corner
+    // touches the edge.
+    Scalar orientation = area > 0 ? 1 : -1;
+    Scalar scale = 1;
+    for (size_t i = 0; i < points.size(); i++) {
+        const Point &p0 = points[i];
+        const Point &p1 = points[(i + 1) % points.size()];
+        if (p0 == p1) {
+            continue;
+        }
+        Point normal = Point(p0.y - p1.y, p1.x - p0.x) * orientation;
+        Scalar distance = normal.Dot(center - p0);
+        Scalar reach = std::abs(normal.x) * half_width +
+                       std::abs(normal.y) * half_height;
+        if (distance <= 0) {
+            return std::nullopt;
+        }
+        if (reach > 0) {
+            scale = std::min(scale, distance / reach);
+        }
+    }
+    return Rect::MakeLTRB(center.x - half_width * scale,
+                          center.y - half_height * scale,
+                          center.x + half_width * scale,
+                          center.y + half_height * scale);
+}
+
+OcclusionBuffer::OcclusionBuffer(const Rect &bounds, Scalar cell_size) {
+    Reset(bounds, cell_size);
+}
+
+void OcclusionBuffer::Reset(const Rect &bounds, Scalar cell_size) {
+    bounds_ = bounds;
+    Scalar size = std::max(bounds.GetWidth(), bounds.GetHeight());
+    cell_size_ = std::max(cell_size, size / kMaxCells);
+    columns_ = std::max(
+        1, static_cast<int32_t>(std::ceil(bounds.GetWidth() / cell_size_)));
+    rows_ = std::max(
+        1, static_cast<int32_t>(std::ceil(bounds.GetHeight() / cell_size_)));
+    words_per_row_ = (columns_ + 63) / 64;
+    bits_.assign(words_per_row_ * rows_, 0);
+}
+
+void OcclusionBuffer::AddOccluder(const Rect &rect) {
+    // Only cells entirely inside [rect] are covered.
+    int32_t x0 = static_cast<int32_t>(
+        std::ceil((rect.l - bounds_.l) / cell_size_));
+    int32_t y0 = static_cast<int32_t>(
+        std::ceil((rect.t - bounds_.t) / cell_size_));
+    int32_t x1 = static_cast<int32_t>(
+                     std::floor((rect.r - bounds_.l) / cell_size_)) - 1;
+    int32_t y1 = static_cast<int32_t>(
+                     std::floor((rect.b - bounds_.t) / cell_size_)) - 1;
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, columns_ - 1);
+    y1 = std::min(y1, rows_ - 1);
+    if (x0 > x1 || y0 > y1) {
+        return;
+    }
+    for (int32_t y = y0; y <= y1; y++) {
+        uint64_t *row = &bits_[y * words_per_row_];
+        for (int32_t word = x0 / 64; word <= x1 / 64; word++) {
+            row[word] |= BitRange(std::max(x0 - word * 64, 0),
+                                  std::min(x1 - word * 64, 63));
+        }
+    }
+}
+
+bool OcclusionBuffer::IsOccluded(const Rect &rect) const {
+    // Every cell touching [rect] must be covered. Anything outside of the
+    // buffer is never covered.
+    if (rect.l < bounds_.l || rect.t < bounds_.t || rect.r > bounds_.r ||
+        rect.b > bounds_.b || !(rect.l <= rect.r && rect.t <= rect.b)) {
+        return false;
+    }
+    int32_t x0 = static_cast<int32_t>((rect.l - bounds_.l) / cell_size_);
+    int32_t y0 = static_cast<int32_t>((rect.t - bounds_.t) / cell_size_);
+    int32_t x1 = static_cast<int32_t>((rect.r - bounds_.l) / cell_size_);
+    int32_t y1 = static_cast<int32_t>((rect.b - bounds_.t) / cell_size_);
+    x1 = std::min(x1, columns_ - 1);
+    y1 = std::min(y1, rows_ - 1);
+    for (int32_t y = y0; y <= y1; y++) {
+        const uint64_t *row = &bits_[y * words_per_row_];
+        for (int32_t word = x0 / 64; word <= x1 / 64; word++) {
+            uint64_t mask = BitRange(std::max(x0 - word * 64, 0),
+                                     std::min(x1 - word * 64, 63));
+            if ((row[word] & mask) != mask) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace flatland
@@ -0,0 +1,56 @@
+#ifndef GEOM_OCCLUSION
+#define GEOM_OCCLUSION
+
+#include <optional>
+#include <vector>
+
+#include "basic.hpp"
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// @brief Compute an axis aligned rect inside [path] after [transform], or
+/// std::nullopt if none was found.
+///
+/// [path] must be convex. The rect is centered on the average of the segment
+/// end points and has the aspect ratio of the device space bounds, scaled up
+/// until it touches an edge of the polygon through the end points. Curves of
+/// a convex path bulge away from that polygon, so the rect is inside the
+/// path as well.
+std::optional<Rect> ComputeInteriorRect(const Path &path,
+                                        const Matrix &transform);
+
+/// @brief A coarse bitmask of the cells of [bounds] that are known to be
+/// covered.
+///
+/// Occluders only mark the cells they cover entirely, and a rect is only
+/// occluded if every cell it touches is marked, so both are conservative.
+class OcclusionBuffer {
+  public:
+    OcclusionBuffer() = default;
+
+    OcclusionBuffer(const Rect &bounds, Scalar cell_size);
+
+    static constexpr int32_t kMaxCells = 512;
+
+    /// @brief Clear the mask and cover [bounds] with cells of [cell_size]
+    /// device pixels, grown as needed to keep the mask within kMaxCells on
+    /// each side. The storage of the mask is reused.
+    void Reset(const Rect &bounds, Scalar cell_size);
+
+    void AddOccluder(const Rect &rect);
+
+    bool IsOccluded(const Rect &rect) const;
+
+  private:
+    Rect bounds_;
+    Scalar cell_size_ = 1;
+    int32_t columns_ = 0;
+    int32_t rows_ = 0;
+    int32_t words_per_row_ = 0;
+    std::vector<uint64_t> bits_;
+};
+
+} // namespace flatland
+
+#endif // GEOM_OCCLUSION
@@ -0,0 +1,49 @@
+#ifndef GEOM_PAINT
+#define GEOM_PAINT
+
+#include <variant>
+
+#include "basic.hpp"
+
+namespace flatland {
+
+enum class FillRule {
+    kNonZero,
+    kEvenOdd,
+};
+
+struct LinearGradient {
+    Point start;
+    Point end;
+    size_t texture_index;
+};
+
+struct RadialGradient {
+    Point center;
+    Scalar radius;
+    size_t texture_index;
+};
+
+// Gradient color ramps are owned by whatever created the gradient, so a
+// texture_index is only meaningful to that Canvas or CpuRenderer.
+using Gradient = std::variant<std::monostate, LinearGradient, RadialGradient>;
+
+struct Paint {
+    Color color;
+    Gradient gradient = std::monostate();
+    bool stroke = false;
+    Scalar stroke_width = 1.0f;
+    FillRule fill_rule = FillRule::kNonZero;
+
+    constexpr bool HasGradient() const {
+        return !std::holds_alternative<std::monostate>(gradient);
+    }
+
+    constexpr bool IsOpaque() const {
+        return !HasGradient() && color.is_opaque();
+    }
+};
+
+} // namespace flatland
+
+#endif // GEOM_PAINT
@@ -0,0 +1,152 @@
+#include "patches.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "wangs_formula.hpp"
+
+namespace flatland {
+
+namespace {
+
+Scalar ComputeResolveLevel(Scalar subdivisions) {
+    Scalar level = std::ceil(std::log2(std::max(subdivisions, 1.0f)));
+    return std::clamp(level, 0.0f, static_cast<Scalar>(kMaxResolveLevel));
+}
+
+// Bounds the halving of a single curve, should its control points be
+// non-finite.
+static constexpr int kMaxChopDepth = 16;
+
+// Add patches for the cubic [p0, p1, p2, p3], and the end points of each to
+// the fan. The cubic is halved until each half resolves within
+// [max_subdivisions] segments.
+void AddCubicPatches(Scalar scale_factor, Scalar max_subdivisions, Point p0,
+                     Point p1, Point p2, Point p3, int depth,
+                     CurvePatchMesh &result) {
+    Scalar subdivisions =
+        ComputeCubicSubdivisions(scale_factor, p0, p1, p2, p3);
+    if (subdivisions > max_subdivisions && depth < kMaxChopDepth) {
+        // de Casteljau at t = 0.5. Each half needs half the segments.
+        Point p01 = (p0 + p1) * 0.5f;
+        Point p12 = (p1 + p2) * 0.5f;
+        Point p23 = (p2 + p3) * 0.5f;
+        Point p012 = (p01 + p12) * 0.5f;
+        Point p123 = (p12 + p23) * 0.5f;
+        Point mid = (p012 + p123) * 0.5f;
+        AddCubicPatches(scale_factor, max_subdivisions, p0, p01, p012, mid,
+                        depth + 1, result);
+        AddCubicPatches(scale_factor, max_subdivisions, mid, p123, p23, p3,
+                        depth + 1, result);
+        return;
+    }
+    result.fan_points.push_back(p3);
+    result.patches.push_back(CurvePatch{
+        .p0 = p0,
+        .p1 = p1,
+        .p2 = p2,
+        .p3 = p3,
+        .resolve_level = ComputeResolveLevel(subdivisions),
+    });
+}
+
+} // namespace
+
+CurvePatch MakeCubicPatch(Scalar scale_factor, Point p0, Point p1, Point p2,
+                          Point p3) {
+    return CurvePatch{
+        .p0 = p0,
+        .p1 = p1,
+        .p2 = p2,
+        .p3 = p3,
+        .resolve_level = ComputeResolveLevel(
+            ComputeCubicSubdivisions(scale_factor, p0, p1, p2, p3)),
+    };
+}
+
+CurvePatch MakeQuadraticPatch(Scalar scale_factor, Point p0, Point cp,
+                              Point p1) {
+    // A quadratic is exactly representable as a cubic with control points
+    // 2/3 of the way to the quadratic control point.
+    constexpr Scalar kTwoThirds = 2.0f / 3.0f;
+    return CurvePatch{
+        .p0 = p0,
+        .p1 = p0 + (cp - p0) * kTwoThirds,
+        .p2 = p1 + (cp - p1) * kTwoThirds,
+        .p3 = p1,
+        .resolve_level = ComputeResolveLevel(
+            ComputeQuadradicSubdivisions(scale_factor, p0, cp, p1)),
+    };
+}
+
+void BuildCurvePatches(const Path &path, Scalar scale_factor,
+                       CurvePatchMesh &result, Scalar resolve_level_bias) {
+    result.fan_points.clear();
+    result.fan_indices.clear();
+    result.patches.clear();
+
+    // Patches are drawn with at most 2^kMaxResolveLevel segments after the
+    // bias is added, so longer curves are chopped until they fit.
+    Scalar max_subdivisions = std::exp2(
+        static_cast<Scalar>(kMaxResolveLevel) - resolve_level_bias);
+
+    size_t contour_start_index = 0;
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            contour_start_index = result.fan_points.size();
+            result.fan_points.push_back(data[0]);
+            break;
+        case SegmentType::kLinear:
+            result.fan_points.push_back(data[1]);
+            break;
+        case SegmentType::kQuad: {
+            // Degree elevated, which leaves Wang's formula unchanged.
+            CurvePatch quad =
+                MakeQuadraticPatch(scale_factor, data[0], data[1], data[2]);
+            AddCubicPatches(scale_factor, max_subdivisions, quad.p0, quad.p1,
+                            quad.p2, quad.p3, /*depth=*/0, result);
+            break;
+        }
+        case SegmentType::kCubic:
+            AddCubicPatches(scale_factor, max_subdivisions, data[0], data[1],
+                            data[2], data[3], /*depth=*/0, result);
+            break;
+        case SegmentType::kClose:
+            // Any fan origin works for stenciling, so use the contour start
+            // rather than adding a centroid point.
+            for (size_t i = contour_start_index + 1;
+                 i + 1 < result.fan_points.size(); i++) {
+                result.fan_indices.push_back(contour_start_index);
+                result.fan_indices.push_back(i);
+                result.fan_indices.push_back(i + 1);
+            }
+            break;
+        }
+        return true;
+    });
+}
+
+Scalar ComputeResolveLevelBias(Scalar scale_factor) {
+    if (scale_factor <= 0) {
+        return 0;
+    }
+    return std::ceil(0.5f * std::log2(scale_factor));
+}
+
+Point EmulatePatchVertex(const CurvePatch &patch, uint32_t vertex_id,
+                         Scalar resolve_level_bias) {
+    uint32_t corner = vertex_id % 3;
+    if (corner == 0) {
+        return patch.p0;
+    }
+    Scalar level = std::clamp(patch.resolve_level + resolve_level_bias, 0.0f,
+                              static_cast<Scalar>(kMaxResolveLevel));
+    uint32_t segments = 1u << static_cast<uint32_t>(level);
+    // Triangle i of the fan spans t = (i + 1) / N to t = (i + 2) / N.
+    uint32_t index = std::min(vertex_id / 3 + corner, segments);
+    Scalar t = static_cast<Scalar>(index) / segments;
+    return SolveCubic(t, patch.p0, patch.p1, patch.p2, patch.p3);
+}
+
+} // namespace flatland
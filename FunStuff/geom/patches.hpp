@@ -0,0 +1,78 @@
+#ifndef GEOM_PATCHES
+#define GEOM_PATCHES
+
+#include <vector>
+
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// The maximum number of times a curve patch may be halved. Each patch is
+/// drawn with enough vertices for a fan of 2^kMaxResolveLevel segments.
+static constexpr int kMaxResolveLevel = 5;
+
+/// The number of vertices drawn per curve patch instance.
+///
+/// A curve with N segments is fanned from its start point, which takes N - 1
+/// triangles. Patches that resolve to fewer segments collapse their trailing
+/// triangles onto the end point.
+static constexpr size_t kPatchVertexCount = 3 * ((1 << kMaxResolveLevel) - 1);
+
+/// @brief A single cubic curve to be expanded into a triangle fan on the GPU.
+///
+/// Must match the layout of `CurvePatch` in patches.metal.
+struct CurvePatch {
+    Point p0;
+    Point p1;
+    Point p2;
+    Point p3;
+    /// log2 of the number of segments required at the recording scale.
+    Scalar resolve_level = 0;
+    Scalar padding = 0;
+};
+
+/// @brief The stencil geometry for a path drawn with curve patches.
+///
+/// The fan triangulates the polygon formed by the end points of every
+/// segment. Each patch covers the region between a curve and its chord. The
+/// winding of the union is the same as the winding of the path.
+struct CurvePatchMesh {
+    std::vector<Point> fan_points;
+    std::vector<uint16_t> fan_indices;
+    std::vector<CurvePatch> patches;
+};
+
+/// @brief Create a patch for the cubic [p0, p1, p2, p3].
+CurvePatch MakeCubicPatch(Scalar scale_factor, Point p0, Point p1, Point p2,
+                          Point p3);
+
+/// @brief Create a patch for the quadratic [p0, cp, p1], degree elevated to a
+/// cubic.
+CurvePatch MakeQuadraticPatch(Scalar scale_factor, Point p0, Point cp,
+                              Point p1);
+
+/// @brief Build the inner fan and curve patches for [path].
+///
+/// Unlike [Triangulator::triangulate], the cost of this is proportional to
+/// the number of segments rather than the number of flattened vertices.
+///
+/// Curves that would need more than 2^kMaxResolveLevel segments once
+/// [resolve_level_bias] is added are chopped into several patches.
+void BuildCurvePatches(const Path &path, Scalar scale_factor,
+                       CurvePatchMesh &result, Scalar resolve_level_bias = 0);
+
+/// @brief The amount to add to the resolve level of patches recorded at
+/// scale 1 when they are drawn with [scale_factor].
+///
+/// Wang's formula grows with the square root of the scale, so each 4x
+/// increase in scale requires one more level.
+Scalar ComputeResolveLevelBias(Scalar scale_factor);
+
+/// @brief A CPU implementation of `patchStencilVertexShader`, returning the
+/// untransformed position of [vertex_id] for [patch].
+Point EmulatePatchVertex(const CurvePatch &patch, uint32_t vertex_id,
+                         Scalar resolve_level_bias = 0);
+
+} // namespace flatland
+
+#endif // GEOM_PATCHES
@@ -0,0 +1,263 @@
+#include "path_clipper.hpp"
+
+#include <vector>
+
+namespace flatland {
+
+namespace {
+
+// Straddling curves are halved at most this many times before the remaining
+// piece is replaced with its chord. At this depth the piece covers 1/256th
+// of the curve parameter.
+static constexpr int kMaxSubdivisionDepth = 8;
+
+struct ClipSegment {
+    SegmentType type;
+    // The start point followed by the control and end points.
+    std::array<Point, 4> points;
+    // The index of the plane this segment was projected onto, or -1 if it is
+    // part of the original path.
+    int boundary = -1;
+
+    int PointCount() const { return static_cast<int>(type) + 1; }
+
+    const Point &End() const { return points[PointCount() - 1]; }
+};
+
+using Contour = std::vector<ClipSegment>;
+
+Point Project(const HalfPlane &plane, const Point &p) {
+    Scalar distance = plane.Distance(p);
+    if (distance >= 0) {
+        return p;
+    }
+    return p - plane.normal * (distance / plane.normal.Dot(plane.normal));
+}
+
+Point Lerp(const Point &a, const Point &b, Scalar t) {
+    return a + (b - a) * t;
+}
+
+void Split(const ClipSegment &segment, ClipSegment &left, ClipSegment &right) {
+    const auto &p = segment.points;
+    left.type = right.type = segment.type;
+    if (segment.type == SegmentType::kQuad) {
+        Point ab = Lerp(p[0], p[1], 0.5);
+        Point bc = Lerp(p[1], p[2], 0.5);
+        Point mid = Lerp(ab, bc, 0.5);
+        left.points = {p[0], ab, mid, {}};
+        right.points = {mid, bc, p[2], {}};
+        return;
+    }
+    Point ab = Lerp(p[0], p[1], 0.5);
+    Point bc = Lerp(p[1], p[2], 0.5);
+    Point cd = Lerp(p[2], p[3], 0.5);
+    Point abc = Lerp(ab, bc, 0.5);
+    Point bcd = Lerp(bc, cd, 0.5);
+    Point mid = Lerp(abc, bcd, 0.5);
+    left.points = {p[0], ab, abc, mid};
+    right.points = {mid, bcd, cd, p[3]};
+}
+
+class PlaneClipper {
+  public:
+    PlaneClipper(const HalfPlane &plane, int plane_index, Contour &output)
+        : plane_(plane), plane_index_(plane_index), output_(output) {}
+
+    void Clip(const ClipSegment &segment, int depth) {
+        Scalar min_distance = std::numeric_limits<Scalar>::infinity();
+        Scalar max_distance = -std::numeric_limits<Scalar>::infinity();
+        for (int i = 0; i < segment.PointCount(); i++) {
+            Scalar distance = plane_.Distance(segment.points[i]);
+            min_distance = std::min(min_distance, distance);
+            max_distance = std::max(max_distance, distance);
+        }
+
+        if (min_distance >= 0) {
+            output_.push_back(segment);
+            return;
+        }
+        if (max_distance <= 0) {
+            EmitBoundary(Project(plane_, segment.points[0]),
+                         Project(plane_, segment.End()));
+            return;
+        }
+        if (segment.type != SegmentType::kLinear &&
+            depth < kMaxSubdivisionDepth) {
+            ClipSegment left;
+            ClipSegment right;
+            Split(segment, left, right);
+            Clip(left, depth + 1);
+            Clip(right, depth + 1);
+            return;
+        }
+
+        // A line (or a curve piece treated as its chord) that crosses the
+        // boundary exactly once.
+        const Point &start = segment.points[0];
+        const Point &end = segment.End();
+        Scalar d0 = plane_.Distance(start);
+        Scalar d1 = plane_.Distance(end);
+        if ((d0 >= 0) == (d1 >= 0)) {
+            // Only the control points crossed.
+            if (d0 >= 0) {
+                EmitLine(start, end, segment.boundary);
+            } else {
+                EmitBoundary(Project(plane_, start), Project(plane_, end));
+            }
+            return;
+        }
+        Point crossing = Project(plane_, Lerp(start, end, d0 / (d0 - d1)));
+        if (d0 >= 0) {
+            EmitLine(start, crossing, segment.boundary);
+            EmitBoundary(crossing, Project(plane_, end));
+        } else {
+            EmitBoundary(Project(plane_, start), crossing);
+            EmitLine(crossing, end, segment.boundary);
+        }
+    }
+
+  private:
+    const HalfPlane &plane_;
+    int plane_index_;
+    Contour &output_;
+
+    void EmitLine(const Point &from, const Point &to, int boundary) {
+        output_.push_back({.type = SegmentType::kLinear,
+                           .points = {from, to, {}, {}},
+                           .boundary = boundary});
+    }
+
+    void EmitBoundary(const Point &from, const Point &to) {
+        // Consecutive projected segments are collinear, so merge them to keep
+        // the vertex count proportional to the visible geometry.
+        if (!output_.empty() && output_.back().boundary == plane_index_) {
+            output_.back().points[1] = to;
+            return;
+        }
+        output_.push_back({.type = SegmentType::kLinear,
+                           .points = {from, to, {}, {}},
+                           .boundary = plane_index_});
+    }
+};
+
+} // namespace
+
+bool ComputeLocalClipPlanes(const Rect &device_clip, const Matrix &transform,
+                            std::array<HalfPlane, 4> &planes) {
+    const Scalar *m = transform.GetStorage();
+    if (m[3] != 0 || m[7] != 0 || m[15] != 1) {
+        return false;
+    }
+    // Device space planes for each edge of the clip.
+    std::array<HalfPlane, 4> device_planes = {
+        HalfPlane{.normal = Point(1, 0), .offset = -device_clip.l},
+        HalfPlane{.normal = Point(-1, 0), .offset = device_clip.r},
+        HalfPlane{.normal = Point(0, 1), .offset = -device_clip.t},
+        HalfPlane{.normal = Point(0, -1), .offset = device_clip.b},
+    };
+    // For q = A * p + t, n . q + c = (A^T n) . p + (n . t + c).
+    for (size_t i = 0; i < planes.size(); i++) {
+        const HalfPlane &plane = device_planes[i];
+        planes[i] = HalfPlane{
+            .normal = Point(plane.normal.x * m[0] + plane.normal.y * m[1],
+                            plane.normal.x * m[4] + plane.normal.y * m[5]),
+            .offset = plane.offset + plane.normal.x * m[12] +
+                      plane.normal.y * m[13],
+        };
+        if (planes[i].normal.Dot(planes[i].normal) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::optional<Path> ClipPathToPlanes(const Path &path,
+                                     const std::array<HalfPlane, 4> &planes) {
+    // Fast accept and reject using the path bounds, which contain all of the
+    // control points.
+    Rect bounds = path.GetBounds();
+    std::array<Point, 4> corners = {
+        Point(bounds.l, bounds.t), Point(bounds.r, bounds.t),
+        Point(bounds.l, bounds.b), Point(bounds.r, bounds.b)};
+    bool all_inside = true;
+    for (const HalfPlane &plane : planes) {
+        int inside_count = 0;
+        for (const Point &corner : corners) {
+            inside_count += plane.Distance(corner) >= 0;
+        }
+        if (inside_count == 0) {
+            return PathBuilder().takePath();
+        }
+        all_inside &= inside_count == 4;
+    }
+    if (all_inside) {
+        return std::nullopt;
+    }
+
+    std::vector<Contour> contours;
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            contours.emplace_back();
+            break;
+        case SegmentType::kLinear:
+        case SegmentType::kQuad:
+        case SegmentType::kCubic: {
+            ClipSegment segment{.type = type, .points = {}, .boundary = -1};
+            for (int i = 0; i <= static_cast<int>(type); i++) {
+                segment.points[i] = data[i];
+            }
+            contours.back().push_back(segment);
+            break;
+        }
+        case SegmentType::kClose:
+            break;
+        }
+        return true;
+    });
+
+    PathBuilder builder;
+    Contour clipped;
+    for (Contour &contour : contours) {
+        for (size_t i = 0; i < planes.size(); i++) {
+            clipped.clear();
+            PlaneClipper clipper(planes[i], i, clipped);
+            for (const ClipSegment &segment : contour) {
+                clipper.Clip(segment, 0);
+            }
+            std::swap(contour, clipped);
+        }
+        // A contour that was entirely outside of one plane has collapsed onto
+        // that plane's boundary and has no area.
+        bool is_collinear = !contour.empty();
+        for (const ClipSegment &segment : contour) {
+            is_collinear &= segment.boundary >= 0 &&
+                            segment.boundary == contour.front().boundary;
+        }
+        if (contour.empty() || is_collinear) {
+            continue;
+        }
+        builder.moveTo(contour.front().points[0]);
+        for (const ClipSegment &segment : contour) {
+            const auto &p = segment.points;
+            switch (segment.type) {
+            case SegmentType::kLinear:
+                builder.lineTo(p[1]);
+                break;
+            case SegmentType::kQuad:
+                builder.quadTo(p[1], p[2]);
+                break;
+            case SegmentType::kCubic:
+                builder.cubicTo(p[1], p[2], p[3]);
+                break;
+            default:
+                break;
+            }
+        }
+        builder.close();
+    }
+    return builder.takePath();
+}
+
+} // namespace flatland
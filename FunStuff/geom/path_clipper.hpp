@@ -0,0 +1,47 @@
+#ifndef GEOM_PATH_CLIPPER
+#define GEOM_PATH_CLIPPER
+
+#include <array>
+#include <optional>
+
+#include "basic.hpp"
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// @brief The set of points p where `normal.Dot(p) + offset >= 0`.
+struct HalfPlane {
+    Point normal;
+    Scalar offset = 0;
+
+    constexpr Scalar Distance(const Point &p) const {
+        return normal.Dot(p) + offset;
+    }
+};
+
+/// @brief Compute the local space half planes that bound [device_clip] when
+/// drawn with [transform].
+///
+/// @returns false if [transform] has perspective, in which case the clip
+/// can't be represented with half planes.
+bool ComputeLocalClipPlanes(const Rect &device_clip, const Matrix &transform,
+                            std::array<HalfPlane, 4> &planes);
+
+/// @brief Clip every contour of [path] to the intersection of [planes].
+///
+/// Each plane is applied in turn, Sutherland-Hodgman style. Segments fully
+/// inside a plane are kept, segments fully outside are projected onto the
+/// plane boundary, and curves that cross the boundary are split until the
+/// pieces are either inside, outside, or small enough to treat as lines.
+/// Projecting rather than discarding the outside geometry keeps each contour
+/// closed, so the winding of every point inside the planes is unchanged and
+/// both fill rules still apply.
+///
+/// @returns std::nullopt if [path] is already inside all of [planes]. If the
+/// path is entirely outside of any plane, an empty path is returned.
+std::optional<Path> ClipPathToPlanes(const Path &path,
+                                     const std::array<HalfPlane, 4> &planes);
+
+} // namespace flatland
+
+#endif // GEOM_PATH_CLIPPER
@@ -0,0 +1,213 @@
+#include "sdf.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "wangs_formula.hpp"
+
+namespace flatland {
+
+namespace {
+
+// Width and height of a bucketing cell in texels.
+static constexpr int32_t kCellSize = 8;
+
+struct Segment {
+    Point p0;
+    Point p1;
+};
+
+void FlattenSegments(const Path &path, Scalar scale_factor,
+                     std::vector<Segment> &segments) {
+    auto add_line = [&](Point p0, Point p1) {
+        if (p0 != p1) {
+            segments.push_back(Segment{p0, p1});
+        }
+    };
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+        case SegmentType::kClose:
+            break;
+        case SegmentType::kLinear:
+            add_line(data[0], data[1]);
+            break;
+        case SegmentType::kQuad: {
+            Scalar divisions = std::ceil(ComputeQuadradicSubdivisions(
+                scale_factor, data[0], data[1], data[2]));
+            Point prev = data[0];
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveQuad(i / divisions, data[0], data[1], data[2]);
+                add_line(prev, pt);
+                prev = pt;
+            }
+            add_line(prev, data[2]);
+            break;
+        }
+        case SegmentType::kCubic: {
+            Scalar divisions = std::ceil(ComputeCubicSubdivisions(
+                scale_factor, data[0], data[1], data[2], data[3]));
+            Point prev = data[0];
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveCubic(i / divisions, data[0], data[1], data[2],
+                                      data[3]);
+                add_line(prev, pt);
+                prev = pt;
+            }
+            add_line(prev, data[3]);
+            break;
+        }
+        }
+        return true;
+    });
+}
+
+// Lists of segment indices per bucket, stored contiguously. The segments of
+// bucket i are indices[offsets[i], offsets[i + 1]).
+struct Buckets {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> indices;
+
+    // Fill the buckets in two passes over [for_each_bucket], which calls its
+    // argument with (segment, bucket) for every bucket of every segment.
+    template <typename F>
+    void Build(size_t bucket_count, size_t segment_count,
+               const F &for_each_bucket) {
+        offsets.assign(bucket_count + 1, 0);
+        for (size_t i = 0; i < segment_count; i++) {
+            for_each_bucket(i, [&](size_t bucket) { offsets[bucket + 1]++; });
+        }
+        for (size_t i = 0; i < bucket_count; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        indices.resize(offsets[bucket_count]);
+        std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < segment_count; i++) {
+            for_each_bucket(i, [&](size_t bucket) {
+                indices[cursor[bucket]++] = static_cast<uint32_t>(i);
+            });
+        }
+    }
+};
+
+Scalar DistanceSquared(const Segment &segment, Point p) {
+    Point d = segment.p1 - segment.p0;
+    Point v = p - segment.p0;
+    Scalar t = std::clamp(v.Dot(d) / d.Dot(d), Scalar(0), Scalar(1));
+    Point offset = v - d * t;
+    return offset.Dot(offset);
+}
+
+} // namespace
+
+std::vector<uint8_t> GenerateDistanceField(const Path &path, ISize size,
+                                           Scalar spread, FillRule fill_rule,
+                                           Scalar max_magnification) {
+    std::vector<uint8_t> field(size.w * size.h, 0);
+    std::vector<Segment> segments;
+    FlattenSegments(path, max_magnification, segments);
+    if (segments.empty() || size.w <= 0 || size.h <= 0) {
+        return field;
+    }
+
+    int32_t columns = (size.w + kCellSize - 1) / kCellSize;
+    int32_t rows = (size.h + kCellSize - 1) / kCellSize;
+    auto cell_range = [&](Scalar lo, Scalar hi, int32_t count) {
+        return std::make_pair(
+            std::clamp(static_cast<int32_t>(std::floor(lo / kCellSize)), 0,
+                       count - 1),
+            std::clamp(static_cast<int32_t>(std::floor(hi / kCellSize)), 0,
+                       count - 1));
+    };
+
+    // Segments within [spread] of each cell, for distances.
+    Buckets cells;
+    cells.Build(columns * rows, segments.size(), [&](size_t i, auto &&emit) {
+        Rect bounds = Rect::MakePointBounds(segments[i].p0, segments[i].p1)
+                          .Expand(spread, spread);
+        if (bounds.r < 0 || bounds.b < 0 || bounds.l > size.w ||
+            bounds.t > size.h) {
+            return;
+        }
+        auto [x0, x1] = cell_range(bounds.l, bounds.r, columns);
+        auto [y0, y1] = cell_range(bounds.t, bounds.b, rows);
+        for (int32_t y = y0; y <= y1; y++) {
+            for (int32_t x = x0; x <= x1; x++) {
+                emit(y * columns + x);
+            }
+        }
+    });
+
+    // Segments overlapping each row of cells vertically, for the winding
+    // number.
+    Buckets bands;
+    bands.Build(rows, segments.size(), [&](size_t i, auto &&emit) {
+        Scalar t = std::min(segments[i].p0.y, segments[i].p1.y);
+        Scalar b = std::max(segments[i].p0.y, segments[i].p1.y);
+        if (b < 0 || t > size.h) {
+            return;
+        }
+        auto [y0, y1] = cell_range(t, b, rows);
+        for (int32_t y = y0; y <= y1; y++) {
+            emit(y);
+        }
+    });
+
+    Scalar max_distance_squared = spread * spread;
+    Scalar encode_scale = 255 / (2 * spread);
+    std::vector<std::pair<Scalar, int>> crossings;
+    for (int32_t y = 0; y < size.h; y++) {
+        Scalar center_y = y + 0.5f;
+        int32_t cell_row = y / kCellSize;
+
+        // Crossings of the scanline through the texel centers, sorted so
+        // that the winding can be swept from left to right.
+        crossings.clear();
+        for (uint32_t i = bands.offsets[cell_row];
+             i < bands.offsets[cell_row + 1]; i++) {
+            const Segment &segment = segments[bands.indices[i]];
+            Point p0 = segment.p0;
+            Point p1 = segment.p1;
+            int direction = 1;
+            if (p0.y > p1.y) {
+                std::swap(p0, p1);
+                direction = -1;
+            }
+            if (center_y < p0.y || center_y >= p1.y) {
+                continue;
+            }
+            Scalar x = p0.x + (center_y - p0.y) * (p1.x - p0.x) / (p1.y - p0.y);
+            crossings.emplace_back(x, direction);
+        }
+        std::sort(crossings.begin(), crossings.end());
+
+        size_t next_crossing = 0;
+        int winding = 0;
+        for (int32_t x = 0; x < size.w; x++) {
+            Point center(x + 0.5f, center_y);
+            while (next_crossing < crossings.size() &&
+                   crossings[next_crossing].first < center.x) {
+                winding += crossings[next_crossing++].second;
+            }
+            bool inside = fill_rule == FillRule::kNonZero ? winding != 0
+                                                          : (winding & 1) != 0;
+
+            size_t cell = cell_row * columns + x / kCellSize;
+            Scalar distance_squared = max_distance_squared;
+            for (uint32_t i = cells.offsets[cell]; i < cells.offsets[cell + 1];
+                 i++) {
+                distance_squared =
+                    std::min(distance_squared,
+                             DistanceSquared(segments[cells.indices[i]], center));
+            }
+            Scalar distance = std::sqrt(distance_squared);
+            Scalar value =
+                127.5f + (inside ? distance : -distance) * encode_scale;
+            field[y * size.w + x] = static_cast<uint8_t>(
+                std::clamp(std::round(value), Scalar(0), Scalar(255)));
+        }
+    }
+    return field;
+}
+
+} // namespace flatland
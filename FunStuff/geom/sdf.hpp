@@ -0,0 +1,30 @@
+#ifndef GEOM_SDF
+#define GEOM_SDF
+
+#include <vector>
+
+#include "basic.hpp"
+#include "bezier.hpp"
+#include "paint.hpp"
+
+namespace flatland {
+
+/// @brief Generate an 8-bit signed distance field of [path] of [size], row
+/// major with one byte per texel.
+///
+/// [path] is in texel coordinates. Each texel stores the distance from its
+/// center to the nearest edge of the flattened path, positive inside
+/// according to [fill_rule], mapped so that 128 is on the edge and 0 and 255
+/// are [spread] texels outside and inside. Curves are flattened finely
+/// enough to stay accurate when the field is magnified by
+/// [max_magnification].
+///
+/// Segments are bucketed into a grid of cells, each listing the segments
+/// within [spread] of it, so a texel only measures the segments near it.
+std::vector<uint8_t> GenerateDistanceField(const Path &path, ISize size,
+                                           Scalar spread, FillRule fill_rule,
+                                           Scalar max_magnification = 4);
+
+} // namespace flatland
+
+#endif // GEOM_SDF
@@ -0,0 +1,175 @@
+#include "simplify.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "wangs_formula.hpp"
+
+namespace flatland {
+
+namespace {
+
+// Upper bound on the number of times the tolerance is doubled to fit within
+// the point budget. Each contour always keeps at least its start point, so a
+// budget smaller than the contour count can't be met.
+static constexpr int kMaxSimplifyAttempts = 16;
+
+// Squared distance from [p] to the segment [a, b].
+Scalar DistanceToSegmentSquared(const Point &p, const Point &a,
+                                const Point &b) {
+    Point ab = b - a;
+    Scalar length_squared = ab.Dot(ab);
+    Scalar t = length_squared > 0
+                   ? std::clamp((p - a).Dot(ab) / length_squared, 0.0f, 1.0f)
+                   : 0.0f;
+    Point d = p - (a + ab * t);
+    return d.Dot(d);
+}
+
+// Iterative Douglas-Peucker over the open polyline [points], marking the
+// points to keep in [keep].
+void DouglasPeucker(const std::vector<Point> &points, Scalar tolerance,
+                    std::vector<bool> &keep) {
+    keep.assign(points.size(), false);
+    keep.front() = true;
+    keep.back() = true;
+    Scalar tolerance_squared = tolerance * tolerance;
+
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.emplace_back(0, points.size() - 1);
+    while (!stack.empty()) {
+        auto [first, last] = stack.back();
+        stack.pop_back();
+        Scalar max_distance = 0;
+        size_t max_index = first;
+        for (size_t i = first + 1; i < last; i++) {
+            Scalar distance =
+                DistanceToSegmentSquared(points[i], points[first], points[last]);
+            if (distance > max_distance) {
+                max_distance = distance;
+                max_index = i;
+            }
+        }
+        if (max_distance > tolerance_squared) {
+            keep[max_index] = true;
+            stack.emplace_back(first, max_index);
+            stack.emplace_back(max_index, last);
+        }
+    }
+}
+
+void FlattenContours(const Path &path, Scalar scale_factor,
+                     std::vector<std::vector<Point>> &contours) {
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+            contours.emplace_back();
+            contours.back().push_back(data[0]);
+            break;
+        case SegmentType::kLinear:
+            contours.back().push_back(data[1]);
+            break;
+        case SegmentType::kQuad: {
+            Scalar divisions = std::ceil(ComputeQuadradicSubdivisions(
+                scale_factor, data[0], data[1], data[2]));
+            for (int i = 1; i < divisions; i++) {
+                contours.back().push_back(
+                    SolveQuad(i / divisions, data[0], data[1], data[2]));
+            }
+            contours.back().push_back(data[2]);
+            break;
+        }
+        case SegmentType::kCubic: {
+            Scalar divisions = std::ceil(ComputeCubicSubdivisions(
+                scale_factor, data[0], data[1], data[2], data[3]));
+            for (int i = 1; i < divisions; i++) {
+                contours.back().push_back(SolveCubic(
+                    i / divisions, data[0], data[1], data[2], data[3]));
+            }
+            contours.back().push_back(data[3]);
+            break;
+        }
+        case SegmentType::kClose:
+            break;
+        }
+        return true;
+    });
+}
+
+} // namespace
+
+Scalar ComputePathArea(const Path &path) {
+    // Green's theorem: the area is the sum over every segment of
+    // 1/2 * integral(x dy - y dx), which has a closed form for beziers.
+    Scalar area = 0;
+    path.iterate([&](SegmentType type, const Point *p) {
+        switch (type) {
+        case SegmentType::kLinear:
+            area += p[0].Cross(p[1]) / 2;
+            break;
+        case SegmentType::kQuad:
+            area += (2 * p[0].Cross(p[1]) + p[0].Cross(p[2]) +
+                     2 * p[1].Cross(p[2])) /
+                    6;
+            break;
+        case SegmentType::kCubic:
+            area += (6 * p[0].Cross(p[1]) + 3 * p[0].Cross(p[2]) +
+                     p[0].Cross(p[3]) + 3 * p[1].Cross(p[2]) +
+                     3 * p[1].Cross(p[3]) + 6 * p[2].Cross(p[3])) /
+                    20;
+            break;
+        case SegmentType::kStart:
+        case SegmentType::kClose:
+            break;
+        }
+        return true;
+    });
+    return area;
+}
+
+Path SimplifyPath(const Path &path, Scalar scale_factor, Scalar tolerance,
+                  size_t max_points) {
+    std::vector<std::vector<Point>> contours;
+    FlattenContours(path, scale_factor, contours);
+
+    std::vector<bool> keep;
+    std::vector<std::vector<Point>> simplified(contours.size());
+    for (int attempt = 0; attempt < kMaxSimplifyAttempts; attempt++) {
+        size_t total_points = 0;
+        for (size_t i = 0; i < contours.size(); i++) {
+            const std::vector<Point> &contour = contours[i];
+            simplified[i].clear();
+            if (contour.size() < 3) {
+                continue;
+            }
+            DouglasPeucker(contour, tolerance, keep);
+            for (size_t j = 0; j < contour.size(); j++) {
+                if (keep[j]) {
+                    simplified[i].push_back(contour[j]);
+                }
+            }
+            total_points += simplified[i].size();
+        }
+        if (total_points <= max_points || tolerance <= 0) {
+            break;
+        }
+        tolerance *= 2;
+    }
+
+    PathBuilder builder;
+    for (const std::vector<Point> &contour : simplified) {
+        // Contours are closed by repeating the start point, so a triangle
+        // needs four points.
+        if (contour.size() < 4) {
+            continue;
+        }
+        builder.moveTo(contour.front());
+        for (size_t i = 1; i < contour.size(); i++) {
+            builder.lineTo(contour[i]);
+        }
+        builder.close();
+    }
+    return builder.takePath();
+}
+
+} // namespace flatland
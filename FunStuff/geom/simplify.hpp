@@ -0,0 +1,28 @@
+#ifndef GEOM_SIMPLIFY
+#define GEOM_SIMPLIFY
+
+#include "bezier.hpp"
+
+namespace flatland {
+
+/// @brief Compute the signed area enclosed by [path].
+///
+/// Curves are integrated exactly, so no flattening is required. Contours with
+/// opposite windings contribute with opposite signs.
+Scalar ComputePathArea(const Path &path);
+
+/// @brief Flatten [path] and simplify each contour with Douglas-Peucker.
+///
+/// Curves are flattened for [scale_factor]. Points are then removed as long
+/// as the contour stays within [tolerance] (in local units) of the flattened
+/// curve. If the result has more than [max_points], the tolerance is doubled
+/// until it fits. Contours that simplify to fewer than three points are
+/// dropped.
+///
+/// The result only contains linear segments.
+Path SimplifyPath(const Path &path, Scalar scale_factor, Scalar tolerance,
+                  size_t max_points);
+
+} // namespace flatland
+
+#endif // GEOM_SIMPLIFY
@@ -1,219 +1,414 @@
 #include "text.hpp"
 
-#include "triangulator.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
 #include "wangs_formula.hpp"
 
 namespace flatland {
 
-using OutCodeValue = uint8_t;
+namespace {
+
+// A flattened line, oriented so that y0 < y1.
+struct Edge {
+    Scalar x0;
+    Scalar y0;
+    Scalar x1;
+    Scalar y1;
+    Scalar dxdy;
+    // +1 if the original line pointed down, -1 if it pointed up.
+    Scalar direction;
 
-enum OutCode : uint8_t {
-    kInside = 0b0000,
-    kLeft = 0b0001,
-    kRight = 0b0010,
-    kBottom = 0b0100,
-    kTop = 0b1000,
+    Scalar XAt(Scalar y) const { return x0 + (y - y0) * dxdy; }
 };
 
-// Compute outcode based on the position of pt with respect to the bounding
-// rectangle.
-static OutCodeValue ComputeOutCode(const Rect &bounds, const Point &pt) {
-    OutCodeValue result = OutCode::kInside;
-    if (pt.x < bounds.l) {
-        result |= OutCode::kLeft;
-    } else if (pt.x > bounds.r) {
-        result |= OutCode::kRight;
-    }
+// Flatten [path] into edges. Geometry left of the mask is projected onto
+// x = 0, which keeps its contribution to the winding of visible pixels, and
+// geometry right of the mask onto x = width, where it contributes nothing.
+// Lines crossing either side are split so that the visible part keeps its
+// shape.
+void BuildEdges(const Path &path, Scalar width, std::vector<Edge> &edges) {
+    auto push_edge = [&](Point p0, Point p1) {
+        if (p0.y == p1.y) {
+            return;
+        }
+        Scalar direction = 1;
+        if (p0.y > p1.y) {
+            std::swap(p0, p1);
+            direction = -1;
+        }
+        edges.push_back(Edge{p0.x, p0.y, p1.x, p1.y,
+                             (p1.x - p0.x) / (p1.y - p0.y), direction});
+    };
+    auto add_line = [&](Point p0, Point p1) {
+        std::array<Scalar, 4> splits = {0, 1, 1, 1};
+        size_t split_count = 1;
+        for (Scalar edge_x : {Scalar(0), width}) {
+            if ((p0.x < edge_x) != (p1.x < edge_x)) {
+                splits[split_count++] = (edge_x - p0.x) / (p1.x - p0.x);
+            }
+        }
+        std::sort(splits.begin(), splits.begin() + split_count);
+        Point prev = p0;
+        for (size_t i = 1; i <= split_count; i++) {
+            Point next = i < split_count ? p0 + (p1 - p0) * splits[i] : p1;
+            push_edge(Point(std::clamp(prev.x, Scalar(0), width), prev.y),
+                      Point(std::clamp(next.x, Scalar(0), width), next.y));
+            prev = next;
+        }
+    };
+
+    path.iterate([&](SegmentType type, const Point *data) {
+        switch (type) {
+        case SegmentType::kStart:
+        case SegmentType::kClose:
+            break;
+        case SegmentType::kLinear:
+            add_line(data[0], data[1]);
+            break;
+        case SegmentType::kQuad: {
+            Scalar divisions = std::ceil(ComputeQuadradicSubdivisions(
+                /*scale_factor=*/1.0, data[0], data[1], data[2]));
+            Point prev = data[0];
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveQuad(i / divisions, data[0], data[1], data[2]);
+                add_line(prev, pt);
+                prev = pt;
+            }
+            add_line(prev, data[2]);
+            break;
+        }
+        case SegmentType::kCubic: {
+            Scalar divisions = std::ceil(ComputeCubicSubdivisions(
+                /*scale_factor=*/1.0, data[0], data[1], data[2], data[3]));
+            Point prev = data[0];
+            for (int i = 1; i < divisions; i++) {
+                Point pt = SolveCubic(i / divisions, data[0], data[1], data[2],
+                                      data[3]);
+                add_line(prev, pt);
+                prev = pt;
+            }
+            add_line(prev, data[3]);
+            break;
+        }
+        }
+        return true;
+    });
+}
 
-    if (pt.y < bounds.t) {
-        result |= OutCode::kTop;
-    } else if (pt.y > bounds.b) {
-        result |= OutCode::kBottom;
+// Accumulate the signed area of a line crossing a single scanline from
+// x = [x_top] to x = [x_bottom], covering [d] of the scanline's height
+// (negative for lines pointing up). The prefix sum of [acc] then gives the
+// winding contribution of the line at each pixel.
+void AccumulateRow(Scalar *acc, Scalar x_top, Scalar x_bottom, Scalar d) {
+    Scalar x0 = std::min(x_top, x_bottom);
+    Scalar x1 = std::max(x_top, x_bottom);
+    Scalar x0_floor = std::floor(x0);
+    Scalar x1_ceil = std::ceil(x1);
+    int32_t x0i = static_cast<int32_t>(x0_floor);
+    int32_t x1i = static_cast<int32_t>(x1_ceil);
+    if (x1i <= x0i + 1) {
+        // The line stays within one pixel.
+        Scalar xmf = 0.5f * (x_top + x_bottom) - x0_floor;
+        acc[x0i] += d - d * xmf;
+        acc[x0i + 1] += d * xmf;
+        return;
     }
+    Scalar s = 1 / (x1 - x0);
+    Scalar x0f = x0 - x0_floor;
+    Scalar a0 = 0.5f * s * (1 - x0f) * (1 - x0f);
+    Scalar x1f = x1 - x1_ceil + 1;
+    Scalar am = 0.5f * s * x1f * x1f;
+    acc[x0i] += d * a0;
+    if (x1i == x0i + 2) {
+        acc[x0i + 1] += d * (1 - a0 - am);
+    } else {
+        Scalar a1 = s * (1.5f - x0f);
+        acc[x0i + 1] += d * (a1 - a0);
+        for (int32_t xi = x0i + 2; xi < x1i - 1; xi++) {
+            acc[xi] += d * s;
+        }
+        Scalar a2 = a1 + (x1i - x0i - 3) * s;
+        acc[x1i - 1] += d * (1 - a2 - am);
+    }
+    acc[x1i] += d * am;
+}
 
-    return result;
+uint8_t ResolveCoverage(Scalar winding, FillRule fill_rule) {
+    Scalar coverage = std::abs(winding);
+    if (fill_rule == FillRule::kEvenOdd) {
+        coverage -= 2 * std::trunc(coverage * 0.5f);
+        coverage = 1 - std::abs(1 - coverage);
+    }
+    return static_cast<uint8_t>(std::min<Scalar>(coverage, 1) * 255 + 0.5f);
 }
 
-struct LineResult {
-    Point p1;
-    Point p2;
-};
+// Rasterize [path] one scanline at a time. Every row that has an edge on it
+// is passed to [visit] as the coverage of the pixels [first, end), plus the
+// coverage shared by every pixel from [end] to the right side of the mask.
+// Pixels left of [first], and rows that are not visited, are empty.
+template <typename Visitor>
+void RasterizeRows(const Path &path, ISize size, FillRule fill_rule,
+                   Visitor &&visit) {
+    if (size.w <= 0 || size.h <= 0) {
+        return;
+    }
+    Scalar width = size.w;
 
-// Clip a line from [pt1] to [pt2] against [bounds].
-std::optional<LineResult> CohenSutherlandLineClip(const Rect &bounds,
-                                                  const Point &pt1,
-                                                  const Point &pt2) {
-    OutCodeValue outcode0 = ComputeOutCode(bounds, pt1);
-    OutCodeValue outcode1 = ComputeOutCode(bounds, pt2);
-    bool accept = false;
-
-    Scalar x0 = pt1.x;
-    Scalar x1 = pt2.x;
-    Scalar y0 = pt1.y;
-    Scalar y1 = pt2.y;
-
-    while (true) {
-        if (!(outcode0 | outcode1)) {
-            // bitwise OR is 0: both points are inside bounds already.
-            accept = true;
-            break;
-        } else if (outcode0 & outcode1) {
-            // bitwise AND is not 0: both points share an outside zone so both
-            // must be outside the window. That is, there is no intersection.
-            break;
-        } else {
-            // At least one endpoint is outside the clip rectangle. Pick
-            // whichever one is non-zero.
-            OutCodeValue outcodeOut = outcode1 > outcode0 ? outcode1 : outcode0;
-
-            // Now find the intersection point.
-            //   m = (y1 - y0) / (x1 - x0)
-            //   x = x0 + (1 / slope) * (ym - y0), where ym is ymin or ymax
-            //   y = y0 + slope * (xm - x0), where xm is xmin or xmax
-            // No need to worry about divide-by-zero because, in each case, the
-            // outcode bit being tested guarantees the denominator is non-zero
-            Scalar x = 0;
-            Scalar y = 0;
-            if (outcodeOut & OutCode::kTop) {
-                // point is above the clip window
-                x = x0 + (x1 - x0) * (bounds.b - y0) / (y1 - y0);
-                y = bounds.b;
-            } else if (outcodeOut & OutCode::kBottom) {
-                // point is below the clip window
-                x = x0 + (x1 - x0) * (bounds.t - y0) / (y1 - y0);
-                y = bounds.t;
-            } else if (outcodeOut & OutCode::kRight) {
-                // point is to the right of clip window
-                y = y0 + (y1 - y0) * (bounds.r - x0) / (x1 - x0);
-                x = bounds.r;
-            } else if (outcodeOut & OutCode::kLeft) {
-                // point is to the left of clip window
-                y = y0 + (y1 - y0) * (bounds.l - x0) / (x1 - x0);
-                x = bounds.l;
+    std::vector<Edge> edges;
+    BuildEdges(path, width, edges);
+    std::sort(edges.begin(), edges.end(),
+              [](const Edge &a, const Edge &b) { return a.y0 < b.y0; });
+
+    // Two spare entries for area landing on or just past the right edge.
+    std::vector<Scalar> acc(size.w + 2);
+    std::vector<uint8_t> coverage(size.w);
+    std::vector<const Edge *> active;
+    size_t next_edge = 0;
+    for (int32_t row = 0; row < size.h; row++) {
+        Scalar row_top = row;
+        Scalar row_bottom = row + 1;
+
+        // Retire edges that end above this row and add those that start in
+        // it.
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [&](const Edge *edge) {
+                                        return edge->y1 <= row_top;
+                                    }),
+                     active.end());
+        while (next_edge < edges.size() && edges[next_edge].y0 < row_bottom) {
+            if (edges[next_edge].y1 > row_top) {
+                active.push_back(&edges[next_edge]);
+            }
+            next_edge++;
+        }
+        if (active.empty()) {
+            if (next_edge == edges.size()) {
+                break;
             }
+            continue;
+        }
+
+        Scalar min_x = width;
+        Scalar max_x = 0;
+        for (const Edge *edge : active) {
+            Scalar y_top = std::max(row_top, edge->y0);
+            Scalar y_bottom = std::min(row_bottom, edge->y1);
+            // Clamped, since rounding can push x slightly outside the mask.
+            Scalar x_top = std::clamp(edge->XAt(y_top), Scalar(0), width);
+            Scalar x_bottom = std::clamp(edge->XAt(y_bottom), Scalar(0), width);
+            AccumulateRow(acc.data(), x_top, x_bottom,
+                          (y_bottom - y_top) * edge->direction);
+            min_x = std::min({min_x, x_top, x_bottom});
+            max_x = std::max({max_x, x_top, x_bottom});
+        }
+
+        // Pixels left of every edge are empty, and pixels right of every
+        // edge share the winding of the last touched pixel.
+        int32_t first = static_cast<int32_t>(min_x);
+        int32_t end = std::min(static_cast<int32_t>(max_x) + 2, size.w);
+        Scalar winding = 0;
+        for (int32_t x = first; x < end; x++) {
+            winding += acc[x];
+            coverage[x] = ResolveCoverage(winding, fill_rule);
+        }
+        visit(row, coverage.data(), first, end,
+              ResolveCoverage(winding, fill_rule));
+        std::fill(acc.begin() + first, acc.end(), 0);
+    }
+}
+
+// Runs of identical coverage at least this long are stored as solid spans
+// rather than as part of a strip.
+static constexpr int32_t kMinSolidSpan = 4;
+
+// Appends the spans of one row to a [SparseMask].
+class SpanWriter {
+  public:
+    SpanWriter(SparseMask &mask, int32_t row) : mask_(mask), row_(row) {}
 
-            // Now we move outside point to intersection point to clip
-            // and get ready for next pass.
-            if (outcodeOut == outcode0) {
-                x0 = x;
-                y0 = y;
-                outcode0 = ComputeOutCode(bounds, Point(x0, y0));
-            } else {
-                x1 = x;
-                y1 = y;
-                outcode1 = ComputeOutCode(bounds, Point(x1, y1));
+    ~SpanWriter() = default;
+
+    // Add [width] pixels of [coverage]. Short runs are added to the current
+    // strip unless [solid] is set.
+    void AddRun(int32_t x, int32_t width, uint8_t coverage,
+                bool solid = false) {
+        if (width <= 0) {
+            return;
+        }
+        if (width < kMinSolidSpan && !solid) {
+            if (strip_width_ == 0) {
+                strip_x_ = x;
             }
+            mask_.alphas.insert(mask_.alphas.end(), width, coverage);
+            strip_width_ += width;
+            return;
+        }
+        FlushStrip();
+        if (coverage == 0) {
+            return;
+        }
+        // Merge with a solid span directly to the left.
+        if (mask_.spans.size() > mask_.row_offsets[row_]) {
+            CoverageSpan &last = mask_.spans.back();
+            if (!last.is_strip && last.coverage == coverage &&
+                last.x + last.width == x) {
+                last.width += width;
+                return;
+            }
+        }
+        mask_.spans.push_back(CoverageSpan{
+            .x = static_cast<uint16_t>(x),
+            .y = static_cast<uint16_t>(row_),
+            .width = static_cast<uint16_t>(width),
+            .coverage = coverage,
+            .is_strip = 0,
+            .alpha_offset = 0,
+        });
+    }
+
+    void FlushStrip() {
+        if (strip_width_ == 0) {
+            return;
         }
+        mask_.spans.push_back(CoverageSpan{
+            .x = static_cast<uint16_t>(strip_x_),
+            .y = static_cast<uint16_t>(row_),
+            .width = static_cast<uint16_t>(strip_width_),
+            .coverage = 0,
+            .is_strip = 1,
+            .alpha_offset =
+                static_cast<uint32_t>(mask_.alphas.size() - strip_width_),
+        });
+        strip_width_ = 0;
     }
 
-    if (accept) {
-        return LineResult{Point{x0, y0}, Point{x1, y1}};
+  private:
+    SparseMask &mask_;
+    int32_t row_;
+    int32_t strip_x_ = 0;
+    int32_t strip_width_ = 0;
+
+    SpanWriter(const SpanWriter &) = delete;
+    SpanWriter &operator=(const SpanWriter &) = delete;
+};
+
+// Source over [color] weighted by [coverage] onto [count] premultiplied
+// RGBA8 pixels.
+void BlendStrip(uint8_t *pixels, const Color &color, const uint8_t *coverage,
+                int32_t count) {
+    for (int32_t i = 0; i < count; i++, pixels += 4) {
+        if (coverage[i] == 0) {
+            continue;
+        }
+        Scalar alpha = coverage[i] / 255.0f;
+        Scalar inv = 1 - color.a * alpha;
+        pixels[0] = static_cast<uint8_t>(color.r * alpha * 255 +
+                                         pixels[0] * inv + 0.5f);
+        pixels[1] = static_cast<uint8_t>(color.g * alpha * 255 +
+                                         pixels[1] * inv + 0.5f);
+        pixels[2] = static_cast<uint8_t>(color.b * alpha * 255 +
+                                         pixels[2] * inv + 0.5f);
+        pixels[3] = static_cast<uint8_t>(color.a * alpha * 255 +
+                                         pixels[3] * inv + 0.5f);
     }
-    return std::nullopt;
 }
 
-std::vector<uint8_t> RasterizePath(const Path &path, ISize size) {
-    std::vector<uint8_t> result(size.w * size.h);
-    std::vector<std::vector<LineResult>> lines(size.w * size.h,
-                                               std::vector<LineResult>());
-
-    for (int i = 0; i < size.w; i++) {
-        for (int j = 0; j < size.h; j++) {
-            // Create a rectangle from [i, j] to (i + 1, j + 1).
-            // Compute the intersection with each bezier segment.
-            // Using Cohen-Sutherland clipping:
-            // https://en.wikipedia.org/wiki/Cohen%E2%80%93Sutherland_algorithm
-
-            size_t index = i + (j * size.w);
-            Point start = Point(0, 0);
-            Point current = start;
-            Rect bounds = Rect(i, j, i + 1, j + 1);
-            path.iterate([&](SegmentType type, const Point *data) {
-                switch (type) {
-                case SegmentType::kStart:
-                    current = start = data[0];
-                    break;
-                case SegmentType::kLinear: {
-                    if (auto result =
-                            CohenSutherlandLineClip(bounds, data[0], data[1]);
-                        result.has_value()) {
-                        lines[index].push_back(result.value());
-                    }
-                    current = data[1];
-                    break;
-                }
-                case SegmentType::kQuad: {
-                    // TODO: check intersection before linearization.
-                    Point p0 = data[0];
-                    Point cp = data[1];
-                    Point p1 = data[2];
-
-                    // (1 - t)^2 * P0 + 2t(1 - t) * CP + t^2 * P1
-                    //
-                    // note: we don't include t=0 or t=1 as these points
-                    // will always be P0 and P1 which have already been
-                    // computed.
-                    Scalar divisions = std::ceilf(ComputeQuadradicSubdivisions(
-                        /*scale_factor=*/1.0, p0, cp, p1));
-                    Point prev_point = p0;
-                    for (int i = 1; i < divisions; i++) {
-                        Scalar t = i / divisions;
-                        Point pt = SolveQuad(t, p0, cp, p1);
-                        if (auto result =
-                                CohenSutherlandLineClip(bounds, prev_point, pt);
-                            result.has_value()) {
-                            lines[index].push_back(result.value());
-                        }
-                        prev_point = pt;
-                    }
-                    break;
-                }
-                case SegmentType::kCubic: {
-                    Point p0 = data[0];
-                    Point cp1 = data[1];
-                    Point cp2 = data[2];
-                    Point p1 = data[3];
-
-                    // (1 - t)^3 * P0 + 3t(1 - t)^2 * CP1 + 3(1 - t)t^2 * CP2 +
-                    // t^3 * P2
-                    //
-                    // note: we don't include t=0 or t=1 as these points
-                    // will always be P0 and P1 which have already been
-                    // computed.
-                    Scalar divisions = std::ceilf(ComputeCubicSubdivisions(
-                        /*scale_factor=*/1.0, p0, cp1, cp2, p1));
-
-                    Point prev_point = p0;
-                    for (int i = 1; i < divisions; i++) {
-                        Scalar t = i / divisions;
-                        Point pt = SolveCubic(t, p0, cp1, cp2, p1);
-                        if (auto result =
-                                CohenSutherlandLineClip(bounds, prev_point, pt);
-                            result.has_value()) {
-                            lines[index].push_back(result.value());
-                        }
-                        prev_point = pt;
-                    }
-
-                    break;
-                }
-                case SegmentType::kClose:
-                    // Treat close as a linear back to start if they're not
-                    // the same point.
-                    if (start != current) {
-                        if (auto result =
-                                CohenSutherlandLineClip(bounds, current, start);
-                            result.has_value()) {
-                            lines[index].push_back(result.value());
-                        }
-                    }
-                    break;
-                }
-                return true;
-            });
+// Source over [color] weighted by a constant [coverage]. The source terms are
+// computed once for the whole span, and opaque fills are plain stores.
+void BlendSolid(uint8_t *pixels, const Color &color, uint8_t coverage,
+                int32_t count) {
+    Scalar alpha = coverage / 255.0f;
+    Scalar inv = 1 - color.a * alpha;
+    std::array<Scalar, 4> source = {color.r * alpha * 255 + 0.5f,
+                                    color.g * alpha * 255 + 0.5f,
+                                    color.b * alpha * 255 + 0.5f,
+                                    color.a * alpha * 255 + 0.5f};
+    if (inv == 0) {
+        std::array<uint8_t, 4> value;
+        for (int c = 0; c < 4; c++) {
+            value[c] = static_cast<uint8_t>(source[c]);
+        }
+        for (int32_t i = 0; i < count; i++, pixels += 4) {
+            ::memcpy(pixels, value.data(), 4);
         }
+        return;
     }
+    for (int32_t i = 0; i < count * 4; i++) {
+        pixels[i] = static_cast<uint8_t>(source[i % 4] + pixels[i] * inv);
+    }
+}
+
+} // namespace
+
+std::vector<uint8_t> RasterizePath(const Path &path, ISize size,
+                                   FillRule fill_rule) {
+    std::vector<uint8_t> result(std::max(size.w, 0) * std::max(size.h, 0));
+    RasterizeRows(path, size, fill_rule,
+                  [&](int32_t row, const uint8_t *coverage, int32_t first,
+                      int32_t end, uint8_t tail) {
+                      uint8_t *out = result.data() + row * size.w;
+                      std::copy(coverage + first, coverage + end, out + first);
+                      std::fill(out + end, out + size.w, tail);
+                  });
     return result;
 }
 
+void RasterizePathSparse(const Path &path, ISize size, SparseMask &result,
+                         FillRule fill_rule) {
+    result.size = size;
+    result.spans.clear();
+    result.alphas.clear();
+    result.row_offsets.assign(std::max(size.h, 0) + 1, 0);
+    int32_t last_row = -1;
+    RasterizeRows(
+        path, size, fill_rule,
+        [&](int32_t row, const uint8_t *coverage, int32_t first, int32_t end,
+            uint8_t tail) {
+            for (int32_t i = last_row + 1; i <= row; i++) {
+                result.row_offsets[i] = result.spans.size();
+            }
+            last_row = row;
+
+            SpanWriter writer(result, row);
+            int32_t x = first;
+            while (x < end) {
+                int32_t run_end = x + 1;
+                while (run_end < end && coverage[run_end] == coverage[x]) {
+                    run_end++;
+                }
+                writer.AddRun(x, run_end - x, coverage[x]);
+                x = run_end;
+            }
+            // The tail is always stored as a solid span, however short.
+            if (end < size.w) {
+                writer.AddRun(end, size.w - end, tail, /*solid=*/true);
+            }
+            writer.FlushStrip();
+        });
+    for (int32_t i = last_row + 1; i <= std::max(size.h, 0); i++) {
+        result.row_offsets[i] = result.spans.size();
+    }
+}
+
+void CompositeMask(const SparseMask &mask, Color color, uint8_t *pixels) {
+    Color premultiplied = color.Premultiply();
+    for (const CoverageSpan &span : mask.spans) {
+        uint8_t *out = pixels + (span.y * mask.size.w + span.x) * 4;
+        if (span.is_strip) {
+            BlendStrip(out, premultiplied,
+                       mask.alphas.data() + span.alpha_offset, span.width);
+        } else {
+            BlendSolid(out, premultiplied, span.coverage, span.width);
+        }
+    }
+}
+
+void CompositeMask(const std::vector<uint8_t> &mask, ISize size, Color color,
+                   uint8_t *pixels) {
+    BlendStrip(pixels, color.Premultiply(), mask.data(),
+               std::max(size.w, 0) * std::max(size.h, 0));
+}
+
 } // namespace flatland
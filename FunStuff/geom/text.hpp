@@ -4,12 +4,76 @@
 #include <vector>
 #include "bezier.hpp"
 #include "basic.hpp"
+#include "paint.hpp"
 
 namespace flatland {
 
+/// @brief Rasterize [path] into an 8-bit anti-aliased coverage mask of
+/// [size], row major with one byte per pixel.
+///
+/// The path is flattened into edges which are sorted by their top. Each
+/// scanline then only visits the edges that are active on it, accumulating
+/// the exact signed area they cover, so the cost scales with the number of
+/// edges times the scanlines they span rather than with the number of
+/// pixels times segments.
+std::vector<uint8_t> RasterizePath(const Path &path, ISize size,
+                                   FillRule fill_rule = FillRule::kNonZero);
 
-std::vector<uint8_t> RasterizePath(const Path& path, ISize size);
+/// @brief A horizontal run of pixels in a [SparseMask].
+///
+/// Spans are plain data, so that the span list can be uploaded as is and
+/// drawn as one instance per span.
+struct CoverageSpan {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    /// The coverage of every pixel in the span, if this is not a strip.
+    uint8_t coverage;
+    /// Whether the span is an anti-aliased strip with per pixel coverage.
+    uint8_t is_strip;
+    /// For strips, the index of the first coverage value in
+    /// [SparseMask::alphas].
+    uint32_t alpha_offset;
+};
 
+static_assert(sizeof(CoverageSpan) == 12);
+
+/// @brief A coverage mask stored as spans of solid coverage plus short
+/// anti-aliased strips at the edges.
+///
+/// Pixels not in any span have zero coverage. Spans are sorted by row and
+/// then by x and do not overlap. The mask must be less than 65536 pixels
+/// wide and tall.
+struct SparseMask {
+    ISize size = ISize(0, 0);
+    std::vector<CoverageSpan> spans;
+    std::vector<uint8_t> alphas;
+    /// The spans of row y are [row_offsets[y], row_offsets[y + 1]).
+    std::vector<uint32_t> row_offsets;
+
+    size_t GetByteSize() const {
+        return spans.size() * sizeof(CoverageSpan) + alphas.size() +
+               row_offsets.size() * sizeof(uint32_t);
+    }
+};
+
+/// @brief Rasterize [path] like [RasterizePath], into a [SparseMask].
+///
+/// Runs of at least four pixels with identical coverage become solid spans
+/// (or are skipped if empty) and everything else is stored in strips, so the
+/// size of the mask scales with the length of the path's edges rather than
+/// with its area.
+void RasterizePathSparse(const Path &path, ISize size, SparseMask &result,
+                         FillRule fill_rule = FillRule::kNonZero);
+
+/// @brief Composite [color] through [mask] onto [pixels], which are
+/// premultiplied RGBA8 of the same size as the mask.
+void CompositeMask(const SparseMask &mask, Color color, uint8_t *pixels);
+
+/// @brief Composite [color] through a dense coverage [mask] of [size] onto
+/// [pixels], which are premultiplied RGBA8 of the same size.
+void CompositeMask(const std::vector<uint8_t> &mask, ISize size, Color color,
+                   uint8_t *pixels);
 
 } // namespace flatland
 
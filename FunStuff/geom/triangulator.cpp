@@ -38,6 +38,10 @@ size_t NextPowerOfTwoSize(size_t x) {
 
 static constexpr size_t kDefaultArenaSize = 4096 * 16;
 
+// Cached decompositions are dropped all at once past this count so that
+// animated or generated paths can't grow the cache without bound.
+static constexpr size_t kMaxCachedDecompositions = 4096;
+
 } // namespace
 
 Triangulator::Triangulator()
@@ -143,10 +147,19 @@ std::pair<size_t, size_t> Triangulator::expensiveTriangulate(const Path &path,
 
 std::pair<size_t, size_t> Triangulator::triangulate(const Path &path,
                                                     Scalar scale_factor) {
-    Point contour_start = Point(0, 0);
-    size_t contour_start_index = 0;
-
-    path.iterate([&](SegmentType type, const Point *data) {
+    // The callback only captures this and the contour state, which keeps it
+    // small enough for std::function to store without a heap allocation.
+    struct {
+        Point contour_start;
+        size_t contour_start_index;
+        Scalar path_area;
+        Scalar scale_factor;
+    } state = {Point(0, 0), 0, 0, scale_factor};
+    size_t index_start = index_size_;
+
+    path.iterate([this, &state](SegmentType type, const Point *data) {
+        auto &[contour_start, contour_start_index, path_area, scale_factor] =
+            state;
         switch (type) {
         case SegmentType::kStart: {
             contour_start = data[0];
@@ -205,42 +218,177 @@ std::pair<size_t, size_t> Triangulator::triangulate(const Path &path,
             break;
         }
         case SegmentType::kClose:
-            // Write indices that generate a triangle fan like structure.
-            size_t required = (vertex_size_ - (contour_start_index + 2)) * 3;
-            EnsureIndexStorage(required);
-
-            // Computer centroid (only weighted on vertices, todo use surface
-            // formula).
-            Scalar cx = 0.0;
-            Scalar cy = 0.0;
-            Scalar n = vertex_size_ - contour_start_index;
-            for (size_t i = contour_start_index; i < vertex_size_; i++) {
-                cx += points_[i].x / n;
-                cy += points_[i].y / n;
+            if (collect_stats_) {
+                for (size_t i = contour_start_index; i + 1 < vertex_size_;
+                     i++) {
+                    path_area += points_[i].Cross(points_[i + 1]) / 2;
+                }
             }
-            EnsurePointStorage(1);
-            points_[vertex_size_++] = Point(cx, cy);
-
-            // While we can technically use any point as the origin of the
-            // triangle fan, triangulating from the centroid gives slightly
-            // better performance as it tends to create fewer skinny triangles.
-            // On an M* macbook rendering ghostscript tiger, I measured 177us
-            // for rasterization with centroid and 215 us for rasterization
-            // without.
-            for (auto i = contour_start_index + 1; i < vertex_size_ - 1; i++) {
-                indices_[index_size_++] = vertex_size_ - 1;
-                indices_[index_size_++] = i - 1;
-                indices_[index_size_++] = i;
+            switch (fan_style_) {
+            case FanStyle::kCentroid:
+                WriteCentroidFan(contour_start_index);
+                break;
+            case FanStyle::kMiddleOut:
+                WriteMiddleOutFan(contour_start_index);
+                break;
             }
             break;
         }
         return true;
     });
+    if (collect_stats_) {
+        for (size_t i = index_start; i + 2 < index_size_; i += 3) {
+            const Point &a = points_[indices_[i]];
+            const Point &b = points_[indices_[i + 1]];
+            const Point &c = points_[indices_[i + 2]];
+            stats_.triangle_area += std::abs((b - a).Cross(c - a)) / 2;
+        }
+        stats_.path_area += std::abs(state.path_area);
+    }
     return std::make_pair(vertex_size_, index_size_);
 }
 
+void Triangulator::WriteCentroidFan(size_t contour_start_index) {
+    // Write indices that generate a triangle fan like structure.
+    size_t required = (vertex_size_ - (contour_start_index + 2)) * 3;
+    EnsureIndexStorage(required);
+
+    // Computer centroid (only weighted on vertices, todo use surface
+    // formula).
+    Scalar cx = 0.0;
+    Scalar cy = 0.0;
+    Scalar n = vertex_size_ - contour_start_index;
+    for (size_t i = contour_start_index; i < vertex_size_; i++) {
+        cx += points_[i].x / n;
+        cy += points_[i].y / n;
+    }
+    EnsurePointStorage(1);
+    points_[vertex_size_++] = Point(cx, cy);
+
+    // While we can technically use any point as the origin of the
+    // triangle fan, triangulating from the centroid gives slightly
+    // better performance as it tends to create fewer skinny triangles.
+    // On an M* macbook rendering ghostscript tiger, I measured 177us
+    // for rasterization with centroid and 215 us for rasterization
+    // without.
+    for (auto i = contour_start_index + 1; i < vertex_size_ - 1; i++) {
+        indices_[index_size_++] = vertex_size_ - 1;
+        indices_[index_size_++] = i - 1;
+        indices_[index_size_++] = i;
+    }
+}
+
+void Triangulator::WriteMiddleOutFan(size_t contour_start_index) {
+    // The contour is closed by repeating the start point, which isn't needed
+    // when walking the contour as a ring.
+    size_t n = vertex_size_ - contour_start_index;
+    if (n > 1 && points_[vertex_size_ - 1] == points_[contour_start_index]) {
+        n--;
+    }
+    if (n < 3) {
+        return;
+    }
+    EnsureIndexStorage(n * 3);
+
+    // Each pass connects every other remaining vertex, cutting off a
+    // triangle between them and halving the size of the remaining polygon:
+    //
+    //   step 1: (0, 1, 2), (2, 3, 4), (4, 5, 6), ...
+    //   step 2: (0, 2, 4), (4, 6, 8), ...
+    //   step 4: (0, 4, 8), ...
+    //
+    // The final vertex wraps back to the start of the contour.
+    for (size_t step = 1; step < n; step *= 2) {
+        for (size_t i = 0; i + step < n; i += 2 * step) {
+            size_t last = std::min(i + 2 * step, n) % n;
+            if (last == i) {
+                continue;
+            }
+            indices_[index_size_++] = contour_start_index + i;
+            indices_[index_size_++] = contour_start_index + i + step;
+            indices_[index_size_++] = contour_start_index + last;
+        }
+    }
+}
+
+std::pair<size_t, size_t>
+Triangulator::triangulateConvexDecomposition(const Path &path,
+                                             Scalar scale_factor) {
+    size_t scale_bits = 0;
+    ::memcpy(&scale_bits, &scale_factor, sizeof(Scalar));
+    size_t key = path.GetHash() ^ (scale_bits * 0x9e3779b97f4a7c15ull);
+
+    auto it = decomposition_cache_.find(key);
+    // A different path or scale factor with the same key replaces the entry.
+    if (it != decomposition_cache_.end() &&
+        (it->second.scale_factor != scale_factor ||
+         !it->second.path.HasSameSegments(path))) {
+        decomposition_cache_.erase(it);
+        it = decomposition_cache_.end();
+    }
+    if (it == decomposition_cache_.end()) {
+        if (decomposition_cache_.size() >= kMaxCachedDecompositions) {
+            decomposition_cache_.clear();
+        }
+        // Failures are cached as an empty decomposition so that paths which
+        // can't be decomposed aren't retried every frame.
+        ConvexDecomposition decomposition;
+        ComputeConvexDecomposition(path, scale_factor, decomposition);
+        it = decomposition_cache_
+                 .emplace(key, CachedDecomposition{
+                                   .path = path.Clone(),
+                                   .scale_factor = scale_factor,
+                                   .decomposition = std::move(decomposition)})
+                 .first;
+    }
+    const ConvexDecomposition &decomposition = it->second.decomposition;
+    if (decomposition.indices.empty()) {
+        return std::make_pair(0, 0);
+    }
+
+    size_t base_vertex = vertex_size_;
+    EnsurePointStorage(decomposition.points.size());
+    EnsureIndexStorage(decomposition.indices.size());
+    for (const Point &pt : decomposition.points) {
+        points_[vertex_size_++] = pt;
+    }
+    for (uint16_t index : decomposition.indices) {
+        indices_[index_size_++] = base_vertex + index;
+    }
+    return std::make_pair(vertex_size_, index_size_);
+}
+
+std::tuple<size_t, size_t, size_t>
+Triangulator::triangulatePatches(const Path &path, Scalar scale_factor,
+                                 Scalar resolve_level_bias) {
+    BuildCurvePatches(path, scale_factor, patch_mesh_, resolve_level_bias);
+
+    size_t base_vertex = vertex_size_;
+    EnsurePointStorage(patch_mesh_.fan_points.size());
+    EnsureIndexStorage(patch_mesh_.fan_indices.size());
+    for (const Point &pt : patch_mesh_.fan_points) {
+        points_[vertex_size_++] = pt;
+    }
+    for (uint16_t index : patch_mesh_.fan_indices) {
+        indices_[index_size_++] = base_vertex + index;
+    }
+    return std::make_tuple(vertex_size_, index_size_,
+                           patch_mesh_.patches.size());
+}
+
+bool Triangulator::writePatches(void *patches) {
+    if (patches != nullptr) {
+        ::memcpy(patches, patch_mesh_.patches.data(),
+                 patch_mesh_.patches.size() * sizeof(CurvePatch));
+    }
+    patch_mesh_.patches.clear();
+    return true;
+}
+
 bool Triangulator::write(void *vertices, void *indices) {
     if (vertices == nullptr || indices == nullptr) {
+        vertex_size_ = 0;
+        index_size_ = 0;
         return true;
     }
     ::memcpy(vertices, points_.data(), vertex_size_ * sizeof(Point));
@@ -253,13 +401,13 @@ bool Triangulator::write(void *vertices, void *indices) {
 
 void Triangulator::EnsurePointStorage(size_t n) {
     if (vertex_size_ + n >= points_.size()) {
-        points_.resize(NextPowerOfTwoSize(points_.size()));
+        points_.resize(NextPowerOfTwoSize(vertex_size_ + n + 1));
     }
 }
 
 void Triangulator::EnsureIndexStorage(size_t n) {
     if (index_size_ + n >= indices_.size()) {
-        indices_.resize(NextPowerOfTwoSize(indices_.size()));
+        indices_.resize(NextPowerOfTwoSize(index_size_ + n + 1));
     }
 }
 
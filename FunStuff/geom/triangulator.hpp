@@ -3,10 +3,44 @@
 
 #include <simd/simd.h>
 
+#include <tuple>
+#include <unordered_map>
+
 #include "bezier.hpp"
+#include "convex_decomposition.hpp"
+#include "patches.hpp"
 
 namespace flatland {
 
+/// @brief How the interior of each contour is split into triangles for
+/// stenciling.
+///
+/// Both styles produce triangles whose signed coverage sums to the winding
+/// number of the contour, so either can be used with the non-zero and even-odd
+/// stencil passes.
+enum class FanStyle {
+    /// A single triangle fan from the vertex centroid of the contour.
+    kCentroid,
+    /// Recursive halving of the contour: connect every other vertex, then
+    /// every fourth, and so on. Triangles are better shaped and overlap less
+    /// than a single fan on long contours.
+    kMiddleOut,
+};
+
+/// @brief Statistics for the fills written by [Triangulator::triangulate].
+struct TriangulatorStats {
+    /// Sum of the unsigned area of every triangle written.
+    Scalar triangle_area = 0;
+    /// Sum of the area covered by each path.
+    Scalar path_area = 0;
+
+    /// @brief An estimate of stencil overdraw: the average number of times
+    /// each covered pixel is touched by the stencil pass.
+    Scalar GetOverdrawEstimate() const {
+        return path_area > 0 ? triangle_area / path_area : 0;
+    }
+};
+
 /// @brief A triangulator consumes [Path] objects and produces a triangulated
 /// mesh for
 ///        rasterization in a triangle layout.
@@ -43,6 +77,30 @@ class Triangulator {
                                                 Scalar stroke_width,
                                                 Scalar scale_factor);
 
+    /// @brief Triangulate [path] into non-overlapping convex pieces that can be
+    /// drawn without a stencil pass.
+    ///
+    /// Decompositions are cached by path contents and scale factor, so
+    /// redrawing the same path only costs a copy.
+    ///
+    /// @returns the number of Points in the mesh and the number of indices, or
+    /// zero for both if the path cannot be decomposed and must be stenciled.
+    std::pair<size_t, size_t>
+    triangulateConvexDecomposition(const Path &path, Scalar scale_factor);
+
+    /// @brief Triangulate [path] into an inner fan of segment end points plus
+    /// one or more [CurvePatch]es per curve, to be expanded on the GPU with
+    /// [resolve_level_bias].
+    ///
+    /// The fan is written out with [write] and the patches with
+    /// [writePatches].
+    ///
+    /// @returns the number of Points and indices in the fan, and the number of
+    /// patches.
+    std::tuple<size_t, size_t, size_t>
+    triangulatePatches(const Path &path, Scalar scale_factor,
+                       Scalar resolve_level_bias = 0);
+
     std::pair<size_t, size_t> expensiveTriangulate(const Path &path,
                                                    Scalar scale_factor);
 
@@ -55,11 +113,46 @@ class Triangulator {
     /// @returns Whether the write was successful.
     bool write(void *vertices, void *indices);
 
+    /// @brief Write out the patches from [triangulatePatches] into [patches].
+    ///
+    /// Providing nullptr will cause the triangulator to discard the patches.
+    bool writePatches(void *patches);
+
+    void SetFanStyle(FanStyle style) { fan_style_ = style; }
+
+    FanStyle GetFanStyle() const { return fan_style_; }
+
+    /// @brief Enable or disable collection of [TriangulatorStats].
+    ///
+    /// Stats are not collected by default as computing them costs an extra
+    /// pass over every triangle.
+    void SetCollectStats(bool value) { collect_stats_ = value; }
+
+    const TriangulatorStats &GetStats() const { return stats_; }
+
+    void ResetStats() { stats_ = {}; }
+
   private:
     std::vector<Point> points_;
     std::vector<uint16_t> indices_;
     size_t vertex_size_ = 0;
     size_t index_size_ = 0;
+    // A cached decomposition, with the path and scale factor it was computed
+    // for so that keys which collide can be told apart.
+    struct CachedDecomposition {
+        Path path;
+        Scalar scale_factor;
+        ConvexDecomposition decomposition;
+    };
+    std::unordered_map<size_t, CachedDecomposition> decomposition_cache_;
+    CurvePatchMesh patch_mesh_;
+    FanStyle fan_style_ = FanStyle::kCentroid;
+    bool collect_stats_ = false;
+    TriangulatorStats stats_;
+
+    void WriteCentroidFan(size_t contour_start_index);
+
+    void WriteMiddleOutFan(size_t contour_start_index);
 
     void EnsurePointStorage(size_t n);
 
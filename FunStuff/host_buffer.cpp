@@ -76,6 +76,12 @@ std::optional<HostBuffer::Result> HostBuffer::LookupPersistent(size_t id) {
     return it->second;
 }
 
+void HostBuffer::ResetPersistent() {
+    for (BufferMetadata &metadata : persistent_buffers_) {
+        metadata.offset = 0;
+    }
+}
+
 HostBuffer::BufferMetadata *
 HostBuffer::FindPersistentStorageOfSize(size_t required_bytes) {
     for (auto i = 0u; i < persistent_buffers_.size(); i++) {
@@ -204,5 +210,21 @@ std::pair<MTL::Texture*, MTL::Texture*> HostBuffer::CreateMSAATextures(uint32_t
     return cached_msaa_[cache_key] = std::make_pair(msaa_tex, ds_tex);
 }
 
+void HostBuffer::ReleaseAttachments(uint32_t width, uint32_t height) {
+    uint64_t cache_key = static_cast<uint64_t>(width) << 32 | height;
+
+    auto msaa = cached_msaa_.find(cache_key);
+    if (msaa != cached_msaa_.end()) {
+        msaa->second.first->release();
+        msaa->second.second->release();
+        cached_msaa_.erase(msaa);
+    }
+    auto ds = cached_depth_stencil_.find(cache_key);
+    if (ds != cached_depth_stencil_.end()) {
+        ds->second->release();
+        cached_depth_stencil_.erase(ds);
+    }
+}
+
 
 } // namespace flatland
@@ -43,6 +43,11 @@ public:
     
     std::optional<Result> LookupPersistent(size_t id);
     
+    /// @brief Rewind the persistent buffers so that their storage is reused.
+    ///
+    /// Every view previously returned by [AllocatePersistent] is invalidated.
+    void ResetPersistent();
+    
     std::pair<MTL::Texture*, size_t> AllocateTexture(MTL::TextureDescriptor* desc);
     
     MTL::Texture* AllocateTempTexture(MTL::TextureDescriptor* desc);
@@ -53,6 +58,10 @@ public:
     std::pair<MTL::Texture*, MTL::Texture*> CreateMSAATextures(uint32_t width, uint32_t height);
     
     MTL::Texture* CreateDepthStencil(uint32_t width, uint32_t height);
+
+    /// @brief Release the MSAA and depth stencil textures made for targets of
+    /// [width] by [height], if any. They are made again when next needed.
+    void ReleaseAttachments(uint32_t width, uint32_t height);
   
 private:
     // Persistent data.
@@ -57,6 +57,9 @@ void MTLEngine::initWindow() {
     metalLayer.device = (__bridge id<MTLDevice>)metalDevice;
     metalLayer.pixelFormat = MTLPixelFormatBGRA8Unorm;
     metalLayer.drawableSize = CGSizeMake(width, height);
+    // Frames are copied into the drawable from the renderer's retained
+    // texture.
+    metalLayer.framebufferOnly = NO;
     
     metalWindow.contentView.layer = metalLayer;
     metalWindow.contentView.wantsLayer = YES;
@@ -0,0 +1,120 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace flatland {
+
+namespace {
+
+// A range of indices owned by one worker. The bounds are packed into a single
+// atomic so that the owner and thieves can both update it with one compare
+// and swap.
+class WorkRange {
+  public:
+    void Reset(uint32_t begin, uint32_t end) {
+        range_.store(Pack(begin, end), std::memory_order_release);
+    }
+
+    // Claim the next index from the front of the range. Called by the owner.
+    bool Pop(uint32_t &index) {
+        uint64_t range = range_.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t begin = range >> 32;
+            uint32_t end = static_cast<uint32_t>(range);
+            if (begin >= end) {
+                return false;
+            }
+            if (range_.compare_exchange_weak(range, Pack(begin + 1, end),
+                                             std::memory_order_acq_rel)) {
+                index = begin;
+                return true;
+            }
+        }
+    }
+
+    // Take the back half of the remaining indices. Called by other workers.
+    bool Steal(uint32_t &stolen_begin, uint32_t &stolen_end) {
+        uint64_t range = range_.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t begin = range >> 32;
+            uint32_t end = static_cast<uint32_t>(range);
+            if (begin >= end) {
+                return false;
+            }
+            uint32_t middle = begin + (end - begin) / 2;
+            if (range_.compare_exchange_weak(range, Pack(begin, middle),
+                                             std::memory_order_acq_rel)) {
+                stolen_begin = middle;
+                stolen_end = end;
+                return true;
+            }
+        }
+    }
+
+  private:
+    std::atomic<uint64_t> range_ = 0;
+
+    static uint64_t Pack(uint32_t begin, uint32_t end) {
+        return static_cast<uint64_t>(begin) << 32 | end;
+    }
+};
+
+} // namespace
+
+void ParallelFor(size_t count, const std::function<void(size_t)> &fn) {
+    size_t thread_count = std::min<size_t>(
+        std::max(std::thread::hardware_concurrency(), 1u), count);
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    // Each worker starts with a contiguous slice, so neighbouring indices
+    // tend to run on the same thread.
+    std::vector<WorkRange> ranges(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        ranges[i].Reset(count * i / thread_count,
+                        count * (i + 1) / thread_count);
+    }
+
+    auto worker = [&](size_t self) {
+        while (true) {
+            uint32_t index;
+            while (ranges[self].Pop(index)) {
+                fn(index);
+            }
+            // Out of work, steal half of another worker's remaining range.
+            // A worker only exits after every other range was seen empty.
+            bool stole = false;
+            for (size_t i = 1; i < thread_count && !stole; i++) {
+                uint32_t begin, end;
+                if (ranges[(self + i) % thread_count].Steal(begin, end)) {
+                    ranges[self].Reset(begin + 1, end);
+                    fn(begin);
+                    stole = true;
+                }
+            }
+            if (!stole) {
+                return;
+            }
+        }
+    };
+
+    // The calling thread also does work.
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+} // namespace flatland
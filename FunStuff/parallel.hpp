@@ -0,0 +1,21 @@
+#ifndef PARALLEL
+#define PARALLEL
+
+#include <cstddef>
+#include <functional>
+
+namespace flatland {
+
+/// @brief Invoke [fn] once for every index in [0, count), distributing the
+/// indices across worker threads.
+///
+/// Each thread starts with a contiguous slice of the indices and steals half
+/// of another thread's remaining slice when it runs out, so uneven work per
+/// index is balanced while neighbouring indices mostly share a thread. Blocks
+/// until every invocation has returned. [fn] must be safe to call
+/// concurrently for different indices, and [count] must be less than 2^32.
+void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+} // namespace flatland
+
+#endif // PARALLEL
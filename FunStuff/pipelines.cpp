@@ -177,6 +177,47 @@ Pipelines::Pipelines(MTL::Device *metal_device, bool enable_msaa) {
         desc->release();
     }
 
+    // Atlas Fill.
+    {
+        MTL::RenderPipelineDescriptor *desc = makeDefaultDescriptor(enable_msaa);
+        MTL::Function *vertexShader = library->newFunction(
+            NS::String::string("atlasVertexShader", NS::ASCIIStringEncoding));
+        MTL::Function *fragmentShader = library->newFunction(NS::String::string(
+            "atlasFragmentShader", NS::ASCIIStringEncoding));
+        desc->setLabel(
+            NS::String::string("Atlas Fill", NS::ASCIIStringEncoding));
+        desc->setVertexFunction(vertexShader);
+        desc->setFragmentFunction(fragmentShader);
+
+        NS::Error *error;
+        makeForBlendMode(BlendMode::kSrcOver,
+                         desc->colorAttachments()->object(0));
+        atlas_fill_ = metal_device->newRenderPipelineState(desc, &error);
+        desc->release();
+    }
+
+    // Batch Fill.
+    {
+        MTL::RenderPipelineDescriptor *desc = makeDefaultDescriptor(enable_msaa);
+        MTL::Function *vertexShader = library->newFunction(
+            NS::String::string("batchVertexShader", NS::ASCIIStringEncoding));
+        MTL::Function *fragmentShader = library->newFunction(NS::String::string(
+            "batchFragmentShader", NS::ASCIIStringEncoding));
+        desc->setLabel(
+            NS::String::string("Batch Fill", NS::ASCIIStringEncoding));
+        desc->setVertexFunction(vertexShader);
+        desc->setFragmentFunction(fragmentShader);
+
+        for (int i = 0; i < 2; i++) {
+            NS::Error *error;
+            makeForBlendMode(static_cast<BlendMode>(i),
+                             desc->colorAttachments()->object(0));
+            batch_fill_[i] =
+                metal_device->newRenderPipelineState(desc, &error);
+        }
+        desc->release();
+    }
+
     // Stencil pipeline
     {
         MTL::RenderPipelineDescriptor *desc = makeDefaultDescriptor(enable_msaa);
@@ -196,12 +237,36 @@ Pipelines::Pipelines(MTL::Device *metal_device, bool enable_msaa) {
         stencil_pipeline_ = metal_device->newRenderPipelineState(desc, &error);
         desc->release();
     }
+
+    // Curve patch stencil pipeline
+    {
+        MTL::RenderPipelineDescriptor *desc = makeDefaultDescriptor(enable_msaa);
+        MTL::Function *vertexShader = library->newFunction(NS::String::string(
+            "patchStencilVertexShader", NS::ASCIIStringEncoding));
+        MTL::Function *fragmentShader = library->newFunction(NS::String::string(
+            "stencilFragmentShader", NS::ASCIIStringEncoding));
+        desc->setLabel(NS::String::string("Patch Stencil Shader",
+                                          NS::ASCIIStringEncoding));
+        desc->setVertexFunction(vertexShader);
+        desc->setFragmentFunction(fragmentShader);
+        desc->colorAttachments()->object(0)->setWriteMask(
+            MTL::ColorWriteMaskNone);
+        desc->colorAttachments()->object(0)->setBlendingEnabled(false);
+
+        NS::Error *error;
+        patch_stencil_pipeline_ =
+            metal_device->newRenderPipelineState(desc, &error);
+        desc->release();
+    }
 }
 
 Pipelines::~Pipelines() {
     stencil_pipeline_->release();
+    patch_stencil_pipeline_->release();
     blur_pipelines_->release();
+    atlas_fill_->release();
     for (int i = 0; i < 2; i++) {
+        batch_fill_[i]->release();
         solid_color_[i]->release();
         linear_gradient_[i]->release();
         radial_gradient_[i]->release();
@@ -225,12 +290,24 @@ MTL::RenderPipelineState *Pipelines::GetTextureFill(BlendMode mode) const {
     return texture_Fill_[static_cast<int>(mode)];
 }
 
+MTL::RenderPipelineState *Pipelines::GetAtlasFill() const {
+    return atlas_fill_;
+}
+
+MTL::RenderPipelineState *Pipelines::GetBatchFill(BlendMode mode) const {
+    return batch_fill_[static_cast<int>(mode)];
+}
+
 MTL::RenderPipelineState *Pipelines::GetBlur() const { return blur_pipelines_; }
 
 MTL::RenderPipelineState *Pipelines::GetStencil() const {
     return stencil_pipeline_;
 }
 
+MTL::RenderPipelineState *Pipelines::GetPatchStencil() const {
+    return patch_stencil_pipeline_;
+}
+
 MTL::RenderPipelineState *Pipelines::GetDownsample() const {
     return downsample_pipeline_;
 }
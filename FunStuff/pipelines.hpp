@@ -28,6 +28,13 @@ class Pipelines {
     MTL::RenderPipelineState *GetRadialGradient(BlendMode mode) const;
     
     MTL::RenderPipelineState *GetTextureFill(BlendMode mode) const;
+
+    /// @brief Fill pipeline for batches of [CoverageAtlas] quads.
+    MTL::RenderPipelineState *GetAtlasFill() const;
+
+    /// @brief Fill pipeline for batches of pre-transformed convex draws with
+    /// per vertex color and depth.
+    MTL::RenderPipelineState *GetBatchFill(BlendMode mode) const;
     
     MTL::RenderPipelineState *GetBlur() const;
     
@@ -38,6 +45,10 @@ class Pipelines {
     // Draw is not impacted by blend mode
     MTL::RenderPipelineState *GetStencil() const;
 
+    /// @brief Stencil pipeline that expands instanced [CurvePatch] data into
+    /// curve fans.
+    MTL::RenderPipelineState *GetPatchStencil() const;
+
   private:
     Pipelines(const Pipelines &) = delete;
     Pipelines &operator=(const Pipelines &) = delete;
@@ -47,8 +58,11 @@ class Pipelines {
     MTL::RenderPipelineState *linear_gradient_[2];
     MTL::RenderPipelineState *radial_gradient_[2];
     MTL::RenderPipelineState *texture_Fill_[2];
+    MTL::RenderPipelineState *atlas_fill_;
+    MTL::RenderPipelineState *batch_fill_[2];
     MTL::RenderPipelineState *downsample_pipeline_;
     MTL::RenderPipelineState *stencil_pipeline_;
+    MTL::RenderPipelineState *patch_stencil_pipeline_;
     MTL::RenderPipelineState *blur_pipelines_;
 };
 
@@ -0,0 +1,93 @@
+#include "recording_backend.hpp"
+
+#include "geom/patches.hpp"
+
+namespace flatland {
+
+void RecordingBackend::Encode(const RenderProgram &program) {
+    for (const RenderProgram::Data &offscreen : program.GetOffscreens()) {
+        EncodePass(offscreen.commands, offscreen.depth_ranges,
+                   program.GetTables());
+    }
+    EncodePass(program.GetCommands(), program.GetDepthRanges(),
+               program.GetTables());
+}
+
+void RecordingBackend::Reset() {
+    draw_calls_.clear();
+    stats_ = {};
+}
+
+void RecordingBackend::EncodePass(const std::vector<PackedCommand> &commands,
+                                  const std::vector<DepthRange> &depth_ranges,
+                                  const DisplayListTables &tables) {
+    stats_.passes++;
+    size_t next_range = 1;
+    // Each case mirrors the corresponding draw method of [Renderer].
+    for (uint32_t i = 0; i < commands.size(); i++) {
+        const PackedCommand &command = commands[i];
+        if (next_range < depth_ranges.size() &&
+            depth_ranges[next_range].begin == i) {
+            // A full screen quad with the clip pipeline, and its uniforms.
+            next_range++;
+            stats_.depth_clears++;
+            stats_.transient_allocations += 2;
+            Draw(CommandType::kClip, 6);
+        }
+        switch (command.type) {
+        case CommandType::kDraw: {
+            // Vertex uniforms and the color source.
+            stats_.transient_allocations += 2;
+            if (command.IsConvex()) {
+                Draw(command.type, command.index_count);
+                break;
+            }
+            const CommandExtra &extra = tables.extras[command.extra_index];
+            if (command.index_count > 0) {
+                Draw(command.type, command.index_count);
+            }
+            if (extra.patch_count > 0) {
+                Draw(command.type, kPatchVertexCount, extra.patch_count);
+            }
+            // Cover.
+            stats_.transient_allocations++;
+            Draw(command.type, 6);
+            break;
+        }
+        case CommandType::kClip: {
+            stats_.transient_allocations++;
+            Draw(command.type, command.index_count);
+            // The difference cover only needs its quad, the intersect cover
+            // needs its own uniforms too.
+            stats_.transient_allocations +=
+                command.GetClipStyle() == ClipStyle::kDifference ? 1 : 2;
+            Draw(command.type, 6);
+            break;
+        }
+        case CommandType::kTexture:
+            stats_.transient_allocations += 3;
+            Draw(command.type, 6);
+            break;
+        case CommandType::kAtlas:
+        case CommandType::kBatch:
+            stats_.transient_allocations++;
+            Draw(command.type, command.index_count);
+            break;
+        case CommandType::kScissor:
+            break;
+        }
+    }
+}
+
+void RecordingBackend::Draw(CommandType type, size_t vertex_count,
+                            size_t instance_count) {
+    draw_calls_.push_back(RecordedDrawCall{
+        .type = type,
+        .vertex_count = vertex_count,
+        .instance_count = instance_count,
+    });
+    stats_.draw_calls++;
+    stats_.vertices += vertex_count * instance_count;
+}
+
+} // namespace flatland
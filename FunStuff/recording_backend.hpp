@@ -0,0 +1,69 @@
+#ifndef RECORDING_BACKEND
+#define RECORDING_BACKEND
+
+#include <vector>
+
+#include "canvas.hpp"
+
+namespace flatland {
+
+/// @brief A draw call as [Renderer] would encode it.
+struct RecordedDrawCall {
+    CommandType type;
+    /// The number of vertices or indices drawn.
+    size_t vertex_count = 0;
+    size_t instance_count = 1;
+};
+
+/// @brief Totals over the passes of a [RenderProgram].
+struct RecordedWorkStats {
+    size_t passes = 0;
+    size_t draw_calls = 0;
+    /// Transient uniform and cover buffers allocated while encoding.
+    size_t transient_allocations = 0;
+    size_t vertices = 0;
+    /// Depth buffer clears between [DepthRange]s, included in [draw_calls].
+    size_t depth_clears = 0;
+};
+
+/// @brief A backend that walks a [RenderProgram] the way [Renderer] encodes
+/// it, recording the draw calls instead of issuing them.
+///
+/// This allows the GPU work of a program to be measured without a device.
+/// Filters and the final composite of each offscreen are not recorded.
+class RecordingBackend {
+  public:
+    RecordingBackend() = default;
+
+    ~RecordingBackend() = default;
+
+    /// @brief Record the draw calls of every pass of [program].
+    void Encode(const RenderProgram &program);
+
+    const std::vector<RecordedDrawCall> &GetDrawCalls() const {
+        return draw_calls_;
+    }
+
+    const RecordedWorkStats &GetStats() const { return stats_; }
+
+    void Reset();
+
+  private:
+    std::vector<RecordedDrawCall> draw_calls_;
+    RecordedWorkStats stats_;
+
+    void EncodePass(const std::vector<PackedCommand> &commands,
+                    const std::vector<DepthRange> &depth_ranges,
+                    const DisplayListTables &tables);
+
+    void Draw(CommandType type, size_t vertex_count,
+              size_t instance_count = 1);
+
+    RecordingBackend(RecordingBackend &&) = delete;
+    RecordingBackend(const RecordingBackend &) = delete;
+    RecordingBackend &operator=(const RecordingBackend &) = delete;
+};
+
+} // namespace flatland
+
+#endif // RECORDING_BACKEND
@@ -1,12 +1,16 @@
 #ifndef RENDERER
 #define RENDERER
 
+#include <unordered_map>
+
 #include <Metal/Metal.hpp>
 #include <QuartzCore/CAMetalLayer.h>
 #include <QuartzCore/CAMetalLayer.hpp>
 #include <QuartzCore/QuartzCore.hpp>
 
 #include "canvas.hpp"
+#include "damage_tracker.hpp"
+#include "geom/atlas.hpp"
 #include "geom/grid.hpp"
 #include "geom/triangulator.hpp"
 #include "host_buffer.hpp"
@@ -44,6 +48,12 @@ class Renderer {
 
     ~Renderer();
 
+    /// @brief Encode a frame of the picture into [onscreen].
+    ///
+    /// The picture is drawn into a retained texture that is copied to
+    /// [onscreen], and only the parts that differ from the last frame are
+    /// drawn again. [onscreen] must allow blits, so drawables need
+    /// `framebufferOnly` turned off.
     MTL::CommandBuffer *render(MTL::Texture *onscreen);
 
   private:
@@ -52,6 +62,8 @@ class Renderer {
     std::unique_ptr<Triangulator> triangulator_;
     std::unique_ptr<HostBuffer> host_buffer_;
     std::unique_ptr<Pipelines> pipelines_;
+    std::unique_ptr<CoverageAtlas> coverage_atlas_;
+    MTL::Texture *atlas_texture_ = nullptr;
     struct NSVGimage *image_;
     struct NSVGimage *star_;
 
@@ -59,6 +71,42 @@ class Renderer {
 
     RenderProgram picture_;
 
+    // Damage tracking.
+    DamageTracker damage_tracker_;
+    // The last frame, which is copied to the drawable each frame.
+    MTL::Texture *retained_texture_ = nullptr;
+    // Render targets for damage rects, by width and height.
+    struct DamageTexture {
+        MTL::Texture *texture;
+        // The frame that last drew into [texture].
+        uint64_t last_used;
+    };
+    std::unordered_map<uint64_t, DamageTexture> damage_textures_;
+    uint64_t frame_count_ = 0;
+
+    /// @brief A render target of [width] by [height] pixels for drawing
+    /// damage rects into.
+    MTL::Texture *GetDamageTexture(uint32_t width, uint32_t height);
+
+    /// @brief Release the damage targets, and the attachments made for them,
+    /// that no recent frame has drawn into.
+    void EvictDamageTextures();
+
+    /// @brief Encode [commands] into a render target covering the device
+    /// space [target_bounds], scissored to [visible_bounds].
+    ///
+    /// Runs of [groups] whose bounds don't intersect [visible_bounds] are
+    /// skipped. If [command_bounds] is given, so are the other commands
+    /// whose bounds don't intersect it. The depth buffer is cleared at the
+    /// start of each of [depth_ranges] but the first.
+    void EncodePass(MTL::RenderCommandEncoder *encoder,
+                    const std::vector<PackedCommand> &commands,
+                    const std::vector<CommandGroup> &groups,
+                    const std::vector<DepthRange> &depth_ranges,
+                    const Matrix &mvp, const Rect &target_bounds,
+                    const Rect &visible_bounds,
+                    const std::vector<std::optional<Rect>> *command_bounds);
+
     MTL::RenderCommandEncoder *
     SetUpRenderPass(MTL::Texture *onscreen, MTL::CommandBuffer *command_buffer,
                     Color clear_color);
@@ -67,20 +115,49 @@ class Renderer {
     SetUpBlurRenderPass(MTL::Texture *onscreen,
                         MTL::CommandBuffer *command_buffer);
 
+    /// @brief The depth of [depth_count] in the current [DepthRange].
+    Scalar ComputeDepth(Scalar depth_count) const {
+        return 1 - (depth_count - depth_base_) * depth_epsilon_;
+    }
+
+    /// @brief Reset the depth buffer within [visible_bounds] of a render
+    /// target covering [target_bounds] to the clear depth, restoring the
+    /// scissor to [scissor_bounds] afterwards.
+    void ClearDepth(MTL::RenderCommandEncoder *encoder,
+                    BufferBindingCache &cache, const Rect &target_bounds,
+                    const Rect &visible_bounds, const Rect &scissor_bounds);
+
     void DrawPathTriangulated(MTL::RenderCommandEncoder *encoder,
                               BufferBindingCache &cache, const Matrix &mvp,
-                              const Command &command);
+                              const PackedCommand &command);
 
+    /// @brief Encode a clip into a render target covering the device space
+    /// [target_bounds], while the draws are scissored to [scissor_bounds].
     void ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
                               BufferBindingCache &cache, const Matrix &mvp,
-                              const Command &command, ClipStyle style,
-                              const Rect &screen_size);
+                              const PackedCommand &command, ClipStyle style,
+                              const Rect &target_bounds,
+                              const Rect &scissor_bounds);
 
     void DrawTexture(MTL::RenderCommandEncoder *encoder,
                      BufferBindingCache &cache, const Matrix &mvp,
                      const Rect &dest, Scalar depth, Scalar alpha,
                      MTL::Texture *texture);
 
+    void DrawAtlas(MTL::RenderCommandEncoder *encoder,
+                   BufferBindingCache &cache, const Matrix &mvp,
+                   const PackedCommand &command);
+
+    void DrawBatch(MTL::RenderCommandEncoder *encoder,
+                   BufferBindingCache &cache, const Matrix &mvp,
+                   const PackedCommand &command);
+
+    /// @brief Copy the texels written to [coverage_atlas_] since the last
+    /// upload into [atlas_texture_].
+    ///
+    /// @returns whether any texels were copied.
+    bool UploadAtlas();
+
     void DrawBlur(MTL::CommandBuffer *command_buffer, MTL::Texture *source,
                   MTL::Texture *dest, Scalar sigma);
 
@@ -104,17 +181,27 @@ class Renderer {
     MTL::DepthStencilState *cover_stencil_opaque_;
     MTL::DepthStencilState *cover_stencil_transparent_;
     MTL::DepthStencilState *clip_depth_write_;
+    MTL::DepthStencilState *depth_clear_;
+
+    // The [DepthRange] of the commands being encoded.
+    Scalar depth_base_ = 0;
+    Scalar depth_epsilon_ = kDepthEpsilon;
 
     // Labels
     NS::String *convex_label_ = nullptr;
     NS::String *complex_label_ = nullptr;
     NS::String *clip_label_ = nullptr;
     NS::String *save_label_ = nullptr;
+    NS::String *atlas_label_ = nullptr;
+    NS::String *batch_label_ = nullptr;
+    NS::String *depth_clear_label_ = nullptr;
 
     // Gradients.
     MTL::SamplerState *gradient_sampler_ = nullptr;
     MTL::SamplerState *save_layer_sampler_ = nullptr;
     MTL::SamplerState *blur_filter_sampler_ = nullptr;
+    // Bilinear, in texel coordinates, for distance fields.
+    MTL::SamplerState *atlas_sampler_ = nullptr;
 
     Renderer(const Renderer &) = delete;
     Renderer(Renderer &&) = delete;
@@ -1,8 +1,10 @@
 #include "renderer.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <simd/simd.h>
 
+#include "display_list_optimizer.hpp"
 #include "geom/bezier.hpp"
 #include "geom/svg.hpp"
 #include "pipelines.hpp"
@@ -67,7 +69,8 @@ Renderer::Renderer(MTL::Device *metal_device)
     : metal_device_(metal_device),
       triangulator_(std::make_unique<Triangulator>()),
       host_buffer_(std::make_unique<HostBuffer>(metal_device)),
-      pipelines_(std::make_unique<Pipelines>(metal_device, kEnableMSAA)) {
+      pipelines_(std::make_unique<Pipelines>(metal_device, kEnableMSAA)),
+      coverage_atlas_(std::make_unique<CoverageAtlas>()) {
     command_queue_ = metal_device->newCommandQueue();
 
     convex_label_ = NS::String::string("Convex Draw", NS::ASCIIStringEncoding);
@@ -75,6 +78,10 @@ Renderer::Renderer(MTL::Device *metal_device)
         NS::String::string("NonConvex Draw", NS::ASCIIStringEncoding);
     clip_label_ = NS::String::string("Clip Draw", NS::ASCIIStringEncoding);
     save_label_ = NS::String::string("Save Layer", NS::ASCIIStringEncoding);
+    atlas_label_ = NS::String::string("Atlas Draw", NS::ASCIIStringEncoding);
+    batch_label_ = NS::String::string("Batch Draw", NS::ASCIIStringEncoding);
+    depth_clear_label_ =
+        NS::String::string("Depth Clear", NS::ASCIIStringEncoding);
 
     // Samplers
     {
@@ -130,6 +137,21 @@ Renderer::Renderer(MTL::Device *metal_device)
         save_layer_sampler_ = metal_device_->newSamplerState(sampler_desc);
         sampler_desc->release();
     }
+    {
+        MTL::SamplerDescriptor *sampler_desc = MTL::SamplerDescriptor::alloc();
+        sampler_desc->setMagFilter(MTL::SamplerMinMagFilterLinear);
+        sampler_desc->setMinFilter(MTL::SamplerMinMagFilterLinear);
+        sampler_desc->setMipFilter(MTL::SamplerMipFilterNotMipmapped);
+        sampler_desc->setRAddressMode(MTL::SamplerAddressModeClampToEdge);
+        sampler_desc->setSAddressMode(MTL::SamplerAddressModeClampToEdge);
+        sampler_desc->setTAddressMode(MTL::SamplerAddressModeClampToEdge);
+        sampler_desc->setNormalizedCoordinates(false);
+        sampler_desc->setMaxAnisotropy(1);
+        sampler_desc->setCompareFunction(MTL::CompareFunctionAlways);
+
+        atlas_sampler_ = metal_device_->newSamplerState(sampler_desc);
+        sampler_desc->release();
+    }
 
     // Descriptors
     {
@@ -272,6 +294,37 @@ Renderer::Renderer(MTL::Device *metal_device)
         front_desc->release();
         desc->release();
     }
+    {
+        // Overwrite the depth of everything drawn so far, leaving the
+        // stencil, which is zero between commands.
+        MTL::DepthStencilDescriptor *desc =
+            MTL::DepthStencilDescriptor::alloc()->init();
+        desc->setDepthWriteEnabled(true);
+        desc->setDepthCompareFunction(MTL::CompareFunctionAlways);
+
+        depth_clear_ = metal_device_->newDepthStencilState(desc);
+        desc->release();
+    }
+
+    // Coverage Atlas
+    {
+        ISize size = coverage_atlas_->GetSize();
+        MTL::TextureDescriptor *desc = MTL::TextureDescriptor::alloc();
+        desc->setWidth(size.w);
+        desc->setHeight(size.h);
+        desc->setDepth(1);
+        desc->setUsage(MTL::TextureUsageShaderRead);
+        desc->setArrayLength(1);
+        desc->setPixelFormat(MTL::PixelFormatR8Unorm);
+        desc->setMipmapLevelCount(1);
+        desc->setStorageMode(MTL::StorageModeShared);
+        desc->setSampleCount(1);
+        desc->setTextureType(MTL::TextureType2D);
+        desc->setSwizzle(MTL::TextureSwizzleChannels()); // WTF Metal CPP.
+
+        atlas_texture_ = host_buffer_->AllocateTexture(desc).first;
+        desc->release();
+    }
 
 //    image_ = ::nsvgParseFromFile(
 //        "/Users/jaydog/Downloads/inputs/svg/paris-30k.svg", "px", 96);
@@ -287,12 +340,26 @@ Renderer::~Renderer() {
     cover_stencil_transparent_->release();
     non_zero_stencil_->release();
     clip_depth_write_->release();
+    if (retained_texture_ != nullptr) {
+        retained_texture_->release();
+    }
+    for (auto &[key, damage_texture] : damage_textures_) {
+        damage_texture.texture->release();
+    }
     ::nsvgDelete(image_);
     ::nsvgDelete(star_);
 }
 
 void Renderer::InitPicture() {
-    Canvas canvas(host_buffer_.get(), triangulator_.get());
+    coverage_atlas_->BeginFrame();
+    Canvas canvas(host_buffer_.get(), triangulator_.get(),
+                  {.convex_decomposition = true,
+                   .curve_patches = true,
+                   .coverage_atlas = coverage_atlas_.get(),
+                   .occlusion_culling = true,
+                   .batch_convex_draws = true,
+                   .scissor_rect_clips = true,
+                   .optimizer_passes = MakeDefaultOptimizerPasses()});
 
     //    std::array<Color, 3> gradient_colors = {kRed, kGreen, kBlue};
     //    auto linear_gradient = canvas.CreateRadialGradient(
@@ -359,14 +426,32 @@ void Renderer::InitPicture() {
 
     RenderProgram program = canvas.Prepare();
     picture_ = std::move(program);
+    UploadAtlas();
 }
 
-static constexpr Scalar kDepthEpsilon = 1.0f / 262144.0;
+// The scissor rect covering the part of device space [rect] inside a render
+// target that covers [target_bounds], or std::nullopt if they don't overlap.
+static std::optional<MTL::ScissorRect>
+ComputeScissorRect(const Rect &rect, const Rect &target_bounds) {
+    std::optional<Rect> visible = rect.Intersection(target_bounds);
+    if (!visible.has_value()) {
+        return std::nullopt;
+    }
+    NS::UInteger l = std::floor(visible->l - target_bounds.l);
+    NS::UInteger t = std::floor(visible->t - target_bounds.t);
+    NS::UInteger r = std::ceil(visible->r - target_bounds.l);
+    NS::UInteger b = std::ceil(visible->b - target_bounds.t);
+    return MTL::ScissorRect{l, t, r - l, b - t};
+}
 
 void Renderer::DrawPathTriangulated(MTL::RenderCommandEncoder *encoder,
                                     BufferBindingCache &cache,
-                                    const Matrix &mvp, const Command &command) {
-    bool is_opaque_draw = command.paint.IsOpaque();
+                                    const Matrix &mvp,
+                                    const PackedCommand &command) {
+    const DisplayListTables &tables = picture_.GetTables();
+    const Paint &paint = tables.paints[command.paint_index];
+    MTL::Buffer *buffer = tables.buffers[command.buffer_index];
+    bool is_opaque_draw = paint.IsOpaque();
     struct UniformData {
         Matrix mvp;
         float depth;
@@ -378,25 +463,30 @@ void Renderer::DrawPathTriangulated(MTL::RenderCommandEncoder *encoder,
         host_buffer_->GetTransientArena(sizeof(UniformData), 16u);
     UniformData data;
     data.mvp = mvp;
-    data.depth = 1 - (command.depth_count * kDepthEpsilon);
+    data.depth = ComputeDepth(command.depth_count);
+    // Read as the resolve level bias by the curve patch stencil shader.
+    // Patches are recorded at scale 1 in local coordinates, and transforms
+    // map into framebuffer pixels, so the device scale is already part of
+    // the transform's scale.
+    data.padding = ComputeResolveLevelBias(
+        tables.transforms[command.transform_index].GetMaxBasisLength());
     ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(UniformData));
 
     // Draw shape. First by stenciling interior and then by restoring
     // via cover draw.
 
     // If path is convex, stenciling can be skipped.
-    if (command.is_convex) {
-        if (command.paint.stroke) {
+    if (command.IsConvex()) {
+        if (paint.stroke) {
             encoder->pushDebugGroup(
                 NS::String::string("Stroke Draw", NS::ASCIIStringEncoding));
         } else {
             encoder->pushDebugGroup(convex_label_);
         }
-        PrepareColorSource(encoder, cache, command.paint);
+        PrepareColorSource(encoder, cache, paint);
         cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
 
-        cache.Bind(command.vertex_buffer.buffer, command.vertex_buffer.offset,
-                   0);
+        cache.Bind(buffer, command.vertex_offset, 0);
 
         if (is_opaque_draw) {
             cache.BindDepthStencil(convex_draw_);
@@ -404,11 +494,10 @@ void Renderer::DrawPathTriangulated(MTL::RenderCommandEncoder *encoder,
             cache.BindDepthStencil(transparent_convex_draw_);
         }
 
-        if (command.index_buffer) {
+        if (command.IsIndexed()) {
             encoder->drawIndexedPrimitives(
                 MTL::PrimitiveTypeTriangle, command.index_count,
-                MTL::IndexTypeUInt16, command.index_buffer.buffer,
-                command.index_buffer.offset);
+                MTL::IndexTypeUInt16, buffer, command.index_offset);
         } else {
             NS::UInteger start = 0;
             NS::UInteger count = command.index_count;
@@ -423,35 +512,50 @@ void Renderer::DrawPathTriangulated(MTL::RenderCommandEncoder *encoder,
     cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
     {
         cache.BindPipeline(pipelines_->GetStencil());
-        cache.Bind(command.vertex_buffer.buffer, command.vertex_buffer.offset,
-                   0);
-        if (command.paint.fill_rule == FillRule::kNonZero) {
+        cache.Bind(buffer, command.vertex_offset, 0);
+        if (paint.fill_rule == FillRule::kNonZero) {
             cache.BindDepthStencil(non_zero_stencil_);
         } else {
             cache.BindDepthStencil(even_odd_stencil_);
         }
 
-        if (command.index_buffer) {
+        if (command.index_count == 0) {
+            // Only curve patches, nothing to fan.
+        } else if (command.IsIndexed()) {
             encoder->drawIndexedPrimitives(
                 MTL::PrimitiveTypeTriangle, command.index_count,
-                MTL::IndexTypeUInt16, command.index_buffer.buffer,
-                command.index_buffer.offset);
+                MTL::IndexTypeUInt16, buffer, command.index_offset);
         } else {
             NS::UInteger start = 0;
             NS::UInteger count = command.index_count;
             encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count);
         }
+
+        // Stencil the region between each curve and its chord. The uniform
+        // data is shared with the fan above.
+        const CommandExtra &extra = tables.extras[command.extra_index];
+        if (extra.patch_count > 0) {
+            cache.BindPipeline(pipelines_->GetPatchStencil());
+            cache.Bind(extra.patch_buffer.buffer, extra.patch_buffer.offset,
+                       0);
+            NS::UInteger start = 0;
+            NS::UInteger count = kPatchVertexCount;
+            NS::UInteger instance_count = extra.patch_count;
+            encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count,
+                                    instance_count);
+        }
     }
 
     // Cover
     // Generate quad for cover stencil restore + fill.
     BufferView cover_buffer =
         host_buffer_->GetTransientArena(6 * sizeof(Point), 16u);
-    std::array<Scalar, 12> bounds = command.bounds.GetQuad();
+    std::array<Scalar, 12> bounds =
+        tables.extras[command.extra_index].bounds.GetQuad();
     std::memcpy(cover_buffer.contents(), bounds.data(), 6 * sizeof(Point));
 
     {
-        PrepareColorSource(encoder, cache, command.paint);
+        PrepareColorSource(encoder, cache, paint);
         cache.Bind(cover_buffer.buffer, cover_buffer.offset, 0);
 
         if (is_opaque_draw) {
@@ -539,7 +643,7 @@ void Renderer::DrawTexture(MTL::RenderCommandEncoder *encoder,
     // Fill uniform buffer for transform.
     UniformData data;
     data.mvp = mvp;
-    data.depth = 1 - (depth * kDepthEpsilon);
+    data.depth = ComputeDepth(depth);
     BufferView vert_uniform_buffer =
         host_buffer_->GetTransientArena(sizeof(data), 16u);
     ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(data));
@@ -589,6 +693,95 @@ void Renderer::DrawTexture(MTL::RenderCommandEncoder *encoder,
     encoder->popDebugGroup();
 }
 
+void Renderer::DrawAtlas(MTL::RenderCommandEncoder *encoder,
+                         BufferBindingCache &cache, const Matrix &mvp,
+                         const PackedCommand &command) {
+    struct UniformData {
+        Matrix mvp;
+        float depth_epsilon;
+        float depth_base;
+    };
+
+    // Depth is per vertex, as the batch spans several draws.
+    UniformData data;
+    data.mvp = mvp;
+    data.depth_epsilon = depth_epsilon_;
+    data.depth_base = depth_base_;
+    BufferView vert_uniform_buffer =
+        host_buffer_->GetTransientArena(sizeof(data), 16u);
+    ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(data));
+
+    encoder->pushDebugGroup(atlas_label_);
+    cache.BindPipeline(pipelines_->GetAtlasFill());
+    cache.Bind(picture_.GetTables().buffers[command.buffer_index],
+               command.vertex_offset, 0);
+    cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
+    encoder->setFragmentTexture(atlas_texture_, 0);
+    encoder->setFragmentSamplerState(atlas_sampler_, 0);
+    cache.BindDepthStencil(transparent_convex_draw_);
+
+    NS::UInteger start = 0;
+    NS::UInteger count = command.index_count;
+    encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count);
+    encoder->popDebugGroup();
+}
+
+void Renderer::DrawBatch(MTL::RenderCommandEncoder *encoder,
+                         BufferBindingCache &cache, const Matrix &mvp,
+                         const PackedCommand &command) {
+    struct UniformData {
+        Matrix mvp;
+        float depth_epsilon;
+        float depth_base;
+    };
+
+    // Positions are in device space, and depth is per vertex.
+    UniformData data;
+    data.mvp = mvp;
+    data.depth_epsilon = depth_epsilon_;
+    data.depth_base = depth_base_;
+    BufferView vert_uniform_buffer =
+        host_buffer_->GetTransientArena(sizeof(data), 16u);
+    ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(data));
+
+    const DisplayListTables &tables = picture_.GetTables();
+    bool is_opaque_draw = tables.paints[command.paint_index].IsOpaque();
+    encoder->pushDebugGroup(batch_label_);
+    cache.BindPipeline(pipelines_->GetBatchFill(
+        is_opaque_draw ? BlendMode::kSrc : BlendMode::kSrcOver));
+    cache.Bind(tables.buffers[command.buffer_index], command.vertex_offset, 0);
+    cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
+    if (is_opaque_draw) {
+        cache.BindDepthStencil(convex_draw_);
+    } else {
+        cache.BindDepthStencil(transparent_convex_draw_);
+    }
+
+    NS::UInteger start = 0;
+    NS::UInteger count = command.index_count;
+    encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count);
+    encoder->popDebugGroup();
+}
+
+bool Renderer::UploadAtlas() {
+    Rect dirty = coverage_atlas_->GetDirtyRegion();
+    if (dirty.GetWidth() <= 0) {
+        return false;
+    }
+    ISize size = coverage_atlas_->GetSize();
+    NS::UInteger l = dirty.l;
+    NS::UInteger t = dirty.t;
+    atlas_texture_->replaceRegion(
+        /*region=*/MTL::Region(l, t, 0, dirty.r - l, dirty.b - t, 1),
+        /*level=*/0,
+        /*slice=*/0,
+        /*withBytes=*/coverage_atlas_->GetPixels().data() + t * size.w + l,
+        /*bytesPerRow=*/size.w,
+        /*bytesPerImage=*/0);
+    coverage_atlas_->ClearDirtyRegion();
+    return true;
+}
+
 void Renderer::BindBlurInfo(MTL::RenderCommandEncoder *encoder,
                             const Matrix &mvp, const Rect &dest, Scalar depth,
                             MTL::Texture *source, bool horizontal,
@@ -800,8 +993,31 @@ void Renderer::DrawBlur(MTL::CommandBuffer *command_buffer,
 
 void Renderer::ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
                                     BufferBindingCache &cache,
-                                    const Matrix &mvp, const Command &command,
-                                    ClipStyle style, const Rect &screen_size) {
+                                    const Matrix &mvp,
+                                    const PackedCommand &command,
+                                    ClipStyle style,
+                                    const Rect &target_bounds,
+                                    const Rect &scissor_bounds) {
+
+    const DisplayListTables &tables = picture_.GetTables();
+    MTL::Buffer *buffer = tables.buffers[command.buffer_index];
+
+    // The depth write of an intersect clip only needs to reach the draws it
+    // clips, which the canvas bounds in device space, within the scissor
+    // already set. Both the stencil and cover draws are scissored to them,
+    // so the stencil outside is untouched.
+    std::optional<MTL::ScissorRect> scissor;
+    if (style == ClipStyle::kIntersect) {
+        std::optional<Rect> cover =
+            tables.extras[command.extra_index].bounds.Intersection(
+                scissor_bounds);
+        if (cover.has_value()) {
+            scissor = ComputeScissorRect(*cover, target_bounds);
+        }
+        if (!scissor.has_value()) {
+            return;
+        }
+    }
 
     // A clip is essentially a draw, except that we only write to the
     // depth buffer.
@@ -815,22 +1031,24 @@ void Renderer::ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
         host_buffer_->GetTransientArena(sizeof(UniformData), 16u);
     UniformData data;
     data.mvp = mvp;
-    data.depth = 1 - (command.depth_count * kDepthEpsilon);
+    data.depth = ComputeDepth(command.depth_count);
     ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(UniformData));
 
     encoder->pushDebugGroup(clip_label_);
+    if (scissor.has_value()) {
+        encoder->setScissorRect(*scissor);
+    }
     // Draw using stencil to increment the stencil buffer where
     // the path is filled.
     cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
     cache.BindPipeline(pipelines_->GetStencil());
-    cache.Bind(command.vertex_buffer.buffer, command.vertex_buffer.offset, 0);
+    cache.Bind(buffer, command.vertex_offset, 0);
     cache.BindDepthStencil(non_zero_stencil_);
 
-    if (command.index_buffer) {
+    if (command.IsIndexed()) {
         encoder->drawIndexedPrimitives(
             MTL::PrimitiveTypeTriangle, command.index_count,
-            MTL::IndexTypeUInt16, command.index_buffer.buffer,
-            command.index_buffer.offset);
+            MTL::IndexTypeUInt16, buffer, command.index_offset);
     } else {
         NS::UInteger start = 0;
         NS::UInteger count = command.index_count;
@@ -843,7 +1061,8 @@ void Renderer::ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
         // is set. If this was a convex shape, we could do it in one go.
         BufferView cover_buffer =
             host_buffer_->GetTransientArena(6 * sizeof(Point), 16u);
-        std::array<Scalar, 12> bounds = command.bounds.GetQuad();
+        std::array<Scalar, 12> bounds =
+            tables.extras[command.extra_index].bounds.GetQuad();
         std::memcpy(cover_buffer.contents(), bounds.data(), 6 * sizeof(Point));
 
         cache.Bind(cover_buffer.buffer, cover_buffer.offset, 0);
@@ -855,11 +1074,9 @@ void Renderer::ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
         break;
     }
     case ClipStyle::kIntersect: {
-        // Now perform a cover draw across the entire screen that writes the
+        // Now perform a cover draw across the scissor rect that writes the
         // depth value everywhere the stencil is not set. The depth value must
-        // be the max of all depth values within a given save/restore pair. The
-        // performance of this clipping can be improved by combining with a
-        // scissor.
+        // be the max of all depth values within a given save/restore pair.
         data.mvp = Matrix();
         BufferView intersect_vert_uniform_buffer =
             host_buffer_->GetTransientArena(sizeof(UniformData), 16u);
@@ -888,6 +1105,9 @@ void Renderer::ClipPathTriangulated(MTL::RenderCommandEncoder *encoder,
         NS::UInteger start = 0;
         NS::UInteger count = 6;
         encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count);
+
+        encoder->setScissorRect(
+            *ComputeScissorRect(scissor_bounds, target_bounds));
         break;
     }
     }
@@ -996,44 +1216,264 @@ Renderer::SetUpRenderPass(MTL::Texture *onscreen,
     }
 }
 
+// The smallest render target made for a damage rect, in pixels.
+static constexpr uint32_t kMinDamageTextureSize = 64;
+// The number of frames a damage target is kept after it was last drawn into.
+static constexpr uint64_t kDamageTextureFrames = 60;
+// The fraction of the frame that, once damaged, is drawn straight into the
+// retained texture rather than through damage targets.
+static constexpr Scalar kFullDamageFraction = 0.5;
+
+MTL::Texture *Renderer::GetDamageTexture(uint32_t width, uint32_t height) {
+    uint64_t key = static_cast<uint64_t>(width) << 32 | height;
+    auto found = damage_textures_.find(key);
+    if (found != damage_textures_.end()) {
+        found->second.last_used = frame_count_;
+        return found->second.texture;
+    }
+    MTL::TextureDescriptor *desc = MTL::TextureDescriptor::alloc()->init();
+    desc->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
+    desc->setUsage(MTL::TextureUsageRenderTarget);
+    desc->setWidth(width);
+    desc->setHeight(height);
+    desc->setStorageMode(MTL::StorageModePrivate);
+    desc->setTextureType(MTL::TextureType2D);
+    MTL::Texture *texture = metal_device_->newTexture(desc);
+    desc->release();
+    damage_textures_[key] = DamageTexture{
+        .texture = texture,
+        .last_used = frame_count_,
+    };
+    return texture;
+}
+
+void Renderer::EvictDamageTextures() {
+    for (auto it = damage_textures_.begin(); it != damage_textures_.end();) {
+        if (frame_count_ - it->second.last_used < kDamageTextureFrames) {
+            ++it;
+            continue;
+        }
+        MTL::Texture *texture = it->second.texture;
+        // The retained texture and layers may share the attachments, but
+        // they are made again on demand.
+        host_buffer_->ReleaseAttachments(
+            static_cast<uint32_t>(texture->width()),
+            static_cast<uint32_t>(texture->height()));
+        texture->release();
+        it = damage_textures_.erase(it);
+    }
+}
+
+void Renderer::ClearDepth(MTL::RenderCommandEncoder *encoder,
+                          BufferBindingCache &cache,
+                          const Rect &target_bounds,
+                          const Rect &visible_bounds,
+                          const Rect &scissor_bounds) {
+    struct UniformData {
+        Matrix mvp;
+        float depth;
+    };
+
+    // A full screen quad in normalized device coordinates at the clear
+    // depth, as the intersect clip cover is drawn.
+    UniformData data;
+    data.mvp = Matrix();
+    data.depth = 1;
+    BufferView vert_uniform_buffer =
+        host_buffer_->GetTransientArena(sizeof(UniformData), 16u);
+    ::memcpy(vert_uniform_buffer.contents(), &data, sizeof(UniformData));
+
+    BufferView cover_buffer =
+        host_buffer_->GetTransientArena(6 * sizeof(Point), 16u);
+    std::array<Scalar, 12> bounds = {
+        -1, -1, //
+        -1, 1,  //
+        1,  1,  //
+        -1, -1, //
+        1,  -1, //
+        1,  1   //
+    };
+    std::memcpy(cover_buffer.contents(), bounds.data(), 6 * sizeof(Point));
+
+    encoder->pushDebugGroup(depth_clear_label_);
+    // Depths outside the scissor would outlive the clear.
+    if (scissor_bounds != visible_bounds) {
+        encoder->setScissorRect(
+            ComputeScissorRect(visible_bounds, target_bounds)
+                .value_or(MTL::ScissorRect{0, 0, 0, 0}));
+    }
+    cache.BindPipeline(pipelines_->GetStencil());
+    cache.Bind(cover_buffer.buffer, cover_buffer.offset, 0);
+    cache.Bind(vert_uniform_buffer.buffer, vert_uniform_buffer.offset, 1);
+    cache.BindDepthStencil(depth_clear_);
+
+    NS::UInteger start = 0;
+    NS::UInteger count = 6;
+    encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, start, count);
+    if (scissor_bounds != visible_bounds) {
+        encoder->setScissorRect(
+            ComputeScissorRect(scissor_bounds, target_bounds)
+                .value_or(MTL::ScissorRect{0, 0, 0, 0}));
+    }
+    encoder->popDebugGroup();
+}
+
+void Renderer::EncodePass(
+    MTL::RenderCommandEncoder *encoder,
+    const std::vector<PackedCommand> &commands,
+    const std::vector<CommandGroup> &groups,
+    const std::vector<DepthRange> &depth_ranges, const Matrix &mvp,
+    const Rect &target_bounds, const Rect &visible_bounds,
+    const std::vector<std::optional<Rect>> *command_bounds) {
+    const DisplayListTables &tables = picture_.GetTables();
+    BufferBindingCache binding_cache(encoder);
+    Rect scissor_bounds = visible_bounds;
+    if (visible_bounds != target_bounds) {
+        encoder->setScissorRect(
+            ComputeScissorRect(visible_bounds, target_bounds)
+                .value_or(MTL::ScissorRect{0, 0, 0, 0}));
+    }
+    depth_base_ = 0;
+    depth_epsilon_ = kDepthEpsilon;
+    size_t next_group = 0;
+    size_t next_range = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        // A group outside the visible bounds is skipped with the groups
+        // inside it.
+        while (next_group < groups.size() && groups[next_group].begin == i) {
+            const CommandGroup &group = groups[next_group++];
+            if (group.bounds.Intersection(visible_bounds).has_value()) {
+                continue;
+            }
+            i = group.end;
+            while (next_group < groups.size() &&
+                   groups[next_group].begin < i) {
+                next_group++;
+            }
+        }
+        if (i == commands.size()) {
+            break;
+        }
+        // Ranges skipped over entirely share the one clear.
+        if (next_range < depth_ranges.size() &&
+            depth_ranges[next_range].begin <= i) {
+            while (next_range + 1 < depth_ranges.size() &&
+                   depth_ranges[next_range + 1].begin <= i) {
+                next_range++;
+            }
+            if (next_range > 0) {
+                ClearDepth(encoder, binding_cache, target_bounds,
+                           visible_bounds, scissor_bounds);
+            }
+            depth_base_ = depth_ranges[next_range].base;
+            depth_epsilon_ = depth_ranges[next_range].epsilon;
+            next_range++;
+        }
+        const PackedCommand &command = commands[i];
+        // Commands outside the visible bounds can't change what is drawn,
+        // but scissors apply to the commands after them.
+        if (command_bounds != nullptr &&
+            command.type != CommandType::kScissor &&
+            !((*command_bounds)[i].has_value() &&
+              (*command_bounds)[i]->Intersection(visible_bounds).has_value())) {
+            continue;
+        }
+        const Matrix &transform = tables.transforms[command.transform_index];
+        switch (command.type) {
+        case CommandType::kClip: {
+            ClipPathTriangulated(encoder, binding_cache, mvp * transform,
+                                 command, command.GetClipStyle(),
+                                 target_bounds, scissor_bounds);
+            break;
+        }
+        case CommandType::kScissor: {
+            scissor_bounds = tables.extras[command.extra_index]
+                                 .bounds.Intersection(visible_bounds)
+                                 .value_or(Rect());
+            encoder->setScissorRect(
+                ComputeScissorRect(scissor_bounds, target_bounds)
+                    .value_or(MTL::ScissorRect{0, 0, 0, 0}));
+            break;
+        }
+        case CommandType::kTexture: {
+            const CommandExtra &extra = tables.extras[command.extra_index];
+            DrawTexture(encoder, binding_cache, mvp * transform, extra.bounds,
+                        command.depth_count,
+                        tables.paints[command.paint_index].color.a,
+                        extra.texture);
+            break;
+        }
+        case CommandType::kDraw: {
+            DrawPathTriangulated(encoder, binding_cache, mvp * transform,
+                                 command);
+            break;
+        }
+        case CommandType::kAtlas: {
+            DrawAtlas(encoder, binding_cache, mvp * transform, command);
+            break;
+        }
+        case CommandType::kBatch: {
+            DrawBatch(encoder, binding_cache, mvp * transform, command);
+            break;
+        }
+        }
+    }
+}
+
 MTL::CommandBuffer *Renderer::render(MTL::Texture *onscreen) {
     host_buffer_->IncrementTransientBuffer();
+    frame_count_++;
+    bool atlas_changed = UploadAtlas();
     MTL::CommandBuffer *command_buffer = command_queue_->commandBuffer();
 
-    for (auto &offscreen : picture_.GetOffscreens()) {
+    if (retained_texture_ == nullptr ||
+        retained_texture_->width() != onscreen->width() ||
+        retained_texture_->height() != onscreen->height()) {
+        if (retained_texture_ != nullptr) {
+            retained_texture_->release();
+        }
+        MTL::TextureDescriptor *desc =
+            MTL::TextureDescriptor::alloc()->init();
+        desc->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
+        desc->setUsage(MTL::TextureUsageShaderRead |
+                       MTL::TextureUsageRenderTarget);
+        desc->setWidth(onscreen->width());
+        desc->setHeight(onscreen->height());
+        desc->setStorageMode(MTL::StorageModePrivate);
+        desc->setTextureType(MTL::TextureType2D);
+        retained_texture_ = metal_device_->newTexture(desc);
+        desc->release();
+        damage_tracker_.Invalidate();
+    }
+
+    Rect target_bounds =
+        Rect::MakeLTRB(0, 0, onscreen->width(), onscreen->height());
+    const std::vector<Rect> &damage = damage_tracker_.ComputeDamage(
+        picture_, target_bounds, atlas_changed);
+
+    // Only layers drawn into the damage are needed.
+    const std::vector<RenderProgram::Data> &offscreens =
+        picture_.GetOffscreens();
+    for (size_t i = 0; i < offscreens.size(); i++) {
+        if (!damage_tracker_.GetDamagedLayers()[i]) {
+            continue;
+        }
+        const RenderProgram::Data &offscreen = offscreens[i];
         MTL::RenderCommandEncoder *encoder =
             SetUpRenderPass(offscreen.texture, command_buffer, kTransparent);
-        BufferBindingCache binding_cache(encoder);
 
         Matrix mvp =
             Matrix::MakeOrthographic(
                 Size(offscreen.texture->width(), offscreen.texture->height())) *
             Matrix::MakeTranslate(-offscreen.bounds.l, -offscreen.bounds.t);
 
-        for (auto i = 0; i < offscreen.commands.size(); i++) {
-            const Command &command = offscreen.commands[i];
-            switch (command.type) {
-            case CommandType::kClip: {
-                ClipPathTriangulated(encoder, binding_cache,
-                                     mvp * command.transform, command,
-                                     command.style,
-                                     Rect(0, 0, offscreen.bounds.GetWidth(),
-                                          offscreen.bounds.GetHeight()));
-                break;
-            }
-            case CommandType::kTexture: {
-                DrawTexture(encoder, binding_cache, mvp * command.transform,
-                            command.bounds, command.depth_count,
-                            command.paint.color.a, command.texture);
-                break;
-            }
-            case CommandType::kDraw: {
-                DrawPathTriangulated(encoder, binding_cache,
-                                     mvp * command.transform, command);
-                break;
-            }
-            }
-        }
+        Rect offscreen_bounds =
+            Rect::MakeLTRB(offscreen.bounds.l, offscreen.bounds.t,
+                           offscreen.bounds.l + offscreen.texture->width(),
+                           offscreen.bounds.t + offscreen.texture->height());
+        EncodePass(encoder, offscreen.commands, offscreen.groups,
+                   offscreen.depth_ranges, mvp, offscreen_bounds,
+                   offscreen_bounds, /*command_bounds=*/nullptr);
         encoder->endEncoding();
 
         MTL::Texture *filter_source = offscreen.texture;
@@ -1048,42 +1488,72 @@ MTL::CommandBuffer *Renderer::render(MTL::Texture *onscreen) {
         }
     }
 
-    MTL::RenderCommandEncoder *encoder =
-        SetUpRenderPass(onscreen, command_buffer, kTransparent);
-    Matrix mvp =
-        Matrix::MakeOrthographic(Size(onscreen->width(), onscreen->height()));
-    const auto &cmds = picture_.GetCommands();
-    if (cmds.empty()) {
-        encoder->endEncoding();
-        return command_buffer;
+    // When most of the frame is damaged it is drawn whole into the retained
+    // texture, which saves targets the size of the frame.
+    Scalar damaged_area = 0;
+    for (const Rect &rect : damage) {
+        damaged_area += rect.GetWidth() * rect.GetHeight();
     }
-
-    BufferBindingCache binding_cache(encoder);
-    for (auto i = 0; i < cmds.size(); i++) {
-        const Command &command = cmds[i];
-        switch (command.type) {
-        case CommandType::kClip: {
-            ClipPathTriangulated(
-                encoder, binding_cache, mvp * command.transform, command,
-                command.style,
-                Rect(0, 0, onscreen->width(), onscreen->height()));
-            break;
-        }
-        case CommandType::kTexture: {
-            DrawTexture(encoder, binding_cache, mvp * command.transform,
-                        command.bounds, command.depth_count,
-                        command.paint.color.a, command.texture);
-            break;
-        }
-        case CommandType::kDraw: {
-            DrawPathTriangulated(encoder, binding_cache,
-                                 mvp * command.transform, command);
-            break;
-        }
+    if (damaged_area >= kFullDamageFraction * target_bounds.GetWidth() *
+                            target_bounds.GetHeight()) {
+        MTL::RenderCommandEncoder *encoder =
+            SetUpRenderPass(retained_texture_, command_buffer, kTransparent);
+        Matrix mvp = Matrix::MakeOrthographic(Size(onscreen->width(),
+                                                   onscreen->height()));
+        EncodePass(encoder, picture_.GetCommands(), picture_.GetGroups(),
+                   picture_.GetDepthRanges(), mvp, target_bounds,
+                   target_bounds, /*command_bounds=*/nullptr);
+        encoder->endEncoding();
+    } else {
+        // Otherwise each damage rect is drawn into a target whose sides are
+        // powers of two, so that few are made, but no larger than the frame,
+        // and copied into the retained texture.
+        for (const Rect &rect : damage) {
+            uint32_t width = kMinDamageTextureSize;
+            while (width < rect.GetWidth()) {
+                width *= 2;
+            }
+            width = std::min(width,
+                             static_cast<uint32_t>(onscreen->width()));
+            uint32_t height = kMinDamageTextureSize;
+            while (height < rect.GetHeight()) {
+                height *= 2;
+            }
+            height = std::min(height,
+                              static_cast<uint32_t>(onscreen->height()));
+            MTL::Texture *texture = GetDamageTexture(width, height);
+            MTL::RenderCommandEncoder *encoder =
+                SetUpRenderPass(texture, command_buffer, kTransparent);
+            Matrix mvp = Matrix::MakeOrthographic(Size(width, height)) *
+                         Matrix::MakeTranslate(-rect.l, -rect.t);
+            EncodePass(encoder, picture_.GetCommands(), picture_.GetGroups(),
+                       picture_.GetDepthRanges(), mvp,
+                       Rect::MakeLTRB(rect.l, rect.t, rect.l + width,
+                                      rect.t + height),
+                       rect, &damage_tracker_.GetCommandBounds());
+            encoder->endEncoding();
+
+            MTL::BlitCommandEncoder *blit =
+                command_buffer->blitCommandEncoder();
+            blit->copyFromTexture(
+                /*sourceTexture=*/texture, /*sourceSlice=*/0,
+                /*sourceLevel=*/0,
+                /*sourceOrigin=*/MTL::Origin(0, 0, 0),
+                /*sourceSize=*/
+                MTL::Size(rect.GetWidth(), rect.GetHeight(), 1),
+                /*destinationTexture=*/retained_texture_,
+                /*destinationSlice=*/0, /*destinationLevel=*/0,
+                /*destinationOrigin=*/MTL::Origin(rect.l, rect.t, 0));
+            blit->endEncoding();
         }
     }
+    EvictDamageTextures();
 
-    encoder->endEncoding();
+    // Drawables don't keep their contents between frames, so the whole
+    // frame is copied even when nothing was damaged.
+    MTL::BlitCommandEncoder *blit = command_buffer->blitCommandEncoder();
+    blit->copyFromTexture(retained_texture_, onscreen);
+    blit->endEncoding();
 
     return command_buffer;
 }
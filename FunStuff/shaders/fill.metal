@@ -128,3 +128,92 @@ fragment float4 radialGradientFragmentShader(
   return colorTexture.sample(gradientSampler, simd::float2(t, 0.5));
 }
 
+
+// Coverage Atlas Shader
+
+struct AtlasVertInput {
+    simd::float4 color;
+    simd::float2 position;
+    simd::float2 uv;
+    float depth_count;
+    float distance_range;
+};
+
+struct AtlasVertInfo {
+    float4x4 mvp;
+    float depth_epsilon;
+    // The least depth count of the depth range being drawn.
+    float depth_base;
+};
+
+struct AtlasVaryings {
+    simd::float4 position [[position]];
+    simd::float4 color;
+    simd::float2 uv;
+    float distance_range [[flat]];
+};
+
+vertex AtlasVaryings atlasVertexShader(uint vertexID [[vertex_id]],
+                                       constant AtlasVertInput* vert_input,
+                                       constant AtlasVertInfo& vert_info) {
+    AtlasVaryings varyings;
+    varyings.position = vert_info.mvp * float4(vert_input[vertexID].position.x,
+                                               vert_input[vertexID].position.y,
+                                               0.0f,
+                                               1.0f);
+    varyings.position.z =
+        1.0f - (vert_input[vertexID].depth_count - vert_info.depth_base) *
+                   vert_info.depth_epsilon;
+    varyings.color = vert_input[vertexID].color;
+    varyings.uv = vert_input[vertexID].uv;
+    varyings.distance_range = vert_input[vertexID].distance_range;
+    return varyings;
+}
+
+// Coverage mask quads are aligned to whole pixels, so every fragment reads
+// exactly one texel. Distance fields are filtered and converted to coverage
+// over one device pixel.
+fragment float4 atlasFragmentShader(AtlasVaryings varyings [[stage_in]],
+                                    texture2d<float> atlas [[texture(0)]],
+                                    sampler atlas_sampler [[sampler(0)]]) {
+    if (varyings.distance_range > 0) {
+        float distance = atlas.sample(atlas_sampler, varyings.uv).r - 0.5;
+        return varyings.color *
+            saturate(distance * varyings.distance_range + 0.5);
+    }
+    return varyings.color * atlas.read(uint2(varyings.uv)).r;
+}
+
+// Batched Solid Fill Shader
+
+struct BatchVertInput {
+    simd::float4 color;
+    simd::float2 position;
+    float depth_count;
+    float padding;
+};
+
+struct BatchVaryings {
+    simd::float4 position [[position]];
+    simd::float4 color [[flat]];
+};
+
+// Positions are pre-transformed, so the uniforms only carry the projection.
+vertex BatchVaryings batchVertexShader(uint vertexID [[vertex_id]],
+                                       constant BatchVertInput* vert_input,
+                                       constant AtlasVertInfo& vert_info) {
+    BatchVaryings varyings;
+    varyings.position = vert_info.mvp * float4(vert_input[vertexID].position.x,
+                                               vert_input[vertexID].position.y,
+                                               0.0f,
+                                               1.0f);
+    varyings.position.z =
+        1.0f - (vert_input[vertexID].depth_count - vert_info.depth_base) *
+                   vert_info.depth_epsilon;
+    varyings.color = vert_input[vertexID].color;
+    return varyings;
+}
+
+fragment float4 batchFragmentShader(BatchVaryings varyings [[stage_in]]) {
+    return varyings.color;
+}
@@ -0,0 +1,56 @@
+#include <metal_stdlib>
+using namespace metal;
+
+// Must match kMaxResolveLevel in geom/patches.hpp.
+constant int kMaxResolveLevel = 5;
+
+struct VertInfo {
+    float4x4 mvp;
+    float depth;
+    float resolve_level_bias;
+};
+
+struct CurvePatch {
+    simd::float2 p0;
+    simd::float2 p1;
+    simd::float2 p2;
+    simd::float2 p3;
+    float resolve_level;
+    float padding;
+};
+
+struct Varyings {
+    simd::float4 position [[position]];
+};
+
+float2 SolveCubic(float t, float2 p0, float2 p1, float2 p2, float2 p3) {
+    float u = 1.0 - t;
+    return u * u * u * p0 + 3.0 * u * u * t * p1 + 3.0 * u * t * t * p2 +
+           t * t * t * p3;
+}
+
+// Expands each patch instance into a triangle fan from p0 across the curve.
+// Triangles past the resolve level of the patch collapse onto p3.
+//
+// See EmulatePatchVertex in geom/patches.cpp.
+vertex Varyings patchStencilVertexShader(uint vertexID [[vertex_id]],
+                                         uint instanceID [[instance_id]],
+                                         constant CurvePatch* patches,
+                                         constant VertInfo& vert_info) {
+    CurvePatch patch = patches[instanceID];
+    uint corner = vertexID % 3;
+    float2 position = patch.p0;
+    if (corner != 0) {
+        float level = clamp(patch.resolve_level + vert_info.resolve_level_bias,
+                            0.0, float(kMaxResolveLevel));
+        uint segments = 1u << uint(level);
+        uint index = min(vertexID / 3 + corner, segments);
+        position = SolveCubic(float(index) / float(segments), patch.p0,
+                              patch.p1, patch.p2, patch.p3);
+    }
+
+    Varyings varyings;
+    varyings.position = vert_info.mvp * float4(position.x, position.y, 0.0f, 1.0f);
+    varyings.position.z = vert_info.depth;
+    return varyings;
+}
@@ -0,0 +1,676 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include <Metal/Metal.hpp>
+
+#include "canvas.hpp"
+#include "cpu_renderer.hpp"
+#include "display_list_optimizer.hpp"
+#include "geom/atlas.hpp"
+#include "geom/bezier.hpp"
+#include "geom/patches.hpp"
+#include "geom/text.hpp"
+#include "geom/triangulator.hpp"
+#include "host_buffer.hpp"
+
+#include "third_party/nanosvg/src/nanosvg.h"
+#define NANOSVGRAST_IMPLEMENTATION
+#include "third_party/nanosvg/src/nanosvgrast.h"
+
+// Count heap allocations made through operator new, so that tests can check
+// that recording a frame on a reset canvas makes none.
+static std::atomic<size_t> g_allocation_count = 0;
+
+void *operator new(size_t size) {
+    g_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *result = std::malloc(size == 0 ? 1 : size)) {
+        return result;
+    }
+    // Exceptions are disabled, so running out of memory is fatal.
+    std::abort();
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+namespace flatland {
+namespace {
+
+// A five pointed star centered on [center], [radius] from center to tip.
+Path BuildStar(Point center, Scalar radius) {
+    PathBuilder builder;
+    for (int point = 0; point < 10; point++) {
+        Scalar angle = point * M_PI / 5;
+        Scalar distance = point % 2 ? radius * 0.4f : radius;
+        Point p = center + Point(distance * std::cos(angle),
+                                 distance * std::sin(angle));
+        if (point == 0) {
+            builder.moveTo(p.x, p.y);
+        } else {
+            builder.lineTo(p.x, p.y);
+        }
+    }
+    builder.close();
+    return builder.takePath();
+}
+
+// Recording and preparing the same scene on a reset canvas makes no heap
+// allocations after the first frame, both with the default options and with
+// those the app draws its picture with.
+bool TestSteadyStateAllocations(MTL::Device *device) {
+    PathBuilder clip_builder;
+    clip_builder.AddRect(Rect::MakeLTRB(0, 0, 600, 600));
+    Path clip = clip_builder.takePath();
+    Path star = BuildStar(Point(20, 20), 20);
+
+    CoverageAtlas coverage_atlas;
+    const CanvasOptions option_sets[] = {
+        {},
+        {.convex_decomposition = true,
+         .curve_patches = true,
+         .coverage_atlas = &coverage_atlas,
+         .occlusion_culling = true,
+         .batch_convex_draws = true,
+         .scissor_rect_clips = true,
+         .optimizer_passes = MakeDefaultOptimizerPasses()},
+    };
+    bool passed = true;
+    for (size_t options = 0; options < std::size(option_sets); options++) {
+        HostBuffer frame_buffer(device);
+        Triangulator frame_triangulator;
+        Canvas frame_canvas(&frame_buffer, &frame_triangulator,
+                            option_sets[options]);
+        RenderProgram frame_program;
+        for (int frame = 0; frame < 4; frame++) {
+            size_t allocations_before = g_allocation_count.load();
+            frame_canvas.Reset(std::move(frame_program));
+            frame_buffer.ResetPersistent();
+            for (int i = 0; i < 1000; i++) {
+                Scalar x = (i * 37) % 500;
+                Scalar y = (i * 53) % 500;
+                frame_canvas.Save();
+                frame_canvas.Translate(x, y);
+                frame_canvas.DrawRect(Rect::MakeLTRB(0, 0, 20, 20),
+                                      {.color = i % 2 ? kRed : kBlue});
+                frame_canvas.DrawPath(star, {.color = Color(0, 0, 1, 0.5)});
+                frame_canvas.Restore();
+                if (i % 100 == 0) {
+                    frame_canvas.ClipPath(clip, ClipStyle::kIntersect);
+                }
+            }
+            frame_canvas.SaveLayer(0.5);
+            frame_canvas.DrawRect(Rect::MakeLTRB(100, 100, 300, 300),
+                                  {.color = kRed});
+            frame_canvas.Restore();
+            frame_program = frame_canvas.Prepare();
+            size_t allocations =
+                g_allocation_count.load() - allocations_before;
+            // The first frame sizes the canvas' storage, and the first reset
+            // sizes the pools that keep it.
+            if (frame > 1 && allocations > 0) {
+                std::cerr << "  options " << options << ", frame " << frame
+                          << " made " << allocations << " allocations"
+                          << std::endl;
+                passed = false;
+            }
+        }
+    }
+    return passed;
+}
+
+// Replay the onscreen commands of [program] on the CPU at the pixel centers
+// of [size], and return a hash of the paints composited into each pixel.
+//
+// Draws and clips are reduced to the device bounds of their vertices, so
+// this only models programs of rects and rect clips. That is enough to
+// compare how two programs drawing the same rects are clipped.
+std::vector<uint64_t> ReplayRectCoverage(const RenderProgram &program,
+                                         ISize size) {
+    const DisplayListTables &tables = program.GetTables();
+    auto vertex_bounds = [&](const PackedCommand &command) {
+        const uint8_t *contents = static_cast<const uint8_t *>(
+            tables.buffers[command.buffer_index]->contents());
+        const Point *points =
+            reinterpret_cast<const Point *>(contents + command.vertex_offset);
+        const uint16_t *indices = reinterpret_cast<const uint16_t *>(
+            contents + command.index_offset);
+        std::optional<Rect> bounds;
+        for (uint32_t i = 0; i < command.index_count; i++) {
+            Point point = points[command.IsIndexed() ? indices[i] : i];
+            Rect rect = Rect::MakePointBounds(point, point);
+            bounds = bounds.has_value() ? bounds->Union(rect) : rect;
+        }
+        return tables.transforms[command.transform_index].TransformBounds(
+            bounds.value_or(Rect()));
+    };
+    auto contains = [](const Rect &rect, int32_t x, int32_t y) {
+        return x + 0.5f >= rect.l && x + 0.5f < rect.r && y + 0.5f >= rect.t &&
+               y + 0.5f < rect.b;
+    };
+
+    Rect target = Rect::MakeLTRB(0, 0, size.w, size.h);
+    Rect scissor = target;
+    // Depth is kept as the depth count, where a larger count is nearer.
+    std::vector<int32_t> depths(size.w * size.h, 0);
+    std::vector<uint64_t> colors(size.w * size.h, 0);
+    for (const PackedCommand &command : program.GetCommands()) {
+        switch (command.type) {
+        case CommandType::kScissor:
+            scissor = tables.extras[command.extra_index]
+                          .bounds.Intersection(target)
+                          .value_or(Rect());
+            break;
+        case CommandType::kClip: {
+            // Intersect clips write depth outside the path within their
+            // cover, difference clips inside it.
+            Rect clip = vertex_bounds(command);
+            bool is_difference =
+                command.GetClipStyle() == ClipStyle::kDifference;
+            Rect cover = is_difference
+                             ? clip
+                             : tables.extras[command.extra_index].bounds;
+            for (int32_t y = 0; y < size.h; y++) {
+                for (int32_t x = 0; x < size.w; x++) {
+                    int32_t &depth = depths[y * size.w + x];
+                    if (contains(scissor, x, y) && contains(cover, x, y) &&
+                        contains(clip, x, y) == is_difference &&
+                        command.depth_count >= depth) {
+                        depth = command.depth_count;
+                    }
+                }
+            }
+            break;
+        }
+        case CommandType::kDraw: {
+            Rect draw = vertex_bounds(command);
+            const Paint &paint = tables.paints[command.paint_index];
+            uint64_t id = 0;
+            for (Scalar channel :
+                 {paint.color.r, paint.color.g, paint.color.b, paint.color.a}) {
+                uint32_t bits;
+                std::memcpy(&bits, &channel, sizeof(bits));
+                id = id * 31 + bits;
+            }
+            for (int32_t y = 0; y < size.h; y++) {
+                for (int32_t x = 0; x < size.w; x++) {
+                    size_t index = y * size.w + x;
+                    if (!contains(scissor, x, y) || !contains(draw, x, y) ||
+                        command.depth_count < depths[index]) {
+                        continue;
+                    }
+                    // Opaque draws replace the color and write depth.
+                    if (paint.IsOpaque()) {
+                        colors[index] = id;
+                        depths[index] = command.depth_count;
+                    } else {
+                        colors[index] = colors[index] * 31 + id;
+                    }
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return colors;
+}
+
+// Rect clips applied as scissor rects clip a scene of nested UI panels the
+// same as stencil clips do.
+bool TestScissorClipsMatchStencil(MTL::Device *device) {
+    // Panels of rows under nested rect clips. One panel is offset by half a
+    // pixel, so its clip stays a stencil clip.
+    auto record_panels = [](Canvas &scene) {
+        for (int panel = 0; panel < 4; panel++) {
+            scene.Save();
+            scene.Translate((panel % 2) * 128 + (panel == 3 ? 0.5f : 0),
+                            (panel / 2) * 128);
+            PathBuilder panel_builder;
+            panel_builder.AddRect(Rect::MakeLTRB(8, 8, 120, 120));
+            scene.ClipPath(panel_builder.takePath(), ClipStyle::kIntersect);
+            scene.DrawRect(Rect::MakeLTRB(0, 0, 128, 128),
+                           {.color = Color(0.2, 0.2, 0.2, 1)});
+            for (int row = 0; row < 8; row++) {
+                scene.Save();
+                scene.Scale(2, 2);
+                PathBuilder row_builder;
+                row_builder.AddRect(
+                    Rect::MakeLTRB(6, 6 + row * 8, 58, 12 + row * 8));
+                scene.ClipPath(row_builder.takePath(), ClipStyle::kIntersect);
+                scene.DrawRect(Rect::MakeLTRB(0, row * 8, 64, 8 + row * 8),
+                               {.color = row % 2 ? kRed : Color(0, 0, 1, 0.5)});
+                scene.Restore();
+            }
+            scene.DrawRect(Rect::MakeLTRB(100, 0, 140, 140),
+                           {.color = Color(0, 0.5, 0, 0.5)});
+            scene.Restore();
+        }
+    };
+    ISize size(256, 256);
+    std::vector<uint64_t> replays[2];
+    size_t scissor_clips = 0;
+    for (bool scissor : {false, true}) {
+        HostBuffer host_buffer(device);
+        Triangulator triangulator;
+        Canvas scene(&host_buffer, &triangulator,
+                     {.occlusion_culling = true,
+                      .scissor_rect_clips = scissor});
+        record_panels(scene);
+        RenderProgram program = scene.Prepare();
+        replays[scissor] = ReplayRectCoverage(program, size);
+        scissor_clips = scene.GetClipStats().scissor_clips;
+    }
+    size_t differing = 0;
+    for (size_t i = 0; i < replays[0].size(); i++) {
+        differing += replays[0][i] != replays[1][i];
+    }
+    if (scissor_clips == 0 || differing > 0) {
+        std::cerr << "  " << scissor_clips << " rect clips as scissors, "
+                  << differing << " pixels clipped differently" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// The winding number of [contours] about [point]. Edges are counted where they
+// cross the horizontal line through [point] to its right.
+int ComputeWinding(const std::vector<std::vector<Point>> &contours,
+                   Point point) {
+    int winding = 0;
+    for (const std::vector<Point> &contour : contours) {
+        for (size_t i = 0; i < contour.size(); i++) {
+            Point p0 = contour[i];
+            Point p1 = contour[(i + 1) % contour.size()];
+            if ((p0.y <= point.y) == (p1.y <= point.y)) {
+                continue;
+            }
+            Scalar x = p0.x + (point.y - p0.y) * (p1.x - p0.x) / (p1.y - p0.y);
+            if (x > point.x) {
+                winding += p1.y > p0.y ? 1 : -1;
+            }
+        }
+    }
+    return winding;
+}
+
+// The distance from [point] to the nearest edge of [contours].
+Scalar ComputeEdgeDistance(const std::vector<std::vector<Point>> &contours,
+                           Point point) {
+    Scalar distance = std::numeric_limits<Scalar>::infinity();
+    for (const std::vector<Point> &contour : contours) {
+        for (size_t i = 0; i < contour.size(); i++) {
+            Point p0 = contour[i];
+            Point p1 = contour[(i + 1) % contour.size()];
+            Point edge = p1 - p0;
+            Scalar length_squared = edge.x * edge.x + edge.y * edge.y;
+            Scalar t = 0;
+            if (length_squared > 0) {
+                Point offset = point - p0;
+                t = std::clamp(
+                    (offset.x * edge.x + offset.y * edge.y) / length_squared,
+                    0.0f, 1.0f);
+            }
+            Point nearest = p0 + edge * t;
+            distance = std::min(distance,
+                                std::hypot(point.x - nearest.x,
+                                           point.y - nearest.y));
+        }
+    }
+    return distance;
+}
+
+// Curve patches expanded as the stencil shader does cover the same winding as
+// the finely flattened path, including curves too long for a single patch at
+// the scale they are drawn at.
+bool TestCurvePatchesMatchFlattening(MTL::Device *) {
+    PathBuilder builder;
+    builder.moveTo(10, 90);
+    builder.cubicTo(Point(110, -60), Point(-40, -60), Point(90, 90));
+    builder.quadTo(Point(50, 140), Point(10, 90));
+    builder.close();
+    builder.moveTo(30, 30);
+    builder.cubicTo(Point(70, 10), Point(90, 60), Point(60, 70));
+    builder.lineTo(30, 30);
+    builder.close();
+    Path path = builder.takePath();
+
+    bool passed = true;
+    for (Scalar scale : {1.0f, 4.0f, 16.0f, 64.0f}) {
+        // The reference flattens every curve into many more segments than
+        // Wang's formula asks for.
+        constexpr int kReferenceSegments = 512;
+        std::vector<std::vector<Point>> reference;
+        path.iterate([&](SegmentType type, const Point *data) {
+            switch (type) {
+            case SegmentType::kStart:
+                reference.push_back({data[0] * scale});
+                break;
+            case SegmentType::kLinear:
+                reference.back().push_back(data[1] * scale);
+                break;
+            case SegmentType::kQuad:
+                for (int i = 1; i <= kReferenceSegments; i++) {
+                    Scalar t = static_cast<Scalar>(i) / kReferenceSegments;
+                    reference.back().push_back(
+                        SolveQuad(t, data[0], data[1], data[2]) * scale);
+                }
+                break;
+            case SegmentType::kCubic:
+                for (int i = 1; i <= kReferenceSegments; i++) {
+                    Scalar t = static_cast<Scalar>(i) / kReferenceSegments;
+                    reference.back().push_back(
+                        SolveCubic(t, data[0], data[1], data[2], data[3]) *
+                        scale);
+                }
+                break;
+            case SegmentType::kClose:
+                break;
+            }
+            return true;
+        });
+
+        // Patches are recorded at scale 1 and drawn with a bias, as the
+        // renderer does.
+        Scalar bias = ComputeResolveLevelBias(scale);
+        CurvePatchMesh mesh;
+        BuildCurvePatches(path, /*scale_factor=*/1, mesh, bias);
+        std::vector<std::array<Point, 3>> triangles;
+        for (size_t i = 0; i < mesh.fan_indices.size(); i += 3) {
+            triangles.push_back({mesh.fan_points[mesh.fan_indices[i]] * scale,
+                                 mesh.fan_points[mesh.fan_indices[i + 1]] *
+                                     scale,
+                                 mesh.fan_points[mesh.fan_indices[i + 2]] *
+                                     scale});
+        }
+        for (const CurvePatch &patch : mesh.patches) {
+            for (uint32_t i = 0; i < kPatchVertexCount; i += 3) {
+                triangles.push_back(
+                    {EmulatePatchVertex(patch, i, bias) * scale,
+                     EmulatePatchVertex(patch, i + 1, bias) * scale,
+                     EmulatePatchVertex(patch, i + 2, bias) * scale});
+            }
+        }
+
+        // Samples within half a pixel of the reference edges may differ by
+        // the flattening tolerance of a quarter pixel.
+        constexpr int kSamples = 96;
+        size_t differing = 0;
+        for (int y = 0; y < kSamples; y++) {
+            for (int x = 0; x < kSamples; x++) {
+                Point point = Point((x + 0.37f) / kSamples * 120 - 10,
+                                    (y + 0.61f) / kSamples * 160 - 40) *
+                              scale;
+                if (ComputeEdgeDistance(reference, point) < 0.5f) {
+                    continue;
+                }
+                int winding = 0;
+                for (const std::array<Point, 3> &triangle : triangles) {
+                    Point a = triangle[0];
+                    Point b = triangle[1];
+                    Point c = triangle[2];
+                    Scalar d0 = (b.x - a.x) * (point.y - a.y) -
+                                (b.y - a.y) * (point.x - a.x);
+                    Scalar d1 = (c.x - b.x) * (point.y - b.y) -
+                                (c.y - b.y) * (point.x - b.x);
+                    Scalar d2 = (a.x - c.x) * (point.y - c.y) -
+                                (a.y - c.y) * (point.x - c.x);
+                    if (d0 > 0 && d1 > 0 && d2 > 0) {
+                        winding++;
+                    } else if (d0 < 0 && d1 < 0 && d2 < 0) {
+                        winding--;
+                    }
+                }
+                differing += winding != ComputeWinding(reference, point);
+            }
+        }
+        if (differing > 0) {
+            std::cerr << "  scale " << scale << ": " << mesh.patches.size()
+                      << " patches, " << differing
+                      << " samples with a different winding" << std::endl;
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+
+// Overlapping fills of both fill rules, with translucent paints and curves.
+constexpr char kFillsSvg[] = R"svg(<svg width="96" height="96">
+<rect x="4" y="4" width="88" height="88" fill="#204080"/>
+<circle cx="40" cy="44" r="30" fill="#e04020" fill-opacity="0.6"/>
+<path d="M48 6 L72 86 L8 34 L88 34 L24 86 Z" fill="#20c040"/>
+<path d="M48 6 L72 86 L8 34 L88 34 L24 86 Z" fill="#f0f020"
+      fill-rule="evenodd" fill-opacity="0.5" transform="translate(6 3)"/>
+<ellipse cx="66" cy="62" rx="24" ry="13" fill="#8020c0" fill-opacity="0.8"/>
+<path d="M10 90 C30 40 70 120 90 60 Q60 70 10 90 Z" fill="#ffffff"
+      fill-opacity="0.4"/>
+</svg>)svg";
+
+// The CPU renderer fills an SVG like nanosvg's rasterizer does.
+bool TestCpuRendererMatchesNanosvg(MTL::Device *) {
+    // nsvgParse writes into its input.
+    std::vector<char> svg(std::begin(kFillsSvg), std::end(kFillsSvg));
+    NSVGimage *image = ::nsvgParse(svg.data(), "px", 96);
+    ISize size(image->width, image->height);
+
+    std::vector<Path> paths;
+    CpuRenderer cpu_renderer;
+    for (auto shape = image->shapes; shape != NULL; shape = shape->next) {
+        PathBuilder builder;
+        for (auto path = shape->paths; path != NULL; path = path->next) {
+            for (int i = 0; i < path->npts - 1; i += 3) {
+                float *p = &path->pts[i * 2];
+                if (i == 0) {
+                    builder.moveTo(p[0], p[1]);
+                }
+                builder.cubicTo(Point{p[2], p[3]}, Point{p[4], p[5]},
+                                Point{p[6], p[7]});
+            }
+            builder.close();
+        }
+        paths.push_back(builder.takePath());
+    }
+    size_t index = 0;
+    for (auto shape = image->shapes; shape != NULL; shape = shape->next) {
+        // The fill opacity is in the alpha byte of the fill color.
+        Scalar alpha = (shape->fill.color >> 24) / 255.0f * shape->opacity;
+        cpu_renderer.DrawPath(
+            paths[index++], Matrix(),
+            {.color = Color::FromRGB(shape->fill.color).WithAlpha(alpha),
+             .fill_rule = shape->fillRule == NSVG_FILLRULE_NONZERO
+                              ? FillRule::kNonZero
+                              : FillRule::kEvenOdd});
+    }
+    std::vector<uint8_t> pixels(size.w * size.h * 4);
+    cpu_renderer.Render(size, kTransparent, pixels.data());
+
+    std::vector<uint8_t> expected(size.w * size.h * 4);
+    NSVGrasterizer *rasterizer = ::nsvgCreateRasterizer();
+    ::nsvgRasterize(rasterizer, image, 0, 0, 1, expected.data(), size.w,
+                    size.h, size.w * 4);
+    ::nsvgDeleteRasterizer(rasterizer);
+    ::nsvgDelete(image);
+
+    // nanosvg unpremultiplies its output.
+    for (size_t i = 0; i < expected.size(); i += 4) {
+        for (size_t channel = 0; channel < 3; channel++) {
+            expected[i + channel] =
+                (expected[i + channel] * expected[i + 3] + 127) / 255;
+        }
+    }
+    // nanosvg samples coverage on 5 scanlines per pixel rather than
+    // computing its area, so pixels next to an edge may differ by more than
+    // rounding. Pixels whose neighbours all match them may not.
+    auto differ = [](const uint8_t *a, const uint8_t *b, int tolerance) {
+        for (size_t channel = 0; channel < 4; channel++) {
+            if (std::abs(a[channel] - b[channel]) > tolerance) {
+                return true;
+            }
+        }
+        return false;
+    };
+    size_t interior_differing = 0;
+    size_t edge_differing = 0;
+    for (int32_t y = 0; y < size.h; y++) {
+        for (int32_t x = 0; x < size.w; x++) {
+            const uint8_t *want = &expected[(y * size.w + x) * 4];
+            const uint8_t *got = &pixels[(y * size.w + x) * 4];
+            bool is_interior = true;
+            for (int32_t ny = std::max(y - 1, 0);
+                 ny <= std::min(y + 1, size.h - 1); ny++) {
+                for (int32_t nx = std::max(x - 1, 0);
+                     nx <= std::min(x + 1, size.w - 1); nx++) {
+                    is_interior &=
+                        !differ(want, &expected[(ny * size.w + nx) * 4], 0);
+                }
+            }
+            if (is_interior) {
+                interior_differing += differ(want, got, 2);
+            } else {
+                edge_differing += differ(want, got, 64);
+            }
+        }
+    }
+    if (interior_differing > 0 || edge_differing > 0) {
+        std::cerr << "  " << interior_differing << " interior and "
+                  << edge_differing << " edge pixels differ" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// RasterizePath coverage matches 16x16 supersampled winding numbers on random
+// self-intersecting polygons, some reaching past the mask, with both fill
+// rules.
+//
+// Accumulating signed area is exact where the windings within a pixel differ
+// by at most one. Pixels that mix windings further apart, next to where the
+// polygon crosses itself, are only checked on average.
+bool TestRasterizePathMatchesSupersampling(MTL::Device *) {
+    constexpr int kSupersample = 16;
+    // A straight edge may miss or hit a row of samples.
+    constexpr Scalar kSampleError = 1.0f / kSupersample + 1.0f / 255;
+    ISize size(32, 32);
+    std::mt19937 random(7);
+    std::uniform_real_distribution<Scalar> coordinate(-4, 36);
+    bool passed = true;
+    for (int polygon = 0; polygon < 20; polygon++) {
+        std::vector<std::vector<Point>> contours(1);
+        PathBuilder builder;
+        int vertex_count = 5 + polygon % 8;
+        for (int i = 0; i < vertex_count; i++) {
+            Point p(coordinate(random), coordinate(random));
+            contours[0].push_back(p);
+            if (i == 0) {
+                builder.moveTo(p);
+            } else {
+                builder.lineTo(p.x, p.y);
+            }
+        }
+        builder.close();
+        Path path = builder.takePath();
+
+        for (FillRule fill_rule : {FillRule::kNonZero, FillRule::kEvenOdd}) {
+            std::vector<uint8_t> mask = RasterizePath(path, size, fill_rule);
+            Scalar total_error = 0;
+            size_t differing = 0;
+            for (int32_t y = 0; y < size.h; y++) {
+                for (int32_t x = 0; x < size.w; x++) {
+                    int inside = 0;
+                    int min_winding = std::numeric_limits<int>::max();
+                    int max_winding = std::numeric_limits<int>::min();
+                    for (int sy = 0; sy < kSupersample; sy++) {
+                        for (int sx = 0; sx < kSupersample; sx++) {
+                            int winding = ComputeWinding(
+                                contours,
+                                Point(x + (sx + 0.5f) / kSupersample,
+                                      y + (sy + 0.5f) / kSupersample));
+                            min_winding = std::min(min_winding, winding);
+                            max_winding = std::max(max_winding, winding);
+                            inside += fill_rule == FillRule::kNonZero
+                                          ? winding != 0
+                                          : winding % 2 != 0;
+                        }
+                    }
+                    Scalar expected = static_cast<Scalar>(inside) /
+                                      (kSupersample * kSupersample);
+                    Scalar error =
+                        std::abs(mask[y * size.w + x] / 255.0f - expected);
+                    total_error += error;
+                    differing += max_winding - min_winding <= 1 &&
+                                 error > kSampleError;
+                }
+            }
+            Scalar mean_error = total_error / (size.w * size.h);
+            if (differing > 0 || mean_error > 0.01f) {
+                std::cerr << "  polygon " << polygon << " ("
+                          << (fill_rule == FillRule::kNonZero ? "nonzero"
+                                                              : "even-odd")
+                          << "): " << differing
+                          << " pixels differ, mean error " << mean_error
+                          << std::endl;
+                passed = false;
+            }
+        }
+    }
+    return passed;
+}
+
+} // namespace
+} // namespace flatland
+
+int main() {
+    // Tests that don't use the device still run without one.
+    MTL::Device *device = MTL::CreateSystemDefaultDevice();
+    if (device == nullptr) {
+        std::cerr << "No Metal device" << std::endl;
+    }
+
+    struct Test {
+        const char *name;
+        bool (*run)(MTL::Device *device);
+        bool needs_device = true;
+    };
+    const Test tests[] = {
+        {"SteadyStateAllocations", flatland::TestSteadyStateAllocations},
+        {"ScissorClipsMatchStencil", flatland::TestScissorClipsMatchStencil},
+        {"CurvePatchesMatchFlattening",
+         flatland::TestCurvePatchesMatchFlattening, /*needs_device=*/false},
+        {"CpuRendererMatchesNanosvg", flatland::TestCpuRendererMatchesNanosvg,
+         /*needs_device=*/false},
+        {"RasterizePathMatchesSupersampling",
+         flatland::TestRasterizePathMatchesSupersampling,
+         /*needs_device=*/false},
+    };
+    int failures = 0;
+    for (const Test &test : tests) {
+        if (test.needs_device && device == nullptr) {
+            std::cout << "[SKIP] " << test.name << std::endl;
+            continue;
+        }
+        bool passed = test.run(device);
+        std::cout << (passed ? "[PASS] " : "[FAIL] ") << test.name
+                  << std::endl;
+        failures += !passed;
+    }
+    if (device != nullptr) {
+        device->release();
+    }
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}